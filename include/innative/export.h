@@ -28,6 +28,25 @@
 #define IR_INIT_FUNCTION "_innative_internal_start"
 #define IR_EXIT_FUNCTION "_innative_internal_exit"
 
+// Every exported function also gets an invocation thunk and a signature, named after the export with these suffixes. The signature
+// is the 32-bit parameter count and 32-bit return count, followed by one byte per parameter type and then per return type.
+#define IR_INVOKE_SUFFIX "#invoke"
+#define IR_SIGNATURE_SUFFIX "#signature"
+
+// Sorted table of every export, so they can be found without asking the dynamic linker for each one
+#define IR_EXPORT_DIRECTORY "_innative_export_directory"
+
+// Symbols emitted by libraries compiled with ENV_INSTANCES
+#define IR_INSTANCE_STATE "_innative_instance_state"
+#define IR_INSTANCE_TEMPLATE "_innative_instance_template"
+#define IR_INSTANCE_SIZE "_innative_instance_size"
+#define IR_INSTANCE_MEMORIES "_innative_instance_memories" // Offsets of each memory pointer in the state block, terminated by ~0
+#define IR_INSTANCE_TABLES "_innative_instance_tables" // Offsets of each table pointer in the state block, terminated by ~0
+#define IR_INSTANCE_SWAP_FUNCTION "_innative_instance_swap"
+
+// Linear memories are page aligned, and large data segments are emitted with the same page offset as their destination so the runtime can map them copy-on-write
+#define IR_PAGE_SIZE 4096
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -49,20 +68,115 @@ extern "C" {
     void* memory; // The additional indirection for memory is important here, becuase the global is a pointer to a pointer
   } IRGlobal;
 
+  // Called when an asynchronous load or compile finishes, possibly on another thread
+  typedef void(*IR_Completion)(void* user, enum IR_ERROR err);
+
+  // One webassembly value in the array passed to an IR_Invoke thunk. Every value takes up 8 bytes regardless of its type.
+  typedef union __IR_VALUE
+  {
+    int32_t i32;
+    int64_t i64;
+    float f32;
+    double f64;
+  } IRValue;
+
+  // Calls a function count times, reading n_params arguments per call from args and writing n_returns results per call to results,
+  // so a host can make many calls with a single transition into guest code.
+  typedef void(*IR_Invoke)(const IRValue* args, IRValue* results, uint64_t count);
+
+  // An export resolved once by LoadTypedFunction, which can then be called through invoke as often as needed
+  typedef struct __IR_FUNCTION
+  {
+    IR_Entrypoint function; // Must be cast to the correct signature before calling it directly
+    IR_Invoke invoke;
+    FunctionType type; // Points into the loaded library
+  } IRFunction;
+
+  // One entry in the export directory. Entries are sorted by hash, which is computed over the module and export names.
+  typedef struct __IR_EXPORT_ENTRY
+  {
+    uint64_t hash;
+    const char* module_name;
+    const char* export_name;
+    void* address; // Null for exports that live in per-instance state
+    uint32_t kind; // WASM_KIND of the export
+    uint32_t type; // Type index for functions, element type for tables, value type for globals
+    IR_Invoke invoke; // Invocation thunk of a function export, or null
+    const void* signature; // Signature of a function export in the IR_SIGNATURE_SUFFIX layout, or null
+    uint32_t module_size; // Names can contain null bytes, so these are compared by size
+    uint32_t export_size;
+  } IRExportEntry;
+
+  typedef struct __IR_EXPORT_DIRECTORY
+  {
+    uint64_t count;
+    const IRExportEntry* entries;
+  } IRExportDirectory;
+
+  // One instance of a library compiled with ENV_INSTANCES. Guest functions obtained from LoadFunction operate on whichever instance
+  // is current on the calling thread, which is set with EnterInstance and restored with LeaveInstance.
+  typedef struct __IR_INSTANCE
+  {
+    void* (*swap)(void* state); // Makes state current on this thread and returns the previous state
+    IR_Entrypoint exit;
+    void* state;
+    uint64_t size;
+    const uint64_t* memories;
+    const uint64_t* tables;
+    void* saved; // Set by SaveInstance
+  } IRInstance;
+
+  // The file a module's data segments are mapped from. The init function starts one zeroed, passes it to every segment it maps, and
+  // closes it afterwards, so /proc/self/maps is only read once per module.
+  typedef struct __IR_IMAGE_BACKING
+  {
+    uint64_t start; // The mapping of the binary the last segment was found in
+    uint64_t end;
+    uint64_t offset; // File offset of start
+    int64_t fd; // One more than the open file, 0 before the first lookup, or -1 if no file can back the image
+  } IRImageBacking;
+
+  // Memory used by an environment's allocator
+  typedef struct __IR_ALLOCATOR_STATS
+  {
+    uint64_t requested; // Bytes asked for by every allocation that lasts until the environment is destroyed
+    uint64_t reserved; // Bytes held in chunks that last until the environment is destroyed, including space not handed out yet
+    uint64_t chunks;
+    uint64_t live; // Bytes held right now, including any temporary allocation scopes
+    uint64_t peak; // The most bytes ever held at once
+  } IRAllocatorStats;
+
   // Contains the actual runtime functions
   typedef struct __IR_EXPORTS
   {
     Environment* (*CreateEnvironment)(unsigned int modules, unsigned int maxthreads, const char* arg0);
     void(*AddModule)(Environment* env, const void* data, uint64_t size, const char* name, int* err); // If size is 0, data points to a null terminated UTF8 file path
+    void(*AddModuleAsync)(Environment* env, const void* data, uint64_t size, const char* name, IR_Completion callback, void* user);
+    // Begins loading a binary module whose bytes arrive in chunks, such as from a pipe or a decompressor. Sections are parsed as
+    // soon as they're complete. FinishModuleStream adds the module to the environment and frees the stream.
+    struct __WASM_MODULE_STREAM* (*BeginModuleStream)(Environment* env, const char* name);
+    enum IR_ERROR(*PushModuleStream)(struct __WASM_MODULE_STREAM* stream, const void* data, uint64_t size);
+    enum IR_ERROR(*FinishModuleStream)(Environment* env, struct __WASM_MODULE_STREAM* stream);
     void(*AddWhitelist)(Environment* env, const char* module_name, const char* export_name);
     void(*WaitForLoad)(Environment* env);
     enum IR_ERROR(*AddEmbedding)(Environment* env, int tag, const void* data, uint64_t size); // If size is 0, data points to a null terminated UTF8 file path
     enum IR_ERROR(*Compile)(Environment* env, const char* file);
+    void(*CompileAsync)(Environment* env, const char* file, IR_Completion callback, void* user); // Waits for all modules to load before compiling
     IR_Entrypoint(*LoadFunction)(void* cache, const char* module_name, const char* function); // if function is null, loads the entrypoint function
     IR_Entrypoint(*LoadTable)(void* cache, const char* module_name, const char* table);
     IRGlobal*(*LoadGlobal)(void* cache, const char* module_name, const char* export_name);
+    enum IR_ERROR(*LoadTypedFunction)(void* cache, const char* module_name, const char* function, IRFunction* out);
+    const IRExportDirectory*(*LoadExportDirectory)(void* cache); // Returns null if the library has no export directory
+    const IRExportEntry*(*FindExport)(const IRExportDirectory* directory, const char* module_name, const char* export_name);
     void*(*LoadAssembly)(const char* file);
     void(*DestroyEnvironment)(Environment* env);
+    void(*GetAllocatorStats)(Environment* env, IRAllocatorStats* stats);
+    IRInstance*(*CreateInstance)(void* cache); // Allocates a new instance and runs its init function, including all start functions
+    void*(*EnterInstance)(IRInstance* instance); // Returns the previously current state, which must be passed to LeaveInstance
+    void(*LeaveInstance)(IRInstance* instance, void* previous);
+    enum IR_ERROR(*SaveInstance)(IRInstance* instance); // Records the current state of the instance, usually right after creating it
+    enum IR_ERROR(*ResetInstance)(IRInstance* instance); // Returns the instance to the state recorded by SaveInstance without rerunning any init code
+    void(*DestroyInstance)(IRInstance* instance);
   } IRExports;
 
   // Statically linked function that loads the runtime stub, which then loads the actual runtime functions.
@@ -86,6 +200,7 @@ extern "C" {
   // Tooling functions that exist for command line utilities that always statically link to the runtime
   IR_COMPILER_DLLEXPORT extern int innative_compile_script(const uint8_t* data, size_t sz, Environment* env, bool always_compile);
   IR_COMPILER_DLLEXPORT extern int innative_compile_file(const char* file, const char* out, uint64_t flags, uint64_t optimize, uint64_t features, bool dynamic, const struct _IR_WHITELIST* whitelist, unsigned int n_whitelist, const char* arg0);
+  IR_COMPILER_DLLEXPORT extern int innative_snapshot(Environment* env, const char* scratch); // Runs all start functions at build time via a scratch library and embeds the resulting state
   IR_COMPILER_DLLEXPORT extern int innative_build_loader(struct _IR_CHUNK* chunks, const char* out, bool dynamic);
   IR_COMPILER_DLLEXPORT extern void innative_set_work_dir_to_bin(const char* arg0);
   IR_COMPILER_DLLEXPORT extern int innative_install(const char* arg0, bool full); // full install requires elevation on windows
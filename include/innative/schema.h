@@ -31,8 +31,8 @@ typedef uint64_t varuptr;
 typedef float float32;
 typedef double float64;
 
-// Maximum number of immediates used by any instruction
-#define MAX_IMMEDIATES 2
+// Maximum number of immediates used by any instruction (load/store use align, offset, memory index)
+#define MAX_IMMEDIATES 3
 
 enum WASM_TYPE_ENCODING
 {
@@ -54,6 +54,11 @@ enum WASM_LIMIT_FLAGS
   WASM_LIMIT_HAS_MAXIMUM = 0x01,
 };
 
+enum WASM_MEMARG_FLAGS
+{
+  WASM_MEMARG_HAS_MEMORY_INDEX = 0x40, // Set in the alignment field when an explicit memory index follows (multi-memory)
+};
+
 enum WASM_SECTION_OPCODE
 {
   WASM_SECTION_CUSTOM   = 0x00,
@@ -427,6 +432,8 @@ enum WASM_ENVIRONMENT_FLAGS
   ENV_EMIT_LLVM = (1 << 5), // Emits intermediate LLVM IR files for debugging
   ENV_HOMOGENIZE_FUNCTIONS = (1 << 6), // Converts all exported functions to i64 types for testing
   ENV_NO_INIT = (1 << 7), // Disables automatic initialization in DLLs, requiring you to manually call IR_INIT_FUNCTION and IR_EXIT_FUNCTION
+  ENV_INSTANCES = (1 << 8), // Moves memories, tables and mutable globals into per-instance state, so one library can be instantiated many times. Requires ENV_LIBRARY and ENV_NO_INIT.
+  ENV_LAZY_FUNCTIONS = (1 << 9), // Only records where each function body is while parsing, decoding it when it's validated or compiled. Module buffers passed in memory must outlive compilation.
   ENV_CHECK_STACK_OVERFLOW = (1 << 10),
   ENV_CHECK_FLOAT_TRUNC = (1 << 11),
   ENV_CHECK_MEMORY_ACCESS = (1 << 12),
@@ -463,6 +470,7 @@ enum WASM_OPTIMIZE_FLAGS
 enum WASM_FEATURE_FLAGS
 {
   ENV_FEATURE_MUTABLE_GLOBALS = (1 << 0),
+  ENV_FEATURE_MULTI_MEMORY = (1 << 1),
   ENV_FEATURE_ALL = ~0,
 };
 
@@ -520,6 +528,12 @@ typedef union __WASM_IMMEDIATE
   struct { varuint32 n_table; varuint32* table; };
 } Immediate;
 
+typedef struct __WASM_SOURCE_POSITION
+{
+  unsigned int line;
+  unsigned int column;
+} SourcePosition;
+
 typedef struct __WASM_INSTRUCTION
 {
   uint8_t opcode;
@@ -611,8 +625,14 @@ typedef struct __WASM_FUNCTION_BODY
   varuint32 body_size;
   varuint32 n_locals;
   varsint7* locals;
-  Instruction* body;
+  uint8_t* body; // Packed instruction stream, read it with an InstructionCursor
+  varuint32 n_code; // INTERNAL: size of the packed instruction stream in bytes
   varuint32 n_body; // INTERNAL: track actual number of instructions
+  SourcePosition* positions; // INTERNAL: source position of each instruction, always the size of n_body or NULL if it doesn't exist
+  uint8_t* source; // INTERNAL: undecoded instructions in the module's source buffer, if the body was parsed lazily
+  varuint32 n_source; // INTERNAL: size of the undecoded instructions in bytes
+  struct __WASM_VALIDATION_ERROR* errors; // INTERNAL: errors found while the body was validated during parsing
+  varuint1 validated; // INTERNAL: set if the body was validated while it was decoded, so ValidateModule only has to report errors
   DebugInfo* local_names; // INTERNAL: debug names of locals, always the size of n_locals or NULL if it doesn't exist
   DebugInfo* param_names; // INTERNAL: debug names of parameters, always the size of n_params or NULL if it doesn't exist
   DebugInfo debug;
@@ -745,6 +765,9 @@ enum WASM_LOG_LEVEL
 KHASH_DECLARE(modulepair, kh_cstr_t, FunctionType);
 
 struct __WASM_ALLOCATOR;
+struct __WASM_THREADPOOL;
+struct __WASM_MAPPING;
+struct __WASM_SYMBOLS;
 
 typedef struct __WASM_ENVIRONMENT
 {
@@ -761,6 +784,9 @@ typedef struct __WASM_ENVIRONMENT
   const char* sdkpath; // Path to look for SDK components, which usually aren't in the working directory
   const char* linker; // If nonzero, attempts to execute this path as a linker instead of using the built-in LLD linker
   struct __WASM_ALLOCATOR* alloc; // Stores a pointer to the allocator
+  struct __WASM_THREADPOOL* pool; // Runs multithreaded loads and asynchronous compiles
+  struct __WASM_MAPPING* mappings; // Module files are mapped until the environment is destroyed, because parsed modules point into them
+  struct __WASM_SYMBOLS* symbols; // Interned module, import and export names, so names can be looked up by pointer
   int loglevel;
   FILE* log;
   void(*wasthook)(void*);
@@ -39,6 +39,8 @@ static const std::unordered_map<std::string, unsigned int> flag_map = {
   { "llvm", ENV_EMIT_LLVM },
   { "homogenize", ENV_HOMOGENIZE_FUNCTIONS },
   { "noinit", ENV_NO_INIT },
+  { "instances", ENV_INSTANCES },
+  { "lazy", ENV_LAZY_FUNCTIONS },
 };
 
 static const std::unordered_map<std::string, unsigned int> optimize_map = {
@@ -52,8 +54,9 @@ static const std::unordered_map<std::string, unsigned int> optimize_map = {
 
 void usage()
 {
-  std::cout << "Usage: innative-cmd [-r] [-f FLAG] [-l FILE] [-o FILE] [-a FILE] [-d PATH]\n"
+  std::cout << "Usage: innative-cmd [-r] [-p] [-f FLAG] [-l FILE] [-o FILE] [-a FILE] [-d PATH]\n"
     "  -r : Run the compiled result immediately and display output. Requires a start function.\n"
+    "  -p : Pre-initializes the modules by running their start functions at build time and embedding the resulting memories and globals. Requires -flibrary or -r.\n"
     "  -f : Set a supported flag to true. Flags:\n";
  
   for(auto& f : flag_map)
@@ -87,6 +90,7 @@ int main(int argc, char *argv[])
   const char* linker = 0;
   bool run = false;
   bool generate = false;
+  bool snapshot = false;
   bool verbose = true;
   int err = ERR_SUCCESS;
 
@@ -100,6 +104,9 @@ int main(int argc, char *argv[])
         run = true;
         flags |= ENV_LIBRARY| ENV_NO_INIT;
         break;
+      case 'p': // pre-initialize
+        snapshot = true;
+        break;
       case 'f': // flag
       {
         auto raw = std::string(argv[i] + 2);
@@ -185,6 +192,12 @@ int main(int argc, char *argv[])
   if(out.empty()) // If no out is specified, default to name of first input file
     out = innative::Path(inputs[0]).RemoveExtension().Get() + ((flags&ENV_LIBRARY) ? IR_LIBRARY_EXTENSION : IR_EXE_EXTENSION);
 
+  if(snapshot && (generate || !(flags&ENV_LIBRARY)))
+  {
+    std::cout << "Pre-initialization requires building a library, because an executable's start function is its entry point." << std::endl;
+    return -9;
+  }
+
   IRExports exports = { 0 };
   if(generate) // If we are generating a loader, we replace all of the normal functions to reroute the resources into the EXE file
   {
@@ -315,8 +328,14 @@ int main(int argc, char *argv[])
     for(size_t i = 0; i < wast.size() && !err; ++i)
       err = innative_compile_script((const uint8_t*)wast[i], 0, env, true);
   }
-  else // Attempt to compile. If an error happens, output it and any validation errors to stderr
-    err = (*exports.Compile)(env, out.c_str());
+  else
+  {
+    if(snapshot) // Run the start functions from a scratch library first, so their effects are baked into the real one
+      err = innative_snapshot(env, (out + ".snapshot" IR_LIBRARY_EXTENSION).c_str());
+
+    if(err >= 0) // Attempt to compile. If an error happens, output it and any validation errors to stderr
+      err = (*exports.Compile)(env, out.c_str());
+  }
 
   if(err < 0)
   {
@@ -1,189 +1,398 @@
-// Copyright (c)2019 Black Sphere Studios
-// For conditions of distribution and use, see copyright notice in innative.h
-
-#include "innative/export.h"
-
-#ifdef IR_PLATFORM_WIN32
-#include "../innative/win32.h"
-#elif defined(IR_PLATFORM_POSIX)
-#include <unistd.h>
-#include <sys/mman.h>
-#else
-#error unknown platform!
-#endif
-
-IR_COMPILER_DLLEXPORT extern void _innative_internal_env_memcpy(char* dest, const char* src, uint64_t sz)
-{
-  // Very simple memcpy implementation because we don't have access to the C library
-  while(sz > sizeof(uint64_t))
-  {
-    *((uint64_t*)dest) = *((uint64_t*)src);
-    dest += sizeof(uint64_t);
-    src += sizeof(uint64_t);
-    sz -= sizeof(uint64_t);
-  }
-  while(sz)
-  {
-    *dest = *src;
-    dest += 1;
-    src += 1;
-    sz -= 1;
-  }
-}
-
-#ifdef IR_PLATFORM_WIN32
-HANDLE heap = 0;
-DWORD heapcount = 0;
-#elif defined(IR_PLATFORM_POSIX)
-#ifdef IR_CPU_x86_64
-IR_COMPILER_NAKED void* _innative_syscall(size_t syscall_number, const void* p1, size_t p2, size_t p3, size_t p4, size_t p5)
-{
-  __asm volatile(
-    "movq %rdi, %rax\n\t"
-    "movq %rsi, %rdi\n\t"
-    "movq %rdx, %rsi\n\t"
-    "movq %rcx, %rdx\n\t"
-    "movq %r8, %r10\n\t"
-    "movq %r9, %r8\n\t"
-    "movq $0, %r9\n\t" // movq 8(%rsp), %r9
-    "syscall\n\t"
-    "ret");
-}
-
-const int SYSCALL_WRITE = 1;
-const int SYSCALL_MMAP = 9;
-const int SYSCALL_MUNMAP = 11;
-const int SYSCALL_MREMAP = 25;
-const int SYSCALL_EXIT = 60;
-const int MREMAP_MAYMOVE = 1;
-
-#else
-#error unsupported architecture!
-#endif
-#endif
-
-void _innative_internal_write_out(const void* buf, size_t num)
-{
-#ifdef IR_PLATFORM_WIN32
-  DWORD out;
-  WriteConsoleA(GetStdHandle(STD_OUTPUT_HANDLE), buf, num, &out, NULL);
-#elif defined(IR_PLATFORM_POSIX)
-  size_t cast = 1;
-  _innative_syscall(SYSCALL_WRITE, (void*)cast, (size_t)buf, num, 0, 0);
-#else
-#error unknown platform!
-#endif
-}
-
-static const char lookup[16] = "0123456789ABCDEF";
-
-IR_COMPILER_DLLEXPORT extern void _innative_internal_env_print(uint64_t a)
-{
-  char buf[25] = { 0 };
-
-  int i = 0;
-  do
-  {
-    buf[i++] = lookup[a >> 60];
-    a <<= 4;
-  } while(i < 16);
-  buf[i++] = '\n';
-  _innative_internal_write_out(buf, i);
-}
-
-IR_COMPILER_DLLEXPORT extern void _innative_internal_env_print_compiler(uint64_t a)
-{
-  _innative_internal_env_print(a);
-}
-
-// Platform-specific implementation of the mem.grow instruction, except it works in bytes
-IR_COMPILER_DLLEXPORT extern void* _innative_internal_env_grow_memory(void* p, uint64_t i, uint64_t max)
-{
-  uint64_t* info = (uint64_t*)p;
-  if(info != 0)
-  {
-    i += info[-1];
-    if(max > 0 && i > max)
-      return 0;
-#ifdef IR_PLATFORM_WIN32
-    info = HeapReAlloc(heap, HEAP_ZERO_MEMORY, info - 1, i + sizeof(uint64_t));
-#elif defined(IR_PLATFORM_POSIX)
-    info = _innative_syscall(SYSCALL_MREMAP, info - 1, info[-1] + sizeof(uint64_t), i + sizeof(uint64_t), MREMAP_MAYMOVE, 0);
-    if((void*)info >= (void*)0xfffffffffffff001) // This is a syscall error from -4095 to -1
-      return 0;
-#else
-#error unknown platform!
-#endif
-  }
-  else if(!max || i <= max)
-  {
-#ifdef IR_PLATFORM_WIN32
-    if(!heap)
-      heap = HeapCreate(0, i, 0);
-    ++heapcount;
-    info = HeapAlloc(heap, HEAP_ZERO_MEMORY, i + sizeof(uint64_t));
-#elif defined(IR_PLATFORM_POSIX)
-    info = _innative_syscall(SYSCALL_MMAP, NULL, i + sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1);
-    if((void*)info >= (void*)0xfffffffffffff001) // This is a syscall error from -4095 to -1
-      return 0;
-#else
-#error unknown platform!
-#endif
-  }
-
-  if((size_t)info % sizeof(uint64_t))
-    i = i / 0; // Force error (we have no standard library so we can't abort)
-
-  if(!info)
-    return 0;
-  info[0] = i;
-  return info + 1;
-}
-
-// Platform-specific memory free, called by the exit function to clean up memory allocations
-IR_COMPILER_DLLEXPORT extern void _innative_internal_env_free_memory(void* p)
-{
-  if(p)
-  {
-    uint64_t* info = (uint64_t*)p;
-
-#ifdef IR_PLATFORM_WIN32
-    HeapFree(heap, 0, info - 1);
-    if(--heapcount == 0)
-      HeapDestroy(heap);
-#elif defined(IR_PLATFORM_POSIX)
-    _innative_syscall(SYSCALL_MUNMAP, info - 1, info[-1], 0, 0, 0);
-#else
-#error unknown platform!
-#endif
-  }
-}
-
-// You cannot return from the entry point of a program, you must instead call a platform-specific syscall to terminate it.
-IR_COMPILER_DLLEXPORT extern void _innative_internal_env_exit(int status)
-{
-#ifdef IR_PLATFORM_WIN32
-  ExitProcess(status);
-#elif defined(IR_PLATFORM_POSIX)
-  size_t cast = status;
-  _innative_syscall(SYSCALL_EXIT, (void*)cast, 0, 0, 0, 0);
-#endif
-}
-
-IR_COMPILER_DLLEXPORT extern void _innative_internal_env_memdump(const unsigned char* mem, uint64_t sz)
-{
-  static const char prefix[] = "\n --- MEMORY DUMP ---\n\n";
-  char buf[256];
-
-  _innative_internal_write_out(prefix, sizeof(prefix));
-  for(uint64_t i = 0; i < sz;)
-  {
-    uint64_t j;
-    for(j = 0; j < 128 && i < sz; ++j, ++i)
-    {
-      buf[j * 2] = lookup[(mem[i] & 0xF0) >> 4];
-      buf[j * 2 + 1] = lookup[mem[i] & 0x0F];
-    }
-    _innative_internal_write_out(buf, j * 2);
-  }
-}
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "innative/export.h"
+
+#ifdef IR_PLATFORM_WIN32
+#include "../innative/win32.h"
+#elif defined(IR_PLATFORM_POSIX)
+#include <unistd.h>
+#include <sys/mman.h>
+#else
+#error unknown platform!
+#endif
+
+IR_COMPILER_DLLEXPORT extern void _innative_internal_env_memcpy(char* dest, const char* src, uint64_t sz)
+{
+  // Very simple memcpy implementation because we don't have access to the C library
+  while(sz > sizeof(uint64_t))
+  {
+    *((uint64_t*)dest) = *((uint64_t*)src);
+    dest += sizeof(uint64_t);
+    src += sizeof(uint64_t);
+    sz -= sizeof(uint64_t);
+  }
+  while(sz)
+  {
+    *dest = *src;
+    dest += 1;
+    src += 1;
+    sz -= 1;
+  }
+}
+
+#ifdef IR_PLATFORM_POSIX
+#ifdef IR_CPU_x86_64
+IR_COMPILER_NAKED void* _innative_syscall(size_t syscall_number, const void* p1, size_t p2, size_t p3, size_t p4, size_t p5, size_t p6)
+{
+  __asm volatile(
+    "movq %rdi, %rax\n\t"
+    "movq %rsi, %rdi\n\t"
+    "movq %rdx, %rsi\n\t"
+    "movq %rcx, %rdx\n\t"
+    "movq %r8, %r10\n\t"
+    "movq %r9, %r8\n\t"
+    "movq 8(%rsp), %r9\n\t"
+    "syscall\n\t"
+    "ret");
+}
+
+const int SYSCALL_READ = 0;
+const int SYSCALL_WRITE = 1;
+const int SYSCALL_OPEN = 2;
+const int SYSCALL_CLOSE = 3;
+const int SYSCALL_FSTAT = 5;
+const int SYSCALL_MMAP = 9;
+const int SYSCALL_MPROTECT = 10;
+const int SYSCALL_MUNMAP = 11;
+const int SYSCALL_EXIT = 60;
+const int OPEN_RDONLY = 0;
+
+#define IR_SYSCALL_FAILED(r) ((void*)(r) >= (void*)0xfffffffffffff001) // This is a syscall error from -4095 to -1
+
+#else
+#error unsupported architecture!
+#endif
+#endif
+
+void _innative_internal_write_out(const void* buf, size_t num)
+{
+#ifdef IR_PLATFORM_WIN32
+  DWORD out;
+  WriteConsoleA(GetStdHandle(STD_OUTPUT_HANDLE), buf, num, &out, NULL);
+#elif defined(IR_PLATFORM_POSIX)
+  size_t cast = 1;
+  _innative_syscall(SYSCALL_WRITE, (void*)cast, (size_t)buf, num, 0, 0, 0);
+#else
+#error unknown platform!
+#endif
+}
+
+static const char lookup[16] = "0123456789ABCDEF";
+
+IR_COMPILER_DLLEXPORT extern void _innative_internal_env_print(uint64_t a)
+{
+  char buf[25] = { 0 };
+
+  int i = 0;
+  do
+  {
+    buf[i++] = lookup[a >> 60];
+    a <<= 4;
+  } while(i < 16);
+  buf[i++] = '\n';
+  _innative_internal_write_out(buf, i);
+}
+
+IR_COMPILER_DLLEXPORT extern void _innative_internal_env_print_compiler(uint64_t a)
+{
+  _innative_internal_env_print(a);
+}
+
+static uint64_t _innative_internal_page_round(uint64_t i)
+{
+  return (i + IR_PAGE_SIZE - 1) & ~(uint64_t)(IR_PAGE_SIZE - 1);
+}
+
+// Reserves address space for max bytes (or only i bytes if there is no maximum) behind a header page, and commits the first i bytes.
+// The header page ends with the reserved size followed by the current size.
+static uint64_t* _innative_internal_reserve(uint64_t i, uint64_t max)
+{
+  uint64_t reserve = _innative_internal_page_round(max > i ? max : i);
+#ifdef IR_PLATFORM_WIN32
+  char* region = VirtualAlloc(NULL, reserve + IR_PAGE_SIZE, MEM_RESERVE, PAGE_NOACCESS);
+  if(!region)
+    return 0;
+  if(!VirtualAlloc(region, IR_PAGE_SIZE + _innative_internal_page_round(i), MEM_COMMIT, PAGE_READWRITE))
+  {
+    VirtualFree(region, 0, MEM_RELEASE);
+    return 0;
+  }
+#elif defined(IR_PLATFORM_POSIX)
+  char* region = _innative_syscall(SYSCALL_MMAP, NULL, reserve + IR_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(IR_SYSCALL_FAILED(region))
+    return 0;
+  if(IR_SYSCALL_FAILED(_innative_syscall(SYSCALL_MPROTECT, region, IR_PAGE_SIZE + _innative_internal_page_round(i), PROT_READ | PROT_WRITE, 0, 0, 0)))
+  {
+    _innative_syscall(SYSCALL_MUNMAP, region, reserve + IR_PAGE_SIZE, 0, 0, 0, 0);
+    return 0;
+  }
+#else
+#error unknown platform!
+#endif
+
+  uint64_t* info = (uint64_t*)(region + IR_PAGE_SIZE);
+  info[-2] = reserve;
+  return info;
+}
+
+// Commits the reserved pages needed to grow from "from" bytes to "to" bytes. Returns 0 on failure.
+static int _innative_internal_commit(char* p, uint64_t from, uint64_t to)
+{
+  from = _innative_internal_page_round(from);
+  to = _innative_internal_page_round(to);
+  if(to <= from)
+    return 1;
+#ifdef IR_PLATFORM_WIN32
+  return VirtualAlloc(p + from, to - from, MEM_COMMIT, PAGE_READWRITE) != 0;
+#elif defined(IR_PLATFORM_POSIX)
+  return !IR_SYSCALL_FAILED(_innative_syscall(SYSCALL_MPROTECT, p + from, to - from, PROT_READ | PROT_WRITE, 0, 0, 0));
+#else
+#error unknown platform!
+#endif
+}
+
+// Platform-specific memory free, called by the exit function to clean up memory allocations
+IR_COMPILER_DLLEXPORT extern void _innative_internal_env_free_memory(void* p)
+{
+  if(p)
+  {
+#ifdef IR_PLATFORM_WIN32
+    VirtualFree((char*)p - IR_PAGE_SIZE, 0, MEM_RELEASE);
+#elif defined(IR_PLATFORM_POSIX)
+    _innative_syscall(SYSCALL_MUNMAP, (char*)p - IR_PAGE_SIZE, ((uint64_t*)p)[-2] + IR_PAGE_SIZE, 0, 0, 0, 0);
+#else
+#error unknown platform!
+#endif
+  }
+}
+
+// Platform-specific implementation of the mem.grow instruction, except it works in bytes. The maximum size is reserved up front, so
+// growing only commits the new pages and never moves the memory. Allocations without a maximum are moved if they outgrow their
+// reservation.
+IR_COMPILER_DLLEXPORT extern void* _innative_internal_env_grow_memory(void* p, uint64_t i, uint64_t max)
+{
+  uint64_t* info = (uint64_t*)p;
+  if(info != 0)
+  {
+    uint64_t old = info[-1];
+    i += old;
+    if(max > 0 && i > max)
+      return 0;
+    if(i > info[-2])
+    {
+      uint64_t* moved = _innative_internal_reserve(i, 0);
+      if(!moved)
+        return 0;
+      _innative_internal_env_memcpy((char*)moved, p, old);
+      _innative_internal_env_free_memory(p);
+      info = moved;
+    }
+    else if(!_innative_internal_commit(p, old, i))
+      return 0;
+  }
+  else if(!max || i <= max)
+    info = _innative_internal_reserve(i, max);
+
+  if(!info)
+    return 0;
+  info[-1] = i;
+  return info;
+}
+
+#ifdef IR_PLATFORM_POSIX
+static uint64_t _innative_internal_parse_hex(const char** s)
+{
+  uint64_t r = 0;
+  for(;; ++*s)
+  {
+    if(**s >= '0' && **s <= '9')
+      r = (r << 4) | (**s - '0');
+    else if(**s >= 'a' && **s <= 'f')
+      r = (r << 4) | (**s - 'a' + 10);
+    else
+      return r;
+  }
+}
+
+static uint64_t _innative_internal_parse_dec(const char** s)
+{
+  uint64_t r = 0;
+  for(; **s >= '0' && **s <= '9'; ++*s)
+    r = r * 10 + (**s - '0');
+  return r;
+}
+
+// Given one line of /proc/self/maps, returns 1 if the mapping contains [addr, addr + sz) and fills in its bounds, its file offset, and
+// the path, device and inode of the file it was mapped from. The path is null if it wasn't mapped from a file.
+static int _innative_internal_maps_line(const char* s, const char* addr, uint64_t sz, IRImageBacking* backing, const char** path,
+                                        uint64_t* dev, uint64_t* inode)
+{
+  uint64_t start = _innative_internal_parse_hex(&s);
+  if(*s++ != '-')
+    return 0;
+  uint64_t end = _innative_internal_parse_hex(&s);
+  if((uint64_t)addr < start || (uint64_t)addr + sz > end)
+    return 0;
+
+  while(*s == ' ') ++s;
+  while(*s && *s != ' ') ++s; // Permissions
+  while(*s == ' ') ++s;
+  uint64_t offset = _innative_internal_parse_hex(&s);
+  while(*s == ' ') ++s;
+  uint64_t major = _innative_internal_parse_hex(&s);
+  if(*s++ != ':')
+    return 0;
+  uint64_t minor = _innative_internal_parse_hex(&s);
+  while(*s == ' ') ++s;
+  *inode = _innative_internal_parse_dec(&s);
+  while(*s == ' ') ++s;
+
+  *dev = (minor & 0xff) | (major << 8) | ((minor & ~0xffULL) << 12); // How the kernel encodes st_dev
+  *path = (*s == '/') ? s : 0;
+  backing->start = start;
+  backing->end = end;
+  backing->offset = offset;
+  return 1;
+}
+
+// The path in /proc/self/maps may name a file that has since been replaced or deleted, so it only counts if it's still the same file
+static int _innative_internal_open_same(const char* path, uint64_t dev, uint64_t inode)
+{
+  uint64_t st[18]; // struct stat, where st_dev and st_ino come first
+  int fd = (int)(size_t)_innative_syscall(SYSCALL_OPEN, path, OPEN_RDONLY, 0, 0, 0, 0);
+  if(fd < 0)
+    return -1;
+  if(IR_SYSCALL_FAILED(_innative_syscall(SYSCALL_FSTAT, (void*)(size_t)fd, (size_t)st, 0, 0, 0, 0)) || st[0] != dev || st[1] != inode)
+  {
+    _innative_syscall(SYSCALL_CLOSE, (void*)(size_t)fd, 0, 0, 0, 0, 0);
+    return -1;
+  }
+  return fd;
+}
+
+// Opens the file that the loader mapped [addr, addr + sz) from, and remembers it in backing so later segments in the same mapping don't
+// have to look again. Returns -1 if no file can back it.
+static int _innative_internal_open_backing(const char* addr, uint64_t sz, IRImageBacking* backing)
+{
+  if(backing->fd != 0 && (uint64_t)addr >= backing->start && (uint64_t)addr + sz <= backing->end)
+    return (int)backing->fd - 1;
+  if(backing->fd > 0)
+    _innative_syscall(SYSCALL_CLOSE, (void*)(size_t)(backing->fd - 1), 0, 0, 0, 0, 0);
+  backing->fd = -1;
+  backing->start = (uint64_t)addr; // If nothing is found, later segments in the same place don't look again
+  backing->end = (uint64_t)addr + sz;
+
+  char buf[512];
+  char line[1024];
+  size_t len = 0;
+  int fd = (int)(size_t)_innative_syscall(SYSCALL_OPEN, "/proc/self/maps", OPEN_RDONLY, 0, 0, 0, 0);
+  if(fd < 0)
+    return -1;
+
+  int result = -1;
+  int found = 0;
+  while(!found)
+  {
+    int64_t n = (int64_t)_innative_syscall(SYSCALL_READ, (void*)(size_t)fd, (size_t)buf, sizeof(buf), 0, 0, 0);
+    if(n <= 0)
+      break;
+
+    for(int64_t i = 0; i < n && !found; ++i)
+    {
+      if(buf[i] != '\n')
+      {
+        if(len < sizeof(line)) // Overlong lines are discarded
+          line[len] = buf[i];
+        ++len;
+        continue;
+      }
+
+      if(len < sizeof(line))
+      {
+        const char* path;
+        uint64_t dev;
+        uint64_t inode;
+        IRImageBacking mapping;
+        line[len] = 0;
+        found = _innative_internal_maps_line(line, addr, sz, &mapping, &path, &dev, &inode);
+        if(found)
+        {
+          result = !path ? -1 : _innative_internal_open_same(path, dev, inode);
+          mapping.fd = (result < 0) ? -1 : result + 1;
+          *backing = mapping;
+        }
+      }
+      len = 0;
+    }
+  }
+
+  _innative_syscall(SYSCALL_CLOSE, (void*)(size_t)fd, 0, 0, 0, 0, 0);
+  return result;
+}
+#endif
+
+// Copies a data segment into linear memory. Whenever the source and destination share a page offset, whole pages are instead
+// mapped copy-on-write from the binary, so they are loaded lazily and shared between processes until written.
+IR_COMPILER_DLLEXPORT extern void _innative_internal_env_map_image(char* dest, const char* src, uint64_t sz, IRImageBacking* backing)
+{
+#ifdef IR_PLATFORM_POSIX
+  uint64_t head = (IR_PAGE_SIZE - ((size_t)dest % IR_PAGE_SIZE)) % IR_PAGE_SIZE;
+  if(((size_t)dest % IR_PAGE_SIZE) == ((size_t)src % IR_PAGE_SIZE) && sz >= head + IR_PAGE_SIZE)
+  {
+    uint64_t pages = (sz - head) & ~(uint64_t)(IR_PAGE_SIZE - 1);
+    int fd = _innative_internal_open_backing(src + head, pages, backing);
+    if(fd >= 0)
+    {
+      uint64_t offset = backing->offset + ((uint64_t)(src + head) - backing->start);
+      void* r = _innative_syscall(SYSCALL_MMAP, dest + head, pages, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+      if(!IR_SYSCALL_FAILED(r))
+      {
+        _innative_internal_env_memcpy(dest, src, head);
+        _innative_internal_env_memcpy(dest + head + pages, src + head + pages, sz - head - pages);
+        return;
+      }
+    }
+  }
+#endif
+  _innative_internal_env_memcpy(dest, src, sz);
+}
+
+// Called once every data segment of a module has been loaded
+IR_COMPILER_DLLEXPORT extern void _innative_internal_env_close_image(IRImageBacking* backing)
+{
+#ifdef IR_PLATFORM_POSIX
+  if(backing->fd > 0)
+    _innative_syscall(SYSCALL_CLOSE, (void*)(size_t)(backing->fd - 1), 0, 0, 0, 0, 0);
+#endif
+  backing->fd = 0;
+}
+
+// You cannot return from the entry point of a program, you must instead call a platform-specific syscall to terminate it.
+IR_COMPILER_DLLEXPORT extern void _innative_internal_env_exit(int status)
+{
+#ifdef IR_PLATFORM_WIN32
+  ExitProcess(status);
+#elif defined(IR_PLATFORM_POSIX)
+  size_t cast = status;
+  _innative_syscall(SYSCALL_EXIT, (void*)cast, 0, 0, 0, 0, 0);
+#endif
+}
+
+IR_COMPILER_DLLEXPORT extern void _innative_internal_env_memdump(const unsigned char* mem, uint64_t sz)
+{
+  static const char prefix[] = "\n --- MEMORY DUMP ---\n\n";
+  char buf[256];
+
+  _innative_internal_write_out(prefix, sizeof(prefix));
+  for(uint64_t i = 0; i < sz;)
+  {
+    uint64_t j;
+    for(j = 0; j < 128 && i < sz; ++j, ++i)
+    {
+      buf[j * 2] = lookup[(mem[i] & 0xF0) >> 4];
+      buf[j * 2 + 1] = lookup[mem[i] & 0x0F];
+    }
+    _innative_internal_write_out(buf, j * 2);
+  }
+}
@@ -0,0 +1,48 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#ifndef __BENCHMARK_H__IR__
+#define __BENCHMARK_H__IR__
+
+#include "innative/export.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+
+class Benchmarks
+{
+public:
+  inline Benchmarks(FILE* out, IRExports& exports, const char* arg0) : _target(out), _exports(exports), _arg0(arg0) {}
+  void bench_instance();
+  void bench_lexer();
+  void bench_parse();
+
+protected:
+  // Runs fn the given number of times and reports the average time per call
+  template<class F>
+  inline void Measure(const char* name, uint64_t iterations, F fn)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for(uint64_t i = 0; i < iterations; ++i)
+      fn();
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    fprintf(_target, "  %-32s %12.3f us\n", name, elapsed.count() / iterations);
+  }
+
+  // Runs fn the given number of times and reports how fast it got through the given number of bytes on each call
+  template<class F>
+  inline void MeasureThroughput(const char* name, uint64_t iterations, uint64_t bytes, F fn)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for(uint64_t i = 0; i < iterations; ++i)
+      fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fprintf(_target, "  %-32s %12.3f MB/s\n", name, (bytes * iterations) / (elapsed.count() * 1000000.0));
+  }
+
+  FILE* _target;
+  IRExports& _exports;
+  const char* _arg0;
+};
+
+#endif
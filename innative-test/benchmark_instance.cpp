@@ -0,0 +1,61 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "benchmark.h"
+
+// A 64 MiB heap whose start function touches every page, and a request that dirties a global, two pages, and grows memory
+static const char bench_module[] = "(module $bench"
+"\n  (memory 1024 2048)"
+"\n  (global $requests (mut i32) (i32.const 0))"
+"\n  (func $start (local $i i32)"
+"\n    (loop $fill"
+"\n      (i32.store (local.get $i) (local.get $i))"
+"\n      (local.set $i (i32.add (local.get $i) (i32.const 4096)))"
+"\n      (br_if $fill (i32.lt_u (local.get $i) (i32.const 67108864)))))"
+"\n  (func $request (export \"request\")"
+"\n    (global.set $requests (i32.add (global.get $requests) (i32.const 1)))"
+"\n    (i32.store (i32.const 0) (global.get $requests))"
+"\n    (i32.store (i32.const 1048576) (global.get $requests))"
+"\n    (drop (memory.grow (i32.const 1))))"
+"\n  (start $start))";
+
+void Benchmarks::bench_instance()
+{
+  static const char* file = "bench_instance" IR_LIBRARY_EXTENSION;
+
+  Environment* env = (*_exports.CreateEnvironment)(1, 0, _arg0);
+  env->flags = ENV_LIBRARY | ENV_NO_INIT | ENV_INSTANCES | ENV_ENABLE_WAT;
+  env->optimize = ENV_OPTIMIZE_O3;
+  env->features = ENV_FEATURE_ALL;
+
+  int err = (*_exports.AddEmbedding)(env, 0, (void*)INNATIVE_DEFAULT_ENVIRONMENT, 0);
+  if(err >= 0)
+    (*_exports.AddModule)(env, bench_module, sizeof(bench_module) - 1, "bench", &err);
+  (*_exports.WaitForLoad)(env);
+  if(err >= 0)
+    err = (*_exports.Compile)(env, file);
+  (*_exports.DestroyEnvironment)(env);
+
+  void* cache = (err < 0) ? nullptr : (*_exports.LoadAssembly)(file);
+  IR_Entrypoint request = !cache ? nullptr : (*_exports.LoadFunction)(cache, "bench", "request");
+  if(!request)
+  {
+    fprintf(_target, "  Failed to compile instance benchmark: %i\n", err);
+    return;
+  }
+
+  IRInstance* instance = (*_exports.CreateInstance)(cache);
+  (*_exports.SaveInstance)(instance);
+
+  // Creating an instance reruns init, including the start function, which is what resetting avoids
+  Measure("create and destroy instance", 10, [&]() { (*_exports.DestroyInstance)((*_exports.CreateInstance)(cache)); });
+
+  Measure("request and reset instance", 1000, [&]() {
+    void* previous = (*_exports.EnterInstance)(instance);
+    (*request)();
+    (*_exports.LeaveInstance)(instance, previous);
+    (*_exports.ResetInstance)(instance);
+  });
+
+  (*_exports.DestroyInstance)(instance);
+}
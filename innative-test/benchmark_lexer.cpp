@@ -0,0 +1,108 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "benchmark.h"
+#include "../innative/wat.h"
+#include "../innative/util.h"
+#include <string>
+
+using namespace innative;
+using namespace wat;
+
+namespace {
+  // Text in the style of a disassembled compiler output, with indentation, names, comments, strings and memory arguments
+  std::string GenerateText(size_t functions)
+  {
+    std::string text = "(module $bench\n  (memory 16)\n  (data (i32.const 1024) \"generated \\\"benchmark\\\" data\\00\")\n";
+    for(size_t i = 0; i < functions; ++i)
+    {
+      std::string index = std::to_string(i);
+      text += "  ;; function " + index + "\n  (func $f" + index + " (param $a i32) (param $b i32) (result i32) (local $c i32)\n";
+      for(size_t j = 0; j < 8; ++j)
+      {
+        std::string n = std::to_string((i * 977 + j * 131) % 100000);
+        text += "    (local.set $c (i32.add (local.get $a) (i32.const " + n + ")))\n";
+        text += "    (block $b" + std::to_string(j) + " (br_if $b" + std::to_string(j) + " (local.get $c)))\n";
+        text += "    (i32.store offset=" + std::to_string(j * 4) + " align=4 (local.get $b) (local.get $c)) (; store ;)\n";
+        text += "    (drop (call $f" + std::to_string((i + j + 1) % functions) + " (local.get $a) (local.get $b)))\n";
+      }
+      text += "    (local.get $c))\n";
+    }
+    return text + ")\n";
+  }
+
+  // Constants in the forms a spec test or a disassembler writes them
+  std::string GenerateNumbers(size_t count)
+  {
+    const char* forms[] = { "%u", "-%u", "0x%x", "%u.%u", "-%u.%ue-%u", "0x%x.%xp-%u", "%u_%03u" };
+    std::string text;
+    char buf[64];
+    for(size_t i = 0; i < count; ++i)
+    {
+      unsigned int a = (unsigned int)(i * 2654435761u), b = (unsigned int)(i * 40503u) % 1000, c = (unsigned int)i % 30;
+      snprintf(buf, sizeof(buf), forms[i % (sizeof(forms) / sizeof(forms[0]))], a, b, c);
+      text += buf;
+      text += ' ';
+    }
+    return text;
+  }
+}
+
+void Benchmarks::bench_lexer()
+{
+  std::string text = GenerateText(20000);
+  const char* end = text.data() + text.size();
+  size_t count = 0;
+
+  MeasureThroughput("tokenize into queue", 10, text.size(), [&]() {
+    Queue<WatToken> tokens;
+    TokenizeWAT(tokens, text.data(), end);
+    count += tokens.Size();
+  });
+  MeasureThroughput("streaming lexer", 10, text.size(), [&]() {
+    WatLexer lexer(text.data(), end);
+    while(lexer.Size() > 0)
+      count += (lexer.Pop().id != TOKEN_NONE);
+  });
+
+  std::string numbers = GenerateNumbers(1000000);
+  Queue<WatToken> literals;
+  TokenizeWAT(literals, numbers.data(), numbers.data() + numbers.size());
+  double sum = 0;
+  MeasureThroughput("numeric literals", 10, numbers.size(), [&]() {
+    for(size_t i = 0; i < literals.Size(); ++i)
+    {
+      float64 d;
+      varsint64 v;
+      if(!ResolveTokeni64(literals[i], v))
+        sum += (float64)v;
+      else if(!ResolveTokenf64(literals[i], d))
+        sum += d;
+    }
+  });
+
+  // With ENV_MULTITHREADED, function bodies are parsed on the thread pool after a pass that only assigns indexes
+  Environment* env = (*_exports.CreateEnvironment)(1, 0, _arg0);
+  int result = ERR_SUCCESS;
+  for(int threaded = 0; threaded < 2; ++threaded)
+  {
+    MeasureThroughput(threaded ? "parse text module on the thread pool" : "parse text module", 3, text.size(), [&]() {
+      Environment scratch = *env;
+      __WASM_ALLOCATOR alloc(env->alloc);
+      scratch.alloc = &alloc;
+      scratch.errors = nullptr;
+      scratch.flags = threaded ? (env->flags | ENV_MULTITHREADED) : (env->flags & ~ENV_MULTITHREADED);
+      Module m;
+      int err = ParseWatModule(scratch, m, (uint8_t*)text.data(), text.size(), utility::StringRef{ "bench", 5 });
+      if(err < 0)
+        result = err;
+      kh_destroy_exports(m.exports);
+    });
+  }
+  (*_exports.DestroyEnvironment)(env);
+
+  if(result < 0)
+    fprintf(_target, "  Failed to parse benchmark text module: %i\n", result);
+  if(!count || sum == 0)
+    fprintf(_target, "  Lexer benchmark produced no tokens or numbers\n");
+}
@@ -0,0 +1,401 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "benchmark.h"
+#include "../innative/parse.h"
+#include "../innative/util.h"
+#include <vector>
+
+using namespace innative;
+using namespace utility;
+
+namespace {
+  void WriteLEB128(std::vector<uint8_t>& out, uint64_t v)
+  {
+    do
+    {
+      uint8_t byte = v & 0x7F;
+      v >>= 7;
+      out.push_back(byte | (v ? 0x80 : 0));
+    } while(v);
+  }
+
+  void WriteSection(std::vector<uint8_t>& out, uint8_t id, const std::vector<uint8_t>& payload)
+  {
+    out.push_back(id);
+    WriteLEB128(out, payload.size());
+    out.insert(out.end(), payload.begin(), payload.end());
+  }
+
+  // The instructions of a function with the mix of locals, constants, memory accesses, branches and calls a compiler usually emits
+  void GenerateInstructions(std::vector<uint8_t>& body, varuint32 i, varuint32 functions)
+  {
+    for(varuint32 j = 0; j < 8; ++j)
+    {
+      body.insert(body.end(), { OP_local_get, 0, OP_i32_const });
+      WriteLEB128(body, (i * 977 + j * 131) % 100000);
+      body.insert(body.end(), { OP_i32_add, OP_local_set, 2, OP_block, 0x40, OP_local_get, 2, OP_br_if, 0, OP_end });
+      body.insert(body.end(), { OP_local_get, 1, OP_local_get, 2, OP_i32_store, 2 });
+      WriteLEB128(body, j * 4);
+      body.insert(body.end(), { OP_local_get, 0, OP_local_get, 1, OP_call });
+      WriteLEB128(body, (i + j + 1) % functions);
+      body.push_back(OP_drop);
+    }
+    body.insert(body.end(), { OP_local_get, 2, OP_end });
+  }
+
+  // A valid module made of functions from GenerateInstructions
+  std::vector<uint8_t> GenerateModule(varuint32 functions)
+  {
+    std::vector<uint8_t> module = { 0x00, 0x61, 0x73, 0x6D, 0x01, 0x00, 0x00, 0x00 };
+    WriteSection(module, WASM_SECTION_TYPE, { 1, 0x60, 2, 0x7F, 0x7F, 1, 0x7F });
+
+    std::vector<uint8_t> payload;
+    WriteLEB128(payload, functions);
+    payload.insert(payload.end(), functions, 0);
+    WriteSection(module, WASM_SECTION_FUNCTION, payload);
+    WriteSection(module, WASM_SECTION_MEMORY, { 1, 0, 16 });
+
+    payload.clear();
+    WriteLEB128(payload, functions);
+    std::vector<uint8_t> body;
+    for(varuint32 i = 0; i < functions; ++i)
+    {
+      body.assign({ 1, 1, 0x7F });
+      GenerateInstructions(body, i, functions);
+      WriteLEB128(payload, body.size());
+      payload.insert(payload.end(), body.begin(), body.end());
+    }
+    WriteSection(module, WASM_SECTION_CODE, payload);
+    return module;
+  }
+
+  // The one byte at a time loop the decoder used to be, kept to measure the fast paths against
+  uint64_t DecodeLEB128Bytewise(Stream& s, IR_ERROR& err, unsigned int maxbits, bool sign = false)
+  {
+    size_t shift = 0;
+    int byte = 0;
+    uint64_t result = 0;
+    do
+    {
+      if(shift >= maxbits)
+        return err = ERR_FATAL_OVERLONG_ENCODING, 0;
+      if((byte = s.Get()) == -1)
+        return err = ERR_PARSE_UNEXPECTED_EOF, 0;
+      result |= (static_cast<uint64_t>(byte & 0x7F) << shift);
+      shift += 7;
+    } while((byte & 0x80) != 0);
+
+    bool negative = sign && (byte & 0x40);
+    if(shift > maxbits && ((negative ? ~byte : byte) & ((~0u << (maxbits + 7 - shift)) & 0x7F)))
+      return err = ERR_FATAL_INVALID_ENCODING, 0;
+    if(negative && shift < 64)
+      result |= (~0ULL << shift);
+    err = ERR_SUCCESS;
+    return result;
+  }
+
+  // ParseInstruction as it was before the fast paths, decoding every immediate one byte at a time
+  IR_ERROR ParseInstructionBytewise(Stream& s, Instruction& ins, const Environment& env)
+  {
+    IR_ERROR err = !s.Read(ins.opcode) ? ERR_PARSE_UNEXPECTED_EOF : ERR_SUCCESS;
+    if(err < 0)
+      return err;
+
+    switch(ins.opcode)
+    {
+    case OP_block:
+    case OP_loop:
+    case OP_if:
+      ins.immediates[0]._varsint7 = static_cast<varsint7>(DecodeLEB128Bytewise(s, err, 7, true)); // Block types are negative, like every other value type
+      break;
+    case OP_br:
+    case OP_br_if:
+    case OP_local_get:
+    case OP_local_set:
+    case OP_local_tee:
+    case OP_global_get:
+    case OP_global_set:
+    case OP_call:
+      ins.immediates[0]._varuint32 = static_cast<varuint32>(DecodeLEB128Bytewise(s, err, 32));
+      break;
+    case OP_i32_const:
+      ins.immediates[0]._varsint32 = static_cast<varsint32>(DecodeLEB128Bytewise(s, err, 32, true));
+      break;
+    case OP_i64_const:
+      ins.immediates[0]._varsint64 = static_cast<varsint64>(DecodeLEB128Bytewise(s, err, 64, true));
+      break;
+    case OP_f32_const:
+      ins.immediates[0]._float32 = s.ReadFloat32(err);
+      break;
+    case OP_f64_const:
+      ins.immediates[0]._float64 = s.ReadFloat64(err);
+      break;
+    case OP_memory_grow:
+    case OP_memory_size:
+      if(env.features & ENV_FEATURE_MULTI_MEMORY) // The reserved byte becomes a memory index
+        ins.immediates[0]._varuint32 = static_cast<varuint32>(DecodeLEB128Bytewise(s, err, 32));
+      else
+      {
+        ins.immediates[0]._varuint32 = DecodeLEB128Bytewise(s, err, 1) != 0;
+        if(err >= 0 && ins.immediates[0]._varuint32 != 0)
+          err = ERR_INVALID_RESERVED_VALUE;
+      }
+      break;
+    case OP_br_table:
+      err = ERR_FATAL_UNKNOWN_INSTRUCTION; // Never generated by GenerateInstructions
+      break;
+    case OP_call_indirect:
+      ins.immediates[0]._varuint32 = static_cast<varuint32>(DecodeLEB128Bytewise(s, err, 32));
+
+      if(err >= 0)
+      {
+        ins.immediates[1]._varuint1 = DecodeLEB128Bytewise(s, err, 1) != 0;
+
+        if(err >= 0 && ins.immediates[1]._varuint1 != 0)
+          err = ERR_INVALID_RESERVED_VALUE;
+      }
+
+      break;
+    case OP_i32_load:
+    case OP_i64_load:
+    case OP_f32_load:
+    case OP_f64_load:
+    case OP_i32_store:
+    case OP_i64_store:
+    case OP_f32_store:
+    case OP_f64_store:
+    case OP_i32_load8_s:
+    case OP_i32_load16_s:
+    case OP_i64_load8_s:
+    case OP_i64_load16_s:
+    case OP_i64_load32_s:
+    case OP_i32_load8_u:
+    case OP_i32_load16_u:
+    case OP_i64_load8_u:
+    case OP_i64_load16_u:
+    case OP_i64_load32_u:
+    case OP_i32_store8:
+    case OP_i32_store16:
+    case OP_i64_store8:
+    case OP_i64_store16:
+    case OP_i64_store32:
+      ins.immediates[0]._varuint32 = static_cast<varuint32>(DecodeLEB128Bytewise(s, err, 32));
+      ins.immediates[2]._varuint32 = 0;
+
+      if(err >= 0 && (env.features & ENV_FEATURE_MULTI_MEMORY) && (ins.immediates[0]._varuint32 & WASM_MEMARG_HAS_MEMORY_INDEX))
+      {
+        ins.immediates[0]._varuint32 &= ~WASM_MEMARG_HAS_MEMORY_INDEX;
+        ins.immediates[2]._varuint32 = static_cast<varuint32>(DecodeLEB128Bytewise(s, err, 32));
+      }
+
+      if(err >= 0)
+        ins.immediates[1]._varuptr = DecodeLEB128Bytewise(s, err, 64);
+
+      break;
+    case OP_unreachable:
+    case OP_nop:
+    case OP_else:
+    case OP_end:
+    case OP_return:
+    case OP_drop:
+    case OP_select:
+    case OP_i32_eqz:
+    case OP_i32_eq:
+    case OP_i32_ne:
+    case OP_i32_lt_s:
+    case OP_i32_lt_u:
+    case OP_i32_gt_s:
+    case OP_i32_gt_u:
+    case OP_i32_le_s:
+    case OP_i32_le_u:
+    case OP_i32_ge_s:
+    case OP_i32_ge_u:
+    case OP_i64_eqz:
+    case OP_i64_eq:
+    case OP_i64_ne:
+    case OP_i64_lt_s:
+    case OP_i64_lt_u:
+    case OP_i64_gt_s:
+    case OP_i64_gt_u:
+    case OP_i64_le_s:
+    case OP_i64_le_u:
+    case OP_i64_ge_s:
+    case OP_i64_ge_u:
+    case OP_f32_eq:
+    case OP_f32_ne:
+    case OP_f32_lt:
+    case OP_f32_gt:
+    case OP_f32_le:
+    case OP_f32_ge:
+    case OP_f64_eq:
+    case OP_f64_ne:
+    case OP_f64_lt:
+    case OP_f64_gt:
+    case OP_f64_le:
+    case OP_f64_ge:
+    case OP_i32_clz:
+    case OP_i32_ctz:
+    case OP_i32_popcnt:
+    case OP_i32_add:
+    case OP_i32_sub:
+    case OP_i32_mul:
+    case OP_i32_div_s:
+    case OP_i32_div_u:
+    case OP_i32_rem_s:
+    case OP_i32_rem_u:
+    case OP_i32_and:
+    case OP_i32_or:
+    case OP_i32_xor:
+    case OP_i32_shl:
+    case OP_i32_shr_s:
+    case OP_i32_shr_u:
+    case OP_i32_rotl:
+    case OP_i32_rotr:
+    case OP_i64_clz:
+    case OP_i64_ctz:
+    case OP_i64_popcnt:
+    case OP_i64_add:
+    case OP_i64_sub:
+    case OP_i64_mul:
+    case OP_i64_div_s:
+    case OP_i64_div_u:
+    case OP_i64_rem_s:
+    case OP_i64_rem_u:
+    case OP_i64_and:
+    case OP_i64_or:
+    case OP_i64_xor:
+    case OP_i64_shl:
+    case OP_i64_shr_s:
+    case OP_i64_shr_u:
+    case OP_i64_rotl:
+    case OP_i64_rotr:
+    case OP_f32_abs:
+    case OP_f32_neg:
+    case OP_f32_ceil:
+    case OP_f32_floor:
+    case OP_f32_trunc:
+    case OP_f32_nearest:
+    case OP_f32_sqrt:
+    case OP_f32_add:
+    case OP_f32_sub:
+    case OP_f32_mul:
+    case OP_f32_div:
+    case OP_f32_min:
+    case OP_f32_max:
+    case OP_f32_copysign:
+    case OP_f64_abs:
+    case OP_f64_neg:
+    case OP_f64_ceil:
+    case OP_f64_floor:
+    case OP_f64_trunc:
+    case OP_f64_nearest:
+    case OP_f64_sqrt:
+    case OP_f64_add:
+    case OP_f64_sub:
+    case OP_f64_mul:
+    case OP_f64_div:
+    case OP_f64_min:
+    case OP_f64_max:
+    case OP_f64_copysign:
+    case OP_i32_wrap_i64:
+    case OP_i32_trunc_f32_s:
+    case OP_i32_trunc_f32_u:
+    case OP_i32_trunc_f64_s:
+    case OP_i32_trunc_f64_u:
+    case OP_i64_extend_i32_s:
+    case OP_i64_extend_i32_u:
+    case OP_i64_trunc_f32_s:
+    case OP_i64_trunc_f32_u:
+    case OP_i64_trunc_f64_s:
+    case OP_i64_trunc_f64_u:
+    case OP_f32_convert_i32_s:
+    case OP_f32_convert_i32_u:
+    case OP_f32_convert_i64_s:
+    case OP_f32_convert_i64_u:
+    case OP_f32_demote_f64:
+    case OP_f64_convert_i32_s:
+    case OP_f64_convert_i32_u:
+    case OP_f64_convert_i64_s:
+    case OP_f64_convert_i64_u:
+    case OP_f64_promote_f32:
+    case OP_i32_reinterpret_f32:
+    case OP_i64_reinterpret_f64:
+    case OP_f32_reinterpret_i32:
+    case OP_f64_reinterpret_i64:
+      break;
+    default:
+      err = ERR_FATAL_UNKNOWN_INSTRUCTION;
+    }
+
+    return err;
+  }
+}
+
+void Benchmarks::bench_parse()
+{
+  // Indices and sizes are mostly one byte, with a tail of longer values
+  std::vector<uint8_t> values;
+  for(varuint32 i = 0; i < (1 << 20); ++i)
+    WriteLEB128(values, (i % 16) ? (i % 100) : (i % 3) ? (i * 31) % 20000 : i * 4099);
+
+  uint64_t sum = 0;
+  MeasureThroughput("LEB128 bytewise", 20, values.size(), [&]() {
+    Stream s = { values.data(), values.size(), 0 };
+    IR_ERROR err = ERR_SUCCESS;
+    while(!s.End() && err >= 0)
+      sum += DecodeLEB128Bytewise(s, err, 32);
+  });
+  MeasureThroughput("LEB128", 20, values.size(), [&]() {
+    Stream s = { values.data(), values.size(), 0 };
+    IR_ERROR err = ERR_SUCCESS;
+    while(!s.End() && err >= 0)
+      sum += s.ReadVarUInt32(err);
+  });
+
+  std::vector<uint8_t> instructions;
+  for(varuint32 i = 0; i < 20000; ++i)
+    GenerateInstructions(instructions, i, 20000);
+
+  Environment* env = (*_exports.CreateEnvironment)(1, 0, _arg0);
+  int result = ERR_SUCCESS;
+  MeasureThroughput("instructions bytewise", 20, instructions.size(), [&]() {
+    Stream s = { instructions.data(), instructions.size(), 0 };
+    Instruction ins;
+    while(!s.End() && (result = ParseInstructionBytewise(s, ins, *env)) >= 0)
+      sum += ins.immediates[0]._varuint32;
+  });
+  MeasureThroughput("instructions", 20, instructions.size(), [&]() {
+    Stream s = { instructions.data(), instructions.size(), 0 };
+    Instruction ins;
+    while(!s.End() && (result = ParseInstruction(s, ins, *env)) >= 0)
+      sum += ins.immediates[0]._varuint32;
+  });
+
+  if(result < 0)
+    fprintf(_target, "  Failed to parse benchmark instructions: %i\n", result);
+
+  std::vector<uint8_t> module = GenerateModule(20000);
+
+  // Each parse gets its own scratch allocator, so memory use doesn't grow with the number of iterations
+  MeasureThroughput("decode and validate module", 10, module.size(), [&]() {
+    Environment scratch = *env;
+    __WASM_ALLOCATOR alloc(env->alloc);
+    scratch.alloc = &alloc;
+    scratch.errors = nullptr;
+    Stream s = { module.data(), module.size(), 0 };
+    Module m;
+    IR_ERROR err = ParseModule(s, scratch, m, ByteArray((uint8_t*)"bench", 5), scratch.errors);
+    if(err < 0 || scratch.errors)
+      result = (err < 0) ? err : scratch.errors->code;
+    else if(m.code.n_funcbody > 0 && m.code.funcbody[0].errors) // Bodies hold on to their errors until ValidateModule
+      result = m.code.funcbody[0].errors->code;
+    kh_destroy_exports(m.exports);
+  });
+
+  if(result < 0)
+    fprintf(_target, "  Failed to parse benchmark module: %i\n", result);
+  if(!sum)
+    fprintf(_target, "  LEB128 benchmark decoded nothing\n");
+  (*_exports.DestroyEnvironment)(env);
+}
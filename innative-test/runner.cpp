@@ -0,0 +1,449 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "runner.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <string.h>
+
+#ifdef IR_PLATFORM_POSIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/wait.h>
+#endif
+
+using namespace std::filesystem;
+
+// This defines the testing environment that we need to inject
+const char testenv[] = "(module $spectest "
+"\n  (global $global_i32 (export \"global_i32\") i32 i32.const 666)"
+"\n  (global $global_i64 (export \"global_i64\") i64 i64.const 666)"
+"\n  (global $global_f32 (export \"global_f32\") f32 f32.const 666)"
+"\n  (global $global_f64 (export \"global_f64\") f64 f64.const 666)"
+"\n  (memory $memory1 (export \"memory\") 1 2)"
+"\n  (table $table10 (export \"table\") 10 20 funcref)"
+"\n  (func $print (export \"print\"))"
+"\n  (func $print_i32 (export \"print_i32\") (param i32))"
+"\n  (func $print_i64 (export \"print_i64\") (param i64))"
+"\n  (func $print_f32 (export \"print_f32\") (param f32))"
+"\n  (func $print_f64 (export \"print_f64\") (param f64))"
+"\n  (func $print_i32_f32 (export \"print_i32_f32\") (param i32 f32))"
+"\n  (func $print_f64_f64 (export \"print_f64_f64\") (param f64 f64))"
+"\n) (register \"spectest\" $spectest)";
+
+TestOptions ParseTestOptions(int argc, const char* const argv[])
+{
+  TestOptions options = { ENV_LIBRARY | ENV_DEBUG | ENV_EMIT_LLVM | ENV_STRICT | ENV_HOMOGENIZE_FUNCTIONS, 1, 600, nullptr, false, false, -1 };
+
+  for(int i = 1; i < argc; ++i)
+  {
+    if(!STRICMP(argv[i], "-internal"))
+      options.internal = true; // If we only want the internal tests, just bail out after running them
+    else if(!STRICMP(argv[i], "-benchmark"))
+      options.benchmark = true;
+    else if(!STRICMP(argv[i], "-jobs"))
+      options.jobs = 0;
+    else if(!strncmp(argv[i], "-jobs=", 6))
+      options.jobs = strtoul(argv[i] + 6, 0, 10);
+    else if(!strncmp(argv[i], "-timeout=", 9))
+      options.timeout = strtoul(argv[i] + 9, 0, 10);
+    else if(!strncmp(argv[i], "-json=", 6))
+      options.json = argv[i] + 6;
+    else if(!strncmp(argv[i], "-flags=", 7))
+      options.flags = strtoull(argv[i] + 7, 0, 10);
+#ifdef IR_PLATFORM_POSIX
+    else if(!strncmp(argv[i], "-worker=", 8)) // We were started by RunSpecParallel, so we only run the scripts it hands us
+      options.worker = atoi(argv[i] + 8);
+#endif
+    else
+      options.files.push_back(argv[i]);
+  }
+
+  return options;
+}
+
+int RunSpecFile(IRExports& exports, const char* arg0, const path& file, uint64_t flags, FILE* log, std::vector<std::string>& errors)
+{
+  Environment* env = (*exports.CreateEnvironment)(1, 0, arg0);
+  env->flags = flags;
+  env->optimize = ENV_OPTIMIZE_O3;
+  env->features = ENV_FEATURE_ALL & ~ENV_FEATURE_MULTI_MEMORY; // The core spec tests assert the MVP single-memory rules
+  env->log = log;
+  env->loglevel = LOG_WARNING;
+  env->wasthook = [](void*) { fputc('.', stdout); fflush(stdout); };
+  int err = (*exports.AddEmbedding)(env, 0, (void*)INNATIVE_DEFAULT_ENVIRONMENT, 0);
+
+  if(err >= 0)
+    err = innative_compile_script(reinterpret_cast<const uint8_t*>(testenv), sizeof(testenv), env, false);
+  if(err < 0) // If the environment injection fails, the script can't run
+  {
+    (*exports.DestroyEnvironment)(env);
+    return assert(false), err;
+  }
+
+  err = innative_compile_script((const uint8_t*)file.generic_u8string().data(), 0, env, true);
+
+  for(ValidationError* cur = env->errors; cur != nullptr; cur = cur->next)
+  {
+    errors.emplace_back();
+    if(cur->m >= 0)
+      errors.back() = std::string(env->modules[cur->m].name.str()) + ": ";
+    errors.back() += cur->error;
+  }
+
+  (*exports.DestroyEnvironment)(env);
+  return err;
+}
+
+#ifdef IR_PLATFORM_POSIX
+namespace {
+  static const size_t IDLE = (size_t)~0;
+
+  // Compiling writes an object file named after each module into the SDK path, so every worker gets its own
+  path WorkerScratch(const path& bin, pid_t pid) { return bin / ("spec-worker-" + std::to_string(pid)); }
+
+  struct SpecResult
+  {
+    path file;
+    int err;
+    bool crashed;
+    double seconds;
+    std::vector<std::string> errors;
+  };
+
+  struct SpecWorker
+  {
+    pid_t pid; // 0 if this worker isn't running
+    int task; // Script paths are written here, one per line
+    int result; // "error <text>" lines for each assertion failure, followed by "done <err>"
+    size_t file; // The script this worker is running, or IDLE
+    bool timedout; // Set once the worker has been killed for taking too long on its script
+    std::chrono::steady_clock::time_point start;
+    std::string buffer;
+    std::vector<std::string> errors;
+  };
+
+  bool StartWorker(SpecWorker& w, const std::string& exe, uint64_t flags)
+  {
+    int task[2];
+    int result[2];
+    if(pipe2(task, O_CLOEXEC) != 0)
+      return false;
+    if(pipe2(result, O_CLOEXEC) != 0)
+    {
+      close(task[0]);
+      close(task[1]);
+      return false;
+    }
+
+    std::vector<std::string> args = WorkerArgs(exe, result[1], flags);
+    std::vector<const char*> argv;
+    for(auto& arg : args)
+      argv.push_back(arg.c_str());
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if(!pid)
+    { // Everything else is closed on exec, and the worker's own log output is thrown away
+      int null = open("/dev/null", O_WRONLY);
+      dup2(task[0], 0);
+      dup2(null, 1);
+      fcntl(result[1], F_SETFD, 0);
+      execv(exe.c_str(), const_cast<char* const*>(argv.data()));
+      _exit(127);
+    }
+
+    close(task[0]);
+    close(result[1]);
+    if(pid < 0)
+    {
+      close(task[1]);
+      close(result[0]);
+      return false;
+    }
+
+    w.pid = pid;
+    w.task = task[1];
+    w.result = result[0];
+    w.file = IDLE;
+    w.timedout = false;
+    w.buffer.clear();
+    w.errors.clear();
+    return true;
+  }
+
+  void ReportResult(const SpecResult& r)
+  {
+    printf("%s: %s (%.2fs)\n", r.file.generic_u8string().c_str(), r.crashed ? "CRASHED" : (!r.err && r.errors.empty()) ? "SUCCESS" : "FAILED", r.seconds);
+    if(r.err < 0 && !r.crashed)
+      printf("Error running script %s: %i\n", r.file.generic_u8string().c_str(), r.err);
+    for(auto& e : r.errors)
+      printf("  %s\n", e.c_str());
+    fflush(stdout);
+  }
+
+  void WriteJSONString(FILE* f, const std::string& s)
+  {
+    fputc('"', f);
+    for(unsigned char c : s)
+    {
+      if(c == '"' || c == '\\')
+        fprintf(f, "\\%c", c);
+      else if(c < 0x20)
+        fprintf(f, "\\u%04x", c);
+      else
+        fputc(c, f);
+    }
+    fputc('"', f);
+  }
+
+  void WriteJSON(FILE* f, std::vector<SpecResult>& results, uint64_t flags, size_t jobs, double seconds)
+  {
+    std::sort(results.begin(), results.end(), [](const SpecResult& a, const SpecResult& b) { return a.file < b.file; });
+
+    size_t passed = 0;
+    for(auto& r : results)
+      passed += !r.crashed && !r.err && r.errors.empty();
+
+    fprintf(f, "{\n  \"flags\": %llu,\n  \"jobs\": %zu,\n  \"seconds\": %.3f,\n  \"passed\": %zu,\n  \"failed\": %zu,\n  \"files\": [",
+      (unsigned long long)flags, jobs, seconds, passed, results.size() - passed);
+
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+      auto& r = results[i];
+      fputs(i ? ",\n    { \"file\": " : "\n    { \"file\": ", f);
+      WriteJSONString(f, r.file.generic_u8string());
+      fprintf(f, ", \"result\": \"%s\", \"error\": %i, \"seconds\": %.3f, \"errors\": [",
+        r.crashed ? "crash" : (!r.err && r.errors.empty()) ? "pass" : "fail", r.err, r.seconds);
+      for(size_t j = 0; j < r.errors.size(); ++j)
+      {
+        if(j)
+          fputs(", ", f);
+        WriteJSONString(f, r.errors[j]);
+      }
+      fputs("] }", f);
+    }
+
+    fputs("\n  ]\n}\n", f);
+    fflush(f);
+  }
+}
+
+std::vector<std::string> WorkerArgs(const std::string& exe, int fd, uint64_t flags)
+{
+  return { exe, "-worker=" + std::to_string(fd), "-flags=" + std::to_string(flags) };
+}
+
+int RunSpecWorker(IRExports& exports, const char* arg0, uint64_t flags, int fd)
+{
+  path bin = path(arg0).parent_path();
+  path scratch = WorkerScratch(bin, getpid());
+  std::error_code ec;
+  create_directory(scratch, ec);
+  create_symlink(bin / INNATIVE_DEFAULT_ENVIRONMENT, scratch / INNATIVE_DEFAULT_ENVIRONMENT, ec);
+  current_path(scratch, ec);
+  std::string sdkarg0 = (scratch / path(arg0).filename()).u8string();
+
+  FILE* results = fdopen(fd, "w");
+  if(!results)
+    return -1;
+
+  char buf[PATH_MAX + 2];
+  while(fgets(buf, sizeof(buf), stdin))
+  {
+    buf[strcspn(buf, "\n")] = 0;
+    std::vector<std::string> errors;
+    int err = RunSpecFile(exports, sdkarg0.c_str(), path(buf), flags, stdout, errors);
+
+    for(auto& e : errors)
+    {
+      std::replace(e.begin(), e.end(), '\n', ' ');
+      fprintf(results, "error %s\n", e.c_str());
+    }
+    fprintf(results, "done %i\n", err);
+    fflush(results);
+  }
+
+  fclose(results);
+  current_path(bin, ec);
+  remove_all(scratch, ec);
+  return 0;
+}
+
+size_t RunSpecParallel(std::vector<path> files, uint64_t flags, size_t jobs, unsigned int timeout, FILE* json)
+{
+  // The biggest scripts go first, so a slow one doesn't start last and hold up the whole run
+  std::error_code ec;
+  std::stable_sort(files.begin(), files.end(), [&ec](const path& a, const path& b) { return file_size(a, ec) > file_size(b, ec); });
+
+  char exe[PATH_MAX] = { 0 };
+  if(readlink("/proc/self/exe", exe, sizeof(exe) - 1) <= 0)
+    return files.size();
+  path bin = path(exe).parent_path();
+
+  signal(SIGPIPE, SIG_IGN); // A worker that crashed can't read the script we just handed it, which we find out from its result pipe
+
+  if(!jobs)
+    jobs = std::max(1U, std::thread::hardware_concurrency());
+  jobs = std::min(jobs, std::max<size_t>(files.size(), 1));
+  printf("Running through %zu spec tests with %zu worker processes.\n", files.size(), jobs);
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<SpecWorker> workers(jobs);
+  std::vector<SpecResult> results;
+  size_t next = 0;
+
+  for(auto& w : workers)
+    if(!StartWorker(w, exe, flags))
+      w.pid = 0;
+
+  while(results.size() < files.size())
+  {
+    for(auto& w : workers)
+    {
+      if(w.pid > 0 && w.file == IDLE && next < files.size())
+      {
+        std::string line = absolute(files[next], ec).u8string() + "\n";
+        w.file = next++;
+        w.start = std::chrono::steady_clock::now();
+        if(write(w.task, line.data(), line.size()) != (ssize_t)line.size())
+          continue; // The worker is gone, which the result pipe will tell us
+      }
+    }
+
+    std::vector<pollfd> fds;
+    std::vector<SpecWorker*> polled;
+    for(auto& w : workers)
+    {
+      if(w.pid > 0)
+      {
+        fds.push_back(pollfd{ w.result, POLLIN, 0 });
+        polled.push_back(&w);
+      }
+    }
+
+    if(fds.empty())
+    {
+      fprintf(stderr, "Could not start any spec test workers\n");
+      break;
+    }
+
+    // Wake up in time for the first worker that would run past its deadline
+    int wait = -1;
+    auto now = std::chrono::steady_clock::now();
+    for(auto& w : workers)
+    {
+      if(timeout > 0 && w.pid > 0 && w.file != IDLE && !w.timedout)
+      {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(w.start + std::chrono::seconds(timeout) - now).count();
+        left = std::max<decltype(left)>(left, 0);
+        if(wait < 0 || left < wait)
+          wait = (int)std::min<decltype(left)>(left, INT_MAX);
+      }
+    }
+
+    if(poll(fds.data(), fds.size(), wait) < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      break;
+    }
+
+    // A worker stuck on a script is killed, which closes its result pipe and sends it down the crash path below
+    now = std::chrono::steady_clock::now();
+    for(auto& w : workers)
+    {
+      if(timeout > 0 && w.pid > 0 && w.file != IDLE && !w.timedout && now - w.start >= std::chrono::seconds(timeout))
+      {
+        kill(w.pid, SIGKILL);
+        w.timedout = true;
+      }
+    }
+
+    for(size_t i = 0; i < fds.size(); ++i)
+    {
+      if(!fds[i].revents)
+        continue;
+
+      SpecWorker& w = *polled[i];
+      char buf[4096];
+      ssize_t n = read(w.result, buf, sizeof(buf));
+      if(n > 0)
+      {
+        w.buffer.append(buf, n);
+        for(size_t end; (end = w.buffer.find('\n')) != std::string::npos; w.buffer.erase(0, end + 1))
+        {
+          if(!w.buffer.compare(0, 6, "error "))
+            w.errors.push_back(w.buffer.substr(6, end - 6));
+          else if(!w.buffer.compare(0, 5, "done ") && w.file != IDLE)
+          {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - w.start;
+            results.push_back(SpecResult{ files[w.file], atoi(w.buffer.c_str() + 5), false, elapsed.count(), std::move(w.errors) });
+            ReportResult(results.back());
+            w.errors.clear();
+            w.file = IDLE;
+          }
+        }
+        continue;
+      }
+      if(n < 0 && errno == EINTR)
+        continue;
+
+      // The result pipe only closes early if the worker died, so we record the crash and replace it
+      int status = 0;
+      close(w.task);
+      close(w.result);
+      waitpid(w.pid, &status, 0);
+      remove_all(WorkerScratch(bin, w.pid), ec);
+      w.pid = 0;
+
+      if(w.file != IDLE)
+      {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - w.start;
+        if(w.timedout)
+          w.errors.push_back("Worker timed out after " + std::to_string(timeout) + " seconds");
+        else
+          w.errors.push_back(WIFSIGNALED(status) ? "Worker killed by signal " + std::to_string(WTERMSIG(status)) :
+            "Worker exited with code " + std::to_string(WEXITSTATUS(status)));
+        results.push_back(SpecResult{ files[w.file], 0, true, elapsed.count(), std::move(w.errors) });
+        ReportResult(results.back());
+        w.errors.clear();
+        w.file = IDLE;
+      }
+
+      if(next < files.size() && !StartWorker(w, exe, flags))
+        w.pid = 0;
+    }
+  }
+
+  for(auto& w : workers) // Closing the task pipe tells the worker to clean up and exit
+  {
+    if(w.pid > 0)
+    {
+      if(w.file != IDLE) // Only possible if we stopped polling early
+        results.push_back(SpecResult{ files[w.file], 0, true, 0.0, { "Worker was abandoned while running this script" } });
+      close(w.task);
+      close(w.result);
+      waitpid(w.pid, nullptr, 0);
+    }
+  }
+
+  for(size_t i = next; i < files.size(); ++i) // Only left over if every worker failed to start
+    results.push_back(SpecResult{ files[i], 0, true, 0.0, { "No worker could run this script" } });
+
+  size_t failures = 0;
+  for(auto& r : results)
+    failures += r.crashed || r.err || !r.errors.empty();
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  printf("%zu of %zu spec tests passed in %.2fs\n", results.size() - failures, results.size(), elapsed.count());
+  if(json)
+    WriteJSON(json, results, flags, jobs, elapsed.count());
+  return failures;
+}
+#endif
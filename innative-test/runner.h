@@ -0,0 +1,45 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#ifndef __RUNNER_H__IR__
+#define __RUNNER_H__IR__
+
+#include "innative/export.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Everything the command line asks for
+struct TestOptions
+{
+  uint64_t flags;
+  size_t jobs; // 0 means one worker process per core
+  unsigned int timeout; // Seconds a worker may spend on one script before it's killed, or 0 for no limit
+  const char* json;
+  bool internal;
+  bool benchmark;
+  int worker; // The result pipe a worker started by RunSpecParallel writes to, or -1
+  std::vector<const char*> files; // If not empty, only the spec scripts with these names are run
+};
+
+// Reads every argument before any of them are acted on, so it doesn't matter what order they're given in
+TestOptions ParseTestOptions(int argc, const char* const argv[]);
+
+// Runs one spec test script in a fresh environment, collecting every assertion failure it reports
+int RunSpecFile(IRExports& exports, const char* arg0, const std::filesystem::path& file, uint64_t flags, FILE* log, std::vector<std::string>& errors);
+
+#ifdef IR_PLATFORM_POSIX
+// The command line RunSpecParallel starts each worker with
+std::vector<std::string> WorkerArgs(const std::string& exe, int fd, uint64_t flags);
+
+// Runs each script path read from stdin and writes its results to the given file descriptor, until stdin is closed
+int RunSpecWorker(IRExports& exports, const char* arg0, uint64_t flags, int fd);
+
+// Shards the scripts across worker processes, restarting any worker that crashes or runs one script for longer than timeout
+// seconds, and returns how many scripts failed. If json is not null, the wall time and result of every script is written to it.
+size_t RunSpecParallel(std::vector<std::filesystem::path> files, uint64_t flags, size_t jobs, unsigned int timeout, FILE* json);
+#endif
+
+#endif
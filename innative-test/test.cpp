@@ -2,6 +2,8 @@
 // For conditions of distribution and use, see copyright notice in innative.h
 
 #include "test.h"
+#include "benchmark.h"
+#include "runner.h"
 #include "innative/export.h"
 #include "innative/khash.h"
 #include <iostream>
@@ -10,40 +12,37 @@
 
 using namespace std::filesystem;
 
-// This defines the testing environment that we need to inject
-const char testenv[] = "(module $spectest "
-"\n  (global $global_i32 (export \"global_i32\") i32 i32.const 666)"
-"\n  (global $global_i64 (export \"global_i64\") i64 i64.const 666)"
-"\n  (global $global_f32 (export \"global_f32\") f32 f32.const 666)"
-"\n  (global $global_f64 (export \"global_f64\") f64 f64.const 666)"
-"\n  (memory $memory1 (export \"memory\") 1 2)"
-"\n  (table $table10 (export \"table\") 10 20 funcref)"
-"\n  (func $print (export \"print\"))"
-"\n  (func $print_i32 (export \"print_i32\") (param i32))"
-"\n  (func $print_i64 (export \"print_i64\") (param i64))"
-"\n  (func $print_f32 (export \"print_f32\") (param f32))"
-"\n  (func $print_f64 (export \"print_f64\") (param f64))"
-"\n  (func $print_i32_f32 (export \"print_i32_f32\") (param i32 f32))"
-"\n  (func $print_f64_f64 (export \"print_f64_f64\") (param f64 f64))"
-"\n) (register \"spectest\" $spectest)";
-
 // We use khash instead of unordered_set so we can make it case-insensitive
 KHASH_INIT(match, kh_cstr_t, char, 0, kh_str_hash_funcins, kh_str_hash_insequal);
 
-size_t internal_tests()
+size_t internal_tests(IRExports& exports, const char* arg0)
 {
   std::pair<const char*, void(TestHarness::*)()> tests[] = {
+    { "allocator", &TestHarness::test_allocator },
+    { "export.h", &TestHarness::test_export },
     { "internal.c", &TestHarness::test_environment },
+    { "instance", &TestHarness::test_instance },
+    { "instruction.h", &TestHarness::test_instruction },
+    { "lazy", &TestHarness::test_lazy },
+    { "lexer.h", &TestHarness::test_lexer },
+    { "module stream", &TestHarness::test_modulestream },
+    { "multi-memory", &TestHarness::test_multimemory },
+    { "multithreaded", &TestHarness::test_multithreaded },
     { "path.h", &TestHarness::test_path },
     { "queue.h", &TestHarness::test_queue },
+    { "runner.h", &TestHarness::test_runner },
+    { "snapshot", &TestHarness::test_snapshot },
     { "stack.h", &TestHarness::test_stack },
     { "stream.h", &TestHarness::test_stream },
+    { "table", &TestHarness::test_table },
+    { "threadpool.h", &TestHarness::test_threadpool },
     { "util.h", &TestHarness::test_util },
+    { "wast.cpp", &TestHarness::test_wast },
   };
 
   static const size_t NUMTESTS = sizeof(tests) / sizeof(decltype(tests[0]));
   static constexpr int COLUMNS[3] = { 24, 11, 8 };
-  TestHarness harness(stderr);
+  TestHarness harness(stderr, exports, arg0);
 
   printf("%-*s %-*s %-*s\n", COLUMNS[0], "Internal Tests", COLUMNS[1], "Subtests", COLUMNS[2], "Pass/Fail");
   printf("%-*s %-*s %-*s\n", COLUMNS[0], "--------------", COLUMNS[1], "--------", COLUMNS[2], "---------");
@@ -64,12 +63,43 @@ size_t internal_tests()
   return failures;
 }
 
+void internal_benchmarks(IRExports& exports, const char* arg0)
+{
+  std::pair<const char*, void(Benchmarks::*)()> benchmarks[] = {
+    { "Instance reset", &Benchmarks::bench_instance },
+    { "Binary parsing", &Benchmarks::bench_parse },
+    { "WAT lexing", &Benchmarks::bench_lexer },
+  };
+
+  Benchmarks bench(stdout, exports, arg0);
+  for(auto& b : benchmarks)
+  {
+    printf("%s\n", b.first);
+    (bench.*b.second)();
+  }
+
+  printf("\n");
+}
+
 int main(int argc, char *argv[])
 {
   innative_set_work_dir_to_bin(!argc ? 0 : argv[0]);
   IRExports exports;
   innative_runtime(&exports);
-  
+
+  TestOptions options = ParseTestOptions(argc, argv);
+#ifdef IR_PLATFORM_POSIX
+  if(options.worker >= 0) // We were started by RunSpecParallel, so we only run the scripts it hands us
+    return RunSpecWorker(exports, argv[0], options.flags, options.worker);
+#endif
+
+  std::unique_ptr<kh_match_t, void(*)(kh_match_t*)> matchfiles(kh_init_match(), kh_destroy_match);
+  for(auto file : options.files)
+  {
+    int r;
+    kh_put_match(matchfiles.get(), file, &r);
+  }
+
   /*std::unique_ptr<FILE, void(*)(FILE*)> f(nullptr, [](FILE* f) { fclose(f); });
   {
     FILE* tmp = 0;
@@ -80,18 +110,14 @@ int main(int argc, char *argv[])
   std::cout << "inNative v" << INNATIVE_VERSION_MAJOR << "." << INNATIVE_VERSION_MINOR << "." << INNATIVE_VERSION_REVISION << " Test Utility" << std::endl;
   std::cout << std::endl;
 
-  internal_tests();
+  internal_tests(exports, argv[0]);
 
-  std::unique_ptr<kh_match_t, void(*)(kh_match_t*)> matchfiles(kh_init_match(), kh_destroy_match);
-  
+  if(options.internal)
+    return 0;
+  if(options.benchmark)
   {
-    int r;
-    for(int i = 1; i < argc; ++i)
-    {
-      if(!STRICMP(argv[i], "-internal"))
-        return 0; // If we only want the internal tests, just bail out at this point
-      kh_put_match(matchfiles.get(), argv[i], &r);
-    }
+    internal_benchmarks(exports, argv[0]);
+    return 0;
   }
 
   path testdir("../spec/test/core");
@@ -116,51 +142,51 @@ int main(int argc, char *argv[])
   }
 
   testfiles.erase(testfiles.begin(), testfiles.begin() + 25);
+
+  if(options.jobs != 1 || options.json != nullptr)
+  {
+#ifdef IR_PLATFORM_POSIX
+    FILE* out = nullptr;
+    if(options.json != nullptr)
+    {
+      FOPEN(out, options.json, "wb");
+      if(!out)
+      {
+        std::cout << "Could not open " << options.json << std::endl;
+        return -1;
+      }
+    }
+
+    size_t failures = RunSpecParallel(testfiles, options.flags, options.jobs, options.timeout, out);
+    if(out)
+      fclose(out);
+    return failures != 0;
+#else
+    std::cout << "Worker processes are only supported on POSIX, so tests will run one at a time." << std::endl;
+#endif
+  }
+
   std::cout << "Running through " << testfiles.size() << " official webassembly spec tests." << std::endl;
 
   for(auto file : testfiles)
   {
-    Environment* env = (*exports.CreateEnvironment)(1, 0, (!argc ? 0 : argv[0]));
-    env->flags = ENV_LIBRARY | ENV_DEBUG | ENV_EMIT_LLVM | ENV_STRICT | ENV_HOMOGENIZE_FUNCTIONS;
-    env->optimize = ENV_OPTIMIZE_O3;
-    env->features = ENV_FEATURE_ALL;
-    env->log = stdout;
-    env->loglevel = LOG_WARNING;
-    env->wasthook = [](void*) { fputc('.', stdout); fflush(stdout); };
-    int err = (*exports.AddEmbedding)(env, 0, (void*)INNATIVE_DEFAULT_ENVIRONMENT, 0);
-
-    if(err >= 0)
-      err = innative_compile_script(reinterpret_cast<const uint8_t*>(testenv), sizeof(testenv), env, false);
-    if(err < 0)
-      return assert(false), -1; // If the environment injection fails, abort everything
-
-    FPRINTF(env->log, "%s: .", file.generic_u8string().c_str());
-    fflush(env->log);
-    err = innative_compile_script((const uint8_t*)file.generic_u8string().data(), 0, env, true);
-
-    if(!err && !env->errors)
-      fputs("SUCCESS\n", env->log);
+    printf("%s: .", file.generic_u8string().c_str());
+    fflush(stdout);
+    std::vector<std::string> errors;
+    int err = RunSpecFile(exports, (!argc ? 0 : argv[0]), file, options.flags, stdout, errors);
+
+    if(!err && errors.empty())
+      fputs("SUCCESS\n", stdout);
     else
     {
-      fputs("FAILED\n", env->log);
+      fputs("FAILED\n", stdout);
       if(err < 0)
-        FPRINTF(env->log, "Error running script %s: %i\n", file.generic_u8string().c_str(), err);
-      while(env->errors != nullptr)
-      {
-        fputs("  ", env->log);
-        if(env->errors->m >= 0)
-        {
-          fputs(env->modules[env->errors->m].name.str(), env->log);
-          fputs(": ", env->log);
-        }
-        fputs(env->errors->error, env->log);
-        fputc('\n', env->log);
-        env->errors = env->errors->next;
-      }
-      fputc('\n', env->log);
-      fflush(env->log);
+        printf("Error running script %s: %i\n", file.generic_u8string().c_str(), err);
+      for(auto& e : errors)
+        printf("  %s\n", e.c_str());
+      fputc('\n', stdout);
+      fflush(stdout);
     }
-    (*exports.DestroyEnvironment)(env);
   }
 
   // Test compiling EXE
@@ -171,4 +197,4 @@ int main(int argc, char *argv[])
   std::cout << std::endl << "Finished running tests, press enter to exit." << std::endl;
   getchar();
   return 0;
-}
\ No newline at end of file
+}
@@ -4,27 +4,147 @@
 #ifndef __TEST_H__IR__
 #define __TEST_H__IR__
 
+#include "innative/export.h"
+#include "../innative/tools.h"
+#include "../innative/serialize.h"
 #include <utility>
+#include <string>
 #include <stdint.h>
 #include <stdio.h>
 #include <vector>
 #include <string.h>
+#include <sstream>
+
+// Helpers for building binary modules by hand
+inline void PushLEB(std::vector<uint8_t>& out, uint32_t v)
+{
+  do
+  {
+    out.push_back((v & 0x7f) | (v > 0x7f ? 0x80 : 0));
+    v >>= 7;
+  } while(v);
+}
+
+inline void PushSection(std::vector<uint8_t>& out, uint8_t id, const std::vector<uint8_t>& payload)
+{
+  out.push_back(id);
+  PushLEB(out, (uint32_t)payload.size());
+  out.insert(out.end(), payload.begin(), payload.end());
+}
+
+// Everything about a loaded module that has to be the same no matter how its bytes arrived or how many threads parsed it
+struct LoadResult
+{
+  int err;
+  int validate;
+  std::string text;
+  std::vector<std::pair<int, std::string>> errors;
+
+  bool operator==(const LoadResult& r) const { return err == r.err && validate == r.validate && text == r.text && errors == r.errors; }
+};
 
 class TestHarness
 {
 public:
-  inline TestHarness(FILE* out) : _target(out), _testdata(0,0) {}
+  inline TestHarness(FILE* out, IRExports& exports, const char* arg0) : _target(out), _exports(exports), _arg0(arg0), _testdata(0,0) {}
   void test_allocator();
   void test_environment();
+  void test_export();
+  void test_instance();
+  void test_instruction();
+  void test_lazy();
+  void test_lexer();
+  void test_modulestream();
+  void test_multimemory();
+  void test_multithreaded();
   void test_path();
   void test_queue();
+  void test_runner();
+  void test_snapshot();
   void test_stack();
   void test_stream();
+  void test_table();
+  void test_threadpool();
   void test_util();
+  void test_wast();
 
   inline std::pair<uint32_t, uint32_t> Results() { auto r = _testdata; _testdata = { 0,0 }; return r; }
 
 protected:
+  // Creates an environment that accepts text modules and links against the default runtime environment
+  inline Environment* CreateEnvironment(uint64_t flags, uint64_t features = ENV_FEATURE_ALL)
+  {
+    Environment* env = (*_exports.CreateEnvironment)(1, 0, _arg0);
+    env->flags = flags | ENV_ENABLE_WAT;
+    env->features = features;
+    env->log = _target;
+    env->loglevel = LOG_NONE;
+    (*_exports.AddEmbedding)(env, 0, (void*)INNATIVE_DEFAULT_ENVIRONMENT, 0);
+    return env;
+  }
+
+  // Adds a text or binary module and waits for it to load
+  inline int AddModule(Environment* env, const void* data, size_t size, const char* name)
+  {
+    int err = ERR_SUCCESS;
+    (*_exports.AddModule)(env, data, size, name, &err);
+    (*_exports.WaitForLoad)(env);
+    return err;
+  }
+
+  // Compiles the environment into a library and loads it, returning null if either step fails
+  inline void* CompileLibrary(Environment* env, const char* file)
+  {
+    int err = (*_exports.Compile)(env, file);
+    if(err < 0)
+    {
+      fprintf(_target, "Failed to compile %s: %i\n", file, err);
+      return nullptr;
+    }
+    return (*_exports.LoadAssembly)(file);
+  }
+
+  static inline bool HasError(const ValidationError* errors, int code)
+  {
+    for(; errors != nullptr; errors = errors->next)
+      if(errors->code == code)
+        return true;
+    return false;
+  }
+
+  // Every error in the list, in order, so the errors from two environments can be compared
+  static inline std::vector<std::pair<int, std::string>> ErrorList(const ValidationError* errors)
+  {
+    std::vector<std::pair<int, std::string>> list;
+    for(; errors != nullptr; errors = errors->next)
+      list.push_back({ errors->code, errors->error ? errors->error : "" });
+    return list;
+  }
+
+  // Writes the first module back out as text, or returns an empty string if a lazily parsed body can't be decoded
+  static inline std::string SerializeModule(const Environment* env)
+  {
+    innative::Queue<innative::wat::WatToken> tokens;
+    std::stringstream out;
+    if(innative::wat::TokenizeModule(*env, tokens, env->modules[0]) < 0)
+      return std::string();
+    innative::wat::WriteTokens(tokens, out);
+    return out.str();
+  }
+
+  // Collects the result of loading the first module, given the error that loading it returned, and then validates it
+  static inline LoadResult GetLoadResult(Environment* env, int err)
+  {
+    LoadResult r = { err, 0 };
+    if(err >= 0)
+    {
+      r.text = SerializeModule(env);
+      r.validate = innative::Validate(env);
+    }
+    r.errors = ErrorList(env->errors);
+    return r;
+  }
+
   inline void DoTest(bool test, const char* text, const char* file, int line)
   {
     ++_testdata.second;
@@ -43,6 +163,8 @@ protected:
 
   std::pair<uint32_t, uint32_t> _testdata;
   FILE* _target;
+  IRExports& _exports;
+  const char* _arg0;
 };
 
 #define TEST(x) DoTest(x, ""#x, __FILE__, __LINE__);
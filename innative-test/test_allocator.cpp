@@ -2,7 +2,142 @@
 // For conditions of distribution and use, see copyright notice in innative.h
 
 #include "test.h"
+#include "../innative/util.h"
+#include <thread>
 
 void TestHarness::test_allocator()
 {
-}
\ No newline at end of file
+  {
+    __WASM_ALLOCATOR alloc;
+    IRAllocatorStats stats;
+    alloc.GetStats(stats);
+    TEST(!stats.requested);
+    TEST(!stats.reserved);
+    TEST(!stats.chunks);
+
+    char* a = (char*)alloc.allocate(1);
+    char* b = (char*)alloc.allocate(3);
+    TEST(a != nullptr);
+    TEST(b != nullptr);
+    TEST(!((size_t)a % __WASM_ALLOCATOR::ALIGNMENT));
+    TEST(!((size_t)b % __WASM_ALLOCATOR::ALIGNMENT));
+    TEST(b >= a + 1);
+    alloc.GetStats(stats);
+    TEST(stats.requested == 4);
+    TEST(stats.reserved == __WASM_ALLOCATOR::CHUNK_SIZE);
+    TEST(stats.live == __WASM_ALLOCATOR::CHUNK_SIZE);
+    TEST(stats.chunks == 1);
+
+    // Large allocations get their own chunk and don't disturb the current one
+    char* big = (char*)alloc.allocate(__WASM_ALLOCATOR::CHUNK_SIZE * 3);
+    TEST(big != nullptr);
+    memset(big, 1, __WASM_ALLOCATOR::CHUNK_SIZE * 3);
+    char* c = (char*)alloc.allocate(8);
+    TEST(c > b && c < a + __WASM_ALLOCATOR::CHUNK_SIZE);
+    alloc.GetStats(stats);
+    TEST(stats.chunks == 2);
+    TEST(stats.requested == 12 + __WASM_ALLOCATOR::CHUNK_SIZE * 3);
+    TEST(stats.reserved == __WASM_ALLOCATOR::CHUNK_SIZE * 4);
+
+    // Filling up a chunk moves on to a new one
+    for(int i = 0; i < 100; ++i)
+      memset(alloc.allocate(1024), 2, 1024);
+    alloc.GetStats(stats);
+    TEST(stats.chunks == 3);
+
+    // Resetting releases everything, but the peak is remembered
+    uint64_t peak = stats.peak;
+    TEST(peak == stats.live);
+    alloc.Reset();
+    alloc.GetStats(stats);
+    TEST(!stats.chunks);
+    TEST(!stats.reserved);
+    TEST(!stats.live);
+    TEST(stats.peak == peak);
+    TEST(alloc.allocate(8) != nullptr);
+  }
+
+  {
+    // A request just over the large size that doesn't fit in the current chunk only reserves what it asked for
+    __WASM_ALLOCATOR alloc;
+    const size_t n = __WASM_ALLOCATOR::CHUNK_SIZE / 4 + 1;
+    char* a = (char*)alloc.allocate(1024);
+    for(int i = 1; i < 48; ++i) // Leaves a quarter of the chunk, one byte short of n
+      alloc.allocate(1024);
+    char* b = (char*)alloc.allocate(n);
+    TEST(b != nullptr);
+    memset(b, 1, n);
+    IRAllocatorStats stats;
+    alloc.GetStats(stats);
+    TEST(stats.chunks == 2);
+    TEST(stats.reserved == __WASM_ALLOCATOR::CHUNK_SIZE + n);
+
+    // Smaller requests keep filling the chunk that was current before it
+    char* c = (char*)alloc.allocate(8);
+    TEST(c > a && c < a + __WASM_ALLOCATOR::CHUNK_SIZE);
+    alloc.GetStats(stats);
+    TEST(stats.chunks == 2);
+  }
+
+  {
+    // Scopes report to their parent's peak, but release their memory without touching what the parent retains
+    __WASM_ALLOCATOR alloc;
+    alloc.allocate(8);
+    IRAllocatorStats stats;
+    {
+      __WASM_ALLOCATOR scope(&alloc);
+      __WASM_ALLOCATOR inner(&scope);
+      scope.allocate(__WASM_ALLOCATOR::CHUNK_SIZE);
+      inner.allocate(8);
+      alloc.GetStats(stats);
+      TEST(stats.chunks == 1);
+      TEST(stats.reserved == __WASM_ALLOCATOR::CHUNK_SIZE);
+      TEST(stats.live > stats.reserved);
+    }
+    alloc.GetStats(stats);
+    TEST(stats.live == stats.reserved);
+    TEST(stats.peak > stats.reserved);
+  }
+
+  {
+    // Two allocators used from the same thread never hand out memory from each other's chunks
+    __WASM_ALLOCATOR a;
+    __WASM_ALLOCATOR b;
+    char* x = (char*)a.allocate(16);
+    char* y = (char*)b.allocate(16);
+    char* z = (char*)a.allocate(16);
+    TEST(z == x + 16);
+    TEST(y < x || y >= x + __WASM_ALLOCATOR::CHUNK_SIZE);
+  }
+
+  {
+    // Every thread gets its own chunk, so concurrent allocations never overlap
+    __WASM_ALLOCATOR alloc;
+    const int THREADS = 8;
+    const int COUNT = 2000;
+    std::vector<std::vector<uint32_t*>> results(THREADS);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < THREADS; ++t)
+      threads.emplace_back([&alloc, &results, t]() {
+        for(int i = 0; i < COUNT; ++i)
+        {
+          uint32_t* p = (uint32_t*)alloc.allocate(sizeof(uint32_t) * 4);
+          p[0] = p[3] = t * COUNT + i;
+          results[t].push_back(p);
+        }
+      });
+    for(auto& t : threads)
+      t.join();
+
+    bool valid = true;
+    for(int t = 0; t < THREADS; ++t)
+      for(int i = 0; i < COUNT; ++i)
+        valid = valid && results[t][i][0] == (uint32_t)(t * COUNT + i) && results[t][i][3] == (uint32_t)(t * COUNT + i);
+    TEST(valid);
+
+    IRAllocatorStats stats;
+    alloc.GetStats(stats);
+    TEST(stats.requested == THREADS * COUNT * sizeof(uint32_t) * 4);
+    TEST(stats.chunks >= THREADS);
+  }
+}
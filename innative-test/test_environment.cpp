@@ -6,6 +6,9 @@
 extern "C" {
   extern void _innative_internal_env_memcpy(char* dest, const char* src, uint64_t sz);
   extern void* _innative_internal_env_grow_memory(void* p, uint64_t i, uint64_t max);
+  extern void _innative_internal_env_free_memory(void* p);
+  extern void _innative_internal_env_map_image(char* dest, const char* src, uint64_t sz, IRImageBacking* backing);
+  extern void _innative_internal_env_close_image(IRImageBacking* backing);
   extern void _innative_internal_env_print(uint64_t a);
 }
 
@@ -81,6 +84,67 @@ void TestHarness::test_environment()
   TEST(p != 0);
   TEST(p[-1] == 101002);
   TEST(!_innative_internal_env_grow_memory(p, 100000, 200000));
+  _innative_internal_env_free_memory(p);
+
+  {
+    char* mem = (char*)_innative_internal_env_grow_memory(0, 65536, 65536 * 4);
+    TEST(mem != 0);
+    mem[65535] = 7;
+    TEST(_innative_internal_env_grow_memory(mem, 65536 * 2, 65536 * 4) == mem); // Growing within the maximum never moves memory
+    TEST(((uint64_t*)mem)[-1] == 65536 * 3);
+    TEST(mem[65535] == 7);
+    TEST(!mem[65536 * 3 - 1]);
+    mem[65536 * 3 - 1] = 8;
+    TEST(!_innative_internal_env_grow_memory(mem, 65536 * 2, 65536 * 4));
+    TEST(_innative_internal_env_grow_memory(mem, 65536, 65536 * 4) == mem);
+    TEST(mem[65536 * 3 - 1] == 8);
+    _innative_internal_env_free_memory(mem);
+  }
+
+  {
+    alignas(4096) static const char image[4096 * 2 + 3] = { 1, 2, 3 };
+    char* mem = (char*)_innative_internal_env_grow_memory(0, 65536, 0);
+    TEST(mem != 0);
+    TEST(!((size_t)mem % 4096));
+    mem[4096 * 3 + 3] = 5;
+    IRImageBacking backing = {};
+    _innative_internal_env_map_image(mem + 4096, image, sizeof(image), &backing);
+#ifdef IR_PLATFORM_POSIX
+    TEST(backing.fd > 0); // The image is in our own binary, which is still the file it was loaded from
+    TEST(backing.start <= (uint64_t)image && (uint64_t)image + 4096 * 2 <= backing.end);
+#endif
+    TEST(mem[4096] == 1);
+    TEST(mem[4096 + 2] == 3);
+    TEST(mem[4096 * 3 + 2] == 0);
+    TEST(mem[4096 * 3 + 3] == 5);
+    mem[4096] = 9; // Writes must never reach the image
+    TEST(image[0] == 1);
+
+    // Another segment in the same mapping reuses the file instead of looking it up again
+    IRImageBacking found = backing;
+    _innative_internal_env_map_image(mem + 4096 * 5, image, 4096, &backing);
+    TEST(!memcmp(&found, &backing, sizeof(backing)));
+    TEST(mem[4096 * 5] == 1);
+
+    // Memory that no file backs is copied instead, and isn't looked up again
+    char* anonymous = (char*)_innative_internal_env_grow_memory(0, 4096 * 2, 0);
+    TEST(anonymous != 0);
+    anonymous[4096 + 1] = 6;
+    _innative_internal_env_map_image(mem + 4096 * 8, anonymous, 4096 * 2, &backing);
+    TEST(backing.fd == -1 || backing.fd == 0);
+    TEST(mem[4096 * 9 + 1] == 6);
+    anonymous[4096 + 1] = 7;
+    TEST(mem[4096 * 9 + 1] == 6);
+    _innative_internal_env_free_memory(anonymous);
+
+    _innative_internal_env_close_image(&backing);
+    TEST(backing.fd == 0);
+    mem = (char*)_innative_internal_env_grow_memory(mem, 65536, 0);
+    TEST(mem != 0);
+    TEST(mem[4096] == 9);
+    TEST(mem[4096 * 3 + 3] == 5);
+    _innative_internal_env_free_memory(mem);
+  }
 
   //_innative_internal_env_print(0);
   //_innative_internal_env_print(~0ULL);
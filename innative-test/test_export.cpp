@@ -0,0 +1,182 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "../innative/tools.h"
+#include "../innative/util.h"
+#include <algorithm>
+#include <string>
+#include <stdio.h>
+
+using namespace innative;
+using utility::StringRef;
+
+static const char export_module[] = "(module $exp"
+"\n  (func (export \"mix\") (param i32 i64 f32 f64) (result f64)"
+"\n    (f64.add (f64.add (f64.convert_i32_s (local.get 0)) (f64.convert_i64_s (local.get 1)))"
+"\n      (f64.add (f64.promote_f32 (local.get 2)) (local.get 3))))"
+"\n  (func (export \"none\"))"
+"\n  (global (export \"g\") i32 (i32.const 4)))";
+
+// Builds a module with a function that takes more parameters than fit in a byte, and returns the sum of the first and last one
+static std::string WideModule(int params)
+{
+  std::string text = "(module $wide (func (export \"wide\") (param";
+  for(int i = 0; i < params; ++i)
+    text += " i32";
+  text += ") (result i32) (i32.add (local.get 0) (local.get " + std::to_string(params - 1) + "))))";
+  return text;
+}
+
+static IRExportEntry DirectoryEntry(StringRef module_name, StringRef export_name, uintptr_t address)
+{
+  IRExportEntry e = { utility::ExportHash(module_name, export_name), module_name.s, export_name.s, (void*)address, WASM_KIND_FUNCTION, 0, nullptr,
+    nullptr, (uint32_t)module_name.len, (uint32_t)export_name.len };
+  return e;
+}
+
+void TestHarness::test_export()
+{
+  // Names are compared by size, so names that only differ after a null byte are still told apart
+  {
+    std::vector<IRExportEntry> entries = {
+      DirectoryEntry({ "m", 1 }, { "a", 1 }, 1),
+      DirectoryEntry({ "m", 1 }, { "a\0b", 3 }, 2),
+      DirectoryEntry({ "m\0x", 3 }, { "a", 1 }, 3),
+      DirectoryEntry({ "", 0 }, { "a", 1 }, 4),
+      DirectoryEntry({ "m", 1 }, { "", 0 }, 5),
+    };
+
+    // Entries that share a hash must be told apart by their names, so put one with a forged hash ahead of the real one
+    entries.insert(entries.begin(), DirectoryEntry({ "m", 1 }, { "collide", 7 }, 6));
+    entries.front().hash = entries[1].hash;
+
+    std::stable_sort(entries.begin(), entries.end(), [](const IRExportEntry& l, const IRExportEntry& r) { return l.hash < r.hash; });
+    IRExportDirectory directory = { entries.size(), entries.data() };
+
+    auto find = [&](StringRef m, StringRef e) -> uintptr_t {
+      auto entry = FindExport(&directory, m.s, m.len, e.s, e.len);
+      return !entry ? 0 : (uintptr_t)entry->address;
+    };
+    TEST(find({ "m", 1 }, { "a", 1 }) == 1);
+    TEST(find({ "m", 1 }, { "a\0b", 3 }) == 2);
+    TEST(find({ "m", 1 }, { "a\0c", 3 }) == 0);
+    TEST(find({ "m\0x", 3 }, { "a", 1 }) == 3);
+    TEST(find({ "", 0 }, { "a", 1 }) == 4);
+    TEST(find({ nullptr, 0 }, { "a", 1 }) == 4);
+    TEST(find({ "m", 1 }, { "", 0 }) == 5);
+    TEST(find({ "m", 1 }, { "collide", 7 }) == 0);
+    TEST(find({ "m", 1 }, { "b", 1 }) == 0);
+    TEST(find({ "ma", 2 }, { "", 0 }) == 0); // The separator in the hash keeps names from running together
+
+    // The C string version stops at the first null byte, like the names it's given
+    TEST(FindExport(&directory, "m", "a") == FindExport(&directory, "m", 1, "a", 1));
+    TEST(FindExport(&directory, nullptr, "a") == FindExport(&directory, "", 0, "a", 1));
+    TEST(FindExport(&directory, "m", nullptr) == nullptr);
+    TEST(FindExport(nullptr, "m", "a") == nullptr);
+    TEST(LoadExportDirectory(nullptr) == nullptr);
+  }
+
+  static const char* file = "test_export" IR_LIBRARY_EXTENSION;
+  std::string wide = WideModule(300);
+  Environment* env = CreateEnvironment(ENV_LIBRARY);
+  TEST(AddModule(env, export_module, sizeof(export_module) - 1, "exp") == ERR_SUCCESS);
+  TEST(AddModule(env, wide.data(), wide.size(), "wide") == ERR_SUCCESS);
+  void* assembly = CompileLibrary(env, file);
+  (*_exports.DestroyEnvironment)(env);
+  TEST(assembly != nullptr);
+
+  IRFunction fn;
+  TEST((*_exports.LoadTypedFunction)(nullptr, "exp", "mix", &fn) == ERR_FATAL_NULL_POINTER);
+  TEST((*_exports.LoadTypedFunction)(assembly, "exp", nullptr, &fn) == ERR_FATAL_NULL_POINTER);
+
+  if(assembly)
+  {
+    TEST((*_exports.LoadTypedFunction)(assembly, "exp", "missing", &fn) == ERR_UNKNOWN_EXPORT);
+    TEST((*_exports.LoadTypedFunction)(assembly, "exp", "g", &fn) == ERR_UNKNOWN_EXPORT); // Not a function
+
+    TEST((*_exports.LoadTypedFunction)(assembly, "exp", "mix", &fn) == ERR_SUCCESS);
+    TEST(fn.function == (*_exports.LoadFunction)(assembly, "exp", "mix"));
+    TEST(fn.type.form == TE_func && fn.type.n_params == 4 && fn.type.n_returns == 1);
+    if(fn.type.n_params == 4 && fn.type.n_returns == 1)
+    {
+      TEST(fn.type.params[0] == TE_i32 && fn.type.params[1] == TE_i64 && fn.type.params[2] == TE_f32 && fn.type.params[3] == TE_f64);
+      TEST(fn.type.returns[0] == TE_f64);
+    }
+
+    // One transition into guest code makes every call, reading the arguments and writing the results in order
+    if(fn.invoke)
+    {
+      IRValue args[3 * 4];
+      IRValue results[3];
+      for(int i = 0; i < 3; ++i)
+      {
+        args[i * 4 + 0].i32 = i;
+        args[i * 4 + 1].i64 = 10 * i;
+        args[i * 4 + 2].f32 = 0.5f;
+        args[i * 4 + 3].f64 = 100.0 * i;
+      }
+      (*fn.invoke)(args, results, 3);
+      for(int i = 0; i < 3; ++i)
+        TEST(results[i].f64 == i + 10.0 * i + 0.5 + 100.0 * i);
+      (*fn.invoke)(args, results, 0);
+    }
+
+    TEST((*_exports.LoadTypedFunction)(assembly, "exp", "none", &fn) == ERR_SUCCESS);
+    TEST(fn.type.n_params == 0 && fn.type.n_returns == 0);
+    if(fn.invoke)
+      (*fn.invoke)(nullptr, nullptr, 2);
+
+    // The directory is looked up once and then reused, and each export in it matches the symbol it was exported under
+    const IRExportDirectory* directory = LoadExportDirectory(assembly);
+    TEST(directory != nullptr);
+    TEST(directory == LoadExportDirectory(assembly));
+    if(directory)
+    {
+      auto mix = FindExport(directory, "exp", "mix");
+      TEST(mix && mix->kind == WASM_KIND_FUNCTION && mix->module_size == 3 && mix->export_size == 3);
+      TEST(mix && mix->address == (void*)(*_exports.LoadFunction)(assembly, "exp", "mix"));
+      auto g = FindExport(directory, "exp", "g");
+      TEST(g && g->kind == WASM_KIND_GLOBAL && g->type == (uint32_t)TE_i32 && g->invoke == nullptr && g->signature == nullptr);
+      TEST(g && g->address && *(int32_t*)g->address == 4);
+      TEST(!FindExport(directory, "exp", "gg") && !FindExport(directory, "ex", "pg"));
+    }
+
+    // Counts aren't truncated to a byte
+    TEST((*_exports.LoadTypedFunction)(assembly, "wide", "wide", &fn) == ERR_SUCCESS);
+    TEST(fn.type.n_params == 300 && fn.type.n_returns == 1);
+    if(fn.type.n_params == 300 && fn.type.n_returns == 1)
+    {
+      TEST(fn.type.params[299] == TE_i32 && fn.type.returns[0] == TE_i32);
+      IRValue args[300] = {};
+      IRValue result;
+      args[0].i32 = 5;
+      args[299].i32 = 7;
+      (*fn.invoke)(args, &result, 1);
+      TEST(result.i32 == 12);
+    }
+  }
+
+  // The directory is read from the library every time, so a library unloaded by the host and replaced by another one that gets the
+  // same handle never finds the old directory
+  if(assembly)
+  {
+    utility::FreeDLL(assembly);
+    static const char* other = "test_export_other" IR_LIBRARY_EXTENSION;
+    env = CreateEnvironment(ENV_LIBRARY);
+    TEST(AddModule(env, export_module, sizeof(export_module) - 1, "other") == ERR_SUCCESS);
+    void* reloaded = CompileLibrary(env, other);
+    (*_exports.DestroyEnvironment)(env);
+    TEST(reloaded != nullptr);
+    if(reloaded)
+    {
+      TEST(LoadExportDirectory(reloaded) == (const IRExportDirectory*)utility::LoadDLLFunction(reloaded, IR_EXPORT_DIRECTORY));
+      TEST(FindExport(LoadExportDirectory(reloaded), "other", "mix") != nullptr);
+      TEST(FindExport(LoadExportDirectory(reloaded), "exp", "mix") == nullptr);
+      utility::FreeDLL(reloaded);
+    }
+    remove(other);
+  }
+
+  remove(file);
+}
@@ -0,0 +1,272 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include <thread>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef IR_PLATFORM_POSIX
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+extern "C" {
+  extern void* _innative_internal_env_grow_memory(void* p, uint64_t i, uint64_t max);
+  extern void _innative_internal_env_free_memory(void* p);
+}
+
+static const char instance_module[] = "(module $inst"
+"\n  (memory (export \"mem\") 1)"
+"\n  (global $g (export \"g\") (mut i32) (i32.const 7))"
+"\n  (func (export \"get\") (result i32) (global.get $g))"
+"\n  (func (export \"set\") (param i32) (global.set $g (local.get 0)))"
+"\n  (func (export \"load\") (result i32) (i32.load (i32.const 64)))"
+"\n  (func (export \"store\") (param i32) (i32.store (i32.const 64) (local.get 0))))";
+
+static const char reset_module[] = "(module $reset"
+"\n  (memory 1 4)"
+"\n  (table 2 anyfunc)"
+"\n  (elem (i32.const 0) $one)"
+"\n  (global $g (mut i64) (i64.const 3))"
+"\n  (func $one (result i32) (i32.const 1))"
+"\n  (func (export \"dirty\") (param i32)"
+"\n    (i32.store (i32.const 100) (local.get 0))"
+"\n    (i32.store (i32.const 40000) (local.get 0))"
+"\n    (drop (memory.grow (i32.const 1)))"
+"\n    (i32.store (i32.const 70000) (local.get 0))"
+"\n    (global.set $g (i64.extend_i32_u (local.get 0))))"
+"\n  (func $start (i32.store (i32.const 8) (i32.const 77)))"
+"\n  (start $start))";
+
+// A copy of everything an instance owns, so we can check that a reset puts back every byte
+struct InstanceImage
+{
+  std::unique_ptr<uint8_t[]> state;
+  std::vector<std::vector<uint8_t>> memories;
+  std::vector<std::vector<uint8_t>> tables;
+
+  explicit InstanceImage(const IRInstance* instance) : state(new uint8_t[instance->size])
+  {
+    memcpy(state.get(), instance->state, instance->size);
+    Copy(instance, instance->memories, memories);
+    Copy(instance, instance->tables, tables);
+  }
+
+  static void Copy(const IRInstance* instance, const uint64_t* offsets, std::vector<std::vector<uint8_t>>& out)
+  {
+    for(; *offsets != ~0ULL; ++offsets)
+    {
+      uint8_t* p = *reinterpret_cast<uint8_t**>(reinterpret_cast<uint8_t*>(instance->state) + *offsets);
+      out.emplace_back(p, p + reinterpret_cast<uint64_t*>(p)[-1]);
+    }
+  }
+
+  bool operator==(const InstanceImage& r) const
+  {
+    return memories == r.memories && tables == r.tables;
+  }
+};
+
+static void* ResetSwap(void* state) { return state; }
+static void ResetExit() {}
+
+void TestHarness::test_instance()
+{
+  // Save and reset only depend on the layout of the state block, so they can be checked without compiling anything
+  {
+    struct State
+    {
+      uint8_t* memory;
+      uint8_t* table;
+      int64_t global;
+    };
+    static const uint64_t memories[] = { offsetof(State, memory), ~0ULL };
+    static const uint64_t tables[] = { offsetof(State, table), ~0ULL };
+
+    IRInstance* instance = reinterpret_cast<IRInstance*>(malloc(sizeof(IRInstance) + sizeof(State)));
+    State* state = reinterpret_cast<State*>(instance + 1);
+    *instance = IRInstance{ &ResetSwap, &ResetExit, state, sizeof(State), memories, tables, nullptr };
+    state->memory = (uint8_t*)_innative_internal_env_grow_memory(0, 65536 * 3, 65536 * 8);
+    state->table = (uint8_t*)_innative_internal_env_grow_memory(0, 64, 0);
+    state->global = 42;
+    TEST(state->memory && state->table);
+
+    if(state->memory && state->table)
+    {
+      for(int i = 0; i < 65536; i += 7) // Leave the last page untouched, so it is still zero in the image
+        state->memory[i] = (uint8_t)(i * 31 + 1);
+      for(int i = 65536; i < 65536 * 2; i += 4093)
+        state->memory[i] = 0xAB;
+      memset(state->table, 0x5A, 64);
+
+      TEST((*_exports.ResetInstance)(instance) == ERR_FATAL_NULL_POINTER); // Can't reset before saving
+      TEST((*_exports.SaveInstance)(instance) == ERR_SUCCESS);
+      InstanceImage saved(instance);
+
+      for(int pass = 0; pass < 3; ++pass) // Resetting more than once must keep working from the same image
+      {
+        state->memory[0] ^= 0xFF;
+        state->memory[65536 + 4093] = 0;
+        state->memory[65536 * 2 + 100] = 1;
+        TEST(_innative_internal_env_grow_memory(state->memory, 65536, 65536 * 8) == state->memory);
+        state->memory[65536 * 3 + 5] = 2;
+        state->table[3] = 0;
+        state->global = -1 - pass;
+        TEST(!(InstanceImage(instance) == saved));
+
+        TEST((*_exports.ResetInstance)(instance) == ERR_SUCCESS);
+        InstanceImage reset(instance);
+        TEST(reset == saved);
+        TEST(!memcmp(reset.state.get(), saved.state.get(), sizeof(State)));
+        TEST(state->global == 42);
+      }
+
+      // Pages grown after the save are given back, so growing again gives zeroed memory
+      TEST(reinterpret_cast<uint64_t*>(state->memory)[-1] == 65536 * 3);
+      TEST(_innative_internal_env_grow_memory(state->memory, 65536, 65536 * 8) == state->memory);
+      TEST(state->memory[65536 * 3 + 5] == 0);
+    }
+
+    uint8_t* memory = state->memory;
+    uint8_t* table = state->table;
+    (*_exports.DestroyInstance)(instance);
+    _innative_internal_env_free_memory(memory);
+    _innative_internal_env_free_memory(table);
+  }
+
+  // The same round trip through a compiled library, where the guest code does the mutating
+  {
+    static const char* file = "test_instance_reset" IR_LIBRARY_EXTENSION;
+    Environment* env = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT | ENV_INSTANCES);
+    TEST(AddModule(env, reset_module, sizeof(reset_module) - 1, "reset") == ERR_SUCCESS);
+    void* assembly = CompileLibrary(env, file);
+    (*_exports.DestroyEnvironment)(env);
+    TEST(assembly != nullptr);
+
+    auto dirty = !assembly ? nullptr : reinterpret_cast<void(*)(int32_t)>((*_exports.LoadFunction)(assembly, "reset", "dirty"));
+    IRInstance* instance = !dirty ? nullptr : (*_exports.CreateInstance)(assembly);
+    TEST(instance != nullptr);
+    if(instance)
+    {
+      TEST((*_exports.SaveInstance)(instance) == ERR_SUCCESS);
+      InstanceImage saved(instance);
+      TEST(saved.memories.size() == 1 && saved.memories[0].size() == 65536 && saved.memories[0][8] == 77);
+      TEST(saved.tables.size() == 1);
+
+      for(int32_t pass = 1; pass <= 3; ++pass)
+      {
+        void* previous = (*_exports.EnterInstance)(instance);
+        (*dirty)(pass);
+        (*_exports.LeaveInstance)(instance, previous);
+
+        // Guest code can't write to tables, so do that directly
+        uint8_t* table = *reinterpret_cast<uint8_t**>(reinterpret_cast<uint8_t*>(instance->state) + instance->tables[0]);
+        memset(table, 0, reinterpret_cast<uint64_t*>(table)[-1]);
+
+        InstanceImage dirtied(instance);
+        TEST(dirtied.memories[0].size() == 65536 * 2);
+        TEST(memcmp(dirtied.state.get(), saved.state.get(), instance->size) != 0);
+
+        TEST((*_exports.ResetInstance)(instance) == ERR_SUCCESS);
+        InstanceImage reset(instance);
+        TEST(reset == saved);
+        TEST(!memcmp(reset.state.get(), saved.state.get(), instance->size));
+      }
+
+      (*_exports.DestroyInstance)(instance);
+    }
+
+    remove(file);
+  }
+
+  // Instances have to be created explicitly, so a library that initializes itself on load can't use them
+  {
+    Environment* env = CreateEnvironment(ENV_LIBRARY | ENV_INSTANCES);
+    TEST(AddModule(env, instance_module, sizeof(instance_module) - 1, "inst") == ERR_SUCCESS);
+    TEST((*_exports.Compile)(env, "test_instance_bad" IR_LIBRARY_EXTENSION) < 0);
+    (*_exports.DestroyEnvironment)(env);
+    remove("test_instance_bad" IR_LIBRARY_EXTENSION);
+  }
+
+  static const char* file = "test_instance" IR_LIBRARY_EXTENSION;
+  Environment* env = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT | ENV_INSTANCES);
+  TEST(AddModule(env, instance_module, sizeof(instance_module) - 1, "inst") == ERR_SUCCESS);
+  void* assembly = CompileLibrary(env, file);
+  (*_exports.DestroyEnvironment)(env);
+  TEST(assembly != nullptr);
+
+  auto get = !assembly ? nullptr : reinterpret_cast<int32_t(*)()>((*_exports.LoadFunction)(assembly, "inst", "get"));
+  auto set = !assembly ? nullptr : reinterpret_cast<void(*)(int32_t)>((*_exports.LoadFunction)(assembly, "inst", "set"));
+  auto load = !assembly ? nullptr : reinterpret_cast<int32_t(*)()>((*_exports.LoadFunction)(assembly, "inst", "load"));
+  auto store = !assembly ? nullptr : reinterpret_cast<void(*)(int32_t)>((*_exports.LoadFunction)(assembly, "inst", "store"));
+  TEST(get && set && load && store);
+
+  if(get && set && load && store)
+  {
+    // Mutable state lives in each instance, so it has no fixed address to export
+    TEST((*_exports.LoadGlobal)(assembly, "inst", "mem") == nullptr);
+    TEST((*_exports.LoadGlobal)(assembly, "inst", "g") == nullptr);
+
+#ifdef IR_PLATFORM_POSIX
+    // Calling in without entering an instance traps cleanly instead of crashing on a null state pointer
+    pid_t child = fork();
+    if(!child)
+    {
+      (*get)();
+      _exit(0);
+    }
+    int status = 0;
+    TEST(child > 0 && waitpid(child, &status, 0) == child);
+    TEST(WIFSIGNALED(status) && WTERMSIG(status) == SIGILL);
+#endif
+
+    IRInstance* a = (*_exports.CreateInstance)(assembly);
+    IRInstance* b = (*_exports.CreateInstance)(assembly);
+    TEST(a && b && a->state != b->state);
+
+    if(a && b)
+    {
+      void* previous = (*_exports.EnterInstance)(a);
+      TEST((*get)() == 7);
+      (*set)(5);
+      (*store)(111);
+      TEST((*get)() == 5 && (*load)() == 111);
+
+      // Entering another instance returns the current one, and leaving it makes the first one current again
+      void* nested = (*_exports.EnterInstance)(b);
+      TEST(nested == a->state);
+      TEST((*get)() == 7 && (*load)() == 0);
+      (*set)(9);
+      (*store)(222);
+      (*_exports.LeaveInstance)(b, nested);
+
+      TEST((*get)() == 5 && (*load)() == 111);
+
+      // The current instance is per thread, so another thread can run a different instance at the same time
+      int32_t other[2] = { 0, 0 };
+      std::thread thread([&]() {
+        void* p = (*_exports.EnterInstance)(b);
+        other[0] = (*get)();
+        other[1] = (*load)();
+        (*_exports.LeaveInstance)(b, p);
+      });
+      thread.join();
+      TEST(other[0] == 9 && other[1] == 222);
+      TEST((*get)() == 5 && (*load)() == 111);
+      (*_exports.LeaveInstance)(a, previous);
+
+      // A destroyed instance doesn't affect the ones that remain
+      (*_exports.DestroyInstance)(a);
+      previous = (*_exports.EnterInstance)(b);
+      TEST((*get)() == 9 && (*load)() == 222);
+      (*_exports.LeaveInstance)(b, previous);
+    }
+
+    (*_exports.DestroyInstance)(b);
+  }
+
+  remove(file);
+}
@@ -0,0 +1,84 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "../innative/instruction.h"
+#include <stdlib.h>
+
+using namespace innative;
+
+void TestHarness::test_instruction()
+{
+  varuint32 table[] = { 2, 0, 1 };
+  Instruction ops[7] = { { OP_block }, { OP_i64_const }, { OP_br_table }, { OP_i32_load16_u }, { OP_call_indirect }, { OP_drop }, { OP_end } };
+  ops[0].immediates[0]._varsint7 = TE_void;
+  ops[1].immediates[0]._varsint64 = -0x123456789LL;
+  ops[2].immediates[0].table = table;
+  ops[2].immediates[0].n_table = 3;
+  ops[2].immediates[1]._varuint32 = 4;
+  ops[3].immediates[0]._varuint32 = 1;
+  ops[3].immediates[1]._varuptr = 0x100000000ULL;
+  ops[3].immediates[2]._varuint32 = 2;
+  ops[4].immediates[0]._varuint32 = 7;
+
+  FunctionBody body = { 0 };
+  size_t total = 0;
+  for(varuint32 i = 0; i < 7; ++i)
+  {
+    ops[i].line = i + 1;
+    ops[i].column = i * 2;
+    TEST(AppendInstruction(body, ops[i]) == ERR_SUCCESS);
+    total += PackedSize(ops[i]);
+  }
+
+  TEST(body.n_body == 7);
+  TEST(body.n_code == total);
+  TEST(body.n_code < sizeof(Instruction) * 2);
+  TEST(PackedSize(ops[5]) == 1);
+  TEST(PackedSize(ops[2]) <= MAX_PACKED_SIZE);
+  TEST(PackedSize(ops[3]) <= MAX_PACKED_SIZE);
+
+  InstructionCursor cursor(body);
+  Instruction ins;
+  for(varuint32 i = 0; i < 7; ++i)
+  {
+    TEST(cursor.Index() == i);
+    TEST(cursor.Next(ins));
+    TEST(ins.opcode == ops[i].opcode);
+    TEST(ins.line == i + 1);
+    TEST(ins.column == i * 2);
+  }
+  TEST(cursor.Done());
+  TEST(!cursor.Next(ins));
+  TEST(ins.opcode == OP_end);
+
+  cursor = InstructionCursor(body);
+  TEST(cursor.Next(ins) && ins.immediates[0]._varsint7 == TE_void);
+  TEST(cursor.Next(ins) && ins.immediates[0]._varsint64 == -0x123456789LL);
+  TEST(cursor.Next(ins) && ins.immediates[0].table == table && ins.immediates[0].n_table == 3 && ins.immediates[1]._varuint32 == 4);
+  TEST(cursor.Next(ins));
+  TEST(ins.immediates[0]._varuint32 == 1);
+  TEST(ins.immediates[1]._varuptr == 0x100000000ULL);
+  TEST(ins.immediates[2]._varuint32 == 2);
+  TEST(cursor.Next(ins) && ins.immediates[0]._varuint32 == 7 && !ins.immediates[1]._varuint1);
+
+  // Patching an immediate rewrites it in place without moving anything after it
+  varuint32 offset = (varuint32)(PackedSize(ops[0]) + PackedSize(ops[1]) + PackedSize(ops[2]));
+  TEST(PatchImmediate(body, offset, 2, 5) == ERR_SUCCESS);
+  TEST(PatchImmediate(body, body.n_code, 0, 5) == ERR_INVALID_FUNCTION_BODY);
+  TEST(body.n_code == total);
+  InstructionCursor patched(body, offset);
+  TEST(patched.Next(ins) && ins.opcode == OP_i32_load16_u);
+  TEST(ins.immediates[2]._varuint32 == 5);
+  TEST(ins.immediates[1]._varuptr == 0x100000000ULL);
+  TEST(patched.Next(ins) && ins.opcode == OP_call_indirect);
+
+  // Bodies without source positions decode with a zero position
+  SourcePosition* positions = body.positions;
+  body.positions = 0;
+  cursor = InstructionCursor(body);
+  TEST(cursor.Next(ins) && !ins.line && !ins.column);
+
+  free(body.body);
+  free(positions);
+}
@@ -0,0 +1,115 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "../innative/tools.h"
+#include "../innative/serialize.h"
+#include "../innative/instruction.h"
+#include <string>
+#include <stdio.h>
+
+using namespace innative;
+using wat::WatToken;
+
+// Two functions of type (i32) -> i32, with a local, a br_table and a call. The second one is exported as "f" and returns its parameter plus 3.
+static const uint8_t lazy_binary[] = { 0, 'a', 's', 'm', 1, 0, 0, 0,
+  WASM_SECTION_TYPE, 6, 1, 0x60, 1, 0x7f, 1, 0x7f,
+  WASM_SECTION_FUNCTION, 3, 2, 0, 0,
+  WASM_SECTION_EXPORT, 5, 1, 1, 'f', WASM_KIND_FUNCTION, 1,
+  WASM_SECTION_CODE, 27, 2,
+  9, 1, 1, 0x7f, OP_local_get, 0, OP_i32_const, 3, OP_i32_add, OP_end,
+  15, 0, OP_block, 0x40, OP_local_get, 0, OP_br_table, 1, 0, 0, OP_end, OP_local_get, 0, OP_call, 0, OP_end };
+
+// Both bodies are invalid, so the order their errors are reported in can be compared too
+static const uint8_t invalid_binary[] = { 0, 'a', 's', 'm', 1, 0, 0, 0,
+  WASM_SECTION_TYPE, 6, 1, 0x60, 1, 0x7f, 1, 0x7f,
+  WASM_SECTION_FUNCTION, 3, 2, 0, 0,
+  WASM_SECTION_CODE, 14, 2,
+  9, 1, 1, 0x7f, OP_local_get, 0, OP_i64_const, 3, OP_i32_add, OP_end,
+  2, 0, OP_end };
+
+void TestHarness::test_lazy()
+{
+  // A lazy body only records where its instructions are, until something needs to decode it
+  {
+    Environment* env = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT | ENV_LAZY_FUNCTIONS);
+    TEST(AddModule(env, lazy_binary, sizeof(lazy_binary), "lazy") == ERR_SUCCESS);
+    TEST(env->n_modules == 1 && env->modules[0].code.n_funcbody == 2);
+    if(env->n_modules == 1 && env->modules[0].code.n_funcbody == 2)
+    {
+      const FunctionBody& body = env->modules[0].code.funcbody[1];
+      TEST(body.body == nullptr && body.source != nullptr && body.n_source == 14);
+    }
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  // Validating and serializing a lazily parsed module gives the same results as an eagerly parsed one
+  for(auto& binary : { std::make_pair(lazy_binary, sizeof(lazy_binary)), std::make_pair(invalid_binary, sizeof(invalid_binary)) })
+  {
+    Environment* eager = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT);
+    Environment* lazy = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT | ENV_LAZY_FUNCTIONS);
+    TEST(AddModule(eager, binary.first, binary.second, "lazy") == ERR_SUCCESS);
+    TEST(AddModule(lazy, binary.first, binary.second, "lazy") == ERR_SUCCESS);
+
+    std::string text = SerializeModule(eager);
+    TEST(!text.empty());
+    TEST(text == SerializeModule(lazy));
+
+    int err = Validate(eager);
+    TEST(err == (binary.first == lazy_binary ? ERR_SUCCESS : ERR_VALIDATION_ERROR));
+    TEST(Validate(lazy) == err);
+    auto errors = ErrorList(eager->errors);
+    TEST(errors == ErrorList(lazy->errors));
+    TEST(errors.size() == (binary.first == lazy_binary ? 0 : 2));
+
+    // Serializing again after validation must still decode the same instructions
+    TEST(SerializeModule(lazy) == text);
+    (*_exports.DestroyEnvironment)(eager);
+    (*_exports.DestroyEnvironment)(lazy);
+  }
+
+  // A body that can't be decoded is refused instead of being serialized as if it were empty
+  {
+    uint8_t broken[sizeof(lazy_binary)];
+    memcpy(broken, lazy_binary, sizeof(lazy_binary));
+    broken[sizeof(broken) - 3] = 0xff; // Replaces the call with an opcode that doesn't exist
+    Environment* env = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT | ENV_LAZY_FUNCTIONS);
+    TEST(AddModule(env, broken, sizeof(broken), "lazy") == ERR_SUCCESS);
+    Queue<WatToken> tokens;
+    TEST(wat::TokenizeModule(*env, tokens, env->modules[0]) < 0);
+    TEST(Validate(env) == ERR_VALIDATION_ERROR);
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  // Both compile to the same code
+  {
+    static const char* eager_file = "test_lazy_eager" IR_LIBRARY_EXTENSION;
+    static const char* lazy_file = "test_lazy" IR_LIBRARY_EXTENSION;
+    void* assembly[2];
+    uint64_t flags[2] = { ENV_LIBRARY, ENV_LIBRARY | ENV_LAZY_FUNCTIONS };
+    const char* files[2] = { eager_file, lazy_file };
+    for(int i = 0; i < 2; ++i)
+    {
+      Environment* env = CreateEnvironment(flags[i]);
+      TEST(AddModule(env, lazy_binary, sizeof(lazy_binary), "lazy") == ERR_SUCCESS);
+      assembly[i] = CompileLibrary(env, files[i]);
+      (*_exports.DestroyEnvironment)(env);
+      TEST(assembly[i] != nullptr);
+    }
+
+    auto eager_f = !assembly[0] ? nullptr : reinterpret_cast<int32_t(*)(int32_t)>((*_exports.LoadFunction)(assembly[0], "lazy", "f"));
+    auto lazy_f = !assembly[1] ? nullptr : reinterpret_cast<int32_t(*)(int32_t)>((*_exports.LoadFunction)(assembly[1], "lazy", "f"));
+    TEST(eager_f && lazy_f);
+    if(eager_f && lazy_f)
+    {
+      for(int32_t i = -2; i < 3; ++i)
+      {
+        TEST((*lazy_f)(i) == i + 3);
+        TEST((*lazy_f)(i) == (*eager_f)(i));
+      }
+    }
+
+    remove(eager_file);
+    remove(lazy_file);
+  }
+}
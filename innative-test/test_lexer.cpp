@@ -0,0 +1,185 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "../innative/lexer.h"
+#include <string>
+#include <float.h>
+
+using namespace innative;
+using namespace wat;
+using namespace utility;
+
+void TestHarness::test_lexer()
+{
+  const char text[] = "(module $m (; nested (; block ;) comment ;)\n  (func (param i32) ;; line comment\r\n    i32.add get_local \"a\\\"b\" offset=8 nan:0x10 -0x1F))";
+  const char* end = text + sizeof(text) - 1;
+
+  Queue<WatToken> tokens;
+  TokenizeWAT(tokens, text, end);
+  WatTokenID ids[] = { TOKEN_OPEN, TOKEN_MODULE, TOKEN_NAME, TOKEN_OPEN, TOKEN_FUNC, TOKEN_OPEN, TOKEN_PARAM, TOKEN_i32, TOKEN_CLOSE, TOKEN_OPERATOR,
+    TOKEN_OPERATOR, TOKEN_STRING, TOKEN_OFFSET, TOKEN_NUMBER, TOKEN_NUMBER, TOKEN_NUMBER, TOKEN_CLOSE, TOKEN_CLOSE };
+  TEST(tokens.Size() == sizeof(ids) / sizeof(ids[0]));
+  for(size_t i = 0; i < tokens.Size() && i < sizeof(ids) / sizeof(ids[0]); ++i)
+    TEST(tokens[i].id == ids[i]);
+
+  TEST(tokens[2].len == 1 && tokens[2].pos[0] == 'm');
+  TEST(tokens[9].i == OP_i32_add);
+  TEST(tokens[10].i == OP_local_get); // Legacy operator names still work
+  TEST(std::string(tokens[11].pos, tokens[11].len) == "a\\\"b");
+  TEST(std::string(tokens[13].pos, tokens[13].len) == "8");
+  TEST(std::string(tokens[14].pos, tokens[14].len) == "nan:0x10");
+  TEST(tokens[1].line == 0 && tokens[1].column == 2); // Columns count from 1 on every line, including the first
+  TEST(tokens[4].line == 1 && tokens[4].column == 4);
+  TEST(tokens[9].line == 2 && tokens[9].column == 5);
+
+  // Every operator name resolves to its own opcode, except the control flow ones that are keywords
+  for(int i = 0; i < OPNAMECOUNT; ++i)
+  {
+    WatCursor cur = { OPNAMES[i], OPNAMES[i], 0 };
+    WatToken t;
+    TEST(NextWatToken(cur, OPNAMES[i] + strlen(OPNAMES[i]), t));
+    if(!strcmp(OPNAMES[i], "RESERVED"))
+    {
+      TEST(t.id == TOKEN_NONE);
+    }
+    else if(t.id == TOKEN_OPERATOR)
+    {
+      TEST(t.i == i);
+    }
+    else
+    {
+      TEST(t.id == TOKEN_BLOCK || t.id == TOKEN_LOOP || t.id == TOKEN_IF || t.id == TOKEN_ELSE || t.id == TOKEN_END);
+    }
+  }
+
+  // Unterminated strings, lone semicolons and empty names are invalid
+  const char* bad[] = { "\"abc", ";", "$", "$(" };
+  for(auto s : bad)
+  {
+    WatCursor cur = { s, s, 0 };
+    WatToken t;
+    TEST(NextWatToken(cur, s + strlen(s), t) && t.id == TOKEN_NONE);
+  }
+
+  // Seeking back further than the window has to lex forward from a checkpoint and find the same tokens
+  std::string big;
+  for(size_t i = 0; i < WatLexer::CHECKPOINT_INTERVAL * 3; ++i)
+    big += "(i32.const " + std::to_string(i) + ") ;; comment\n";
+  Queue<WatToken> all;
+  TokenizeWAT(all, big.data(), big.data() + big.size());
+
+  WatLexer lexer(big.data(), big.data() + big.size());
+  size_t n = 0;
+  while(lexer.Size() > 0)
+  {
+    WatToken t = lexer.Pop();
+    TEST(t.pos == all[n].pos && t.id == all[n].id);
+    ++n;
+  }
+  TEST(n == all.Size());
+  TEST(lexer[0].id == TOKEN_NONE); // Reading past the end is harmless
+
+  size_t positions[] = { n - 1, n - WatLexer::WINDOW, 5, WatLexer::CHECKPOINT_INTERVAL * 2 + 3, 0 };
+  for(size_t p : positions)
+  {
+    lexer.SetPosition(p);
+    TEST(lexer.GetPosition() == p);
+    TEST(lexer[0].pos == all[p].pos && lexer[0].line == all[p].line);
+    TEST(lexer.Pop().pos == all[p].pos);
+    TEST(lexer.Peek().pos == all[p + 1 < n ? p + 1 : p].pos || p + 1 == n);
+  }
+
+  // A second lexer started from a mark sees the same tokens, even when the first one has already peeked ahead
+  lexer.SetPosition(WatLexer::CHECKPOINT_INTERVAL + 7);
+  lexer.Peek();
+  WatLexer resumed(lexer.Mark(), lexer.End());
+  for(size_t p = WatLexer::CHECKPOINT_INTERVAL + 7; p < n; ++p)
+  {
+    WatToken t = resumed.Pop();
+    TEST(t.pos == all[p].pos && t.line == all[p].line && t.column == all[p].column);
+  }
+  TEST(resumed.Size() == 0);
+
+  // Seeking with a mark skips straight to a token the lexer has never seen, and plain seeks still work afterwards
+  size_t target = WatLexer::CHECKPOINT_INTERVAL * 2 + 11;
+  lexer.SetPosition(target);
+  WatCursor mark = lexer.Mark();
+  WatLexer jumped(big.data(), big.data() + big.size());
+  jumped.SetPosition(target, mark);
+  TEST(jumped.GetPosition() == target);
+  TEST(jumped.Pop().pos == all[target].pos && jumped.Peek().pos == all[target + 1].pos);
+  jumped.SetPosition(3);
+  TEST(jumped.Peek().pos == all[3].pos);
+
+  // Numbers are parsed straight out of the token, with underscores, hex floats and NaN payloads
+  auto token = [](const char* s) {
+    WatToken t = { TOKEN_NUMBER, s, 0, 0 };
+    t.len = strlen(s);
+    return t;
+  };
+  auto bits64 = [](float64 f) {
+    uint64_t b;
+    memcpy(&b, &f, sizeof(b));
+    return b;
+  };
+  auto bits32 = [](float32 f) {
+    uint32_t b;
+    memcpy(&b, &f, sizeof(b));
+    return b;
+  };
+  float64 d;
+  float32 f;
+  TEST(!ResolveTokenf64(token("1.5"), d) && d == 1.5);
+  TEST(!ResolveTokenf64(token("1_000.000_1e-1_0"), d) && d == 1000.0001e-10);
+  TEST(!ResolveTokenf64(token("0x1.8p3"), d) && d == 12.0);
+  TEST(!ResolveTokenf64(token("1000000000000000000000000000001"), d) && d == 1e30);
+  TEST(!ResolveTokenf64(token("1.7976931348623157e308"), d) && d == DBL_MAX);
+  TEST(ResolveTokenf64(token("1.7976931348623159e308"), d) == ERR_WAT_OUT_OF_RANGE);
+  TEST(ResolveTokenf64(token("0x1.fffffffffffff8p1023"), d) == ERR_WAT_OUT_OF_RANGE);
+  TEST(!ResolveTokenf64(token("-0x1p-1074"), d) && bits64(d) == 0x8000000000000001ULL);
+  TEST(!ResolveTokenf64(token("4.9406564584124654e-324"), d) && bits64(d) == 1);
+  TEST(!ResolveTokenf64(token("0x1p-1075"), d) && bits64(d) == 0); // Ties round to even
+  TEST(!ResolveTokenf64(token("0x1.0000000000001p-1075"), d) && bits64(d) == 1);
+  TEST(!ResolveTokenf64(token("2.2250738585072011e-308"), d) && bits64(d) == 0x000FFFFFFFFFFFFFULL);
+  TEST(!ResolveTokenf64(token("1e-400"), d) && bits64(d) == 0);
+  TEST(!ResolveTokenf64(token("-nan"), d) && bits64(d) == 0xFFF8000000000000ULL);
+  TEST(!ResolveTokenf64(token("nan:0x1"), d) && bits64(d) == 0x7FF0000000000001ULL);
+  TEST(!ResolveTokenf64(token("-inf"), d) && d == -std::numeric_limits<float64>::infinity());
+  TEST(ResolveTokenf64(token("nan:0x0"), d) == ERR_WAT_OUT_OF_RANGE);
+  TEST(ResolveTokenf64(token("nan:0x10000000000000"), d) == ERR_WAT_OUT_OF_RANGE);
+
+  TEST(!ResolveTokenf32(token("0x1.fffffep127"), f) && f == FLT_MAX);
+  TEST(ResolveTokenf32(token("0x1.ffffffp127"), f) == ERR_WAT_OUT_OF_RANGE);
+  TEST(!ResolveTokenf32(token("0x1p-149"), f) && bits32(f) == 1);
+  TEST(!ResolveTokenf32(token("16777217"), f) && f == 16777216.0f);
+  TEST(!ResolveTokenf32(token("16777219"), f) && f == 16777220.0f);
+  TEST(!ResolveTokenf32(token("0.1"), f) && f == 0.1f);
+  TEST(!ResolveTokenf32(token("+nan:0x7f_ffff"), f) && bits32(f) == 0x7FFFFFFFU);
+  TEST(ResolveTokenf32(token("nan:0x800000"), f) == ERR_WAT_OUT_OF_RANGE);
+  TEST(ResolveTokenf32(token("1e39"), f) == ERR_WAT_OUT_OF_RANGE);
+
+  const char* malformed[] = { "1__0", "_1", "1_", "1._5", "1_.5", "0x", "0x_1", "1e", "1e_5", "0x1p", "1.5x", "nan:", "nan:0x", "infx" };
+  for(auto s : malformed)
+  {
+    TEST(ResolveTokenf64(token(s), d) == ERR_WAT_INVALID_NUMBER);
+    TEST(ResolveTokenf32(token(s), f) == ERR_WAT_INVALID_NUMBER);
+  }
+
+  varsint32 i32;
+  varuint32 u32;
+  varsint64 i64;
+  TEST(!ResolveTokeni32(token("0x7fff_ffff"), i32) && i32 == 0x7FFFFFFF);
+  TEST(!ResolveTokeni32(token("-0x8000_0000"), i32) && i32 == std::numeric_limits<varsint32>::min());
+  TEST(!ResolveTokeni32(token("4294967295"), i32) && i32 == -1);
+  TEST(ResolveTokeni32(token("4294967296"), i32) == ERR_WAT_OUT_OF_RANGE);
+  TEST(!ResolveTokenu32(token("0010"), u32) && u32 == 10);
+  TEST(ResolveTokenu32(token("-1"), u32) == ERR_WAT_OUT_OF_RANGE);
+  TEST(!ResolveTokeni64(token("18446744073709551615"), i64) && i64 == -1);
+  TEST(ResolveTokeni64(token("18446744073709551616"), i64) == ERR_WAT_OUT_OF_RANGE);
+  TEST(!ResolveTokeni64(token("-9223372036854775808"), i64) && i64 == std::numeric_limits<varsint64>::min());
+  TEST(ResolveTokeni64(token("-9223372036854775809"), i64) == ERR_WAT_OUT_OF_RANGE);
+  TEST(ResolveTokeni64(token("1__0"), i64) == ERR_WAT_INVALID_NUMBER);
+  TEST(ResolveTokeni64(token("0x"), i64) == ERR_WAT_INVALID_NUMBER);
+  TEST(ResolveTokeni64(token("1.0"), i64) == ERR_WAT_INVALID_NUMBER);
+}
@@ -0,0 +1,179 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "../innative/tools.h"
+#include "../innative/parse.h"
+#include "../innative/instruction.h"
+#include <algorithm>
+#include <functional>
+#include <random>
+
+using namespace innative;
+
+// Names the first and last functions, so the last name is parsed while the last body may still be in flight
+static std::vector<uint8_t> NameSection(uint32_t n)
+{
+  std::vector<uint8_t> names = { 2, 0, 2, 'f', '0' };
+  PushLEB(names, n - 1);
+  names.insert(names.end(), { 4, 'l', 'a', 's', 't' });
+  std::vector<uint8_t> payload = { 4, 'n', 'a', 'm', 'e', 1 };
+  PushLEB(payload, (uint32_t)names.size());
+  payload.insert(payload.end(), names.begin(), names.end());
+  return payload;
+}
+
+// Builds a module with a memory, a global, a data segment, a name section and n functions of type (i32) -> i32. Each body listed in
+// invalid adds an i64 to an i32, so it fails validation.
+static std::vector<uint8_t> StreamModule(uint32_t n, std::vector<uint32_t> invalid = {})
+{
+  std::vector<uint8_t> out = { 0, 'a', 's', 'm', 1, 0, 0, 0 };
+  PushSection(out, WASM_SECTION_TYPE, { 1, 0x60, 1, 0x7f, 1, 0x7f });
+
+  std::vector<uint8_t> functions;
+  PushLEB(functions, n);
+  functions.insert(functions.end(), n, 0);
+  PushSection(out, WASM_SECTION_FUNCTION, functions);
+  PushSection(out, WASM_SECTION_MEMORY, { 1, 0, 1 });
+  PushSection(out, WASM_SECTION_GLOBAL, { 1, 0x7f, 0, OP_i32_const, 5, OP_end });
+  PushSection(out, WASM_SECTION_EXPORT, { 1, 2, 'f', '0', WASM_KIND_FUNCTION, 0 });
+
+  std::vector<uint8_t> code;
+  PushLEB(code, n);
+  for(uint32_t i = 0; i < n; ++i)
+  {
+    bool bad = std::find(invalid.begin(), invalid.end(), i) != invalid.end();
+    code.insert(code.end(), { 12, 1, 1, 0x7f, OP_local_get, 0, OP_global_get, 0, OP_i32_add, uint8_t(bad ? OP_i64_const : OP_i32_const),
+      uint8_t(i & 0x3f), OP_i32_add, OP_end });
+  }
+  PushSection(out, WASM_SECTION_CODE, code);
+  PushSection(out, WASM_SECTION_DATA, { 1, 0, OP_i32_const, 0, OP_end, 3, 'a', 'b', 'c' });
+  PushSection(out, WASM_SECTION_CUSTOM, NameSection(n));
+  return out;
+}
+
+void TestHarness::test_modulestream()
+{
+  static const uint64_t SERIAL = ENV_LIBRARY | ENV_NO_INIT;
+  static const uint64_t THREADED = ENV_LIBRARY | ENV_NO_INIT | ENV_MULTITHREADED;
+
+  // Loads a binary in one piece with AddModule, or pushes it through a stream in chunks of whatever size chunk returns
+  auto load = [this](uint64_t flags, const std::vector<uint8_t>& binary, std::function<size_t()> chunk) {
+    Environment* env = CreateEnvironment(flags);
+    int err;
+    if(!chunk)
+      err = AddModule(env, binary.data(), binary.size(), "stream");
+    else
+    {
+      __WASM_MODULE_STREAM* stream = (*_exports.BeginModuleStream)(env, "stream");
+      for(size_t pos = 0; pos < binary.size();)
+      {
+        size_t n = std::min(chunk(), binary.size() - pos);
+        if((*_exports.PushModuleStream)(stream, binary.data() + pos, n) < 0)
+          break;
+        pos += n;
+      }
+      err = (*_exports.FinishModuleStream)(env, stream);
+    }
+
+    LoadResult r = GetLoadResult(env, err);
+    (*_exports.DestroyEnvironment)(env);
+    return r;
+  };
+
+  std::mt19937 rng(5489u);
+  std::function<size_t()> single = []() -> size_t { return 1; };
+  std::function<size_t()> random = [&rng]() -> size_t { return std::uniform_int_distribution<size_t>(1, 64)(rng); };
+  std::function<size_t()> whole = []() -> size_t { return ~size_t(0); };
+
+  // However the bytes are split, and whether or not bodies are parsed on other threads, the result is the same as parsing the whole
+  // buffer at once. There are enough bodies for them to be spread over several threads.
+  for(auto& binary : { StreamModule(3), StreamModule(300), StreamModule(300, { 7, 150, 299 }) })
+  {
+    LoadResult expected = load(SERIAL, binary, nullptr);
+    TEST(expected.err == ERR_SUCCESS);
+    TEST(expected.text.find("$f0") != std::string::npos); // Names from the name section are kept
+    TEST(expected.text.find("$last") != std::string::npos);
+    TEST(expected.errors.size() == (expected.validate < 0 ? 3 : 0));
+    TEST(load(THREADED, binary, nullptr) == expected);
+
+    for(auto flags : { SERIAL, THREADED })
+    {
+      TEST(load(flags, binary, single) == expected);
+      TEST(load(flags, binary, random) == expected);
+      TEST(load(flags, binary, whole) == expected);
+    }
+  }
+
+  // Bodies are validated as soon as they arrive, before the stream is finished
+  {
+    std::vector<uint8_t> binary = StreamModule(4, { 2 });
+    Environment* env = CreateEnvironment(SERIAL);
+    __WASM_MODULE_STREAM* stream = (*_exports.BeginModuleStream)(env, "stream");
+    TEST((*_exports.PushModuleStream)(stream, binary.data(), binary.size()) == ERR_SUCCESS);
+    TEST(stream->m.code.n_funcbody == 4);
+    for(varuint32 i = 0; i < stream->m.code.n_funcbody; ++i)
+    {
+      TEST(stream->m.code.funcbody[i].validated);
+      TEST(!stream->m.code.funcbody[i].errors == (i != 2));
+    }
+    TEST((*_exports.FinishModuleStream)(env, stream) == ERR_SUCCESS);
+    TEST(Validate(env) == ERR_VALIDATION_ERROR);
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  // A module cut short anywhere fails exactly when the same bytes fail to parse as a whole buffer. Cut at a section boundary, both
+  // report the same problem with the module, and cut anywhere else the stream knows it's still waiting for bytes.
+  {
+    std::vector<uint8_t> binary = StreamModule(2);
+    for(size_t size = 1; size < binary.size(); ++size)
+    {
+      std::vector<uint8_t> truncated(binary.begin(), binary.begin() + size);
+      int expected = load(SERIAL, truncated, nullptr).err;
+      for(auto flags : { SERIAL, THREADED })
+      {
+        int err = load(flags, truncated, single).err;
+        TEST((err < 0) == (expected < 0));
+        TEST(err == expected || err == ERR_PARSE_UNEXPECTED_EOF);
+      }
+    }
+  }
+
+  // A bad section header is reported as soon as it arrives, without waiting for the rest of the module
+  {
+    std::vector<uint8_t> binary = StreamModule(2);
+    size_t code = binary.size();
+    std::vector<uint8_t> tail; // Everything after the code section
+    PushSection(tail, WASM_SECTION_DATA, { 1, 0, OP_i32_const, 0, OP_end, 3, 'a', 'b', 'c' });
+    PushSection(tail, WASM_SECTION_CUSTOM, NameSection(2));
+    code -= tail.size();
+
+    std::pair<uint8_t, int> bad[] = { { WASM_SECTION_TYPE, ERR_FATAL_INVALID_WASM_SECTION_ORDER }, { 0x20, ERR_FATAL_UNKNOWN_SECTION } };
+    for(auto& section : bad)
+    {
+      std::vector<uint8_t> broken(binary.begin(), binary.begin() + code);
+      PushSection(broken, section.first, { 0 });
+      broken.insert(broken.end(), tail.begin(), tail.end());
+      TEST(load(SERIAL, broken, nullptr).err == section.second);
+
+      for(auto flags : { SERIAL, THREADED })
+      {
+        Environment* env = CreateEnvironment(flags);
+        __WASM_MODULE_STREAM* stream = (*_exports.BeginModuleStream)(env, "stream");
+        size_t failed = 0;
+        for(size_t i = 0; i < broken.size(); ++i)
+        {
+          int err = (*_exports.PushModuleStream)(stream, &broken[i], 1);
+          if(err < 0 && !failed)
+          {
+            TEST(err == section.second);
+            failed = i;
+          }
+        }
+        TEST(failed == code + 1); // Right after its size
+        TEST((*_exports.FinishModuleStream)(env, stream) == section.second);
+        (*_exports.DestroyEnvironment)(env);
+      }
+    }
+  }
+}
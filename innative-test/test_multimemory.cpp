@@ -0,0 +1,128 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "../innative/tools.h"
+#include "../innative/instruction.h"
+#include <stdio.h>
+
+using namespace innative;
+
+static const char multi_module[] = "(module $multi"
+"\n  (memory $a 1)"
+"\n  (memory $b 1 3)"
+"\n  (func (export \"store_b\") (param i32)"
+"\n    (i32.store $b (i32.const 8) (local.get 0)))"
+"\n  (func (export \"load_a\") (result i32) (i32.load $a (i32.const 8)))"
+"\n  (func (export \"load_b\") (result i32) (i32.load 1 (i32.const 8)))"
+"\n  (func (export \"grow_b\") (result i32) (memory.grow $b (i32.const 1)))"
+"\n  (func (export \"size_a\") (result i32) (memory.size $a)))";
+
+// Two memories, and a function that loads from the second one with the binary memarg encoding
+static const uint8_t multi_binary[] = { 0, 'a', 's', 'm', 1, 0, 0, 0,
+  WASM_SECTION_TYPE, 5, 1, 0x60, 0, 1, 0x7f,
+  WASM_SECTION_FUNCTION, 2, 1, 0,
+  WASM_SECTION_MEMORY, 5, 2, 0, 1, 0, 1,
+  WASM_SECTION_CODE, 10, 1, 8, 0, OP_i32_const, 0, OP_i32_load, 0x40 | 2, 1, 0, OP_end };
+
+void TestHarness::test_multimemory()
+{
+  {
+    Environment* env = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT);
+    TEST(AddModule(env, multi_module, sizeof(multi_module) - 1, "multi") == ERR_SUCCESS);
+    TEST(Validate(env) == ERR_SUCCESS);
+    TEST(!env->errors);
+
+    // Named and numbered references both resolve to the second memory, and loads default to the first one
+    Instruction ins;
+    InstructionCursor store(env->modules[0].code.funcbody[0]);
+    while(store.Next(ins) && ins.opcode != OP_i32_store);
+    TEST(ins.opcode == OP_i32_store && ins.immediates[2]._varuint32 == 1);
+    InstructionCursor load(env->modules[0].code.funcbody[2]);
+    while(load.Next(ins) && ins.opcode != OP_i32_load);
+    TEST(ins.opcode == OP_i32_load && ins.immediates[2]._varuint32 == 1);
+    InstructionCursor size(env->modules[0].code.funcbody[4]);
+    TEST(size.Next(ins) && ins.opcode == OP_memory_size && ins.immediates[0]._varuint32 == 0);
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  {
+    Environment* env = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT);
+    TEST(AddModule(env, multi_binary, sizeof(multi_binary), "binary") == ERR_SUCCESS);
+    TEST(Validate(env) == ERR_SUCCESS);
+    Instruction ins;
+    InstructionCursor cursor(env->modules[0].code.funcbody[0]);
+    while(cursor.Next(ins) && ins.opcode != OP_i32_load);
+    TEST(ins.opcode == OP_i32_load && ins.immediates[0]._varuint32 == 2 && ins.immediates[1]._varuptr == 0 && ins.immediates[2]._varuint32 == 1);
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  // Without the feature, a memory index is a syntax error in text, and the flag bit is just an oversized alignment in binary
+  {
+    Environment* env = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT, ENV_FEATURE_ALL & ~ENV_FEATURE_MULTI_MEMORY);
+    TEST(AddModule(env, multi_module, sizeof(multi_module) - 1, "multi") == ERR_WAT_INVALID_TOKEN);
+    (*_exports.DestroyEnvironment)(env);
+
+    env = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT, ENV_FEATURE_ALL & ~ENV_FEATURE_MULTI_MEMORY);
+    TEST(AddModule(env, multi_binary, sizeof(multi_binary), "binary") == ERR_SUCCESS);
+    TEST(Validate(env) == ERR_VALIDATION_ERROR);
+    TEST(HasError(env->errors, ERR_MULTIPLE_MEMORIES));
+    TEST(HasError(env->errors, ERR_INVALID_MEMORY_ALIGNMENT));
+    (*_exports.DestroyEnvironment)(env);
+
+    const char two[] = "(module $two (memory 1) (memory 1))";
+    env = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT, ENV_FEATURE_ALL & ~ENV_FEATURE_MULTI_MEMORY);
+    TEST(AddModule(env, two, sizeof(two) - 1, "two") == ERR_SUCCESS);
+    TEST(Validate(env) == ERR_VALIDATION_ERROR);
+    TEST(HasError(env->errors, ERR_MULTIPLE_MEMORIES));
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  // Indexes past the last memory are rejected by every memory instruction
+  {
+    const char* bad[] = {
+      "(module $bad (memory 1) (memory 1) (func (drop (i32.load 2 (i32.const 0)))))",
+      "(module $bad (memory 1) (memory 1) (func (i64.store 2 (i32.const 0) (i64.const 0))))",
+      "(module $bad (memory 1) (memory 1) (func (drop (memory.size 2))))",
+      "(module $bad (memory 1) (func (drop (memory.grow 1 (i32.const 1)))))",
+    };
+    for(auto text : bad)
+    {
+      Environment* env = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT);
+      TEST(AddModule(env, text, strlen(text), "bad") == ERR_SUCCESS);
+      TEST(Validate(env) == ERR_VALIDATION_ERROR);
+      TEST(HasError(env->errors, ERR_INVALID_MEMORY_INDEX));
+      (*_exports.DestroyEnvironment)(env);
+    }
+  }
+
+  // Writes to the second memory don't touch the first, and each memory grows on its own
+  {
+    static const char* file = "test_multimemory" IR_LIBRARY_EXTENSION;
+    Environment* env = CreateEnvironment(ENV_LIBRARY);
+    TEST(AddModule(env, multi_module, sizeof(multi_module) - 1, "multi") == ERR_SUCCESS);
+    void* assembly = CompileLibrary(env, file);
+    (*_exports.DestroyEnvironment)(env);
+    TEST(assembly != nullptr);
+
+    auto store_b = !assembly ? nullptr : reinterpret_cast<void(*)(int32_t)>((*_exports.LoadFunction)(assembly, "multi", "store_b"));
+    auto load_a = !assembly ? nullptr : reinterpret_cast<int32_t(*)()>((*_exports.LoadFunction)(assembly, "multi", "load_a"));
+    auto load_b = !assembly ? nullptr : reinterpret_cast<int32_t(*)()>((*_exports.LoadFunction)(assembly, "multi", "load_b"));
+    auto grow_b = !assembly ? nullptr : reinterpret_cast<int32_t(*)()>((*_exports.LoadFunction)(assembly, "multi", "grow_b"));
+    auto size_a = !assembly ? nullptr : reinterpret_cast<int32_t(*)()>((*_exports.LoadFunction)(assembly, "multi", "size_a"));
+    TEST(store_b && load_a && load_b && grow_b && size_a);
+    if(store_b && load_a && load_b && grow_b && size_a)
+    {
+      (*store_b)(1234);
+      TEST((*load_b)() == 1234);
+      TEST((*load_a)() == 0);
+      TEST((*grow_b)() == 1);
+      TEST((*grow_b)() == 2);
+      TEST((*grow_b)() == -1);
+      TEST((*size_a)() == 1);
+      TEST((*load_b)() == 1234);
+    }
+
+    remove(file);
+  }
+}
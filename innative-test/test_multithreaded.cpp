@@ -0,0 +1,136 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "../innative/tools.h"
+#include "../innative/instruction.h"
+#include <algorithm>
+
+using namespace innative;
+
+// Builds a text module with n functions that each add a global to their parameter and pass it on to the next one. Each function listed
+// in invalid adds an i64 instead, so it parses but fails validation. Each function listed in replaced gets that body instead, and
+// fields is added after the functions.
+static std::string TextModule(int n, std::vector<int> invalid = {}, std::vector<std::pair<int, std::string>> replaced = {},
+  std::string fields = "")
+{
+  std::string text = "(module $par\n  (global $g i32 (i32.const 5))\n  (export \"f0\" (func $f0))";
+  for(int i = 0; i < n; ++i)
+  {
+    std::string value = std::find(invalid.begin(), invalid.end(), i) != invalid.end() ? "(i64.const 1)" : "(global.get $g)";
+    std::string sum = "(i32.add (local.get $p) " + value + ")";
+    text += "\n  (func $f" + std::to_string(i) + " (param $p i32) (result i32) (local $l i32)";
+    auto body = std::find_if(replaced.begin(), replaced.end(), [i](const std::pair<int, std::string>& r) { return r.first == i; });
+    if(body != replaced.end())
+      text += " " + body->second + ")";
+    else
+      text += (i + 1 < n) ? " (call $f" + std::to_string(i + 1) + " " + sum + "))" : " " + sum + ")";
+  }
+  return text + fields + ")";
+}
+
+// The same as TextModule, but as a binary without names or an export. Each body listed in malformed has an opcode that doesn't exist, so the
+// module fails to parse.
+static std::vector<uint8_t> BinaryModule(uint32_t n, std::vector<int> invalid = {}, std::vector<int> malformed = {})
+{
+  std::vector<uint8_t> out = { 0, 'a', 's', 'm', 1, 0, 0, 0 };
+  PushSection(out, WASM_SECTION_TYPE, { 1, 0x60, 1, 0x7f, 1, 0x7f });
+
+  std::vector<uint8_t> functions;
+  PushLEB(functions, n);
+  functions.insert(functions.end(), n, 0);
+  PushSection(out, WASM_SECTION_FUNCTION, functions);
+  PushSection(out, WASM_SECTION_GLOBAL, { 1, 0x7f, 0, OP_i32_const, 5, OP_end });
+
+  std::vector<uint8_t> code;
+  PushLEB(code, n);
+  for(uint32_t i = 0; i < n; ++i)
+  {
+    uint8_t value = OP_global_get;
+    if(std::find(invalid.begin(), invalid.end(), (int)i) != invalid.end())
+      value = OP_i64_const;
+    if(std::find(malformed.begin(), malformed.end(), (int)i) != malformed.end())
+      value = 0xff;
+
+    std::vector<uint8_t> body = { 0, OP_local_get, 0, value, 0, OP_i32_add };
+    if(i + 1 < n)
+    {
+      body.push_back(OP_call);
+      PushLEB(body, i + 1);
+    }
+    body.push_back(OP_end);
+    PushLEB(code, (uint32_t)body.size());
+    code.insert(code.end(), body.begin(), body.end());
+  }
+  PushSection(out, WASM_SECTION_CODE, code);
+  return out;
+}
+
+void TestHarness::test_multithreaded()
+{
+  static const uint64_t SERIAL = ENV_LIBRARY | ENV_NO_INIT;
+  static const uint64_t THREADED = ENV_LIBRARY | ENV_NO_INIT | ENV_MULTITHREADED;
+
+  auto load = [this](uint64_t flags, const void* data, size_t size) {
+    Environment* env = CreateEnvironment(flags);
+    LoadResult r = GetLoadResult(env, AddModule(env, data, size, "par"));
+    (*_exports.DestroyEnvironment)(env);
+    return r;
+  };
+
+  // Bodies are validated in batches of 64, so there are enough of them to need several batches, with errors in more than one
+  std::vector<int> invalid[] = { {}, {}, { 0, 63, 64, 150, 199 } };
+  int counts[] = { 3, 200, 200 };
+  for(int i = 0; i < 3; ++i)
+  {
+    std::string text = TextModule(counts[i], invalid[i]);
+    LoadResult serial = load(SERIAL, text.data(), text.size());
+    TEST(serial.err == ERR_SUCCESS);
+    TEST(!serial.text.empty());
+    TEST(serial.validate == (invalid[i].empty() ? ERR_SUCCESS : ERR_VALIDATION_ERROR));
+    TEST(serial.errors.size() == invalid[i].size());
+    TEST(load(THREADED, text.data(), text.size()) == serial);
+  }
+
+  // Text bodies are parsed in batches once the main pass has numbered everything. Whatever fails first in the source is reported,
+  // even if the main pass fails in a later field before the bodies are parsed.
+  {
+    const std::string label = "(br $nowhere)";
+    const std::string local = "(local.get $nowhere)";
+    const std::string import = "\n  (import \"env\" \"late\" (func))"; // Imports have to come first
+    std::pair<std::string, int> broken[] = {
+      { TextModule(200, {}, { { 130, label } }), ERR_WAT_EXPECTED_VAR },
+      { TextModule(200, {}, { { 70, label }, { 140, local } }), ERR_WAT_EXPECTED_VAR },
+      { TextModule(200, {}, { { 70, local }, { 140, label } }), ERR_WAT_INVALID_LOCAL },
+      { TextModule(200, {}, {}, import), ERR_WAT_INVALID_IMPORT_ORDER },
+      { TextModule(200, {}, { { 199, local } }, import), ERR_WAT_INVALID_LOCAL },
+      { TextModule(200, { 5 }, { { 0, label } }, import), ERR_WAT_EXPECTED_VAR },
+    };
+    for(auto& module : broken)
+    {
+      LoadResult serial = load(SERIAL, module.first.data(), module.first.size());
+      TEST(serial.err == module.second);
+      TEST(load(THREADED, module.first.data(), module.first.size()) == serial);
+    }
+  }
+
+  // Binary bodies are decoded and validated in batches of 64 while the module is parsed, which has to give the same results
+  for(int i = 0; i < 3; ++i)
+  {
+    std::vector<uint8_t> binary = BinaryModule(counts[i], invalid[i]);
+    LoadResult serial = load(SERIAL, binary.data(), binary.size());
+    TEST(serial.err == ERR_SUCCESS);
+    TEST(serial.validate == (invalid[i].empty() ? ERR_SUCCESS : ERR_VALIDATION_ERROR));
+    TEST(serial.errors.size() == invalid[i].size());
+    TEST(load(THREADED, binary.data(), binary.size()) == serial);
+  }
+
+  // A body that can't be decoded stops the parse, no matter which batch it's in or how many other bodies fail
+  for(auto& malformed : std::vector<std::vector<int>>{ { 0 }, { 130 }, { 70, 140 }, { 199 } })
+  {
+    std::vector<uint8_t> binary = BinaryModule(200, { 10, 150 }, malformed);
+    LoadResult serial = load(SERIAL, binary.data(), binary.size());
+    TEST(serial.err == ERR_FATAL_UNKNOWN_INSTRUCTION);
+    TEST(load(THREADED, binary.data(), binary.size()) == serial);
+  }
+}
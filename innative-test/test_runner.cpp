@@ -0,0 +1,50 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "runner.h"
+#include <algorithm>
+
+static TestOptions Parse(const std::vector<std::string>& args)
+{
+  std::vector<const char*> argv;
+  for(auto& arg : args)
+    argv.push_back(arg.c_str());
+  return ParseTestOptions((int)argv.size(), argv.data());
+}
+
+void TestHarness::test_runner()
+{
+  TestOptions defaults = Parse({ "innative-test" });
+  TEST(defaults.jobs == 1 && defaults.json == nullptr && !defaults.internal && !defaults.benchmark);
+  TEST(defaults.timeout == 600);
+  TEST(defaults.worker == -1 && defaults.files.empty());
+  TEST(defaults.flags == (ENV_LIBRARY | ENV_DEBUG | ENV_EMIT_LLVM | ENV_STRICT | ENV_HOMOGENIZE_FUNCTIONS));
+
+  // Options don't depend on where they're given, and anything that isn't one is the name of a script to run
+  for(auto& args : std::vector<std::vector<std::string>>{ { "innative-test", "-flags=5", "a.wast", "-jobs=3", "-json=out.json", "-INTERNAL" },
+        { "innative-test", "-INTERNAL", "-json=out.json", "-jobs=3", "a.wast", "-flags=5" } })
+  {
+    TestOptions options = Parse(args);
+    TEST(options.flags == 5 && options.jobs == 3 && options.internal && !options.benchmark);
+    TEST(options.json != nullptr && !strcmp(options.json, "out.json"));
+    TEST(options.files.size() == 1 && !strcmp(options.files[0], "a.wast"));
+  }
+  TEST(Parse({ "innative-test", "-jobs" }).jobs == 0);
+  TEST(Parse({ "innative-test", "-timeout=30" }).timeout == 30);
+  TEST(Parse({ "innative-test", "-timeout=0" }).timeout == 0);
+
+#ifdef IR_PLATFORM_POSIX
+  // A worker's result pipe comes before its flags on the command line, and it must still run with the flags it was started with
+  uint64_t flags = ENV_LIBRARY | ENV_NO_INIT | ENV_MULTITHREADED | (1ULL << 40);
+  TestOptions worker = Parse(WorkerArgs("innative-test", 7, flags));
+  TEST(worker.worker == 7);
+  TEST(worker.flags == flags);
+  TEST(worker.files.empty());
+
+  auto args = WorkerArgs("innative-test", 7, flags);
+  std::reverse(args.begin() + 1, args.end());
+  worker = Parse(args);
+  TEST(worker.worker == 7 && worker.flags == flags);
+#endif
+}
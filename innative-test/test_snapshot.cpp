@@ -0,0 +1,136 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "../innative/tools.h"
+#include "../innative/util.h"
+#include <stdio.h>
+
+using namespace innative;
+
+static const char snapshot_module[] = "(module $snap"
+"\n  (memory (export \"mem\") 1 4)"
+"\n  (global $g (export \"g\") (mut i32) (i32.const 1))"
+"\n  (global $h (export \"h\") (mut i64) (i64.const 2))"
+"\n  (global $f (export \"f\") (mut f64) (f64.const 0.5))"
+"\n  (table (export \"tab\") 3 anyfunc)"
+"\n  (elem (i32.const 1) $seven $eight)"
+"\n  (data (i32.const 16) \"abc\")"
+"\n  (data (i32.const 9000) \"\\01\\00\\00\\00\\00\\02\")"
+"\n  (func $seven (result i32) (i32.const 7))"
+"\n  (func $eight (result i32) (i32.const 8))"
+"\n  (func $start"
+"\n    (i32.store (i32.const 20000) (i32.const 0x12345678))"
+"\n    (drop (memory.grow (i32.const 1)))"
+"\n    (i32.store (i32.const 70000) (i32.const 99))"
+"\n    (global.set $g (i32.const 42))"
+"\n    (global.set $h (i64.const -5))"
+"\n    (global.set $f (f64.const 2.25)))"
+"\n  (start $start))";
+
+void TestHarness::test_snapshot()
+{
+  // Data segments are replaced by the snapshot, so one aimed at an imported memory must be refused before anything is compiled
+  {
+    const char importer[] = "(module $importer (import \"snap\" \"mem\" (memory 1)) (data (i32.const 0) \"x\"))";
+    Environment* env = CreateEnvironment(ENV_LIBRARY);
+    TEST(AddModule(env, snapshot_module, sizeof(snapshot_module) - 1, "snap") == ERR_SUCCESS);
+    TEST(AddModule(env, importer, sizeof(importer) - 1, "importer") == ERR_SUCCESS);
+    TEST(SnapshotEnvironment(env, "test_snapshot_scratch" IR_LIBRARY_EXTENSION) == ERR_INVALID_DATA_SEGMENT);
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  // The scratch compile must leave the real environment alone, whether or not it succeeds
+  {
+    Environment* env = CreateEnvironment(ENV_LIBRARY);
+    TEST(AddModule(env, snapshot_module, sizeof(snapshot_module) - 1, "snap") == ERR_SUCCESS);
+    varuint32 n_exports = env->modules[0].exportsection.n_exports;
+    Export* exports = env->modules[0].exportsection.exports;
+    SnapshotEnvironment(env, "test_snapshot_scratch" IR_LIBRARY_EXTENSION);
+    remove("test_snapshot_scratch" IR_LIBRARY_EXTENSION);
+    TEST(kh_size(env->modulemap) == 0);
+    TEST(env->modules[0].exportsection.n_exports == n_exports);
+    TEST(env->modules[0].exportsection.exports == exports);
+
+    // Snapshot export names are interned, like the names of every other export
+    Identifier name((uint8_t*)"_innative_snapshot_memory#0", 27);
+    TEST(utility::FindIdentifier(*env, name));
+    TEST(Validate(env) == ERR_SUCCESS);
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  // A snapshotted binary must start in exactly the state that running init produces
+  {
+    static const char* expected_file = "test_snapshot_init" IR_LIBRARY_EXTENSION;
+    static const char* snapshot_file = "test_snapshot" IR_LIBRARY_EXTENSION;
+    Environment* env = CreateEnvironment(ENV_LIBRARY);
+    TEST(AddModule(env, snapshot_module, sizeof(snapshot_module) - 1, "snap") == ERR_SUCCESS);
+    void* expected = CompileLibrary(env, expected_file);
+    (*_exports.DestroyEnvironment)(env);
+    TEST(expected != nullptr);
+
+    env = CreateEnvironment(ENV_LIBRARY);
+    TEST(AddModule(env, snapshot_module, sizeof(snapshot_module) - 1, "snap") == ERR_SUCCESS);
+    int err = SnapshotEnvironment(env, "test_snapshot_scratch" IR_LIBRARY_EXTENSION);
+    remove("test_snapshot_scratch" IR_LIBRARY_EXTENSION);
+    TEST(err == ERR_SUCCESS);
+    void* snapshot = (err < 0) ? nullptr : CompileLibrary(env, snapshot_file);
+    (*_exports.DestroyEnvironment)(env);
+    TEST(snapshot != nullptr);
+
+    if(expected && snapshot)
+    {
+      IRGlobal* mem[2] = { (*_exports.LoadGlobal)(expected, "snap", "mem"), (*_exports.LoadGlobal)(snapshot, "snap", "mem") };
+      TEST(mem[0] && mem[0]->memory && mem[1] && mem[1]->memory);
+      if(mem[0] && mem[0]->memory && mem[1] && mem[1]->memory)
+      {
+        uint64_t size = ((uint64_t*)mem[0]->memory)[-1];
+        TEST(size == 2 * 65536);
+        TEST(((uint64_t*)mem[1]->memory)[-1] == size);
+        TEST(!memcmp(mem[0]->memory, mem[1]->memory, size));
+      }
+
+      std::pair<const char*, size_t> globals[] = { { "g", sizeof(uint32_t) }, { "h", sizeof(uint64_t) }, { "f", sizeof(double) } };
+      for(auto& global : globals)
+      {
+        IRGlobal* g[2] = { (*_exports.LoadGlobal)(expected, "snap", global.first), (*_exports.LoadGlobal)(snapshot, "snap", global.first) };
+        TEST(g[0] && g[1] && !memcmp(g[0], g[1], global.second));
+      }
+
+      // Function pointers differ between the two libraries, so compare what each table entry points to
+      for(varuint32 i = 0; i < 3; ++i)
+      {
+        auto a = reinterpret_cast<int32_t(*)()>(LoadTable(expected, "snap", "tab", i));
+        auto b = reinterpret_cast<int32_t(*)()>(LoadTable(snapshot, "snap", "tab", i));
+        TEST(!a == !b);
+        if(a && b)
+          TEST((*a)() == (*b)());
+      }
+    }
+
+    remove(expected_file);
+    remove(snapshot_file);
+  }
+  // A start function that traps must come back as an error instead of taking the compiler down with it
+  {
+    const char trapping[] = "(module $trap (func $start unreachable) (start $start))";
+    Environment* env = CreateEnvironment(ENV_LIBRARY);
+    TEST(AddModule(env, trapping, sizeof(trapping) - 1, "trap") == ERR_SUCCESS);
+    TEST(SnapshotEnvironment(env, "test_snapshot_scratch" IR_LIBRARY_EXTENSION) == ERR_RUNTIME_TRAP);
+    remove("test_snapshot_scratch" IR_LIBRARY_EXTENSION);
+    TEST(env->modules[0].knownsections & (1 << WASM_SECTION_START));
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+#ifdef IR_PLATFORM_POSIX
+  // Only POSIX runs the start functions in a child process, so only there can one that never returns be stopped
+  {
+    const char looping[] = "(module $loop (func $start (loop (br 0))) (start $start))";
+    Environment* env = CreateEnvironment(ENV_LIBRARY);
+    TEST(AddModule(env, looping, sizeof(looping) - 1, "loop") == ERR_SUCCESS);
+    TEST(SnapshotEnvironment(env, "test_snapshot_scratch" IR_LIBRARY_EXTENSION, 1) == ERR_RUNTIME_INIT_ERROR);
+    remove("test_snapshot_scratch" IR_LIBRARY_EXTENSION);
+    (*_exports.DestroyEnvironment)(env);
+  }
+#endif
+}
@@ -49,4 +49,31 @@ void TestHarness::test_stream()
   s.pos = 15;
   TEST(!s.End());
   TEST(s.ReadVarUInt32(err) == 9);
+
+  // The same encodings are decoded near the end of a buffer and with a whole word left, which take different paths
+  uint8_t leb[] = { 0x7F, 0xE5, 0x8E, 0x26, 0xC0, 0xBB, 0x78, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01,
+                    0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 0, 0, 0, 0, 0, 0, 0, 0 };
+  for(size_t end : { (size_t)22, sizeof(leb) })
+  {
+    s = { leb, end, 0 };
+    TEST(s.ReadVarInt32(err) == -1 && err == ERR_SUCCESS);
+    TEST(s.ReadVarUInt32(err) == 624485 && err == ERR_SUCCESS);
+    TEST(s.ReadVarInt64(err) == -123456 && err == ERR_SUCCESS);
+    TEST(s.ReadVarUInt64(err) == 0x8000000000000000ULL && err == ERR_SUCCESS);
+    TEST(s.ReadVarUInt32(err) == 0xFFFFFFFF && err == ERR_SUCCESS);
+    TEST(s.pos == 22);
+  }
+
+  uint8_t overlong[] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0, 0, 0 };
+  s = { overlong, sizeof(overlong), 0 };
+  s.ReadVarUInt32(err);
+  TEST(err == ERR_FATAL_OVERLONG_ENCODING);
+  uint8_t invalid[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x1F };
+  s = { invalid, sizeof(invalid), 0 };
+  s.ReadVarUInt32(err);
+  TEST(err == ERR_FATAL_INVALID_ENCODING);
+  uint8_t truncated[] = { 0x80, 0x80 };
+  s = { truncated, sizeof(truncated), 0 };
+  s.ReadVarUInt32(err);
+  TEST(err == ERR_PARSE_UNEXPECTED_EOF);
 }
\ No newline at end of file
@@ -0,0 +1,84 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "../innative/tools.h"
+#include <stdio.h>
+
+using namespace innative;
+
+// Mirrors the layout of a table entry in compiled code
+struct TableEntry
+{
+  IR_Entrypoint func;
+  uint32_t type;
+};
+
+static const char base_module[] = "(module $base"
+"\n  (table (export \"tab\") 8 anyfunc)"
+"\n  (global (export \"off\") i32 (i32.const 3)))";
+
+static const char own_module[] = "(module $own"
+"\n  (table (export \"tab\") 4 anyfunc)"
+"\n  (elem (i32.const 1) $a $a)"
+"\n  (func $a (result i32) (i32.const 10)))";
+
+// The first segment has a constant offset and is emitted as a static image, while the second depends on an imported global and has to
+// fall back to storing each element. Both write the same functions into the same imported table, so their entries must be identical.
+static const char user_module[] = "(module $user"
+"\n  (import \"base\" \"tab\" (table 8 anyfunc))"
+"\n  (import \"base\" \"off\" (global i32))"
+"\n  (type $r (func (result i32)))"
+"\n  (elem (i32.const 0) $one $two $three)"
+"\n  (elem (global.get 0) $one $two $three)"
+"\n  (func $one (result i32) (i32.const 1))"
+"\n  (func $two (result i32) (i32.const 2))"
+"\n  (func $three (result i32) (i32.const 3))"
+"\n  (func (export \"call\") (param i32) (result i32) (call_indirect (type $r) (local.get 0))))";
+
+void TestHarness::test_table()
+{
+  static const char* file = "test_table" IR_LIBRARY_EXTENSION;
+  Environment* env = CreateEnvironment(ENV_LIBRARY);
+  TEST(AddModule(env, base_module, sizeof(base_module) - 1, "base") == ERR_SUCCESS);
+  TEST(AddModule(env, user_module, sizeof(user_module) - 1, "user") == ERR_SUCCESS);
+  TEST(AddModule(env, own_module, sizeof(own_module) - 1, "own") == ERR_SUCCESS);
+  void* assembly = CompileLibrary(env, file);
+  (*_exports.DestroyEnvironment)(env);
+  TEST(assembly != nullptr);
+
+  if(assembly)
+  {
+    IRGlobal* tab = (*_exports.LoadGlobal)(assembly, "base", "tab");
+    TEST(tab && tab->memory);
+    if(tab && tab->memory)
+    {
+      TEST(((uint64_t*)tab->memory)[-1] == 8 * sizeof(TableEntry));
+      const TableEntry* entries = (const TableEntry*)tab->memory;
+      for(int i = 0; i < 3; ++i)
+      {
+        TEST(entries[i].func != nullptr);
+        TEST(entries[i].func == entries[i + 3].func);
+        TEST(entries[i].type == entries[i + 3].type);
+      }
+      TEST(entries[6].func == nullptr && entries[7].func == nullptr);
+    }
+
+    auto call = reinterpret_cast<int32_t(*)(int32_t)>((*_exports.LoadFunction)(assembly, "user", "call"));
+    TEST(call != nullptr);
+    if(call)
+    {
+      for(int32_t i = 0; i < 6; ++i)
+        TEST((*call)(i) == (i % 3) + 1);
+    }
+
+    // A constant segment in a table the module defines itself
+    TEST(LoadTable(assembly, "own", "tab", 0) == nullptr);
+    TEST(LoadTable(assembly, "own", "tab", 1) != nullptr);
+    TEST(LoadTable(assembly, "own", "tab", 1) == LoadTable(assembly, "own", "tab", 2));
+    TEST(LoadTable(assembly, "own", "tab", 3) == nullptr);
+    TEST(LoadTable(assembly, "own", "tab", 4) == nullptr);
+  }
+
+  remove(file);
+}
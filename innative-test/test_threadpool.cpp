@@ -0,0 +1,82 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "../innative/threadpool.h"
+
+void TestHarness::test_threadpool()
+{
+  {
+    __WASM_THREADPOOL pool(4);
+    auto f = pool.Submit([]() { return 5; });
+    TEST(f.get() == 5);
+
+    // Tasks can submit more tasks, and Wait helps run them until the predicate is satisfied
+    int count = 0;
+    for(int i = 0; i < 100; ++i)
+      pool.Submit([&pool, &count]() {
+        pool.Submit([&pool, &count]() { std::lock_guard<std::mutex> l(pool.lock); ++count; });
+        std::lock_guard<std::mutex> l(pool.lock);
+        ++count;
+      });
+    pool.Wait([&count]() { return count == 200; });
+    TEST(count == 200);
+  }
+
+  {
+    // A single thread pool can't deadlock when a task waits on other tasks, because the waiting task runs them
+    __WASM_THREADPOOL pool(1);
+    bool ran = false;
+    auto f = pool.Submit([&pool, &ran]() {
+      pool.Submit([&pool, &ran]() { std::lock_guard<std::mutex> l(pool.lock); ran = true; });
+      pool.Wait([&ran]() { return ran; });
+      return ran;
+    });
+    TEST(f.get());
+  }
+
+  {
+    // A task waiting on work that's queued from outside the pool after it went to sleep has to wake up and run it, because its thread
+    // is the only one that can
+    __WASM_THREADPOOL pool(1);
+    bool ran = false;
+    std::atomic<bool> waiting(false);
+    auto f = pool.Submit([&pool, &ran, &waiting]() {
+      waiting.store(true);
+      pool.Wait([&ran]() { return ran; });
+    });
+    while(!waiting.load())
+      std::this_thread::yield();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20)); // Give it time to go to sleep
+    pool.Submit([&pool, &ran]() { std::lock_guard<std::mutex> l(pool.lock); ran = true; });
+
+    bool woke = f.wait_for(std::chrono::seconds(10)) == std::future_status::ready;
+    TEST(woke);
+    if(!woke) // Let the waiting task finish anyway, so destroying the pool doesn't hang
+    {
+      {
+        std::lock_guard<std::mutex> l(pool.lock);
+        ran = true;
+      }
+      pool.done.notify_all();
+    }
+  }
+
+  {
+    // Destroying the pool finishes everything that was queued
+    std::atomic<int> count(0);
+    {
+      __WASM_THREADPOOL pool(2);
+      for(int i = 0; i < 50; ++i)
+        pool.Submit([&count]() { count.fetch_add(1); });
+    }
+    TEST(count.load() == 50);
+  }
+
+  {
+    // Nothing runs until something is submitted, and waiting on a satisfied predicate returns immediately
+    __WASM_THREADPOOL pool(0);
+    pool.Wait([]() { return true; });
+    TEST(!pool.RunOne());
+  }
+}
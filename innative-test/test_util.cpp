@@ -3,11 +3,17 @@
 
 #include "test.h"
 #include "../innative/util.h"
+#include "../innative/tools.h"
 #include <functional>
 
 using namespace innative;
 using namespace utility;
 
+extern "C" {
+  extern void* _innative_internal_env_grow_memory(void* p, uint64_t i, uint64_t max);
+  extern void _innative_internal_env_free_memory(void* p);
+}
+
 void TestHarness::test_util()
 {
   {
@@ -118,6 +124,95 @@ void TestHarness::test_util()
     TEST(ModuleHasSection(m, 1));
   }
 
+  {
+    char* mem = (char*)_innative_internal_env_grow_memory(0, 65536, 65536 * 4);
+    TEST(mem != 0);
+    mem[5] = 1;
+    int image = SaveMemoryImage(mem, 65536);
+    TEST(mem[5] == 1);
+    mem[5] = 2;
+    mem[70] = 3;
+    TEST(_innative_internal_env_grow_memory(mem, 65536, 65536 * 4) == mem);
+    mem[65536] = 4;
+
+    if(image >= 0)
+    {
+      ResetMemoryImage(image, mem, 65536);
+      TEST(mem[5] == 1);
+      TEST(!mem[70]);
+      FreeMemoryImage(image);
+    }
+
+    DecommitMemory(mem + 65536, 65536);
+    reinterpret_cast<uint64_t*>(mem)[-1] = 65536;
+    TEST(_innative_internal_env_grow_memory(mem, 65536, 65536 * 4) == mem);
+    TEST(!mem[65536]); // Decommitted pages come back zeroed
+    _innative_internal_env_free_memory(mem);
+  }
+
+  {
+    FILE* f = nullptr;
+    FOPEN(f, "mapfile.tmp", "wb");
+    TEST(f != nullptr);
+    if(f)
+    {
+      fwrite("mapped", 1, 6, f);
+      fclose(f);
+    }
+
+    uint64_t size = 0;
+    void* p = MapFile("mapfile.tmp", size);
+    TEST(p != nullptr);
+    TEST(size == 6);
+    if(p)
+    {
+      TEST(!memcmp(p, "mapped", 6));
+      UnmapFile(p, size);
+    }
+    remove("mapfile.tmp");
+    TEST(!MapFile("mapfile.tmp", size));
+  }
+
+  {
+    Environment env = { 0 };
+    env.alloc = new __WASM_ALLOCATOR();
+    env.symbols = CreateSymbols();
+    char first[] = "memory";
+    char second[] = "memory";
+    Identifier a((uint8_t*)first, 6);
+    Identifier b((uint8_t*)second, 6);
+    Identifier c((uint8_t*)second, 3);
+    TEST(!FindIdentifier(env, a));
+    TEST(InternIdentifier(env, a) == ERR_SUCCESS);
+    TEST(a.get() != (uint8_t*)first);
+    TEST(!strcmp(a.str(), "memory"));
+    TEST(FindIdentifier(env, b));
+    TEST(a.get() == b.get());
+    TEST(InternIdentifier(env, c) == ERR_SUCCESS);
+    TEST(c.get() != a.get() && c.size() == 3);
+    TEST(internal::HashBytes("func1", 5) != internal::HashBytes("func2", 5));
+    TEST(internal::__ac_hash_string_pair("a\0b") != internal::__ac_hash_string_pair("a\0c"));
+    DestroySymbols(env.symbols);
+    delete env.alloc;
+  }
+
+  // Modules are found by pointer, so a name replaced after parsing has to be interned again before imports can resolve to it
+  {
+    const char exporter[] = "(module $a (func (export \"f\")))";
+    const char importer[] = "(module $b (import \"a\" \"f\" (func)))";
+    Environment* env = CreateEnvironment(ENV_LIBRARY | ENV_NO_INIT);
+    TEST(AddModule(env, exporter, sizeof(exporter) - 1, "a") == ERR_SUCCESS);
+    TEST(AddModule(env, importer, sizeof(importer) - 1, "b") == ERR_SUCCESS);
+    const uint8_t* interned = env->modules[0].name.get();
+    Identifier& name = env->modules[0].name;
+    name.resize(1, true, *env);
+    tmemcpy((char*)name.get(), name.size(), "a", 1);
+    TEST(name.get() != interned);
+    TEST(Validate(env) == ERR_SUCCESS);
+    TEST(name.get() == interned);
+    (*_exports.DestroyEnvironment)(env);
+  }
+
   TEST(StrFormat("%i", 3) == "3");
   uintcpuinfo info = { 0 };
   GetCPUInfo(info, 0);
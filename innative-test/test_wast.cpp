@@ -0,0 +1,53 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+
+// $a is loaded on its own before $b is defined, so $b has to link against a library that's already loaded, and then re-exports what it
+// imported to $c, which is loaded later still. Memory written through $a must still be there when $b reads it.
+static const char wast_script[] = "(module $a"
+"\n  (memory (export \"mem\") 1)"
+"\n  (global (export \"g\") i32 (i32.const 7))"
+"\n  (func (export \"f\") (result i32) (i32.const 42))"
+"\n  (func (export \"store\") (param i32) (i32.store (i32.const 0) (local.get 0))))"
+"\n(register \"a\" $a)"
+"\n(invoke $a \"store\" (i32.const 5))"
+"\n(module $b"
+"\n  (import \"a\" \"f\" (func $f (result i32)))"
+"\n  (import \"a\" \"mem\" (memory 1))"
+"\n  (import \"a\" \"g\" (global $g i32))"
+"\n  (export \"f\" (func $f))"
+"\n  (export \"g\" (global $g))"
+"\n  (func (export \"load\") (result i32) (i32.load (i32.const 0))))"
+"\n(register \"b\" $b)"
+"\n(assert_return (invoke $b \"f\") (i32.const 42))"
+"\n(assert_return (invoke $b \"load\") (i32.const 5))"
+"\n(assert_return (get $b \"g\") (i32.const 7))"
+"\n(module $c"
+"\n  (import \"b\" \"f\" (func $f (result i32)))"
+"\n  (import \"b\" \"g\" (global $g i32))"
+"\n  (func (export \"sum\") (result i32) (i32.add (call $f) (global.get $g))))"
+"\n(assert_return (invoke $c \"sum\") (i32.const 49))"
+"\n(invoke $a \"store\" (i32.const 9))"
+"\n(assert_return (invoke $b \"load\") (i32.const 9))";
+
+static int wast_loads = 0;
+
+void TestHarness::test_wast()
+{
+  wast_loads = 0;
+  Environment* env = CreateEnvironment(ENV_LIBRARY);
+  env->wasthook = [](void*) { ++wast_loads; };
+  int err = innative_compile_script(reinterpret_cast<const uint8_t*>(wast_script), sizeof(wast_script) - 1, env, true);
+  TEST(err == ERR_SUCCESS);
+  TEST(env->errors == nullptr);
+  for(ValidationError* cur = env->errors; cur != nullptr; cur = cur->next)
+    fprintf(_target, "%s\n", cur->error);
+  (*_exports.DestroyEnvironment)(env);
+
+#ifdef IR_PLATFORM_POSIX
+  TEST(wast_loads == 3); // Each module is compiled once, into its own library
+#else
+  TEST(wast_loads >= 3); // Importing data from a loaded DLL relinks everything
+#endif
+}
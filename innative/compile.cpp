@@ -7,6 +7,8 @@
 #include "util.h"
 #include "validate.h"
 #include "optimize.h"
+#include "parse.h"
+#include "instruction.h"
 #include "innative/export.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/raw_ostream.h"
@@ -20,6 +22,7 @@
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Vectorize.h"
 #include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/IPO.h"
@@ -34,6 +37,7 @@
 #include "llvm/Analysis/PostDominators.h"
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
 #pragma warning(pop)
 
 using namespace innative;
@@ -250,6 +254,65 @@ Func* WrapFunction(Func* fn, const Twine& name, code::Context& context, llvm::Gl
   return wrap;
 }
 
+// Generates an IR_Invoke thunk, which calls fn once for each tuple of arguments in an IRValue array and writes each result to another
+Func* InvokeFunction(Func* fn, const Twine& name, code::Context& context)
+{
+  llvm::IRBuilder<> builder(context.context); // Deliberately avoids the debug location of the shared builder
+  auto slot = builder.getInt64Ty(); // Every IRValue is 8 bytes
+  Func* invoke = Func::Create(FuncTy::get(builder.getVoidTy(), { slot->getPointerTo(0), slot->getPointerTo(0), builder.getInt64Ty() }, false), Func::ExternalLinkage, name, context.llvm);
+  invoke->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+
+  auto args = invoke->arg_begin();
+  auto results = args + 1;
+  auto count = args + 2;
+  BB* entry = BB::Create(context.context, "entry", invoke);
+  BB* loop = BB::Create(context.context, "invoke_loop", invoke);
+  BB* exit = BB::Create(context.context, "invoke_exit", invoke);
+
+  builder.SetInsertPoint(entry);
+  builder.CreateCondBr(builder.CreateICmpEQ(count, builder.getInt64(0)), exit, loop);
+
+  builder.SetInsertPoint(loop);
+  auto i = builder.CreatePHI(builder.getInt64Ty(), 2);
+  i->addIncoming(builder.getInt64(0), entry);
+
+  vector<llvmVal*> values;
+  auto params = fn->getFunctionType()->params();
+  llvmVal* base = builder.CreateInBoundsGEP(args, builder.CreateMul(i, builder.getInt64(params.size())));
+  for(size_t j = 0; j < params.size(); ++j)
+    values.push_back(builder.CreateLoad(builder.CreatePointerCast(builder.CreateConstInBoundsGEP1_64(base, j), params[j]->getPointerTo(0))));
+
+  CallInst* call = builder.CreateCall(fn, values);
+  call->setCallingConv(fn->getCallingConv());
+  call->setAttributes(fn->getAttributes());
+  if(!fn->getReturnType()->isVoidTy())
+    builder.CreateStore(call, builder.CreatePointerCast(builder.CreateInBoundsGEP(results, i), fn->getReturnType()->getPointerTo(0)));
+
+  auto next = builder.CreateAdd(i, builder.getInt64(1));
+  i->addIncoming(next, loop);
+  builder.CreateCondBr(builder.CreateICmpULT(next, count), loop, exit);
+
+  builder.SetInsertPoint(exit);
+  builder.CreateRetVoid();
+  return invoke;
+}
+
+// Emits a function signature as the 32-bit parameter and return counts, followed by the parameter types and then the return types
+llvm::GlobalVariable* SignatureGlobal(FunctionType& sig, const Twine& name, code::Context& context)
+{
+  vector<uint8_t> types;
+  types.insert(types.end(), (uint8_t*)sig.params, (uint8_t*)sig.params + sig.n_params);
+  types.insert(types.end(), (uint8_t*)sig.returns, (uint8_t*)sig.returns + sig.n_returns);
+
+  llvm::IRBuilder<> builder(context.context);
+  auto data = llvm::ConstantDataArray::get(context.context, llvm::makeArrayRef(types));
+  auto ty = llvm::StructType::get(context.context, { builder.getInt32Ty(), builder.getInt32Ty(), data->getType() });
+  auto init = llvm::ConstantStruct::get(ty, { builder.getInt32(sig.n_params), builder.getInt32(sig.n_returns), data });
+  auto g = new llvm::GlobalVariable(*context.llvm, ty, true, llvm::GlobalValue::ExternalLinkage, init, name);
+  g->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+  return g;
+}
+
 IR_ERROR PushReturn(code::Context& context) { return ERR_SUCCESS; }
 
 // Given a set of returns in the order given in the function/instruction signature, pushes them on to the stack in reverse order
@@ -485,10 +548,10 @@ BB* BindLabel(BB* block, code::Context& context)
   return block;
 }
 
-void PushResult(code::BlockResult** root, llvmVal* result, BB* block, const Environment& env)
+void PushResult(code::BlockResult** root, llvmVal* result, BB* block, __WASM_ALLOCATOR& scratch)
 {
   code::BlockResult* next = *root;
-  *root = tmalloc<code::BlockResult>(env, 1);
+  *root = tmalloc<code::BlockResult>(scratch, 1);
   new(*root) code::BlockResult{ result, block, next };
 }
 
@@ -501,7 +564,7 @@ IR_ERROR AddBranch(code::Block& target, code::Context& context)
     llvmVal* value;
     err = PopType(target.sig, context, value, true);
     if(!err)
-      PushResult(&target.results, value, context.builder.GetInsertBlock(), context.env); // Push result
+      PushResult(&target.results, value, context.builder.GetInsertBlock(), *context.scratch); // Push result
   }
   return err;
 }
@@ -595,7 +658,7 @@ IR_ERROR CompileElseBlock(code::Context& context)
     llvmVal* value;
     if(err = PopType(context.control.Peek().sig, context, value))
       return assert(false), err;
-    PushResult(&context.control.Peek().results, value, context.builder.GetInsertBlock(), context.env); // Push result
+    PushResult(&context.control.Peek().results, value, context.builder.GetInsertBlock(), *context.scratch); // Push result
   }
 
   // Reset value stack, but ensure that we preserve a polymorphic value if we had pushed one before
@@ -764,7 +827,7 @@ IR_ERROR CompileCall(varuint32 index, code::Context& context)
 
   // Pop arguments in reverse order
   IR_ERROR err;
-  llvmVal** ArgsV = tmalloc<llvmVal*>(context.env, num);
+  llvmVal** ArgsV = tmalloc<llvmVal*>(*context.scratch, num);
   for(unsigned int i = num; i-- > 0;)
   {
     if(err = PopType(GetTypeEncoding(fn->getFunctionType()->getParamType(i)), context, ArgsV[i]))
@@ -822,7 +885,7 @@ IR_ERROR CompileIndirectCall(varuint32 index, code::Context& context)
     return assert(false), ERR_INVALID_TABLE_INDEX;
 
   // Pop arguments in reverse order
-  llvmVal** ArgsV = tmalloc<llvmVal*>(context.env, ftype.n_params);
+  llvmVal** ArgsV = tmalloc<llvmVal*>(*context.scratch, ftype.n_params);
   for(unsigned int i = ftype.n_params; i-- > 0;)
   {
     if(err = PopType(ftype.params[i], context, ArgsV[i]))
@@ -891,7 +954,7 @@ IR_ERROR CompileConstant(Instruction& instruction, code::Context& context, llvm:
   return ERR_SUCCESS;
 }
 
-llvmVal* GetMemPointer(code::Context& context, llvmVal* base, llvm::PointerType* pointer_type, varuint7 memory, varuint32 offset)
+llvmVal* GetMemPointer(code::Context& context, llvmVal* base, llvm::PointerType* pointer_type, varuint32 memory, varuint32 offset)
 {
   llvmVal* loc = context.builder.CreateAdd(context.builder.CreateIntCast(base, context.builder.getInt64Ty(), false), context.builder.getInt64(offset), "", true, true);
 
@@ -907,9 +970,9 @@ llvmVal* GetMemPointer(code::Context& context, llvmVal* base, llvm::PointerType*
 }
 
 template<bool SIGNED>
-IR_ERROR CompileLoad(code::Context& context, varuint7 memory, varuint32 offset, varuint32 memflags, const char* name, llvmTy* ext, llvmTy* ty)
+IR_ERROR CompileLoad(code::Context& context, varuint32 memory, varuint32 offset, varuint32 memflags, const char* name, llvmTy* ext, llvmTy* ty)
 {
-  if(context.memories.size() < 1)
+  if(memory >= context.memories.size())
     return assert(false), ERR_INVALID_MEMORY_INDEX;
 
   llvmVal* base;
@@ -926,9 +989,9 @@ IR_ERROR CompileLoad(code::Context& context, varuint7 memory, varuint32 offset,
 }
 
 template<WASM_TYPE_ENCODING TY>
-IR_ERROR CompileStore(code::Context& context, varuint7 memory, varuint32 offset, varuint32 memflags, const char* name, llvm::IntegerType* ext)
+IR_ERROR CompileStore(code::Context& context, varuint32 memory, varuint32 offset, varuint32 memflags, const char* name, llvm::IntegerType* ext)
 {
-  if(context.memories.size() < 1)
+  if(memory >= context.memories.size())
     return assert(false), ERR_INVALID_MEMORY_INDEX;
 
   IR_ERROR err;
@@ -954,9 +1017,9 @@ llvmVal* CompileMemSize(llvm::GlobalVariable* target, code::Context& context)
   return context.builder.CreateIntCast(context.builder.CreateLShr(GetMemSize(target, context), 16), context.builder.getInt32Ty(), true);
 }
 
-IR_ERROR CompileMemGrow(code::Context& context, const char* name)
+IR_ERROR CompileMemGrow(code::Context& context, varuint32 memory, const char* name)
 {
-  if(context.memories.size() < 1)
+  if(memory >= context.memories.size())
     return assert(false), ERR_INVALID_MEMORY_INDEX;
 
   IR_ERROR err;
@@ -964,29 +1027,14 @@ IR_ERROR CompileMemGrow(code::Context& context, const char* name)
   if(err = PopType(TE_i32, context, delta))
     return assert(false), err;
 
-  llvmVal* old = CompileMemSize(context.memories[0], context);
+  llvmVal* old = CompileMemSize(context.memories[memory], context);
 
-  auto max = llvm::cast<llvm::ConstantAsMetadata>(context.memories[0]->getMetadata(IR_MEMORY_MAX_METADATA)->getOperand(0))->getValue();
-  CallInst* call = context.builder.CreateCall(context.memgrow, { context.builder.CreateLoad(context.memories[0]), context.builder.CreateShl(context.builder.CreateZExt(delta, context.builder.getInt64Ty()), 16), max }, name);
+  auto max = llvm::cast<llvm::ConstantAsMetadata>(context.memories[memory]->getMetadata(IR_MEMORY_MAX_METADATA)->getOperand(0))->getValue();
+  CallInst* call = context.builder.CreateCall(context.memgrow, { context.builder.CreateLoad(context.memories[memory]), context.builder.CreateShl(context.builder.CreateZExt(delta, context.builder.getInt64Ty()), 16), max }, name);
 
+  // The runtime reserves the maximum size up front, so a successful grow never moves the memory and there is no new base to store.
   llvmVal* success = context.builder.CreateICmpNE(context.builder.CreatePtrToInt(call, context.intptrty), CInt::get(context.intptrty, 0));
-
-  auto oldblock = context.builder.GetInsertBlock();
-  auto successblock = BB::Create(context.context, "grow_success", context.builder.GetInsertBlock()->getParent());
-  auto contblock = BB::Create(context.context, "grow_fail", context.builder.GetInsertBlock()->getParent());
-
-  context.builder.CreateCondBr(success, successblock, contblock);
-  context.builder.SetInsertPoint(successblock); // Only set new memory if call succeeded
-  context.builder.CreateAlignedStore(call, context.memories[0], context.builder.getInt64Ty()->getPrimitiveSizeInBits() / 8);
-  context.builder.CreateBr(contblock);
-
-  context.builder.SetInsertPoint(contblock);
-
-  auto phi = context.builder.CreatePHI(context.builder.getInt32Ty(), 2);
-  phi->addIncoming(old, successblock);
-  phi->addIncoming(CInt::get(context.builder.getInt32Ty(), -1, true), oldblock);
-
-  return PushReturn(context, phi);
+  return PushReturn(context, context.builder.CreateSelect(success, old, CInt::get(context.builder.getInt32Ty(), -1, true)));
 }
 
 template<WASM_TYPE_ENCODING Ty1, WASM_TYPE_ENCODING Ty2, WASM_TYPE_ENCODING TyR>
@@ -1202,55 +1250,57 @@ IR_ERROR CompileInstruction(Instruction& ins, code::Context& context)
 
     // Memory-related operators
   case OP_i32_load:
-    return CompileLoad<false>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr, context.builder.getInt32Ty());
+    return CompileLoad<false>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr, context.builder.getInt32Ty());
   case OP_i64_load:
-    return CompileLoad<false>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr, context.builder.getInt64Ty());
+    return CompileLoad<false>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr, context.builder.getInt64Ty());
   case OP_f32_load:
-    return CompileLoad<false>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr, context.builder.getFloatTy());
+    return CompileLoad<false>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr, context.builder.getFloatTy());
   case OP_f64_load:
-    return CompileLoad<false>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr, context.builder.getDoubleTy());
+    return CompileLoad<false>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr, context.builder.getDoubleTy());
   case OP_i32_load8_s:
-    return CompileLoad<true>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt32Ty(), context.builder.getInt8Ty());
+    return CompileLoad<true>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt32Ty(), context.builder.getInt8Ty());
   case OP_i32_load8_u:
-    return CompileLoad<false>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt32Ty(), context.builder.getInt8Ty());
+    return CompileLoad<false>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt32Ty(), context.builder.getInt8Ty());
   case OP_i32_load16_s:
-    return CompileLoad<true>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt32Ty(), context.builder.getInt16Ty());
+    return CompileLoad<true>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt32Ty(), context.builder.getInt16Ty());
   case OP_i32_load16_u:
-    return CompileLoad<false>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt32Ty(), context.builder.getInt16Ty());
+    return CompileLoad<false>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt32Ty(), context.builder.getInt16Ty());
   case OP_i64_load8_s:
-    return CompileLoad<true>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt8Ty());
+    return CompileLoad<true>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt8Ty());
   case OP_i64_load8_u:
-    return CompileLoad<false>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt8Ty());
+    return CompileLoad<false>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt8Ty());
   case OP_i64_load16_s:
-    return CompileLoad<true>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt16Ty());
+    return CompileLoad<true>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt16Ty());
   case OP_i64_load16_u:
-    return CompileLoad<false>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt16Ty());
+    return CompileLoad<false>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt16Ty());
   case OP_i64_load32_s:
-    return CompileLoad<true>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt32Ty());
+    return CompileLoad<true>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt32Ty());
   case OP_i64_load32_u:
-    return CompileLoad<false>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt32Ty());
+    return CompileLoad<false>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt64Ty(), context.builder.getInt32Ty());
   case OP_i32_store:
-    return CompileStore<TE_i32>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr);
+    return CompileStore<TE_i32>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr);
   case OP_i64_store:
-    return CompileStore<TE_i64>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr);
+    return CompileStore<TE_i64>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr);
   case OP_f32_store:
-    return CompileStore<TE_f32>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr);
+    return CompileStore<TE_f32>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr);
   case OP_f64_store:
-    return CompileStore<TE_f64>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr);
+    return CompileStore<TE_f64>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], nullptr);
   case OP_i32_store8:
-    return CompileStore<TE_i32>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt8Ty());
+    return CompileStore<TE_i32>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt8Ty());
   case OP_i32_store16:
-    return CompileStore<TE_i32>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt16Ty());
+    return CompileStore<TE_i32>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt16Ty());
   case OP_i64_store8:
-    return CompileStore<TE_i64>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt8Ty());
+    return CompileStore<TE_i64>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt8Ty());
   case OP_i64_store16:
-    return CompileStore<TE_i64>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt16Ty());
+    return CompileStore<TE_i64>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt16Ty());
   case OP_i64_store32:
-    return CompileStore<TE_i64>(context, 0, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt32Ty());
+    return CompileStore<TE_i64>(context, ins.immediates[2]._varuint32, ins.immediates[1]._varuint32, ins.immediates[0]._varuint32, OPNAMES[ins.opcode], context.builder.getInt32Ty());
   case OP_memory_size:
-    return PushReturn(context, CompileMemSize(context.memories[0], context));
+    if(ins.immediates[0]._varuint32 >= context.memories.size())
+      return assert(false), ERR_INVALID_MEMORY_INDEX;
+    return PushReturn(context, CompileMemSize(context.memories[ins.immediates[0]._varuint32], context));
   case OP_memory_grow:
-    return CompileMemGrow(context, OPNAMES[ins.opcode]);
+    return CompileMemGrow(context, ins.immediates[0]._varuint32, OPNAMES[ins.opcode]);
 
     // Constants
   case OP_i32_const: // While we interpret this as unsigned, it is cast to a signed int.
@@ -1613,19 +1663,27 @@ IR_ERROR CompileFunctionBody(Func* fn, FunctionType& sig, FunctionBody& body, co
   if(stacksize > 2048)
     fn->addFnAttr("probe-stack");
 
+  // Lazily parsed bodies are decoded into the per-function scratch scope, which is released once this body is compiled
+  FunctionBody code;
+  IR_ERROR decode = DecodeFunctionBody(body, code, *context.scratch, context.env);
+  if(decode < 0)
+    return decode;
+
   // Begin iterating through the instructions until there aren't any left
-  for(varuint32 i = 0; i < body.n_body; ++i)
+  InstructionCursor cursor(code);
+  Instruction ins = { OP_unreachable };
+  while(cursor.Next(ins))
   {
     if(context.dbuilder)
-      context.builder.SetCurrentDebugLocation(llvm::DILocation::get(context.context, body.body[i].line, body.body[i].column, context.control.Peek().scope));
-    IR_ERROR err = CompileInstruction(body.body[i], context);
+      context.builder.SetCurrentDebugLocation(llvm::DILocation::get(context.context, ins.line, ins.column, context.control.Peek().scope));
+    IR_ERROR err = CompileInstruction(ins, context);
     if(err < 0)
       return err;
   }
 
   if(context.values.Size() > 0 && !context.values.Peek()) // Pop at most 1 polymorphic type off the stack. Any additional ones are an error.
     context.values.Pop();
-  if(body.body[body.n_body - 1].opcode != OP_end)
+  if(ins.opcode != OP_end)
     return assert(false), ERR_FATAL_EXPECTED_END_INSTRUCTION;
   if(context.control.Size() > 0 || context.control.Limit() > 0)
     return assert(false), ERR_END_MISMATCH;
@@ -1746,6 +1804,30 @@ llvmTy* GetTableType(varsint7 element_type, code::Context& context)
   return llvm::StructType::create({ GetLLVMType(element_type, context), GetLLVMType(TE_i32, context) });
 }
 
+// In a chain of resident libraries, imports of another module's export link against the module that actually defines it, under the
+// name that module was compiled with. This still resolves once that module has been loaded into an earlier library, or registered under
+// another name since. Everything else links against the canonical name of the import, like it always has.
+std::string ImportSymbolName(const code::Context& context, const Import& imp)
+{
+  if(!context.resident)
+    return CanonImportName(imp);
+
+  const Environment& env = context.env;
+  auto pair = ResolveExport(env, imp);
+  if(!pair.second)
+    return CanonImportName(imp);
+
+  while(Import* next = ResolveImport(*pair.first, *pair.second))
+  {
+    auto source = ResolveExport(env, *next);
+    if(!source.second)
+      break;
+    pair = source;
+  }
+
+  return CanonicalName(StringRef::From(pair.first->name), StringRef::From(pair.second->name));
+}
+
 Func* TopLevelFunction(llvm::LLVMContext& context, llvm::IRBuilder<>& builder, const char* name, llvm::Module* m)
 {
   Func* fn = Func::Create(
@@ -1761,6 +1843,12 @@ Func* TopLevelFunction(llvm::LLVMContext& context, llvm::IRBuilder<>& builder, c
 
 IR_ERROR CompileModule(const Environment* env, code::Context& context)
 {
+  // Anything only needed while compiling a single function body goes in this scope, which is reset after each one
+  __WASM_ALLOCATOR scratch(context.scratch);
+  __WASM_ALLOCATOR* parent = context.scratch;
+  context.scratch = &scratch;
+  utility::DeferLambda<std::function<void()>> restore([&]() { context.scratch = parent; });
+
   context.llvm = new llvm::Module(context.m.name.str(), context.context);
   context.llvm->setTargetTriple(context.machine->getTargetTriple().getTriple());
   context.llvm->setDataLayout(context.machine->createDataLayout());
@@ -1809,7 +1897,6 @@ IR_ERROR CompileModule(const Environment* env, code::Context& context)
     Func::ExternalLinkage,
     "_innative_internal_env_grow_memory",
     context.llvm);
-  context.memgrow->setReturnDoesNotAlias(); // This is a system memory allocation function, so the return value does not alias
 
   Func* fn_memcpy = Func::Create(
     FuncTy::get(context.builder.getVoidTy(), { context.builder.getInt8PtrTy(0), context.builder.getInt8PtrTy(0), context.builder.getInt64Ty() }, false),
@@ -1817,6 +1904,18 @@ IR_ERROR CompileModule(const Environment* env, code::Context& context)
     "_innative_internal_env_memcpy",
     context.llvm);
 
+  Func* fn_mapimage = Func::Create(
+    FuncTy::get(context.builder.getVoidTy(), { context.builder.getInt8PtrTy(0), context.builder.getInt8PtrTy(0), context.builder.getInt64Ty(), context.builder.getInt8PtrTy(0) }, false),
+    Func::ExternalLinkage,
+    "_innative_internal_env_map_image",
+    context.llvm);
+
+  Func* fn_closeimage = Func::Create(
+    FuncTy::get(context.builder.getVoidTy(), { context.builder.getInt8PtrTy(0) }, false),
+    Func::ExternalLinkage,
+    "_innative_internal_env_close_image",
+    context.llvm);
+
   Func* fn_memfree = Func::Create(
     FuncTy::get(context.builder.getVoidTy(), { context.builder.getInt8PtrTy(0) }, false),
     Func::ExternalLinkage,
@@ -1843,7 +1942,7 @@ IR_ERROR CompileModule(const Environment* env, code::Context& context)
       if(index >= context.m.type.n_functions)
         return assert(false), ERR_INVALID_TYPE_INDEX;
 
-      auto fname = CanonImportName(context.m.importsection.imports[i]);
+      auto fname = ImportSymbolName(context, context.m.importsection.imports[i]);
       khiter_t iter = code::kh_get_importhash(context.importhash, fname.c_str());
       if(iter != kh_end(context.importhash))
         context.functions.back().internal = static_cast<Func*>(kh_val(context.importhash, iter));
@@ -1885,7 +1984,7 @@ IR_ERROR CompileModule(const Environment* env, code::Context& context)
   // Import tables
   for(varuint32 i = context.m.importsection.functions; i < context.m.importsection.tables; ++i)
   {
-    auto name = CanonImportName(context.m.importsection.imports[i]);
+    auto name = ImportSymbolName(context, context.m.importsection.imports[i]);
 
     khiter_t iter = code::kh_get_importhash(context.importhash, name.c_str());
     if(iter != kh_end(context.importhash))
@@ -1912,7 +2011,7 @@ IR_ERROR CompileModule(const Environment* env, code::Context& context)
   // Import memory
   for(varuint32 i = context.m.importsection.tables; i < context.m.importsection.memories; ++i)
   {
-    auto name = CanonImportName(context.m.importsection.imports[i]);
+    auto name = ImportSymbolName(context, context.m.importsection.imports[i]);
 
     khiter_t iter = code::kh_get_importhash(context.importhash, name.c_str());
     if(iter != kh_end(context.importhash))
@@ -1942,7 +2041,7 @@ IR_ERROR CompileModule(const Environment* env, code::Context& context)
   // Import global variables
   for(varuint32 i = context.m.importsection.memories; i < context.m.importsection.globals; ++i)
   {
-    auto name = CanonImportName(context.m.importsection.imports[i]);
+    auto name = ImportSymbolName(context, context.m.importsection.imports[i]);
 
     khiter_t iter = code::kh_get_importhash(context.importhash, name.c_str());
     if(iter != kh_end(context.importhash))
@@ -2056,27 +2155,57 @@ IR_ERROR CompileModule(const Environment* env, code::Context& context)
   if(baselocation)
     context.builder.SetCurrentDebugLocation(baselocation);
 
+  // Every segment mapped from the binary shares one IRImageBacking on the init function's stack, so the file is only looked up once
+  llvm::Value* backing = nullptr;
+
   // Process data section by appending to the init function
   for(varuint32 i = 0; i < context.m.data.n_data; ++i)
   {
     DataInit& d = context.m.data.data[i]; // First we declare a constant array that stores the data in the EXE
-    auto data = llvm::ConstantDataArray::get(context.context, llvm::makeArrayRef<uint8_t>(d.data.get(), d.data.get() + d.data.size()));
+
+    // Segments spanning at least a page at a constant offset are padded so they share their destination's page offset, which lets
+    // the runtime map them copy-on-write straight from the binary instead of copying them.
+    bool image = d.offset.opcode == OP_i32_const && d.data.size() >= IR_PAGE_SIZE;
+    uint32_t pad = image ? ((uint32_t)d.offset.immediates[0]._varsint32 % IR_PAGE_SIZE) : 0;
+    std::vector<uint8_t> padded;
+    if(pad > 0)
+    {
+      padded.resize(pad, 0);
+      padded.insert(padded.end(), d.data.get(), d.data.get() + d.data.size());
+    }
+
+    auto data = llvm::ConstantDataArray::get(context.context, !pad ?
+      llvm::makeArrayRef<uint8_t>(d.data.get(), d.data.get() + d.data.size()) :
+      llvm::makeArrayRef<uint8_t>(padded));
     auto val = new llvm::GlobalVariable(*context.llvm, data->getType(), true, llvm::GlobalValue::LinkageTypes::PrivateLinkage, data, CanonicalName(StringRef{ 0,0 }, StringRef::From("data"), i));
+    if(image)
+      val->setAlignment(IR_PAGE_SIZE);
     GenGlobalDebugInfo(val, context, 0);
 
     llvm::Constant* offset;
     if(err = CompileInitConstant(d.offset, context.m, context, offset))
       return err;
 
-    // Then we create a memcpy call that copies this data to the appropriate location in the init function
-    context.builder.CreateCall(fn_memcpy,
-      {
-        context.builder.CreateInBoundsGEP(context.builder.getInt8Ty(), context.builder.CreateLoad(context.memories[d.index]), offset),
-        context.builder.CreateInBoundsGEP(data->getType(), val, {context.builder.getInt32(0), context.builder.getInt32(0)}),
-        context.builder.getInt64(GetTotalSize(data->getType()))
-      });
+    if(image && !backing)
+    {
+      auto backingty = llvm::ArrayType::get(context.builder.getInt64Ty(), sizeof(IRImageBacking) / sizeof(uint64_t));
+      backing = context.builder.CreateAlloca(backingty, nullptr, "backing");
+      context.builder.CreateStore(llvm::ConstantAggregateZero::get(backingty), backing);
+      backing = context.builder.CreatePointerCast(backing, context.builder.getInt8PtrTy(0));
+    }
+
+    // Then we create a call that copies or maps this data to the appropriate location in the init function
+    auto dest = context.builder.CreateInBoundsGEP(context.builder.getInt8Ty(), context.builder.CreateLoad(context.memories[d.index]), offset);
+    auto src = context.builder.CreateInBoundsGEP(data->getType(), val, { context.builder.getInt32(0), context.builder.getInt32(pad) });
+    if(image)
+      context.builder.CreateCall(fn_mapimage, { dest, src, context.builder.getInt64(d.data.size()), backing });
+    else
+      context.builder.CreateCall(fn_memcpy, { dest, src, context.builder.getInt64(d.data.size()) });
   }
 
+  if(backing)
+    context.builder.CreateCall(fn_closeimage, { backing });
+
   // Process element section by appending to the init function
   for(uint64_t i = 0; i < context.m.element.n_elements; ++i)
   {
@@ -2092,6 +2221,41 @@ IR_ERROR CompileModule(const Environment* env, code::Context& context)
       if(err = CompileInitConstant(e.offset, context.m, context, offset))
         return err;
 
+      // Segments at a constant offset become a constant table image whose function pointers are filled in by relocations, which is
+      // then copied into the table with a single call instead of emitting two stores per element.
+      if(llvm::isa<CInt>(offset))
+      {
+        auto entry = llvm::cast<llvm::StructType>(context.tables[e.index]->getType()->getElementType()->getPointerElementType());
+        std::vector<llvm::Constant*> entries;
+        entries.reserve(e.n_elements);
+
+        for(uint64_t j = 0; j < e.n_elements; ++j)
+        {
+          if(e.elements[j] >= context.functions.size())
+            return assert(false), ERR_INVALID_FUNCTION_INDEX;
+
+          varuint32 index = GetFirstType(ModuleFunctionType(context.m, e.elements[j]), context);
+          if(index == (varuint32)~0)
+            return assert(false), ERR_INVALID_FUNCTION_INDEX;
+
+          entries.push_back(llvm::ConstantStruct::get(entry, {
+            llvm::ConstantExpr::getPointerCast(context.functions[e.elements[j]].internal, target),
+            context.builder.getInt32(index) }));
+        }
+
+        auto type = llvm::ArrayType::get(entry, e.n_elements);
+        auto val = new llvm::GlobalVariable(*context.llvm, type, true, llvm::GlobalValue::LinkageTypes::PrivateLinkage, llvm::ConstantArray::get(type, entries), CanonicalName(StringRef{ 0,0 }, StringRef::From("elem"), i));
+        GenGlobalDebugInfo(val, context, 0);
+
+        context.builder.CreateCall(fn_memcpy,
+          {
+            context.builder.CreatePointerCast(context.builder.CreateInBoundsGEP(context.builder.CreateLoad(context.tables[e.index]), offset), context.builder.getInt8PtrTy(0)),
+            context.builder.CreatePointerCast(val, context.builder.getInt8PtrTy(0)),
+            context.builder.getInt64(context.llvm->getDataLayout().getTypeAllocSize(type))
+          });
+        continue;
+      }
+
       // Go through and resolve all indices to function pointers
       for(uint64_t j = 0; j < e.n_elements; ++j)
       {
@@ -2146,6 +2310,7 @@ IR_ERROR CompileModule(const Environment* env, code::Context& context)
         return assert(false), ERR_INVALID_TYPE_INDEX;
       if((err = CompileFunctionBody(fn, context.m.type.functions[context.m.function.funcdecl[i]], context.m.code.funcbody[i], context)) < 0)
         return err;
+      scratch.Reset();
     }
   }
 
@@ -2201,23 +2366,85 @@ IR_ERROR OutputObjectFile(code::Context& context, const char* out)
   return ERR_SUCCESS;
 }
 
+struct ExportEntry
+{
+  uint64_t hash;
+  Module* m; // Module and export the entry was requested from, before resolving it
+  Export* e;
+  llvm::GlobalValue* value; // Definition the exported symbol refers to
+  llvm::GlobalValue* invoke; // Invocation thunk and signature of a function, or null
+  llvm::GlobalValue* signature;
+  varuint7 kind;
+  uint32_t type;
+  std::string symbol; // Empty if nothing is exported
+};
+
+// Emits the sorted export directory into the given module, declaring any exported symbols it refers to that live in other modules
+void CompileExportDirectory(vector<ExportEntry>& directory, llvm::LLVMContext& llvm_context, code::Context& context)
+{
+  std::stable_sort(directory.begin(), directory.end(), [](const ExportEntry& l, const ExportEntry& r) { return l.hash < r.hash; });
+
+  llvm::IRBuilder<> builder(llvm_context);
+  auto ptrty = builder.getInt8PtrTy(0);
+  auto entryty = llvm::StructType::get(llvm_context, { builder.getInt64Ty(), ptrty, ptrty, ptrty, builder.getInt32Ty(), builder.getInt32Ty(), ptrty, ptrty,
+    builder.getInt32Ty(), builder.getInt32Ty() });
+
+  auto string = [&](const ByteArray& b) -> llvm::Constant* {
+    auto init = llvm::ConstantDataArray::getString(llvm_context, llvm::StringRef(b.str(), b.size()), true);
+    auto g = new llvm::GlobalVariable(*context.llvm, init->getType(), true, llvm::GlobalValue::PrivateLinkage, init);
+    return llvm::ConstantExpr::getPointerCast(g, ptrty);
+  };
+
+  auto symbol = [&](const std::string& name, llvm::GlobalValue* value) -> llvm::Constant* {
+    if(name.empty() || !value)
+      return llvm::ConstantPointerNull::get(ptrty);
+    llvm::GlobalValue* v = context.llvm->getNamedValue(name);
+    if(!v && llvm::isa<Func>(value))
+      v = Func::Create(llvm::cast<Func>(value)->getFunctionType(), Func::ExternalLinkage, name, context.llvm);
+    else if(!v)
+      v = new llvm::GlobalVariable(*context.llvm, value->getValueType(), false, llvm::GlobalValue::ExternalLinkage, nullptr, name);
+    return llvm::ConstantExpr::getPointerCast(v, ptrty);
+  };
+
+  vector<llvm::Constant*> entries;
+  for(auto& entry : directory)
+  {
+    // The thunk and signature of a function are always exported under the same name as the function, plus a suffix
+    bool suffixed = !entry.symbol.empty();
+    entries.push_back(llvm::ConstantStruct::get(entryty, { builder.getInt64(entry.hash), string(entry.m->name), string(entry.e->name),
+      symbol(entry.symbol, entry.value), builder.getInt32(entry.kind), builder.getInt32(entry.type),
+      symbol(suffixed ? entry.symbol + IR_INVOKE_SUFFIX : "", entry.invoke), symbol(suffixed ? entry.symbol + IR_SIGNATURE_SUFFIX : "", entry.signature),
+      builder.getInt32(entry.m->name.size()), builder.getInt32(entry.e->name.size()) }));
+  }
+
+  auto arrayty = llvm::ArrayType::get(entryty, entries.size());
+  auto array = new llvm::GlobalVariable(*context.llvm, arrayty, true, llvm::GlobalValue::PrivateLinkage, llvm::ConstantArray::get(arrayty, entries));
+  auto dirty = llvm::StructType::get(llvm_context, { builder.getInt64Ty(), entryty->getPointerTo(0) });
+  auto dir = new llvm::GlobalVariable(*context.llvm, dirty, true, llvm::GlobalValue::ExternalLinkage,
+    llvm::ConstantStruct::get(dirty, { builder.getInt64(entries.size()), llvm::ConstantExpr::getPointerCast(array, entryty->getPointerTo(0)) }), IR_EXPORT_DIRECTORY);
+  dir->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+}
+
 // Resolve all exports in the module they originated from (in case any module is exporting an import)
-void ResolveModuleExports(const Environment* env, llvm::LLVMContext& llvm_context, code::Context* context)
+void ResolveModuleExports(const Environment* env, llvm::LLVMContext& llvm_context, code::Context* context, varuint32 first)
 {
   // Set ENV_HOMOGENIZE_FUNCTIONS flag appropriately.
   auto wrapperfn = (env->flags & ENV_HOMOGENIZE_FUNCTIONS) ? &HomogenizeFunction : &WrapFunction;
+  vector<ExportEntry> directory;
 
-  for(varuint32 i = 0; i < env->n_modules; ++i)
+  for(varuint32 i = first; i < env->n_modules; ++i)
   {
     for(varuint32 j = 0; j < context[i].m.exportsection.n_exports; ++j)
     {
       Export* e = &context[i].m.exportsection.exports[j];
       Module* m = &context[i].m;
+      ExportEntry entry = { ExportHash(StringRef::From(m->name), StringRef::From(e->name)), m, e, nullptr, nullptr, nullptr, e->kind, 0, "" };
 
       // Calculate the canonical name we wish to export as using the initial export object
       auto canonical = CanonicalName(StringRef::From(context[i].m.name), StringRef::From(e->name));
 
-      // Resolve the export/module pair to the concrete source
+      // Resolve the export/module pair to the concrete source. If that's in a library that was already loaded, or isn't a module at all,
+      // stop at the last module compiled here, whose import of it is then exported like any other import.
       for(;;)
       {
         Import* imp = ResolveImport(*m, *e);
@@ -2226,12 +2453,21 @@ void ResolveModuleExports(const Environment* env, llvm::LLVMContext& llvm_contex
           break;
 
         auto pair = ResolveExport(*env, *imp);
+        if(!pair.second || pair.first - env->modules < first)
+          break;
         m = pair.first;
         e = pair.second;
       }
 
+      assert(m - env->modules >= first); // Contexts before first are never constructed
       code::Context* ctx = context + (m - env->modules); // Figure out what the corresponding context is for this module
 
+      // Aliases must point to a definition, so data imported from a loaded library is only found through the export directory
+      auto alias = [&](llvm::GlobalVariable* value) {
+        if(!value->isDeclaration())
+          llvm::GlobalAlias::create(llvm::GlobalValue::ExternalLinkage, canonical, value)->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+      };
+
       switch(e->kind)
       {
       case WASM_KIND_FUNCTION:
@@ -2240,24 +2476,261 @@ void ResolveModuleExports(const Environment* env, llvm::LLVMContext& llvm_contex
           if(ctx->dbuilder)
             ctx->builder.SetCurrentDebugLocation(llvm::DILocation::get(llvm_context, ctx->init->getSubprogram()->getLine(), 0, ctx->init->getSubprogram()));
 
-          ctx->functions[e->index].exported = (*wrapperfn)(ctx->functions[e->index].imported ? ctx->functions[e->index].imported : ctx->functions[e->index].internal, canonical, *ctx, Func::ExternalLinkage, llvm::CallingConv::C);
+          Func* target = ctx->functions[e->index].imported ? ctx->functions[e->index].imported : ctx->functions[e->index].internal;
+          ctx->functions[e->index].exported = (*wrapperfn)(target, canonical, *ctx, Func::ExternalLinkage, llvm::CallingConv::C);
           ctx->functions[e->index].exported->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+
+          FunctionType* sig = ModuleFunction(*m, e->index);
+          if(sig)
+          {
+            InvokeFunction(target, canonical + IR_INVOKE_SUFFIX, *ctx);
+            SignatureGlobal(*sig, canonical + IR_SIGNATURE_SUFFIX, *ctx);
+          }
         }
         else
+        {
+          auto name = ctx->functions[e->index].exported->getName().str();
           llvm::GlobalAlias::create(llvm::GlobalValue::ExternalLinkage, canonical, ctx->functions[e->index].exported)->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+          if(auto invoke = ctx->llvm->getFunction(name + IR_INVOKE_SUFFIX))
+            llvm::GlobalAlias::create(llvm::GlobalValue::ExternalLinkage, canonical + IR_INVOKE_SUFFIX, invoke)->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+          if(auto sig = ctx->llvm->getGlobalVariable(name + IR_SIGNATURE_SUFFIX))
+            llvm::GlobalAlias::create(llvm::GlobalValue::ExternalLinkage, canonical + IR_SIGNATURE_SUFFIX, sig)->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+        }
+        break;
+      case WASM_KIND_TABLE: // Per-instance state has no fixed address to export
+        if(!(env->flags&ENV_INSTANCES))
+          alias(ctx->tables[e->index]);
+        break;
+      case WASM_KIND_MEMORY:
+        if(!(env->flags&ENV_INSTANCES))
+          alias(ctx->memories[e->index]);
+        break;
+      case WASM_KIND_GLOBAL:
+        if(!(env->flags&ENV_INSTANCES) || ctx->globals[e->index]->isConstant())
+          alias(ctx->globals[e->index]);
+        break;
+      }
+
+      switch(e->kind)
+      {
+      case WASM_KIND_FUNCTION:
+        if(FunctionType* sig = ModuleFunction(*m, e->index))
+          entry.type = (uint32_t)(sig - m->type.functions);
+        entry.value = ctx->functions[e->index].exported;
+        entry.invoke = ctx->llvm->getFunction(entry.value->getName().str() + IR_INVOKE_SUFFIX);
+        entry.signature = ctx->llvm->getGlobalVariable(entry.value->getName().str() + IR_SIGNATURE_SUFFIX);
         break;
       case WASM_KIND_TABLE:
-        llvm::GlobalAlias::create(llvm::GlobalValue::ExternalLinkage, canonical, ctx->tables[e->index])->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+        if(TableDesc* desc = ModuleTable(*m, e->index))
+          entry.type = (uint32_t)desc->element_type;
+        entry.value = ctx->tables[e->index];
         break;
       case WASM_KIND_MEMORY:
-        llvm::GlobalAlias::create(llvm::GlobalValue::ExternalLinkage, canonical, ctx->memories[e->index])->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+        entry.value = ctx->memories[e->index];
         break;
       case WASM_KIND_GLOBAL:
-        llvm::GlobalAlias::create(llvm::GlobalValue::ExternalLinkage, canonical, ctx->globals[e->index])->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+        if(GlobalDesc* desc = ModuleGlobal(*m, e->index))
+          entry.type = (uint32_t)desc->type;
+        entry.value = ctx->globals[e->index];
         break;
       }
+
+      // Anything that wasn't given an exported symbol above lives in per-instance state and has no address
+      if(ctx->llvm->getNamedValue(canonical) != nullptr)
+        entry.symbol = canonical;
+      directory.push_back(entry);
     }
   }
+
+  CompileExportDirectory(directory, llvm_context, context[first]);
+}
+
+// Turns every constant expression using c into an instruction, so that c is only used directly by instructions
+void ExpandConstantUsers(llvm::Constant* c)
+{
+  std::vector<llvm::User*> users(c->user_begin(), c->user_end());
+  for(auto user : users)
+  {
+    auto expr = llvm::dyn_cast<llvm::ConstantExpr>(user);
+    if(!expr)
+      continue;
+
+    ExpandConstantUsers(expr);
+    std::vector<llvm::User*> inner(expr->user_begin(), expr->user_end());
+    for(auto u : inner)
+    {
+      if(auto phi = llvm::dyn_cast<llvm::PHINode>(u))
+      {
+        for(unsigned int i = 0; i < phi->getNumIncomingValues(); ++i)
+        {
+          if(phi->getIncomingValue(i) == expr)
+          {
+            auto ins = expr->getAsInstruction();
+            ins->insertBefore(phi->getIncomingBlock(i)->getTerminator());
+            phi->setIncomingValue(i, ins);
+          }
+        }
+      }
+      else if(auto target = llvm::dyn_cast<llvm::Instruction>(u))
+      {
+        auto ins = expr->getAsInstruction();
+        ins->insertBefore(target);
+        target->replaceUsesOfWith(expr, ins);
+      }
+    }
+  }
+}
+
+// Replaces all uses of g inside functions with a pointer to the given field of the current instance state
+void ReplaceWithInstanceState(llvm::GlobalVariable* g, unsigned int field, llvm::StructType* layout, llvm::GlobalVariable* state, std::unordered_map<Func*, llvm::Instruction*>& bases)
+{
+  ExpandConstantUsers(g);
+
+  std::unordered_map<Func*, llvmVal*> fields;
+  std::vector<llvm::User*> users(g->user_begin(), g->user_end());
+  for(auto user : users)
+  {
+    auto ins = llvm::dyn_cast<llvm::Instruction>(user);
+    if(!ins)
+      continue;
+
+    Func* fn = ins->getFunction();
+    llvmVal*& ptr = fields[fn];
+    if(!ptr)
+    {
+      llvm::Instruction*& base = bases[fn];
+      if(!base) // The state pointer is loaded once on entry and stays pinned for the rest of the function
+      {
+        auto at = fn->getEntryBlock().getFirstInsertionPt();
+        while(llvm::isa<llvm::AllocaInst>(*at)) // Allocas have to stay in the entry block to be promoted to registers
+          ++at;
+
+        llvm::IRBuilder<> builder(&*at);
+        auto current = builder.CreateLoad(state);
+        base = llvm::cast<llvm::Instruction>(builder.CreatePointerCast(current, layout->getPointerTo(0), "instance"));
+
+        // Calling in without entering an instance traps instead of dereferencing null
+        builder.SetInsertPoint(llvm::SplitBlockAndInsertIfThen(builder.CreateIsNull(current), &*at, true));
+        builder.CreateCall(llvm::Intrinsic::getDeclaration(fn->getParent(), llvm::Intrinsic::trap), {})->setDoesNotReturn();
+      }
+
+      llvm::IRBuilder<> builder(base->getNextNode());
+      ptr = builder.CreateStructGEP(layout, base, field, g->getName());
+    }
+
+    ins->replaceUsesOfWith(g, ptr);
+  }
+}
+
+// Moves every linear memory, table and mutable global into one state block per instance, which generated code reaches through a
+// thread-local pointer. Also emits the initial contents of the state block, its size, where its memories and tables are, and a function
+// that swaps the current instance.
+IR_ERROR CompileInstanceState(const Environment* env, llvm::LLVMContext& llvm_context, code::Context* context)
+{
+  std::unordered_map<llvm::GlobalVariable*, unsigned int> fields;
+  vector<llvmTy*> types;
+  vector<llvm::Constant*> inits;
+  vector<unsigned int> tables;
+  vector<unsigned int> memories;
+
+  auto assign = [&](llvm::GlobalVariable* g, vector<unsigned int>* kind) {
+    if(fields.emplace(g, (unsigned int)types.size()).second)
+    {
+      if(kind)
+        kind->push_back((unsigned int)types.size());
+      types.push_back(g->getValueType());
+      inits.push_back(g->getInitializer());
+    }
+  };
+
+  for(varuint32 i = 0; i < env->n_modules; ++i)
+  {
+    Module& m = context[i].m;
+    for(size_t j = m.importsection.tables - m.importsection.functions; j < context[i].tables.size(); ++j)
+      assign(context[i].tables[j], &tables);
+    for(size_t j = m.importsection.memories - m.importsection.tables; j < context[i].memories.size(); ++j)
+      assign(context[i].memories[j], &memories);
+    for(size_t j = m.importsection.globals - m.importsection.memories; j < context[i].globals.size(); ++j)
+      if(!context[i].globals[j]->isConstant())
+        assign(context[i].globals[j], nullptr);
+  }
+
+  // Imports share the field of the definition they resolve to
+  auto resolve = [&](llvm::GlobalVariable* g, Import& imp, vector<llvm::GlobalVariable*> code::Context::*kind) {
+    auto pair = ResolveTrueExport(*env, imp);
+    if(!pair.first || !pair.second)
+      return;
+    auto iter = fields.find((context[pair.first - env->modules].*kind)[pair.second->index]);
+    if(iter != fields.end())
+      fields[g] = iter->second;
+  };
+
+  for(varuint32 i = 0; i < env->n_modules; ++i)
+  {
+    Module& m = context[i].m;
+    for(varuint32 j = m.importsection.functions; j < m.importsection.tables; ++j)
+      resolve(context[i].tables[j - m.importsection.functions], m.importsection.imports[j], &code::Context::tables);
+    for(varuint32 j = m.importsection.tables; j < m.importsection.memories; ++j)
+      resolve(context[i].memories[j - m.importsection.tables], m.importsection.imports[j], &code::Context::memories);
+    for(varuint32 j = m.importsection.memories; j < m.importsection.globals; ++j)
+      resolve(context[i].globals[j - m.importsection.memories], m.importsection.imports[j], &code::Context::globals);
+  }
+
+  llvm::StructType* layout = llvm::StructType::get(llvm_context, types);
+  llvm::IRBuilder<> builder(llvm_context);
+  auto statety = builder.getInt8PtrTy(0);
+
+  // The state pointer is only touched by code inside the library, so it is hidden and uses the local dynamic model, which lets the
+  // linker resolve its offset once per function instead of calling __tls_get_addr on every access. The initial exec model would be
+  // cheaper still, but it takes space from the static TLS block that a library loaded with dlopen isn't guaranteed to get.
+  for(varuint32 i = 0; i < env->n_modules; ++i)
+  {
+    auto state = new llvm::GlobalVariable(*context[i].llvm, statety, false, llvm::GlobalValue::ExternalLinkage, !i ? llvm::ConstantPointerNull::get(statety) : nullptr,
+      IR_INSTANCE_STATE, nullptr, llvm::GlobalValue::LocalDynamicTLSModel);
+    state->setVisibility(llvm::GlobalValue::HiddenVisibility);
+    std::unordered_map<Func*, llvm::Instruction*> bases;
+
+    for(auto& pair : fields)
+    {
+      if(pair.first->getParent() != context[i].llvm)
+        continue;
+      ReplaceWithInstanceState(pair.first, pair.second, layout, state, bases);
+      if(pair.first->use_empty())
+        pair.first->eraseFromParent();
+    }
+
+    if(i > 0)
+      continue;
+
+    auto image = new llvm::GlobalVariable(*context[i].llvm, layout, true, llvm::GlobalValue::ExternalLinkage, llvm::ConstantStruct::get(layout, inits), IR_INSTANCE_TEMPLATE);
+    image->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+
+    auto size = builder.getInt64(context[i].llvm->getDataLayout().getTypeAllocSize(layout));
+    auto sizevar = new llvm::GlobalVariable(*context[i].llvm, size->getType(), true, llvm::GlobalValue::ExternalLinkage, size, IR_INSTANCE_SIZE);
+    sizevar->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+
+    // List where the memory and table pointers live in the state block, so the runtime can save and reset them
+    auto offsets = [&](const vector<unsigned int>& kind, const char* name) {
+      vector<uint64_t> list;
+      for(auto field : kind)
+        list.push_back(context[i].llvm->getDataLayout().getStructLayout(layout)->getElementOffset(field));
+      list.push_back(~0ULL);
+      auto data = llvm::ConstantDataArray::get(llvm_context, llvm::makeArrayRef(list));
+      auto var = new llvm::GlobalVariable(*context[i].llvm, data->getType(), true, llvm::GlobalValue::ExternalLinkage, data, name);
+      var->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+    };
+    offsets(memories, IR_INSTANCE_MEMORIES);
+    offsets(tables, IR_INSTANCE_TABLES);
+
+    Func* swap = Func::Create(FuncTy::get(statety, { statety }, false), Func::ExternalLinkage, IR_INSTANCE_SWAP_FUNCTION, context[i].llvm);
+    swap->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+    builder.SetInsertPoint(BB::Create(llvm_context, "entry", swap));
+    auto previous = builder.CreateLoad(state);
+    builder.CreateStore(swap->arg_begin(), state);
+    builder.CreateRet(previous);
+  }
+
+  return ERR_SUCCESS;
 }
 
 int CallLinker(const Environment* env, const vector<const char*>& linkargs)
@@ -2331,9 +2804,9 @@ int CallLinker(const Environment* env, const vector<const char*>& linkargs)
   return err;
 }
 
-void GenerateLinkerObjects(const Environment* env, code::Context* context, vector<string>& cache, vector<string>& garbage)
+void GenerateLinkerObjects(const Environment* env, code::Context* context, varuint32 first, vector<string>& cache, vector<string>& garbage)
 {
-  for(size_t i = 0; i < env->n_modules; ++i)
+  for(size_t i = first; i < env->n_modules; ++i)
   {
     assert(context[i].m.name.get() != nullptr);
     cache.emplace_back(std::string(context[i].m.name.str(), context[i].m.name.size()) + ".o");
@@ -2341,7 +2814,7 @@ void GenerateLinkerObjects(const Environment* env, code::Context* context, vecto
     garbage.emplace_back(cache.back());
 
 #ifdef IR_PLATFORM_POSIX
-    if(i == 0)
+    if(i == first)
     { // https://stackoverflow.com/questions/9759880/automatically-executed-functions-when-loading-shared-libraries
       if(!(env->flags&ENV_LIBRARY)) // If this isn't a shared library, we must specify an entry point instead of an init function
         cache.emplace_back("--entry=" IR_INIT_FUNCTION);
@@ -2356,7 +2829,7 @@ void GenerateLinkerObjects(const Environment* env, code::Context* context, vecto
 }
 
 namespace innative {
-  IR_ERROR CompileEnvironment(const Environment* env, const char* filepath)
+  IR_ERROR CompileEnvironment(const Environment* env, const char* filepath, varuint32 first, bool resident)
   {
     // Construct the LLVM environment and current working directories
     llvm::LLVMContext llvm_context;
@@ -2374,7 +2847,17 @@ namespace innative {
     bool has_start = false;
     IR_ERROR err = ERR_SUCCESS;
 
-    code::Context* context = tmalloc<code::Context>(*env, env->n_modules);
+    // Compiler state only lives as long as this call, so it goes in a scratch scope instead of the environment's permanent arena
+    __WASM_ALLOCATOR scratch(env->alloc);
+    code::Context* context = tmalloc<code::Context>(scratch, env->n_modules);
+    varuint32 n_context = 0;
+    utility::DeferLambda<std::function<void()>> destroy([&]() {
+      for(varuint32 i = first; i < first + n_context; ++i)
+      {
+        code::kh_destroy_importhash(context[i].importhash);
+        context[i].~Context();
+      }
+    });
     string triple = llvm::sys::getProcessTriple();
 
     // Set up our target architecture, necessary up here so our code generation knows how big a pointer is
@@ -2411,40 +2894,51 @@ namespace innative {
     }
     auto machine = arch->createTargetMachine(triple, llvm::sys::getHostCPUName(), subtarget_features.getString(), opt, RM, llvm::None);
 
-    if(!env->n_modules)
+    if(first >= env->n_modules)
+      return ERR_FATAL_INVALID_MODULE;
+
+    // Instances must be created explicitly, so the library can't initialize itself on load
+    if((env->flags&ENV_INSTANCES) && (~env->flags & (ENV_LIBRARY | ENV_NO_INIT)))
+      return ERR_FATAL_INVALID_MODULE;
+
+    // Instance state has to cover every module, so it can't be split across libraries
+    if((env->flags&ENV_INSTANCES) && first > 0)
       return ERR_FATAL_INVALID_MODULE;
 
-    // Compile all modules
-    for(varuint32 i = 0; i < env->n_modules; ++i)
+    // Compile all modules that aren't already in another library
+    for(varuint32 i = first; i < env->n_modules; ++i)
     {
       new(context + i) code::Context{ *env, env->modules[i], llvm_context, 0, builder, machine, code::kh_init_importhash() };
+      context[i].scratch = &scratch;
+      context[i].resident = resident;
+      ++n_context;
       if((err = CompileModule(env, context[i])) < 0)
         return err;
       has_start |= context[i].start != nullptr;
     }
 
-    ResolveModuleExports(env, llvm_context, context);
+    ResolveModuleExports(env, llvm_context, context, first);
 
     if((!has_start || env->flags & ENV_NO_INIT) && !(env->flags&ENV_LIBRARY))
       return ERR_FATAL_INVALID_MODULE; // We can't compile an EXE without at least one start function
 
     // Create cleanup function
-    Func* cleanup = TopLevelFunction(llvm_context, builder, IR_EXIT_FUNCTION, context[0].llvm);
+    Func* cleanup = TopLevelFunction(llvm_context, builder, IR_EXIT_FUNCTION, context[first].llvm);
 
-    if(context[0].dbuilder)
+    if(context[first].dbuilder)
     {
-      FunctionDebugInfo(cleanup, context[0], true, 0);
-      builder.SetCurrentDebugLocation(llvm::DILocation::get(context[0].context, cleanup->getSubprogram()->getLine(), 0, cleanup->getSubprogram()));
+      FunctionDebugInfo(cleanup, context[first], true, 0);
+      builder.SetCurrentDebugLocation(llvm::DILocation::get(context[first].context, cleanup->getSubprogram()->getLine(), 0, cleanup->getSubprogram()));
     }
 
-    builder.CreateCall(context[0].exit, {});
+    builder.CreateCall(context[first].exit, {});
 
-    for(size_t i = 1; i < env->n_modules; ++i)
+    for(size_t i = first + 1; i < env->n_modules; ++i)
     {
       Func* stub = Func::Create(context[i].exit->getFunctionType(),
         context[i].exit->getLinkage(),
         context[i].exit->getName(),
-        context[0].llvm); // Create function prototype in main module
+        context[first].llvm); // Create function prototype in main module
       builder.CreateCall(stub, {});
     }
 
@@ -2453,37 +2947,37 @@ namespace innative {
     // Create main function that calls all init functions for all modules and all start functions
     Func* main = TopLevelFunction(llvm_context, builder, IR_INIT_FUNCTION, nullptr);
 
-    if(context[0].dbuilder)
+    if(context[first].dbuilder)
     {
-      FunctionDebugInfo(main, context[0], true, 0);
-      builder.SetCurrentDebugLocation(llvm::DILocation::get(context[0].context, main->getSubprogram()->getLine(), 0, main->getSubprogram()));
+      FunctionDebugInfo(main, context[first], true, 0);
+      builder.SetCurrentDebugLocation(llvm::DILocation::get(context[first].context, main->getSubprogram()->getLine(), 0, main->getSubprogram()));
     }
 
-    builder.CreateCall(context[0].init, {});
+    builder.CreateCall(context[first].init, {});
 
-    for(size_t i = 1; i < env->n_modules; ++i)
+    for(size_t i = first + 1; i < env->n_modules; ++i)
     {
       Func* stub = Func::Create(context[i].init->getFunctionType(),
         context[i].init->getLinkage(),
         context[i].init->getName(),
-        context[0].llvm); // Create function prototype in main module
+        context[first].llvm); // Create function prototype in main module
       builder.CreateCall(stub, {});
     }
 
     // Call every single start function in all modules AFTER we initialize them.
-    if(context[0].start != nullptr)
-      builder.CreateCall(context[0].start, {});
+    if(context[first].start != nullptr)
+      builder.CreateCall(context[first].start, {});
 
-    for(size_t i = 1; i < env->n_modules; ++i)
+    for(size_t i = first + 1; i < env->n_modules; ++i)
     {
       if(context[i].start != nullptr)
       {
-        Func* stub = context[0].llvm->getFunction(context[i].start->getName()); // Catch the case where an import from this module is being called from another module
+        Func* stub = context[first].llvm->getFunction(context[i].start->getName()); // Catch the case where an import from this module is being called from another module
         if(!stub)
           stub = Func::Create(context[i].start->getFunctionType(),
             context[i].start->getLinkage(),
             context[i].start->getName(),
-            context[0].llvm); // Create function prototype in main module
+            context[first].llvm); // Create function prototype in main module
         builder.CreateCall(stub, {});
       }
     }
@@ -2504,7 +2998,7 @@ namespace innative {
         FuncTy::get(builder.getVoidTy(), { builder.getInt32Ty() }, false),
         Func::ExternalLinkage,
         "_innative_internal_env_exit",
-        context[0].llvm);
+        context[first].llvm);
       fn_exit->setDoesNotReturn();
 
       builder.CreateCall(cleanup, {}); // Call cleanup function
@@ -2513,13 +3007,13 @@ namespace innative {
       builder.CreateUnreachable(); // This function never returns
     }
 
-    context[0].llvm->getFunctionList().push_back(main);
+    context[first].llvm->getFunctionList().push_back(main);
 
 #ifdef IR_PLATFORM_WIN32
     if(env->flags&ENV_LIBRARY)
     {
       Func* mainstub = Func::Create(
-        FuncTy::get(builder.getInt32Ty(), { builder.getInt8PtrTy(), context[0].builder.getInt32Ty(), builder.getInt8PtrTy() }, false),
+        FuncTy::get(builder.getInt32Ty(), { builder.getInt8PtrTy(), context[first].builder.getInt32Ty(), builder.getInt8PtrTy() }, false),
         Func::ExternalLinkage,
         IR_INIT_FUNCTION "-stub");
       mainstub->setCallingConv(llvm::CallingConv::X86_StdCall);
@@ -2533,8 +3027,8 @@ namespace innative {
         BB* exitblock = BB::Create(llvm_context, "exit", mainstub);
 
         llvm::SwitchInst* s = builder.CreateSwitch(mainstub->arg_begin() + 1, endblock, 2);
-        s->addCase(context->builder.getInt32(1), initblock); // DLL_PROCESS_ATTACH
-        s->addCase(context->builder.getInt32(0), exitblock); // DLL_PROCESS_DETACH
+        s->addCase(context[first].builder.getInt32(1), initblock); // DLL_PROCESS_ATTACH
+        s->addCase(context[first].builder.getInt32(0), exitblock); // DLL_PROCESS_DETACH
 
         builder.SetInsertPoint(initblock);
         builder.CreateCall(main, {});
@@ -2548,10 +3042,16 @@ namespace innative {
       }
 
       builder.CreateRet(builder.getInt32(1)); // Always return 1, since an error will trap instead.
-      context[0].llvm->getFunctionList().push_back(mainstub);
+      context[first].llvm->getFunctionList().push_back(mainstub);
     }
 #endif
 
+    if(env->flags&ENV_INSTANCES)
+    {
+      if((err = CompileInstanceState(env, llvm_context, context)) < 0)
+        return err;
+    }
+
     // Annotate functions
     AnnotateFunctions(env, context);
 
@@ -2602,7 +3102,7 @@ namespace innative {
       llvm::ModulePassManager modulePassManager = passBuilder.buildPerModuleDefaultPipeline(optlevel, env->loglevel >= LOG_DEBUG);
       
       // Optimize all modules
-      for(size_t i = 1; i < env->n_modules; ++i)
+      for(size_t i = first + 1; i < env->n_modules; ++i)
         modulePassManager.run(*context[i].llvm, moduleAnalysisManager);
       
       /*{
@@ -2677,7 +3177,7 @@ namespace innative {
     }
 
     // Finalize all modules
-    for(varuint32 i = 0; i < env->n_modules; ++i)
+    for(varuint32 i = first; i < env->n_modules; ++i)
     {
       if(context[i].dbuilder)
         context[i].dbuilder->finalize();
@@ -2737,7 +3237,7 @@ namespace innative {
       );
 
       // Generate object code
-      GenerateLinkerObjects(env, context, cache, garbage);
+      GenerateLinkerObjects(env, context, first, cache, garbage);
 
       // Write all in-memory environments to cache files
       for(Embedding* cur = env->embeddings; cur != nullptr; cur = cur->next)
@@ -9,7 +9,9 @@
 #include <string>
 
 namespace innative {
-  IR_ERROR CompileEnvironment(const Environment* env, const char* file);
+  // Modules before first are left out, because they were already compiled into a library that is loaded before this one. Pass resident
+  // when compiling into such a chain of libraries, so imports link against the library of the module that defines them.
+  IR_ERROR CompileEnvironment(const Environment* env, const char* file, varuint32 first = 0, bool resident = false);
   std::vector<std::string> GetSymbols(const char* file);
   void AppendIntrinsics(Environment& env);
 }
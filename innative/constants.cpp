@@ -237,6 +237,6 @@ namespace innative {
       "f32.reinterpret_i32",   // 0xbe
       "f64.reinterpret_i64"    // 0xbf
     };
-    int OPNAMECOUNT = sizeof(OPNAMES) / sizeof(const char*);
+    int OPNAMECOUNT = sizeof(OPNAMES) / sizeof(OPNAMES[0]);
   }
 }
@@ -17,14 +17,29 @@ void innative_runtime(IRExports* exports)
 {
   exports->CreateEnvironment = &CreateEnvironment;
   exports->AddModule = &AddModule;
+  exports->AddModuleAsync = &AddModuleAsync;
+  exports->BeginModuleStream = &BeginModuleStream;
+  exports->PushModuleStream = &PushModuleStream;
+  exports->FinishModuleStream = &FinishModuleStream;
   exports->AddWhitelist = &AddWhitelist;
   exports->WaitForLoad = &WaitForLoad;
   exports->AddEmbedding = &AddEmbedding;
   exports->Compile = &Compile;
+  exports->CompileAsync = &CompileAsync;
   exports->LoadFunction = &LoadFunction;
   exports->LoadGlobal = &LoadGlobal;
+  exports->LoadTypedFunction = &LoadTypedFunction;
+  exports->LoadExportDirectory = &LoadExportDirectory;
+  exports->FindExport = &FindExport;
   exports->LoadAssembly = &LoadAssembly;
   exports->DestroyEnvironment = &DestroyEnvironment;
+  exports->GetAllocatorStats = &GetAllocatorStats;
+  exports->CreateInstance = &CreateInstance;
+  exports->EnterInstance = &EnterInstance;
+  exports->LeaveInstance = &LeaveInstance;
+  exports->SaveInstance = &SaveInstance;
+  exports->ResetInstance = &ResetInstance;
+  exports->DestroyInstance = &DestroyInstance;
 }
 
 int innative_compile_file(const char* file, const char* out, uint64_t flags, uint64_t optimize, uint64_t features, bool dynamic, const struct _IR_WHITELIST* whitelist, unsigned int n_whitelist, const char* arg0)
@@ -50,15 +65,9 @@ int innative_compile_file(const char* file, const char* out, uint64_t flags, uin
   }
 
   // Load the module
-  long sz = 0;
   int err = ERR_SUCCESS;
-  auto data_module = utility::LoadFile(file, sz);
   Path name(file);
-
-  if(sz > 0)
-    AddModule(env, data_module.get(), sz, name.RemoveExtension().c_str(), &err);
-  else
-    err = -1;
+  AddModule(env, file, 0, name.RemoveExtension().c_str(), &err); // Passing the path lets the environment map the file instead of copying it
 
   if(err < 0)
   {
@@ -157,6 +166,13 @@ int innative_compile_script(const uint8_t* data, size_t sz, Environment* env, bo
   return err;
 }
 
+int innative_snapshot(Environment* env, const char* scratch)
+{
+  int err = SnapshotEnvironment(env, scratch);
+  remove(scratch);
+  return err;
+}
+
 void innative_set_work_dir_to_bin(const char* arg0)
 {
   utility::SetWorkingDir(utility::GetProgramPath(arg0).BaseDir().c_str());
@@ -0,0 +1,135 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "instruction.h"
+#include "util.h"
+#include <assert.h>
+
+using namespace innative;
+using namespace utility;
+
+namespace innative {
+  namespace internal {
+    template<class T>
+    IR_FORCEINLINE void WritePacked(uint8_t*& p, T v)
+    {
+      memcpy(p, &v, sizeof(T));
+      p += sizeof(T);
+    }
+  }
+}
+
+size_t innative::PackedSize(const Instruction& ins)
+{
+  switch(ins.opcode)
+  {
+  case OP_block:
+  case OP_loop:
+  case OP_if:
+    return 1 + sizeof(varsint7);
+  case OP_br:
+  case OP_br_if:
+  case OP_local_get:
+  case OP_local_set:
+  case OP_local_tee:
+  case OP_global_get:
+  case OP_global_set:
+  case OP_call:
+  case OP_memory_grow:
+  case OP_memory_size:
+  case OP_i32_const:
+  case OP_f32_const:
+    return 1 + sizeof(uint32);
+  case OP_i64_const:
+  case OP_f64_const:
+    return 1 + sizeof(varuint64);
+  case OP_br_table:
+    return 1 + sizeof(varuint32) + sizeof(varuint32*) + sizeof(varuint32);
+  case OP_call_indirect:
+    return 1 + sizeof(varuint32) + sizeof(varuint1);
+  }
+
+  if(ins.opcode >= OP_i32_load && ins.opcode <= OP_i64_store32)
+    return 1 + sizeof(varuint32) + sizeof(varuint32) + sizeof(varuptr);
+  return 1;
+}
+
+uint8_t* innative::PackInstruction(const Instruction& ins, uint8_t* out)
+{
+  using internal::WritePacked;
+  *out++ = ins.opcode;
+
+  switch(ins.opcode)
+  {
+  case OP_block:
+  case OP_loop:
+  case OP_if:
+    WritePacked<varsint7>(out, ins.immediates[0]._varsint7);
+    break;
+  case OP_br:
+  case OP_br_if:
+  case OP_local_get:
+  case OP_local_set:
+  case OP_local_tee:
+  case OP_global_get:
+  case OP_global_set:
+  case OP_call:
+  case OP_memory_grow:
+  case OP_memory_size:
+  case OP_i32_const:
+  case OP_f32_const:
+    WritePacked<uint32>(out, ins.immediates[0]._uint32);
+    break;
+  case OP_i64_const:
+  case OP_f64_const:
+    WritePacked<varuint64>(out, ins.immediates[0]._varuint64);
+    break;
+  case OP_br_table:
+    WritePacked<varuint32>(out, ins.immediates[0].n_table);
+    WritePacked<varuint32*>(out, ins.immediates[0].table);
+    WritePacked<varuint32>(out, ins.immediates[1]._varuint32);
+    break;
+  case OP_call_indirect:
+    WritePacked<varuint32>(out, ins.immediates[0]._varuint32);
+    WritePacked<varuint1>(out, ins.immediates[1]._varuint1);
+    break;
+  default:
+    if(ins.opcode >= OP_i32_load && ins.opcode <= OP_i64_store32)
+    {
+      WritePacked<varuint32>(out, ins.immediates[0]._varuint32);
+      WritePacked<varuint32>(out, ins.immediates[2]._varuint32);
+      WritePacked<varuptr>(out, ins.immediates[1]._varuptr);
+    }
+    break;
+  }
+
+  return out;
+}
+
+IR_ERROR innative::AppendInstruction(FunctionBody& body, const Instruction& ins)
+{
+  size_t sz = PackedSize(ins);
+  if(!(body.body = trealloc<uint8_t>(body.body, body.n_code + sz)))
+    return assert(false), ERR_FATAL_OUT_OF_MEMORY;
+  if(!(body.positions = trealloc<SourcePosition>(body.positions, body.n_body + 1)))
+    return assert(false), ERR_FATAL_OUT_OF_MEMORY;
+
+  PackInstruction(ins, body.body + body.n_code);
+  body.positions[body.n_body] = SourcePosition{ ins.line, ins.column };
+  body.n_code += (varuint32)sz;
+  ++body.n_body;
+  return ERR_SUCCESS;
+}
+
+IR_ERROR innative::PatchImmediate(FunctionBody& body, varuint32 offset, int slot, varuint32 value)
+{
+  if(offset >= body.n_code || slot < 0 || slot >= MAX_IMMEDIATES)
+    return ERR_INVALID_FUNCTION_BODY;
+
+  Instruction ins;
+  InstructionCursor cursor(body, offset);
+  cursor.Next(ins);
+  ins.immediates[slot]._varuint32 = value;
+  PackInstruction(ins, body.body + offset); // The layout only depends on the opcode, so this rewrites the same bytes
+  return ERR_SUCCESS;
+}
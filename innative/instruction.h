@@ -0,0 +1,123 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#ifndef __INSTRUCTION_H__IR__
+#define __INSTRUCTION_H__IR__
+
+#include "innative/schema.h"
+#include <string.h>
+
+namespace innative {
+  // Function bodies are stored as a packed stream instead of an array of Instructions, because an Instruction is mostly empty
+  // immediate slots. Each instruction is its opcode byte followed by only the immediates that opcode uses, at their natural
+  // width. The layout depends only on the opcode, so an immediate can be patched in place. br_table targets stay in their own
+  // allocation and the stream just stores a pointer to them. Source positions are kept in FunctionBody::positions.
+  namespace internal {
+    template<class T>
+    IR_FORCEINLINE T ReadPacked(const uint8_t*& p)
+    {
+      T v;
+      memcpy(&v, p, sizeof(T));
+      p += sizeof(T);
+      return v;
+    }
+  }
+
+  // Returns the number of bytes ins takes up in a packed stream
+  size_t PackedSize(const Instruction& ins);
+
+  // No instruction takes up more than this, which is a memory access or a br_table with 64-bit pointers
+  static const size_t MAX_PACKED_SIZE = 1 + sizeof(varuint32) + sizeof(varuint32) + sizeof(varuint64);
+
+  // Writes ins to out, which must have room for PackedSize(ins) bytes, and returns a pointer just past it
+  uint8_t* PackInstruction(const Instruction& ins, uint8_t* out);
+
+  // Appends ins to the heap-allocated packed stream of a function body being built incrementally
+  IR_ERROR AppendInstruction(FunctionBody& body, const Instruction& ins);
+
+  // Overwrites one immediate of the instruction starting at the given byte offset of the packed stream
+  IR_ERROR PatchImmediate(FunctionBody& body, varuint32 offset, int slot, varuint32 value);
+
+  // Decodes a packed stream one instruction at a time into a reusable Instruction
+  class InstructionCursor
+  {
+  public:
+    explicit InstructionCursor(const FunctionBody& body, varuint32 offset = 0) :
+      cur(body.body + offset), end(body.body + body.n_code), positions(body.positions), index(0) {}
+
+    inline bool Done() const { return cur >= end; }
+    inline varuint32 Index() const { return index; } // Index of the next instruction
+
+    // Decodes the next instruction into ins, returning false once the stream is exhausted
+    IR_FORCEINLINE bool Next(Instruction& ins)
+    {
+      using internal::ReadPacked;
+      if(cur >= end)
+        return false;
+
+      ins.opcode = *cur++;
+      switch(ins.opcode)
+      {
+      case OP_block:
+      case OP_loop:
+      case OP_if:
+        ins.immediates[0]._varsint7 = ReadPacked<varsint7>(cur);
+        break;
+      case OP_br:
+      case OP_br_if:
+      case OP_local_get:
+      case OP_local_set:
+      case OP_local_tee:
+      case OP_global_get:
+      case OP_global_set:
+      case OP_call:
+      case OP_memory_grow:
+      case OP_memory_size:
+      case OP_i32_const:
+      case OP_f32_const:
+        ins.immediates[0]._uint32 = ReadPacked<uint32>(cur);
+        break;
+      case OP_i64_const:
+      case OP_f64_const:
+        ins.immediates[0]._varuint64 = ReadPacked<varuint64>(cur);
+        break;
+      case OP_br_table:
+        ins.immediates[0].n_table = ReadPacked<varuint32>(cur);
+        ins.immediates[0].table = ReadPacked<varuint32*>(cur);
+        ins.immediates[1]._varuint32 = ReadPacked<varuint32>(cur);
+        break;
+      case OP_call_indirect:
+        ins.immediates[0]._varuint32 = ReadPacked<varuint32>(cur);
+        ins.immediates[1]._varuint1 = ReadPacked<varuint1>(cur);
+        break;
+      default:
+        if(ins.opcode >= OP_i32_load && ins.opcode <= OP_i64_store32)
+        {
+          ins.immediates[0]._varuint32 = ReadPacked<varuint32>(cur);
+          ins.immediates[2]._varuint32 = ReadPacked<varuint32>(cur);
+          ins.immediates[1]._varuptr = ReadPacked<varuptr>(cur);
+        }
+        break;
+      }
+
+      if(positions)
+      {
+        ins.line = positions[index].line;
+        ins.column = positions[index].column;
+      }
+      else
+        ins.line = ins.column = 0;
+
+      ++index;
+      return true;
+    }
+
+  private:
+    const uint8_t* cur;
+    const uint8_t* end;
+    const SourcePosition* positions;
+    varuint32 index;
+  };
+}
+
+#endif
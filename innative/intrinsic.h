@@ -81,6 +81,8 @@ namespace innative {
       llvm::Function* exit;
       llvm::Function* start;
       llvm::Function* memgrow;
+      __WASM_ALLOCATOR* scratch; // Temporary memory for the function body being compiled
+      bool resident; // Modules are split across libraries that stay loaded, so imports link against the module that defines them
     };
 
     llvm::Function* IR_Intrinsic_ToC(llvm::Function* f, struct Context& context);
@@ -6,6 +6,12 @@
 #include "parse.h"
 #include "validate.h"
 #include <limits>
+#include <algorithm>
+
+#if defined(IR_CPU_x86_64) || defined(IR_CPU_x86)
+#define IR_WAT_SSE2
+#include <emmintrin.h>
+#endif
 
 using std::string;
 using std::numeric_limits;
@@ -15,36 +21,144 @@ using namespace utility;
 
 namespace innative {
   namespace wat {
-    KHASH_INIT(tokens, StringRef, WatTokenID, 1, internal::__ac_X31_hash_stringrefins, kh_int_hash_equal);
+    static const char* tokenlist[] = { "(", ")", "module", "import", "type", "start", "func", "table", "memory", "global", "export",
+      "data", "elem", "offset", "align", "local", "result", "param", "i32", "i64", "f32", "f64", "funcref", "mut", "block", "loop",
+      "if", "then", "else", "end", /* script extensions */ "binary", "quote", "register", "invoke", "get", "assert_return",
+      "assert_return_canonical_nan", "assert_return_arithmetic_nan", "assert_trap", "assert_malformed", "assert_invalid",
+      "assert_unlinkable", "assert_exhaustion", "script", "input", "output" };
 
-    template<int LEN>
-    inline kh_tokens_t* GenTokenHash(const char* (&list)[LEN], std::initializer_list<std::pair<const char*, int>> legacy)
+    // Keywords and operator names are a fixed set, so they're looked up through a perfect hash built once at startup. The top
+    // bits of a word's hash pick a bucket, and each bucket has a seed that sends all of its words to their own slot, so a
+    // lookup is one hash and one comparison.
+    class WatKeywords
     {
-      kh_tokens_t* h = kh_init_tokens();
+    public:
+      struct Entry
+      {
+        const char* s;
+        size_t len;
+        uint64_t first;
+        uint64_t last;
+        WatTokenID id;
+        uint8_t op;
+      };
 
-      WatTokenID count = 0;
-      int r;
-      for(int i = 0; i < LEN; ++i)
+      WatKeywords()
       {
-        auto iter = kh_put_tokens(h, StringRef{ list[i], strlen(list[i]) }, &r);
-        kh_val(h, iter) = ++count;
+        std::vector<Entry> words;
+        for(size_t i = 0; i < sizeof(tokenlist) / sizeof(tokenlist[0]); ++i)
+          words.push_back(MakeEntry(tokenlist[i], (WatTokenID)(i + 1), 0xFF));
+        words.push_back(MakeEntry("anyfunc", TOKEN_FUNCREF, 0xFF));
+
+        for(int i = 0; i < OPNAMECOUNT; ++i)
+        {
+          Entry e = MakeEntry(OPNAMES[i], TOKEN_OPERATOR, (uint8_t)i);
+          auto same = [&e](const Entry& w) { return w.len == e.len && !memcmp(w.s, e.s, e.len); };
+          if(strcmp(e.s, "RESERVED") != 0 && std::find_if(words.begin(), words.end(), same) == words.end()) // Keywords like block take priority
+            words.push_back(e);
+        }
+
+        std::vector<size_t> buckets[BUCKETS];
+        size_t order[BUCKETS];
+        for(size_t i = 0; i < words.size(); ++i)
+          buckets[Hash(words[i].first, words[i].last, words[i].len) >> (64 - BUCKET_BITS)].push_back(i);
+        for(size_t i = 0; i < BUCKETS; ++i)
+          order[i] = i;
+        std::sort(order, order + BUCKETS, [&buckets](size_t l, size_t r) { return buckets[l].size() > buckets[r].size(); }); // Crowded buckets go first, while there's the most room
+
+        for(auto& e : _slots)
+          e = Entry{ nullptr, (size_t)~0, 0, 0, TOKEN_NONE, 0xFF };
+        for(size_t b : order)
+        {
+          _seeds[b] = 0;
+          while(!Place(words, buckets[b], _seeds[b]))
+          {
+            assert(_seeds[b] != 0xFFFF); // Only possible if two words have the same hash
+            ++_seeds[b];
+          }
+        }
       }
 
-      for(auto& e : legacy)
+      // The word has to be inside the input, which ends at end
+      IR_FORCEINLINE const Entry* Find(const char* s, size_t len, const char* end) const
       {
-        auto iter = kh_put_tokens(h, StringRef{ e.first, strlen(e.first) }, &r);
-        kh_val(h, iter) = e.second;
+        uint64_t first;
+        uint64_t last;
+        Load(s, len, end, first, last);
+        uint64_t h = Hash(first, last, len);
+        const Entry& e = _slots[Slot(h, _seeds[h >> (64 - BUCKET_BITS)])];
+        if(e.len != len || e.first != first || e.last != last)
+          return nullptr;
+        return (len <= 16 || !memcmp(e.s + 8, s + 8, len - 16)) ? &e : nullptr; // Anything shorter is covered by first and last
       }
 
-      return h;
-    }
+    private:
+      static const int BUCKET_BITS = 7;
+      static const int SLOT_BITS = 9;
+      static const size_t BUCKETS = 1 << BUCKET_BITS;
 
-    static const char* tokenlist[] = { "(", ")", "module", "import", "type", "start", "func", "table", "memory", "global", "export",
-      "data", "elem", "offset", "align", "local", "result", "param", "i32", "i64", "f32", "f64", "funcref", "mut", "block", "loop",
-      "if", "then", "else", "end", /* script extensions */ "binary", "quote", "register", "invoke", "get", "assert_return",
-      "assert_return_canonical_nan", "assert_return_arithmetic_nan", "assert_trap", "assert_malformed", "assert_invalid",
-      "assert_unlinkable", "assert_exhaustion", "script", "input", "output" };
-    static const kh_tokens_t* tokenhash = GenTokenHash(tokenlist, { { "anyfunc", TOKEN_FUNCREF } });
+      // Gets the first and last 8 bytes of a word, which overlap if it's shorter than 16 and are zero padded if it's shorter than 8
+      static IR_FORCEINLINE void Load(const char* s, size_t len, const char* end, uint64_t& first, uint64_t& last)
+      {
+        if(len >= 8)
+        {
+          memcpy(&first, s, 8);
+          memcpy(&last, s + len - 8, 8);
+          return;
+        }
+
+        first = 0;
+#ifdef IR_ENDIAN_LITTLE
+        if(s + 8 <= end) // Read the whole word at once and mask off what isn't part of it
+        {
+          memcpy(&first, s, 8);
+          first &= len ? (~0ULL >> (64 - len * 8)) : 0;
+        }
+        else
+#endif
+          memcpy(&first, s, len);
+        last = first;
+      }
+
+      static IR_FORCEINLINE uint64_t Hash(uint64_t first, uint64_t last, size_t len)
+      {
+        uint64_t h = (first ^ (last * 0x9E3779B97F4A7C15ULL) ^ len) * 0xFF51AFD7ED558CCDULL;
+        return h ^ (h >> 29);
+      }
+
+      static Entry MakeEntry(const char* s, WatTokenID id, uint8_t op)
+      {
+        Entry e = { s, strlen(s), 0, 0, id, op };
+        Load(e.s, e.len, e.s + e.len, e.first, e.last);
+        return e;
+      }
+
+      static IR_FORCEINLINE size_t Slot(uint64_t h, uint16_t seed)
+      {
+        return (size_t)(((h ^ (seed * 0xC4CEB9FE1A85EC53ULL)) * 0x9E3779B97F4A7C15ULL) >> (64 - SLOT_BITS));
+      }
+
+      bool Place(const std::vector<Entry>& words, const std::vector<size_t>& bucket, uint16_t seed)
+      {
+        size_t slots[BUCKETS];
+        for(size_t i = 0; i < bucket.size(); ++i)
+        {
+          const Entry& w = words[bucket[i]];
+          slots[i] = Slot(Hash(w.first, w.last, w.len), seed);
+          if(_slots[slots[i]].s != nullptr || std::find(slots, slots + i, slots[i]) != slots + i)
+            return false;
+        }
+
+        for(size_t i = 0; i < bucket.size(); ++i)
+          _slots[slots[i]] = words[bucket[i]];
+        return true;
+      }
+
+      uint16_t _seeds[BUCKETS];
+      Entry _slots[1 << SLOT_BITS];
+    };
+
+    static const WatKeywords keywords;
 
     template<int LEN>
     inline const char* __getTokenString(WatTokenID token, const char* (&list)[LEN])
@@ -54,38 +168,33 @@ namespace innative {
 
     const char* GetTokenString(WatTokenID token) { return __getTokenString(token - 1, tokenlist); }
 
-    const char* CheckTokenINF(const char* s, const char* end, std::string* target)
+    const char* CheckTokenINF(const char* s, const char* end)
     {
       if(s >= end)
         return nullptr;
 
-      const char* begin = s;
       if(s[0] == '-' || s[0] == '+')
         ++s;
       int i;
-      for(i = 0; i < 3 && s < end; ++i)
+      for(i = 0; i < 3 && s + i < end; ++i)
       {
         if(s[i] != "inf"[i] && s[i] != "INF"[i])
           return nullptr;
       }
       if(i != 3)
         return nullptr;
-      s += 3;
-      if(target)
-        target->assign(begin, s - begin);
-      return s;
+      return s + 3;
     }
 
-    const char* CheckTokenNAN(const char* s, const char* end, std::string* target)
+    const char* CheckTokenNAN(const char* s, const char* end)
     {
       if(s >= end)
         return nullptr;
 
       if(s[0] == '-' || s[0] == '+')
         ++s;
-      const char* begin = s;
       int i;
-      for(i = 0; i < 3 && s < end; ++i)
+      for(i = 0; i < 3 && s + i < end; ++i)
       {
         if(s[i] != "nan"[i] && s[i] != "NAN"[i])
           return nullptr;
@@ -96,122 +205,462 @@ namespace innative {
       if(s >= end)
         return end;
 
-      for(i = 0; i < 3 && s < end; ++i)
+      for(i = 0; i < 3 && s + i < end; ++i)
       {
         if(s[i] != ":0x"[i])
           return s;
       }
+      if(i < 3)
+        return s;
       s += i;
 
-      while(s < end && isxdigit(*s)) ++s;
-
-      if(target)
-        target->assign(begin + 3 + i, s - begin - 3 - i);
-
+      while(s < end && (isxdigit(*s) || *s == '_')) ++s;
       return s;
     }
 
-    template<typename T, typename Arg, typename... Args>
-    int ResolveTokenNumber(const WatToken& token, string& numbuf, Arg(*fn)(const char*, char**, Args...), T& out, Args... args)
+    // Numeric literals are parsed straight out of the token. Decimal floats go through the Eisel-Lemire algorithm, which
+    // multiplies the first 19 significant digits by a 128-bit approximation of the power of ten and can tell when that
+    // approximation isn't enough to round correctly. The table of powers is built once at startup from exact big integers.
+    class WatPowersOfTen
     {
-      numbuf.clear();
-      int length = token.len;
-      int(*digitcheck)(int) = (token.len > 2 && token.pos[0] == '0' && token.pos[1] == 'x') ? &isxdigit : &isdigit;
-      for(size_t i = 0; i < token.len; ++i)
+    public:
+      static const int MIN = -342;
+      static const int MAX = 308;
+
+      WatPowersOfTen()
       {
-        if(token.pos[i] == '_')
+        std::vector<uint32_t> n(1, 1);
+        for(int q = 0; q <= MAX; ++q)
         {
-          if(!i || (i + 1) >= token.len || !(*digitcheck)(token.pos[i - 1]) || !(*digitcheck)(token.pos[i + 1])) // If it's a _, it's valid only if it's surrounded by valid digits
-            return ERR_WAT_INVALID_NUMBER;
-          --length; // Compensate for the character we removed from the amount we expect to consume
+          Top128(n, _powers[q - MIN]);
+          uint64_t carry = 0;
+          for(auto& w : n)
+          {
+            carry += (uint64_t)w * 5;
+            w = (uint32_t)carry;
+            carry >>= 32;
+          }
+          if(carry)
+            n.push_back((uint32_t)carry);
+        }
+
+        n.assign(1024 / 32 + 1, 0); // 2^1024 keeps at least 128 bits after dividing by 5^342
+        n.back() = 1;
+        for(int q = -1; q >= MIN; --q)
+        {
+          uint64_t rem = 0;
+          for(size_t i = n.size(); i-- > 0;)
+          {
+            rem = (rem << 32) | n[i];
+            n[i] = (uint32_t)(rem / 5);
+            rem %= 5;
+          }
+          while(!n.back())
+            n.pop_back();
+          Top128(n, _powers[q - MIN]);
         }
-        else // otherwise, only add all non-underscore characters
-          numbuf += token.pos[i];
       }
 
-      if(digitcheck == &isdigit) // If this is a decimal number, strip all leading 0s because otherwise it'll be considered octal 
+      // 10^q is about hi * 2^(floor(q * log2(10)) - 127), rounded down
+      IR_FORCEINLINE const uint64_t* operator[](int q) const { return _powers[q - MIN]; }
+
+    private:
+      static void Top128(const std::vector<uint32_t>& n, uint64_t(&out)[2])
       {
-        size_t iter = numbuf.find_first_not_of('0');
-        if(iter != std::string::npos && iter > 0)
+        int64_t bit = (int64_t)n.size() * 32 - 1;
+        while(!(n[bit >> 5] & (1u << (bit & 31))))
+          --bit;
+
+        out[0] = out[1] = 0;
+        for(int i = 0; i < 128; ++i, --bit)
         {
-          numbuf.erase(0, iter);
-          length -= iter;
+          uint64_t b = (bit >= 0) ? ((n[bit >> 5] >> (bit & 31)) & 1) : 0;
+          out[0] = (out[0] << 1) | (out[1] >> 63);
+          out[1] = (out[1] << 1) | b;
         }
       }
 
-      errno = 0;
-      char* end;
-      out = (*fn)(numbuf.c_str(), &end, args...);
-      if(errno == ERANGE)
-        return ERR_WAT_OUT_OF_RANGE;
-      // assert(!(errno != 0 || (end - numbuf.c_str()) != length));
-      return (errno != 0 || (end - numbuf.c_str()) != length) ? ERR_WAT_INVALID_NUMBER : ERR_SUCCESS;
+      uint64_t _powers[MAX - MIN + 1][2]; // { high, low }
+    };
+
+    static const WatPowersOfTen powers;
+
+    template<class T> struct WatFloat;
+    template<> struct WatFloat<float32>
+    {
+      typedef uint32_t BITS;
+      static const int MANTISSA = 23;
+      static const int BIAS = 127;
+      static const int EXPONENT = 0xFF;
+    };
+    template<> struct WatFloat<float64>
+    {
+      typedef uint64_t BITS;
+      static const int MANTISSA = 52;
+      static const int BIAS = 1023;
+      static const int EXPONENT = 0x7FF;
+    };
+
+    template<class T>
+    IR_FORCEINLINE T FloatFromBits(uint64_t bits, bool negative)
+    {
+      typename WatFloat<T>::BITS b = (typename WatFloat<T>::BITS)bits;
+      if(negative)
+        b |= (typename WatFloat<T>::BITS)1 << (sizeof(b) * 8 - 1);
+      T f;
+      memcpy(&f, &b, sizeof(T));
+      return f;
     }
 
-    int ResolveTokenf32(const WatToken& token, string& numbuf, float32& out)
+    // Rounds man * 10^exp10 to the nearest float, returning false if that can't be decided from 128 bits of the product, or
+    // if the result is subnormal or out of range.
+    template<class T>
+    bool EiselLemire(uint64_t man, int64_t exp10, uint64_t& bits)
     {
-      char* last;
+      typedef WatFloat<T> F;
+      const uint64_t low = (1ULL << (64 - F::MANTISSA - 3)) - 1; // Bits of the product below the ones we keep
+      const uint64_t* pow = powers[(int)exp10];
+
+      unsigned int clz = internal::CountLeadingZeros(man);
+      man <<= clz;
+      uint64_t exp2 = (uint64_t)(((217706 * exp10) >> 16) + 64 + F::BIAS) - clz;
 
-      numbuf.assign("400000"); // Hex for the first bit in the mantissa
-      if(CheckTokenNAN(token.pos, token.pos + token.len, &numbuf))
+      uint64_t lo;
+      uint64_t hi = internal::Multiply128(man, pow[0], lo);
+      if((hi & low) == low && lo + man < man) // The rest of the power could carry into the bits we keep
       {
-        union { uint32_t i; float f; } u = { 0x7F800000UL | strtoul(numbuf.c_str(), &last, 16) };
-        if(token.pos[0] == '-')
-          u.i |= 0x80000000UL;
+        uint64_t lo2;
+        uint64_t hi2 = internal::Multiply128(man, pow[1], lo2);
+        uint64_t merged = lo + hi2;
+        hi += (merged < lo);
+        lo = merged;
+        if((hi & low) == low && lo + 1 == 0 && lo2 + man < man)
+          return false;
+      }
 
-        out = u.f;
-        return ERR_SUCCESS;
+      uint64_t msb = hi >> 63;
+      uint64_t mantissa = hi >> (msb + 64 - F::MANTISSA - 3);
+      exp2 -= 1 ^ msb;
+
+      if(!lo && !(hi & low) && (mantissa & 3) == 1) // Exactly halfway, or too close to tell
+        return false;
+
+      mantissa += mantissa & 1;
+      mantissa >>= 1;
+      if(mantissa >> (F::MANTISSA + 1))
+      {
+        mantissa >>= 1;
+        exp2 += 1;
       }
+      if(exp2 - 1 >= F::EXPONENT - 1)
+        return false;
+
+      bits = (exp2 << F::MANTISSA) | (mantissa & ((1ULL << F::MANTISSA) - 1));
+      return true;
+    }
+
+    // Rounds man * 2^exp2 to the nearest float, where sticky means there were more nonzero bits below man
+    template<class T>
+    int RoundWatFloat(uint64_t man, bool sticky, int64_t exp2, bool negative, T& out)
+    {
+      typedef WatFloat<T> F;
+      if(!man)
+        return out = FloatFromBits<T>(0, negative), ERR_SUCCESS;
+
+      unsigned int clz = internal::CountLeadingZeros(man);
+      man <<= clz;
+      int64_t exponent = exp2 - clz + 63; // Exponent of the top bit
+      int64_t shift = 63 - F::MANTISSA;
+      bool subnormal = exponent < 1 - F::BIAS;
+      if(subnormal)
+        shift = std::min<int64_t>(shift + (1 - F::BIAS) - exponent, 65);
+
+      uint64_t kept = (shift < 64) ? (man >> shift) : 0;
+      bool half = (shift <= 64) && ((man >> (shift - 1)) & 1);
+      bool rest = sticky || (shift > 1 && shift <= 64 && (man & ((1ULL << (shift - 1)) - 1)) != 0) || shift > 64;
+      if(half && (rest || (kept & 1)))
+        ++kept;
 
-      if(CheckTokenINF(token.pos, token.pos + token.len, &numbuf) != nullptr)
+      if(subnormal) // Rounding up into the smallest normal number still gives the right bits
+        return out = FloatFromBits<T>(kept, negative), ERR_SUCCESS;
+
+      int64_t biased = exponent + F::BIAS;
+      if(kept >> (F::MANTISSA + 1))
       {
-        out = strtof(numbuf.c_str(), &last);
-        return (last - numbuf.c_str()) == numbuf.size() ? ERR_SUCCESS : ERR_WAT_INVALID_NUMBER;
+        kept >>= 1;
+        ++biased;
       }
-      return ResolveTokenNumber<float32>(token, numbuf, &strtof, out);
+      if(biased >= F::EXPONENT)
+        return ERR_WAT_OUT_OF_RANGE;
+
+      out = FloatFromBits<T>(((uint64_t)biased << F::MANTISSA) | (kept & ((1ULL << F::MANTISSA) - 1)), negative);
+      return ERR_SUCCESS;
     }
 
-    int ResolveTokenf64(const WatToken& token, string& numbuf, float64& out)
+    template<bool HEX>
+    IR_FORCEINLINE int WatDigit(char c)
     {
-      char* last;
+      if((unsigned char)(c - '0') < 10)
+        return c - '0';
+      if(HEX && (unsigned char)((c | 0x20) - 'a') < 6)
+        return (c | 0x20) - 'a' + 10;
+      return -1;
+    }
 
-      numbuf.assign("8000000000000"); // Hex for the first bit in the mantissa
-      if(CheckTokenNAN(token.pos, token.pos + token.len, &numbuf))
+    // Reads digits that may be separated by single underscores, passing each one to fn. Returns nullptr if an underscore isn't
+    // between two digits.
+    template<bool HEX, typename F>
+    IR_FORCEINLINE const char* ReadWatDigits(const char* s, const char* end, F fn)
+    {
+      const char* begin = s;
+      for(; s < end; ++s)
       {
-        union { uint64_t i; double f; } u = { 0x7FF0000000000000ULL | strtoull(numbuf.c_str(), &last, 16) };
-        if(token.pos[0] == '-')
-          u.i |= 0x8000000000000000ULL;
+        int d = WatDigit<HEX>(*s);
+        if(d >= 0)
+          fn(d);
+        else if(*s != '_')
+          break;
+        else if(s == begin || s + 1 >= end || WatDigit<HEX>(s[1]) < 0)
+          return nullptr;
+      }
+      return s;
+    }
 
-        out = u.f;
+    // Reads the decimal exponent of a float, which saturates long before it could overflow
+    IR_FORCEINLINE const char* ReadWatExponent(const char* s, const char* end, int64_t& exp)
+    {
+      bool negative = (s < end && s[0] == '-');
+      if(s < end && (s[0] == '-' || s[0] == '+'))
+        ++s;
+      int64_t e = 0;
+      const char* p = ReadWatDigits<false>(s, end, [&e](int d) { e = std::min<int64_t>(e * 10 + d, 1000000); });
+      if(!p || p == s)
+        return nullptr;
+      exp += negative ? -e : e;
+      return p;
+    }
+
+    // Eisel-Lemire can't decide exact halfway cases, subnormals or overflow, so those are rounded by the C library from a copy
+    // of just their significant digits. The copy has no decimal point, so the locale doesn't matter.
+    template<class T>
+    int ParseWatFloatSlow(const char* s, const char* digitend, int64_t exp10, bool negative, T& out)
+    {
+      const size_t MAX_DIGITS = 800; // Enough to decide the rounding of any float
+      char buf[MAX_DIGITS + 32];
+      size_t n = 0;
+      bool fraction = false;
+      bool sticky = false;
+
+      if(negative)
+        buf[n++] = '-';
+      size_t start = n;
+      for(; s < digitend; ++s)
+      {
+        if(*s == '_')
+          continue;
+        if(*s == '.')
+        {
+          fraction = true;
+          continue;
+        }
+        if(fraction)
+          --exp10;
+        if(n == start && *s == '0')
+          continue;
+        if(n - start < MAX_DIGITS)
+          buf[n++] = *s;
+        else
+        {
+          ++exp10;
+          sticky = sticky || *s != '0';
+        }
+      }
+      if(sticky) // Any digit past the last one we kept is enough to break a tie
+      {
+        buf[n++] = '1';
+        --exp10;
+      }
+      snprintf(buf + n, sizeof(buf) - n, "e%lld", (long long)exp10);
+
+      char* last;
+      out = (sizeof(T) == sizeof(float)) ? (T)strtof(buf, &last) : (T)strtod(buf, &last);
+      return (out == numeric_limits<T>::infinity() || out == -numeric_limits<T>::infinity()) ? ERR_WAT_OUT_OF_RANGE : ERR_SUCCESS;
+    }
+
+    template<class T>
+    int ParseWatFloat(const char* s, const char* end, T& out)
+    {
+      typedef WatFloat<T> F;
+      bool negative = (s < end && s[0] == '-');
+      if(s < end && (s[0] == '-' || s[0] == '+'))
+        ++s;
+
+      if(s < end && (s[0] | 0x20) == 'n')
+      {
+        if(!CheckTokenNAN(s, end))
+          return ERR_WAT_INVALID_NUMBER;
+        uint64_t payload = 1ULL << (F::MANTISSA - 1); // The first bit in the mantissa makes a canonical NaN
+        const char* p = s + 3;
+        if(p < end)
+        {
+          if(end - p < 3 || memcmp(p, ":0x", 3) != 0)
+            return ERR_WAT_INVALID_NUMBER;
+          payload = 0;
+          p = ReadWatDigits<true>(p + 3, end, [&payload](int d) { payload = (payload >> 60) ? ~0ULL : payload * 16 + d; });
+          if(!p || p == s + 6 || p != end)
+            return ERR_WAT_INVALID_NUMBER;
+          if(!payload || (payload >> F::MANTISSA))
+            return ERR_WAT_OUT_OF_RANGE;
+        }
+        out = FloatFromBits<T>(((uint64_t)F::EXPONENT << F::MANTISSA) | payload, negative);
+        return ERR_SUCCESS;
+      }
+      if(s < end && (s[0] | 0x20) == 'i')
+      {
+        if(CheckTokenINF(s, end) != end)
+          return ERR_WAT_INVALID_NUMBER;
+        out = FloatFromBits<T>((uint64_t)F::EXPONENT << F::MANTISSA, negative);
         return ERR_SUCCESS;
       }
 
-      if(CheckTokenINF(token.pos, token.pos + token.len, &numbuf) != nullptr)
+      if(end - s > 2 && s[0] == '0' && s[1] == 'x')
       {
-        out = strtod(numbuf.c_str(), &last);
-        return (last - numbuf.c_str()) == numbuf.size() ? ERR_SUCCESS : ERR_WAT_INVALID_NUMBER;
+        uint64_t man = 0;
+        int64_t exp2 = 0;
+        bool sticky = false;
+        const char* p = ReadWatDigits<true>(s + 2, end, [&](int d) {
+          if(man >> 60)
+            exp2 += 4, sticky = sticky || d != 0;
+          else
+            man = man * 16 + d;
+        });
+        if(!p || p == s + 2)
+          return ERR_WAT_INVALID_NUMBER;
+        if(p < end && *p == '.')
+        {
+          p = ReadWatDigits<true>(p + 1, end, [&](int d) {
+            if(man >> 60)
+              sticky = sticky || d != 0;
+            else
+              man = man * 16 + d, exp2 -= 4;
+          });
+          if(!p)
+            return ERR_WAT_INVALID_NUMBER;
+        }
+        if(p < end && (*p | 0x20) == 'p')
+          p = ReadWatExponent(p + 1, end, exp2);
+        if(p != end)
+          return ERR_WAT_INVALID_NUMBER;
+        return RoundWatFloat<T>(man, sticky, exp2, negative, out);
       }
-      return ResolveTokenNumber<float64>(token, numbuf, &strtod, out);
+
+      // Only the first 19 significant digits fit, the rest just tell us if we cut anything off
+      uint64_t man = 0;
+      int64_t exp10 = 0;
+      bool truncated = false;
+      const char* p = ReadWatDigits<false>(s, end, [&](int d) {
+        if(man < 1000000000000000000ULL)
+          man = man * 10 + d;
+        else
+          ++exp10, truncated = truncated || d != 0;
+      });
+      if(!p || p == s)
+        return ERR_WAT_INVALID_NUMBER;
+      if(p < end && *p == '.')
+      {
+        p = ReadWatDigits<false>(p + 1, end, [&](int d) {
+          if(man < 1000000000000000000ULL)
+            man = man * 10 + d, --exp10;
+          else
+            truncated = truncated || d != 0;
+        });
+        if(!p)
+          return ERR_WAT_INVALID_NUMBER;
+      }
+      const char* digitend = p;
+      int64_t exponent = 0;
+      if(p < end && (*p | 0x20) == 'e')
+        p = ReadWatExponent(p + 1, end, exponent);
+      if(p != end)
+        return ERR_WAT_INVALID_NUMBER;
+      exp10 += exponent;
+
+      if(!man)
+        return out = FloatFromBits<T>(0, negative), ERR_SUCCESS;
+      if(exp10 > WatPowersOfTen::MAX)
+        return ERR_WAT_OUT_OF_RANGE;
+      if(exp10 < WatPowersOfTen::MIN) // Less than 10^-323, which is less than half of the smallest double
+        return out = FloatFromBits<T>(0, negative), ERR_SUCCESS;
+
+      // If digits were cut off, the answer is only known when rounding up the last digit we kept gives the same float
+      uint64_t bits, upper;
+      if(EiselLemire<T>(man, exp10, bits) && (!truncated || (EiselLemire<T>(man + 1, exp10, upper) && upper == bits)))
+        return out = FloatFromBits<T>(bits, negative), ERR_SUCCESS;
+      return ParseWatFloatSlow<T>(s, digitend, exponent, negative, out);
     }
 
-    int ResolveTokeni64(const WatToken& token, string& numbuf, varsint64& out)
+    // Parses the magnitude of an integer, which can't overflow 64 bits
+    int ParseWatInteger(const char* s, const char* end, bool& negative, uint64_t& out)
     {
-      if(token.len > 0 && token.pos[0] == '-')
-        return ResolveTokenNumber<varsint64, long long, int>(token, numbuf, strtoll, out, 0);
-      return ResolveTokenNumber<varsint64, unsigned long long, int>(token, numbuf, strtoull, out, 0);
+      negative = (s < end && s[0] == '-');
+      if(s < end && (s[0] == '-' || s[0] == '+'))
+        ++s;
+
+      uint64_t v = 0;
+      bool overflow = false;
+      const char* begin = s;
+      const char* p;
+      if(end - s > 2 && s[0] == '0' && s[1] == 'x')
+      {
+        begin = s + 2;
+        p = ReadWatDigits<true>(begin, end, [&](int d) {
+          overflow = overflow || (v >> 60) != 0;
+          v = v * 16 + d;
+        });
+      }
+      else
+        p = ReadWatDigits<false>(begin, end, [&](int d) {
+          overflow = overflow || v > (~0ULL - d) / 10;
+          v = v * 10 + d;
+        });
+
+      if(!p || p == begin || p != end)
+        return ERR_WAT_INVALID_NUMBER;
+      if(overflow)
+        return ERR_WAT_OUT_OF_RANGE;
+      out = v;
+      return ERR_SUCCESS;
+    }
+
+    int ResolveTokenf32(const WatToken& token, float32& out) { return ParseWatFloat<float32>(token.pos, token.pos + token.len, out); }
+
+    int ResolveTokenf64(const WatToken& token, float64& out) { return ParseWatFloat<float64>(token.pos, token.pos + token.len, out); }
+
+    int ResolveTokeni64(const WatToken& token, varsint64& out)
+    {
+      bool negative;
+      uint64_t v;
+      int err = ParseWatInteger(token.pos, token.pos + token.len, negative, v);
+      if(err)
+        return err;
+      if(negative && v > (1ULL << 63))
+        return ERR_WAT_OUT_OF_RANGE;
+
+      out = (varsint64)(negative ? 0 - v : v);
+      return ERR_SUCCESS;
     }
 
-    int ResolveTokenu64(const WatToken& token, string& numbuf, varuint64& out)
+    int ResolveTokenu64(const WatToken& token, varuint64& out)
     {
       if(token.len > 0 && token.pos[0] == '-')
         return ERR_WAT_OUT_OF_RANGE;
-      return ResolveTokeni64(token, numbuf, reinterpret_cast<varsint64&>(out));
+      return ResolveTokeni64(token, reinterpret_cast<varsint64&>(out));
     }
 
-    int ResolveTokeni32(const WatToken& token, string& numbuf, varsint32& out)
+    int ResolveTokeni32(const WatToken& token, varsint32& out)
     {
       varsint64 buf;
-      int err = ResolveTokeni64(token, numbuf, buf);
+      int err = ResolveTokeni64(token, buf);
       if(err)
         return err;
       if((buf < std::numeric_limits<varsint32>::min()) || (buf > (varsint64)std::numeric_limits<varuint32>::max()))
@@ -221,10 +670,10 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    int ResolveTokenu32(const WatToken& token, string& numbuf, varuint32& out)
+    int ResolveTokenu32(const WatToken& token, varuint32& out)
     {
       varsint64 buf;
-      int err = ResolveTokeni64(token, numbuf, buf);
+      int err = ResolveTokeni64(token, buf);
       if(err)
         return err;
       if((buf < 0) || (buf > (varsint64)std::numeric_limits<varuint32>::max()))
@@ -234,160 +683,219 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    IR_FORCEINLINE const char* IncToken(const char*& s, const char* end, unsigned int& line, unsigned int& column)
+    enum WatCharClass : uint8_t
     {
-      ++s;
-      if(s + 1 < end && ((s[0] == '\r' && s[1] != '\n') || s[0] == '\n'))
+      WATCHAR_SPACE = (1 << 0),
+      WATCHAR_NAME = (1 << 1), // Characters allowed in a $name
+      WATCHAR_WORDEND = (1 << 2), // Characters that end a keyword
+      WATCHAR_NUMBER = (1 << 3), // Characters a number can run through
+    };
+
+    struct WatCharTable
+    {
+      WatCharTable()
       {
-        ++line;
-        column = 0;
+        for(int c = 0; c < 256; ++c)
+        {
+          uint8_t f = 0;
+          if(c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f')
+            f |= WATCHAR_SPACE | WATCHAR_WORDEND;
+          if(c == '=' || c == '(' || c == ')' || c == ';')
+            f |= WATCHAR_WORDEND;
+          if(c > ' ' && c < 0x7F && !strchr("\"(),;[]{}", c))
+            f |= WATCHAR_NAME;
+          if(isalnum(c) || c == '.' || c == '_' || c == '-' || c == '+')
+            f |= WATCHAR_NUMBER;
+          flags[c] = f;
+        }
       }
-      else
-        ++column;
-      return s;
+
+      IR_FORCEINLINE bool Is(char c, uint8_t f) const { return (flags[(uint8_t)c] & f) != 0; }
+
+      uint8_t flags[256];
+    };
+
+    static const WatCharTable charclass;
+
+#ifdef IR_WAT_SSE2
+    IR_FORCEINLINE __m128i MatchChar(__m128i v, char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); }
+    IR_FORCEINLINE __m128i MatchSpace(__m128i v)
+    {
+      return _mm_or_si128(_mm_or_si128(_mm_or_si128(MatchChar(v, ' '), MatchChar(v, '\n')), _mm_or_si128(MatchChar(v, '\r'), MatchChar(v, '\t'))), MatchChar(v, '\f'));
     }
+    IR_FORCEINLINE __m128i MatchNot(__m128i v) { return _mm_xor_si128(v, _mm_set1_epi8(-1)); }
+#endif
 
-    void TokenizeWAT(Queue<WatToken>& tokens, const char* s, const char* end)
+    // Scanners stop at the first character they match. Block checks 16 characters at a time and Char checks the leftovers.
+    struct ScanSpace
+    {
+      static IR_FORCEINLINE bool Char(char c) { return !charclass.Is(c, WATCHAR_SPACE); }
+#ifdef IR_WAT_SSE2
+      static IR_FORCEINLINE __m128i Block(__m128i v) { return MatchNot(MatchSpace(v)); }
+#endif
+    };
+
+    struct ScanWord
     {
-      unsigned int line = 0;
-      unsigned int column = 0;
-      while(s < end)
+      static IR_FORCEINLINE bool Char(char c) { return charclass.Is(c, WATCHAR_WORDEND); }
+#ifdef IR_WAT_SSE2
+      static IR_FORCEINLINE __m128i Block(__m128i v)
       {
-        while(s < end && (s[0] == ' ' || s[0] == '\n' || s[0] == '\r' || s[0] == '\t' || s[0] == '\f'))
-          IncToken(s, end, line, column);
+        return _mm_or_si128(MatchSpace(v), _mm_or_si128(_mm_or_si128(MatchChar(v, '='), MatchChar(v, ';')), _mm_or_si128(MatchChar(v, '('), MatchChar(v, ')'))));
+      }
+#endif
+    };
 
+    struct ScanName
+    {
+      static IR_FORCEINLINE bool Char(char c) { return !charclass.Is(c, WATCHAR_NAME); }
+#ifdef IR_WAT_SSE2
+      static IR_FORCEINLINE __m128i Block(__m128i v)
+      {
+        __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(' ')), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F))); // Signed, so bytes above 0x7F fail the first test
+        __m128i reserved = _mm_or_si128(_mm_or_si128(_mm_or_si128(MatchChar(v, '"'), MatchChar(v, '(')), _mm_or_si128(MatchChar(v, ')'), MatchChar(v, ','))),
+          _mm_or_si128(_mm_or_si128(MatchChar(v, ';'), MatchChar(v, '[')), _mm_or_si128(_mm_or_si128(MatchChar(v, ']'), MatchChar(v, '{')), MatchChar(v, '}'))));
+        return _mm_or_si128(MatchNot(printable), reserved);
+      }
+#endif
+    };
+
+    struct ScanString
+    {
+      static IR_FORCEINLINE bool Char(char c) { return c == '"' || c == '\\'; }
+#ifdef IR_WAT_SSE2
+      static IR_FORCEINLINE __m128i Block(__m128i v) { return _mm_or_si128(MatchChar(v, '"'), MatchChar(v, '\\')); }
+#endif
+    };
+
+    struct ScanComment
+    {
+      static IR_FORCEINLINE bool Char(char c) { return c == '(' || c == ';'; }
+#ifdef IR_WAT_SSE2
+      static IR_FORCEINLINE __m128i Block(__m128i v) { return _mm_or_si128(MatchChar(v, '(' ), MatchChar(v, ';')); }
+#endif
+    };
+
+    template<class SCAN>
+    IR_FORCEINLINE const char* Scan(const char* p, const char* end)
+    {
+#ifdef IR_WAT_SSE2
+      for(; p + 16 <= end; p += 16)
+      {
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(SCAN::Block(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+        if(mask)
+          return p + internal::CountTrailingZeros(mask);
+      }
+#endif
+      while(p < end && !SCAN::Char(*p))
+        ++p;
+      return p;
+    }
+
+    // A lone \r counts as a newline, and one that ends the input doesn't count at all
+    IR_FORCEINLINE void NewLine(WatCursor& cur, const char* q)
+    {
+      if(q[0] == '\n' || q[1] != '\n')
+      {
+        ++cur.line;
+        cur.linestart = q + 1;
+      }
+    }
+
+    // Moves the cursor forward to p, counting the newlines before it. Only whitespace, comments and strings can have newlines
+    // in them, so everything else just sets the position.
+    IR_FORCEINLINE void Advance(WatCursor& cur, const char* p, const char* end)
+    {
+      if(p <= cur.s)
+        return;
+
+      const char* q = cur.s;
+      const char* last = (p < end - 1) ? p : end - 1;
+#ifdef IR_WAT_SSE2
+      for(; q + 16 <= last; q += 16)
+      {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(q));
+        for(unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(MatchChar(v, '\n'), MatchChar(v, '\r'))); mask; mask &= mask - 1)
+          NewLine(cur, q + internal::CountTrailingZeros(mask));
+      }
+#endif
+      for(; q < last; ++q)
+        if(q[0] == '\n' || q[0] == '\r')
+          NewLine(cur, q);
+      cur.s = p;
+    }
+
+    bool NextWatToken(WatCursor& cur, const char* end, WatToken& t)
+    {
+      for(;;)
+      {
+        const char* s = Scan<ScanSpace>(cur.s, end);
+        Advance(cur, s, end);
         if(s >= end)
-          break;
+          return false;
 
+        t = WatToken{ TOKEN_NONE, s, cur.line, (unsigned int)(s - cur.linestart) + 1 };
+        const char* next = s + 1;
         switch(s[0])
         {
         case 0:
-          assert(s < end);
-          IncToken(s, end, line, column);
-          break;
+          cur.s = next;
+          continue;
         case '(':
-          if(s + 1 < end && s[1] == ';') // This is a comment
+          if(next < end && next[0] == ';') // Block comments can be nested
           {
-            IncToken(s, end, line, column);
-            IncToken(s, end, line, column);
             size_t depth = 1;
-            while(depth > 0 && s < end)
+            for(next = s + 2; depth > 0 && (next = Scan<ScanComment>(next, end)) < end;)
             {
-              switch(*s)
+              if(next + 1 < end && next[0] == '(' && next[1] == ';')
+              {
+                ++depth;
+                next += 2;
+              }
+              else if(next + 1 < end && next[0] == ';' && next[1] == ')')
               {
-              case '(':
-                if(s + 1 < end && s[1] == ';')
-                  depth += 1;
-                IncToken(s, end, line, column);
-                break;
-              case ';':
-                if(s + 1 < end && s[1] == ')')
-                  depth -= 1;
-                IncToken(s, end, line, column);
-                break;
+                --depth;
+                next += 2;
               }
-              IncToken(s, end, line, column);
+              else
+                ++next;
             }
+            Advance(cur, next, end);
+            continue;
           }
-          else
-          {
-            tokens.Push(WatToken{ TOKEN_OPEN, s, line, column });
-            IncToken(s, end, line, column);
-          }
+          t.id = TOKEN_OPEN;
           break;
         case ')':
-          tokens.Push(WatToken{ TOKEN_CLOSE, s, line, column });
-          IncToken(s, end, line, column);
-          break;
-        case ';': // A comment
-        {
-          if(s + 1 < end && s[1] == ';')
-          {
-            do
-            {
-              IncToken(s, end, line, column);
-            } while(s < end && s[0] != '\n');
-          }
-          else
-          {
-            tokens.Push(WatToken{ TOKEN_NONE });
-            assert(false);
-          }
-
-          if(s < end)
-            IncToken(s, end, line, column);
-
+          t.id = TOKEN_CLOSE;
           break;
-        }
-        case '"': // A string
-        {
-          const char* begin = IncToken(s, end, line, column);
-          while(s[0] != '"' && s + 1 < end)
+        case ';':
+          if(next < end && next[0] == ';') // A line comment
           {
-            if(s[0] == '\\')
-              IncToken(s, end, line, column);
-            IncToken(s, end, line, column);
+            next = (const char*)memchr(s + 2, '\n', end - s - 2);
+            Advance(cur, !next ? end : next + 1, end);
+            continue;
           }
-
-          WatToken t = { TOKEN_STRING, begin, line };
-          t.len = s - begin;
-          tokens.Push(t);
-
-          if(s[0] == '"')
-            IncToken(s, end, line, column);
+          t.len = 1;
           break;
-        }
-        case '$': // A name
-        {
-          WatToken t = { TOKEN_NAME, s + 1, line };
-
-          // We avoid using a regex here because extremely long names are still technically valid but can overwhelm the standard C++ regex evaluator
-          while(s < end)
+        case '"': // A string, which is invalid if it never ends
+          t.pos = next;
+          while((next = Scan<ScanString>(next, end)) < end && next[0] == '\\')
+            next = (next + 2 < end) ? next + 2 : end;
+          t.len = next - t.pos;
+          if(next < end)
           {
-            IncToken(s, end, line, column);
-            switch(*s)
-            {
-            case '!':
-            case '#':
-            case '$':
-            case '%':
-            case '&':
-            case '\'':
-            case '*':
-            case '+':
-            case '-':
-            case '.':
-            case '/':
-            case ':':
-            case '<':
-            case '=':
-            case '>':
-            case '?':
-            case '@':
-            case '\\':
-            case '^':
-            case '_':
-            case '`':
-            case '|':
-            case '~':
-              t.len++;
-              continue;
-            default:
-              if(isalnum(s[0]))
-              {
-                t.len++;
-                continue;
-              }
-            }
-            break;
+            t.id = TOKEN_STRING;
+            ++next;
           }
-
-          if(!t.len) // Empty names are invalid
-            t.id = TOKEN_NONE;
-
-          tokens.Push(t);
+          Advance(cur, next, end);
+          return true;
+        case '$': // A name, which can't be empty
+          t.pos = next;
+          next = Scan<ScanName>(next, end);
+          t.len = next - t.pos;
+          if(t.len > 0)
+            t.id = TOKEN_NAME;
           break;
-        }
         case '-':
         case '+':
         case '0':
@@ -400,69 +908,141 @@ namespace innative {
         case '7':
         case '8':
         case '9': // Either an integer or a float
-        {
-          const char* last = s;
-          if(!(last = CheckTokenNAN(s, end, 0)) && !(last = CheckTokenINF(s, end, 0))) // Check if this is an NaN or an INF
+          next = s + (s[0] == '-' || s[0] == '+');
+          if(next >= end || ((next[0] | 0x20) != 'n' && (next[0] | 0x20) != 'i') || (!(next = CheckTokenNAN(s, end)) && !(next = CheckTokenINF(s, end))))
           {
-            last = s; // If it's not an NAN, estimate what the number is
-            if(last[0] == '-' || last[0] == '+')
-              ++last;
-            if(last + 2 < end && last[0] == '0' && last[1] == 'x')
-              last += 2;
-            if(last >= end || !isxdigit(last[0]))
+            next = s; // If it's not an NAN or INF, estimate where the number ends
+            if(next[0] == '-' || next[0] == '+')
+              ++next;
+            if(next + 2 < end && next[0] == '0' && next[1] == 'x')
+              next += 2;
+            if(next >= end || !isxdigit((unsigned char)next[0]))
             {
-              tokens.Push(WatToken{ TOKEN_NONE, s, line, column, last - s });
-              column += last - s;
-              s = last;
+              t.len = next - s;
               break;
             }
-            while(last < end && (isalnum(last[0]) || last[0] == '.' || last[0] == '_' || last[0] == '-' || last[0] == '+'))
-              ++last;
+            while(next < end && charclass.Is(next[0], WATCHAR_NUMBER))
+              ++next;
           }
-          tokens.Push(WatToken{ TOKEN_NUMBER, s, line, column, last - s });
-          column += last - s;
-          s = last;
+          t.id = TOKEN_NUMBER;
+          t.len = next - s;
           break;
-        }
         default:
-        {
-          const char* begin = s;
-          if((begin = CheckTokenNAN(s, end, 0)) != 0 || (begin = CheckTokenINF(s, end, 0)) != 0) // Check if this is an NaN
+          if(((s[0] | 0x20) == 'n' || (s[0] | 0x20) == 'i') && ((next = CheckTokenNAN(s, end)) != 0 || (next = CheckTokenINF(s, end)) != 0))
+          {
+            t.id = TOKEN_NUMBER;
+            t.len = next - s;
+            break;
+          }
+
+          next = Scan<ScanWord>(s, end);
+          if(const WatKeywords::Entry* e = keywords.Find(s, next - s, end))
           {
-            tokens.Push(WatToken{ TOKEN_NUMBER, s, line, column, begin - s });
-            column += begin - s;
-            s = begin;
+            t.id = e->id;
+            if(e->id == TOKEN_OPERATOR)
+              t.i = e->op;
           }
           else
           {
-            begin = s;
-
-            while(s < end && s[0] != ' ' && s[0] != '\n' && s[0] != '\r' && s[0] != '\t' && s[0] != '\f' && s[0] != '=' && s[0] != ')' && s[0] != '(' && s[0] != ';')
-              IncToken(s, end, line, column);
-
-            StringRef ref = { begin, static_cast<size_t>(s - begin) };
-            khiter_t iter = kh_get_tokens(tokenhash, ref);
-            if(kh_exist2(tokenhash, iter))
-              tokens.Push(WatToken{ kh_val(tokenhash, iter), begin, line, column });
-            else
+            uint8_t op = GetInstruction(StringRef{ s, static_cast<size_t>(next - s) }); // Legacy operator names aren't in the keyword table
+            if(op != 0xFF)
             {
-              uint8_t op = GetInstruction(ref);
-              if(op != 0xFF)
-                tokens.Push(WatToken{ TOKEN_OPERATOR, begin, line, column, (int64_t)op });
-              else
-              {
-                // assert(false);
-                tokens.Push(WatToken{ TOKEN_NONE, begin, line, column, (int64_t)ref.len });
-              }
+              t.id = TOKEN_OPERATOR;
+              t.i = op;
             }
-            if(*s == '=')
-              IncToken(s, end, line, column);
+            else
+              t.len = next - s;
           }
+
+          if(next < end && next[0] == '=')
+            ++next;
+          break;
         }
+
+        cur.s = next;
+        assert(t.id < TOKEN_TOTALCOUNT);
+        return true;
+      }
+    }
+
+    WatLexer::WatLexer(const char* s, const char* end) : _end(end), _pos(0), _first(0), _last(0), _total((size_t)~0)
+    {
+      _cur = WatCursor{ s, s, 0 };
+      _eof = WatToken{ TOKEN_NONE, end };
+      _checkpoints.push_back(Checkpoint{ 0, _cur }); // Seeking with a mark can skip the others, but never this one
+    }
+
+    WatLexer::WatLexer(const WatCursor& start, const char* end) : _end(end), _cur(start), _pos(0), _first(0), _last(0), _total((size_t)~0)
+    {
+      _eof = WatToken{ TOKEN_NONE, end };
+      _checkpoints.push_back(Checkpoint{ 0, _cur });
+    }
+
+    WatCursor WatLexer::Mark()
+    {
+      (*this)[0];
+      return (_pos < _last) ? _marks[_pos & (WINDOW - 1)] : _cur;
+    }
+
+    WatToken& WatLexer::Fill(size_t index)
+    {
+      while(_last <= index)
+      {
+        if(_last >= _total)
+          return _eof;
+        if(!(_last % CHECKPOINT_INTERVAL) && _checkpoints.back().index < _last)
+          _checkpoints.push_back(Checkpoint{ _last, _cur });
+        WatCursor mark = _cur;
+        WatToken t; // NextWatToken can write to t even when it runs out of input, and this slot still holds the oldest token
+        if(!NextWatToken(_cur, _end, t))
+        {
+          _total = _last;
+          return _eof;
         }
-        if(tokens.Size() > 0)
-          assert(tokens.Peek().id < TOKEN_TOTALCOUNT);
+        _window[_last & (WINDOW - 1)] = t;
+        _marks[_last & (WINDOW - 1)] = mark;
+        if(++_last - _first > WINDOW)
+          _first = _last - WINDOW;
       }
+
+      return _window[index & (WINDOW - 1)];
+    }
+
+    void WatLexer::SetPosition(size_t pos)
+    {
+      if(pos < _first) // Too far back for the window, so start over from the closest checkpoint
+      {
+        auto cp = std::upper_bound(_checkpoints.begin(), _checkpoints.end(), pos, [](size_t i, const Checkpoint& c) { return i < c.index; });
+        assert(cp != _checkpoints.begin());
+        --cp;
+        _cur = cp->cur;
+        _first = _last = cp->index;
+      }
+      _pos = pos;
+    }
+
+    void WatLexer::SetPosition(size_t pos, const WatCursor& mark)
+    {
+      if(pos < _first || pos > _last)
+      {
+        _cur = mark;
+        _first = _last = pos;
+      }
+      _pos = pos;
+    }
+
+    size_t WatLexer::Size()
+    {
+      (*this)[1];
+      return (_last > _pos) ? _last - _pos : 0;
+    }
+
+    void TokenizeWAT(Queue<WatToken>& tokens, const char* s, const char* end)
+    {
+      WatCursor cur = { s, s, 0 };
+      WatToken t;
+      while(NextWatToken(cur, end, t))
+        tokens.Push(t);
     }
   }
 }
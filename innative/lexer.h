@@ -86,15 +86,89 @@ namespace innative {
       };
     } WatToken;
 
+    // Where the lexer is in the source text. Lines are counted from 0 and columns from 1, and columns are measured from the
+    // first character of the line, so only that position is tracked.
+    struct WatCursor
+    {
+      const char* s;
+      const char* linestart;
+      unsigned int line;
+    };
+
+    // Lexes the token at the cursor and moves past it, returning false once only whitespace and comments are left
+    bool NextWatToken(WatCursor& cur, const char* end, WatToken& token);
+
+    // Pulls tokens out of the source text as the parser asks for them, instead of tokenizing the whole file up front. It
+    // behaves like a Queue<WatToken>: positions are token indexes and lookahead is relative to the current position. The
+    // last WINDOW tokens are kept so short backtracking is free, and seeking further back lexes forward again from the
+    // closest checkpoint, which is recorded every CHECKPOINT_INTERVAL tokens.
+    class WatLexer
+    {
+    public:
+      WatLexer(const char* s, const char* end);
+      WatLexer(const WatCursor& start, const char* end); // Starts partway through the source, at a cursor from Mark()
+
+      inline WatToken Pop()
+      {
+        WatToken t = (*this)[0];
+        assert(_pos < _total);
+        if(_pos < _total)
+          ++_pos;
+        return t;
+      }
+      inline WatToken& Peek() { return (*this)[0]; }
+      inline size_t GetPosition() const { return _pos; }
+      void SetPosition(size_t pos);
+      void SetPosition(size_t pos, const WatCursor& mark); // Lexes forward from a cursor that Mark() returned at pos, if pos isn't in the window
+      inline const char* End() const { return _end; }
+
+      // Returns a cursor that another lexer can start from to get the same tokens as this one from the current position
+      WatCursor Mark();
+
+      // Number of tokens left, which is only exact once the end of the input has been reached. Until then it is at least 2,
+      // because that's as far ahead as anything checks.
+      size_t Size();
+
+      // Reading past the end of the input returns a TOKEN_NONE instead of asserting
+      inline WatToken& operator[](size_t i)
+      {
+        size_t index = _pos + i;
+        return (index < _last) ? _window[index & (WINDOW - 1)] : Fill(index);
+      }
+
+      static const size_t WINDOW = 64;
+      static const size_t CHECKPOINT_INTERVAL = 1024;
+
+    private:
+      WatToken& Fill(size_t index);
+
+      struct Checkpoint
+      {
+        size_t index;
+        WatCursor cur;
+      };
+
+      const char* _end;
+      WatCursor _cur; // Position of the token at _last
+      size_t _pos;
+      size_t _first; // Oldest token still in the window
+      size_t _last; // One past the newest token in the window
+      size_t _total; // Number of tokens in the input, once it is known
+      WatToken _window[WINDOW];
+      WatCursor _marks[WINDOW]; // Where lexing started for each token in the window
+      WatToken _eof;
+      std::vector<Checkpoint> _checkpoints;
+    };
+
     void TokenizeWAT(Queue<WatToken>& tokens, const char* s, const char* end);
-    int CheckWatTokens(const Environment& env, ValidationError*& errors, Queue<WatToken>& tokens, const char* start);
+    int CheckWatTokens(const Environment& env, ValidationError*& errors, const char* start, const char* end);
     const char* GetTokenString(WatTokenID token);
-    int ResolveTokeni32(const WatToken& token, std::string& numbuf, varsint32& out);
-    int ResolveTokenu32(const WatToken& token, std::string& numbuf, varuint32& out);
-    int ResolveTokenf32(const WatToken& token, std::string& numbuf, float32& out);
-    int ResolveTokeni64(const WatToken& token, std::string& numbuf, varsint64& out);
-    int ResolveTokenu64(const WatToken& token, std::string& numbuf, varuint64& out);
-    int ResolveTokenf64(const WatToken& token, std::string& numbuf, float64& out);
+    int ResolveTokeni32(const WatToken& token, varsint32& out);
+    int ResolveTokenu32(const WatToken& token, varuint32& out);
+    int ResolveTokenf32(const WatToken& token, float32& out);
+    int ResolveTokeni64(const WatToken& token, varsint64& out);
+    int ResolveTokenu64(const WatToken& token, varuint64& out);
+    int ResolveTokenf64(const WatToken& token, float64& out);
   }
 }
 
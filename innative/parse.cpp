@@ -2,18 +2,22 @@
 // For conditions of distribution and use, see copyright notice in innative.h
 
 #include "parse.h"
+#include "instruction.h"
 #include "validate.h"
 #include "stream.h"
 #include "util.h"
+#include "threadpool.h"
 #include <assert.h>
 #include <algorithm>
+#include <vector>
 
 using namespace innative;
 using namespace utility;
 using namespace internal;
 
-__KHASH_IMPL(exports, , Identifier, varuint32, 1, __ac_X31_hash_bytearray, kh_int_hash_equal);
-__KHASH_IMPL(modules, , Identifier, size_t, 1, __ac_X31_hash_bytearray, kh_int_hash_equal);
+// Module and export names are always interned before they go into either of these
+__KHASH_IMPL(exports, , Identifier, varuint32, 1, __ac_hash_symbol, kh_symbol_hash_equal);
+__KHASH_IMPL(modules, , Identifier, size_t, 1, __ac_hash_symbol, kh_symbol_hash_equal);
 
 namespace innative {
   namespace internal {
@@ -28,6 +32,12 @@ namespace innative {
     {
       template<IR_ERROR(*PARSE)(Stream&, T&, Args...)>
       static IR_ERROR Array(Stream& s, T*& ptr, varuint32& size, const Environment& env, Args... args)
+      {
+        return Array<PARSE>(s, ptr, size, *env.alloc, args...);
+      }
+
+      template<IR_ERROR(*PARSE)(Stream&, T&, Args...)>
+      static IR_ERROR Array(Stream& s, T*& ptr, varuint32& size, __WASM_ALLOCATOR& alloc, Args... args)
       {
         IR_ERROR err = ParseVarUInt32(s, size);
         if(err < 0)
@@ -39,7 +49,7 @@ namespace innative {
           return err;
         }
 
-        T* r = tmalloc<T>(env, size);
+        T* r = tmalloc<T>(alloc, size);
         if(!r)
           return assert(false), ERR_FATAL_OUT_OF_MEMORY;
 
@@ -54,7 +64,7 @@ namespace innative {
     struct LocalEntry
     {
       varuint32 count;
-      varuint7 type;
+      varsint7 type;
     };
 
     IR_ERROR ParseLocalEntry(Stream& s, LocalEntry& entry)
@@ -62,7 +72,7 @@ namespace innative {
       IR_ERROR err = ParseVarUInt32(s, entry.count);
 
       if(err >= 0)
-        err = ParseVarUInt7(s, entry.type);
+        err = ParseVarSInt7(s, entry.type);
 
       return err;
     }
@@ -76,6 +86,15 @@ IR_ERROR innative::ParseByteArray(Stream& s, ByteArray& section, bool terminator
   if(err < 0)
     return err;
 
+  if(s.persistent && !terminator) // Identifiers still need a null terminator, but everything else can point straight into the stream
+  {
+    if(n > s.size - s.pos)
+      return ERR_PARSE_UNEXPECTED_EOF;
+    section = !n ? ByteArray() : ByteArray(s.data + s.pos, n);
+    s.pos += n;
+    return ERR_SUCCESS;
+  }
+
   section.resize(n, terminator, env);
   if(n > 0)
   {
@@ -227,6 +246,11 @@ IR_ERROR innative::ParseExport(Stream& s, Export& e, const Environment& env)
 }
 
 IR_ERROR innative::ParseInstruction(Stream& s, Instruction& ins, const Environment& env)
+{
+  return ParseInstruction(s, ins, env, *env.alloc);
+}
+
+IR_ERROR innative::ParseInstruction(Stream& s, Instruction& ins, const Environment& env, __WASM_ALLOCATOR& alloc)
 {
   IR_ERROR err = ParseByte(s, ins.opcode);
   if(err < 0)
@@ -237,7 +261,7 @@ IR_ERROR innative::ParseInstruction(Stream& s, Instruction& ins, const Environme
   case OP_block:
   case OP_loop:
   case OP_if:
-    ins.immediates[0]._varuint7 = s.ReadVarUInt7(err);
+    ins.immediates[0]._varsint7 = s.ReadVarInt7(err); // Block types are negative, like every other value type
     break;
   case OP_br:
   case OP_br_if:
@@ -263,12 +287,17 @@ IR_ERROR innative::ParseInstruction(Stream& s, Instruction& ins, const Environme
     break;
   case OP_memory_grow:
   case OP_memory_size:
-    ins.immediates[0]._varuint1 = s.ReadVarUInt1(err);
-    if(err >= 0 && ins.immediates[0]._varuint1 != 0)
-      err = ERR_INVALID_RESERVED_VALUE;
+    if(env.features & ENV_FEATURE_MULTI_MEMORY) // The reserved byte becomes a memory index
+      ins.immediates[0]._varuint32 = s.ReadVarUInt32(err);
+    else
+    {
+      ins.immediates[0]._varuint32 = s.ReadVarUInt1(err);
+      if(err >= 0 && ins.immediates[0]._varuint32 != 0)
+        err = ERR_INVALID_RESERVED_VALUE;
+    }
     break;
   case OP_br_table:
-    err = Parse<varuint32>::template Array<&ParseVarUInt32>(s, ins.immediates[0].table, ins.immediates[0].n_table, env);
+    err = Parse<varuint32>::template Array<&ParseVarUInt32>(s, ins.immediates[0].table, ins.immediates[0].n_table, alloc);
 
     if(err >= 0)
       ins.immediates[1]._varuint32 = s.ReadVarUInt32(err);
@@ -308,8 +337,24 @@ IR_ERROR innative::ParseInstruction(Stream& s, Instruction& ins, const Environme
   case OP_i64_store8:
   case OP_i64_store16:
   case OP_i64_store32:
+    ins.immediates[2]._varuint32 = 0;
+    if(s.size - s.pos >= 2 && !((s.data[s.pos] | s.data[s.pos + 1]) & 0x80) &&
+       !(s.data[s.pos] & WASM_MEMARG_HAS_MEMORY_INDEX)) // One byte each for the alignment and the offset, checked together
+    {
+      ins.immediates[0]._varuint32 = s.data[s.pos];
+      ins.immediates[1]._varuptr = s.data[s.pos + 1];
+      s.pos += 2;
+      break;
+    }
+
     ins.immediates[0]._varuint32 = s.ReadVarUInt32(err);
 
+    if(err >= 0 && (env.features & ENV_FEATURE_MULTI_MEMORY) && (ins.immediates[0]._varuint32 & WASM_MEMARG_HAS_MEMORY_INDEX))
+    {
+      ins.immediates[0]._varuint32 &= ~WASM_MEMARG_HAS_MEMORY_INDEX;
+      ins.immediates[2]._varuint32 = s.ReadVarUInt32(err);
+    }
+
     if(err >= 0)
       ins.immediates[1]._varuptr = s.ReadVarUInt64(err);
 
@@ -473,7 +518,46 @@ IR_ERROR innative::ParseTableInit(Stream& s, TableInit& init, Module& m, const E
   return err;
 }
 
-IR_ERROR innative::ParseFunctionBody(Stream& s, FunctionBody& f, const Environment& env)
+IR_ERROR innative::ParseInstructions(Stream& s, size_t end, FunctionBody& f, const Environment& env, __WASM_ALLOCATOR& alloc,
+                                     BodyValidator* validator)
+{
+  // Instructions are packed into a reused per-thread buffer first, so only the exact size is taken from the allocator
+  static thread_local std::vector<uint8_t> packed;
+  packed.clear();
+
+  IR_ERROR err = ERR_SUCCESS;
+  Instruction ins;
+  size_t used = 0;
+  f.n_body = 0;
+  while(s.pos < end && (err = ParseInstruction(s, ins, env, alloc)) >= 0)
+  {
+    if(packed.size() < used + MAX_PACKED_SIZE) // Grow ahead of time, so packing never has to measure the instruction first
+      packed.resize(std::max(packed.size() * 2, used + MAX_PACKED_SIZE));
+    used = PackInstruction(ins, packed.data() + used) - packed.data();
+    ++f.n_body;
+    if(validator) // Validating right after decoding means the instruction is never read back out of memory
+      validator->Step(ins);
+  }
+
+  f.n_code = (varuint32)used;
+  f.body = tmalloc<uint8_t>(alloc, f.n_code);
+  if(!f.body && f.n_code)
+    return assert(false), ERR_FATAL_OUT_OF_MEMORY;
+  tmemcpy<uint8_t>(f.body, f.n_code, packed.data(), used);
+  return err;
+}
+
+IR_ERROR innative::DecodeFunctionBody(const FunctionBody& lazy, FunctionBody& f, __WASM_ALLOCATOR& alloc, const Environment& env)
+{
+  f = lazy;
+  if(lazy.body || !lazy.source)
+    return ERR_SUCCESS;
+
+  Stream s = { lazy.source, lazy.n_source, 0 };
+  return ParseInstructions(s, s.size, f, env, alloc); // Everything the decode allocates, including br_table targets, goes to alloc
+}
+
+IR_ERROR innative::ParseFunctionBody(Stream& s, FunctionBody& f, const Environment& env, Module* m, varuint32 index)
 {
   IR_ERROR err = ParseVarUInt32(s, f.body_size);
   size_t end = s.pos + f.body_size; // body_size is the size of both local_entries and body in bytes.
@@ -501,14 +585,37 @@ IR_ERROR innative::ParseFunctionBody(Stream& s, FunctionBody& f, const Environme
   }
 
   f.body = 0;
+  f.n_code = 0;
+  f.n_body = 0;
+  f.positions = 0;
+  f.source = 0;
+  f.n_source = 0;
+  f.errors = 0;
+  f.validated = false;
   if(err >= 0 && f.body_size)
   {
-    f.body = tmalloc<Instruction>(env, f.body_size); // Overallocate maximum number of possible instructions we might have
-    if(!f.body)
-      return assert(false), ERR_FATAL_OUT_OF_MEMORY;
-
-    for(f.n_body = 0; s.pos < end && err >= 0; ++f.n_body)
-      err = ParseInstruction(s, f.body[f.n_body], env);
+    if(env.flags & ENV_LAZY_FUNCTIONS) // Just remember where the instructions are, DecodeFunctionBody parses them when they're needed
+    {
+      if(end > s.size || s.pos > end)
+        return ERR_PARSE_UNEXPECTED_EOF;
+      f.source = s.data + s.pos;
+      f.n_source = (varuint32)(end - s.pos);
+      s.pos = end;
+    }
+    else if(m && index < m->function.n_funcdecl && m->function.funcdecl[index] < m->type.n_functions)
+    {
+      Environment local = env; // Errors are kept with the body until ValidateModule reports them
+      local.errors = 0;
+      BodyValidator validator(m->type.functions[m->function.funcdecl[index]], f, local, m);
+      bool valid = validator.Begin();
+      err = ParseInstructions(s, end, f, env, *env.alloc, valid ? &validator : nullptr);
+      if(valid && err >= 0)
+        validator.End();
+      f.errors = local.errors;
+      f.validated = true;
+    }
+    else
+      err = ParseInstructions(s, end, f, env, *env.alloc);
   }
   f.local_names = 0;
   f.param_names = 0;
@@ -517,6 +624,65 @@ IR_ERROR innative::ParseFunctionBody(Stream& s, FunctionBody& f, const Environme
   return err;
 }
 
+IR_ERROR innative::ParseCodeSection(Stream& s, Module& m, const Environment& env)
+{
+  static const varuint32 BATCH_SIZE = 64;
+  IR_ERROR err = ParseVarUInt32(s, m.code.n_funcbody);
+  if(err < 0)
+    return err;
+  if(m.code.n_funcbody > s.size - s.pos) // Every body takes at least one byte, so this catches absurd counts before we allocate anything
+    return ERR_PARSE_UNEXPECTED_EOF;
+
+  m.code.funcbody = tmalloc<FunctionBody>(env, m.code.n_funcbody);
+  if(!m.code.funcbody && m.code.n_funcbody > 0)
+    return assert(false), ERR_FATAL_OUT_OF_MEMORY;
+
+  if(!(env.flags & ENV_MULTITHREADED) || !env.pool || m.code.n_funcbody <= BATCH_SIZE)
+  {
+    for(varuint32 i = 0; i < m.code.n_funcbody && err >= 0; ++i)
+      err = ParseFunctionBody(s, m.code.funcbody[i], env, &m, i);
+    return err;
+  }
+
+  // Find where every body starts by skipping over their sizes, so batches of them can be decoded and validated on the thread pool
+  std::vector<size_t> offsets(m.code.n_funcbody);
+  for(varuint32 i = 0; i < m.code.n_funcbody; ++i)
+  {
+    offsets[i] = s.pos;
+    varuint32 size = s.ReadVarUInt32(err);
+    if(err < 0)
+      return err;
+    if(size > s.size - s.pos)
+      return ERR_PARSE_UNEXPECTED_EOF;
+    s.pos += size;
+  }
+
+  size_t batches = (m.code.n_funcbody + BATCH_SIZE - 1) / BATCH_SIZE;
+  std::vector<IR_ERROR> results(m.code.n_funcbody, ERR_SUCCESS);
+  std::atomic<size_t> outstanding(batches);
+
+  for(size_t b = 0; b < batches; ++b)
+  {
+    env.pool->Submit([&, b]() {
+      varuint32 last = (varuint32)std::min<size_t>((b + 1) * BATCH_SIZE, m.code.n_funcbody);
+      for(varuint32 i = (varuint32)(b * BATCH_SIZE); i < last; ++i)
+      {
+        Stream body = { s.data, s.size, offsets[i], s.persistent };
+        if((results[i] = ParseFunctionBody(body, m.code.funcbody[i], env, &m, i)) < 0)
+          break;
+      }
+      outstanding.fetch_sub(1, std::memory_order_release);
+    });
+  }
+
+  env.pool->Wait([&outstanding]() { return !outstanding.load(std::memory_order_acquire); });
+
+  for(auto r : results) // Report the first body that failed, just like a serial parse
+    if(r < 0)
+      return r;
+  return ERR_SUCCESS;
+}
+
 IR_ERROR innative::ParseDataInit(Stream& s, DataInit& data, const Environment& env)
 {
   IR_ERROR err = ParseVarUInt32(s, data.index);
@@ -628,10 +794,8 @@ IR_ERROR innative::ParseNameSection(Stream& s, size_t end, Module& m, const Envi
   return err;
 }
 
-IR_ERROR innative::ParseModule(Stream& s, const Environment& env, Module& m, ByteArray name, ValidationError*& errors)
+IR_ERROR innative::ParseModuleHeader(Stream& s, Module& m)
 {
-  m = { 0 };
-
   IR_ERROR err = ERR_SUCCESS;
   m.magic_cookie = s.ReadUInt32(err);
 
@@ -647,141 +811,113 @@ IR_ERROR innative::ParseModule(Stream& s, const Environment& env, Module& m, Byt
   if(m.version != WASM_MAGIC_VERSION)
     return ERR_PARSE_INVALID_VERSION;
 
-  size_t begin = s.pos;
-  m.n_custom = 0; // Count the custom sections so we can preallocate them
-  while(!s.End())
-  {
-    varuint7 op = s.ReadVarUInt7(err);
-    if(err < 0)
-      return err;
-
-    if(op > WASM_SECTION_DATA) // require valid opcode to continue
-      return ERR_FATAL_UNKNOWN_SECTION;
-    if(op == WASM_SECTION_CUSTOM)
-      ++m.n_custom;
-    s.pos += s.ReadVarUInt32(err);
-
-    if(err < 0)
-      return err;
-  }
-
-  if(s.pos != s.size)
-    return ERR_PARSE_INVALID_FILE_LENGTH;
-
   m.exports = kh_init_exports();
-  s.pos = begin;
-  size_t curcustom = 0;
+  return ERR_SUCCESS;
+}
 
-  if(m.n_custom > 0)
+IR_ERROR innative::ParseSectionOrder(Module& m, varuint7 opcode)
+{
+  if(opcode > WASM_SECTION_DATA) // require valid opcode to continue
+    return ERR_FATAL_UNKNOWN_SECTION;
+  if(opcode != WASM_SECTION_CUSTOM) // Section order only applies to known sections
   {
-    m.custom = tmalloc<CustomSection>(env, m.n_custom);
-    if(!m.custom)
-      return assert(false), ERR_FATAL_OUT_OF_MEMORY;
+    if(!ValidateSectionOrder(m.knownsections, opcode))
+      return ERR_FATAL_INVALID_WASM_SECTION_ORDER; // This has to be a fatal error because some sections rely on others being loaded
+    m.knownsections |= (1 << opcode);
   }
+  return ERR_SUCCESS;
+}
 
-  while(err >= 0 && !s.End())
+IR_ERROR innative::ParseSection(Stream& s, varuint7 opcode, varuint32 payload, Module& m, const Environment& env)
+{
+  IR_ERROR err = ERR_SUCCESS;
+
+  switch(opcode)
   {
-    varuint7 opcode = s.ReadVarUInt7(err);
-    if(err < 0)
-      break;
-    varuint32 payload = s.ReadVarUInt32(err);
-    if(err < 0)
-      break;
-    if(opcode != WASM_SECTION_CUSTOM) // Section order only applies to known sections
-    {
-      if(!ValidateSectionOrder(m.knownsections, opcode))
-        return ERR_FATAL_INVALID_WASM_SECTION_ORDER; // This has to be a fatal error because some sections rely on others being loaded
-      m.knownsections |= (1 << opcode);
-    }
+  case WASM_SECTION_TYPE:
+    return Parse<FunctionType, const Environment&>::template Array<&ParseFunctionType>(s, m.type.functions, m.type.n_functions, env, env);
+  case WASM_SECTION_IMPORT:
+  {
+    if(err = Parse<Import, const Environment&>::template Array<&ParseImport>(s, m.importsection.imports, m.importsection.n_import, env, env))
+      return err;
+    std::stable_sort(m.importsection.imports, m.importsection.imports + m.importsection.n_import, [](const Import& a, const Import& b) -> bool { return a.kind < b.kind; });
 
-    switch(opcode)
+    varuint32 num = m.importsection.n_import;
+    m.importsection.globals = 0;
+    for(varuint32 i = 0; i < num; ++i)
     {
-    case WASM_SECTION_TYPE:
-      err = Parse<FunctionType, const Environment&>::template Array<&ParseFunctionType>(s, m.type.functions, m.type.n_functions, env, env);
-      break;
-    case WASM_SECTION_IMPORT:
-    {
-      if(err = Parse<Import, const Environment&>::template Array<&ParseImport>(s, m.importsection.imports, m.importsection.n_import, env, env))
-        return err;
-      std::stable_sort(m.importsection.imports, m.importsection.imports + m.importsection.n_import, [](const Import& a, const Import& b) -> bool { return a.kind < b.kind; });
-
-      varuint32 num = m.importsection.n_import;
-      m.importsection.globals = 0;
-      for(varuint32 i = 0; i < num; ++i)
-      {
-        switch(m.importsection.imports[i].kind)
-        {
-        case WASM_KIND_FUNCTION:
-          ++m.importsection.functions;
-        case WASM_KIND_TABLE:
-          ++m.importsection.tables;
-        case WASM_KIND_MEMORY:
-          ++m.importsection.memories;
-        case WASM_KIND_GLOBAL:
-          ++m.importsection.globals;
-          break;
-        default:
-          return ERR_FATAL_UNKNOWN_KIND;
-        }
-      }
-
-      if(m.importsection.n_import != num) // n_import is the same as globals, check to make sure we derived it properly
-        return ERR_FATAL_INVALID_MODULE;
-    }
-    break;
-    case WASM_SECTION_FUNCTION:
-      err = Parse<varuint32>::template Array<&ParseVarUInt32>(s, m.function.funcdecl, m.function.n_funcdecl, env);
-      break;
-    case WASM_SECTION_TABLE:
-      err = Parse<TableDesc>::template Array<&ParseTableDesc>(s, m.table.tables, m.table.n_tables, env);
-      break;
-    case WASM_SECTION_MEMORY:
-      err = Parse<MemoryDesc>::template Array<&ParseMemoryDesc>(s, m.memory.memories, m.memory.n_memories, env);
-      break;
-    case WASM_SECTION_GLOBAL:
-      err = Parse<GlobalDecl, const Environment&>::template Array<&ParseGlobalDecl>(s, m.global.globals, m.global.n_globals, env, env);
-      break;
-    case WASM_SECTION_EXPORT:
-      err = Parse<Export, const Environment&>::template Array<&ParseExport>(s, m.exportsection.exports, m.exportsection.n_exports, env, env);
-      break;
-    case WASM_SECTION_START:
-      m.start = s.ReadVarUInt32(err);
-      break;
-    case WASM_SECTION_ELEMENT:
-      err = Parse<TableInit, Module&, const Environment&>::template Array<&ParseTableInit>(s, m.element.elements, m.element.n_elements, env, m, env);
-      break;
-    case WASM_SECTION_CODE:
-      err = Parse<FunctionBody, const Environment&>::template Array<&ParseFunctionBody>(s, m.code.funcbody, m.code.n_funcbody, env, env);
-      break;
-    case WASM_SECTION_DATA:
-      err = Parse<DataInit, const Environment&>::template Array<&ParseDataInit>(s, m.data.data, m.data.n_data, env, env);
-      break;
-    case WASM_SECTION_CUSTOM:
-      if(payload < 1) // A custom section MUST have an identifier, which itself must take up at least 1 byte, so a payload of 0 bytes is impossible.
-        return ERR_PARSE_INVALID_FILE_LENGTH;
-      else
+      switch(m.importsection.imports[i].kind)
       {
-        assert(curcustom < m.n_custom);
-        m.custom[curcustom].payload = payload;
-        m.custom[curcustom].data = s.data + s.pos;
-        size_t custom = s.pos + payload;
-        err = ParseIdentifier(s, m.custom[curcustom].name, env);
-        if(err == ERR_SUCCESS && !ValidateIdentifier(m.custom[curcustom].name))
-          return ERR_INVALID_UTF8_ENCODING; // An invalid UTF8 encoding for the name is an actual parse error for some reason
-        if(err == ERR_SUCCESS && !strcmp(m.custom[curcustom].name.str(), "name"))
-          ParseNameSection(s, custom, m, env);
-        else
-          s.pos = custom; // Skip over the custom payload, minus the name
+      case WASM_KIND_FUNCTION:
+        ++m.importsection.functions;
+      case WASM_KIND_TABLE:
+        ++m.importsection.tables;
+      case WASM_KIND_MEMORY:
+        ++m.importsection.memories;
+      case WASM_KIND_GLOBAL:
+        ++m.importsection.globals;
         break;
+      default:
+        return ERR_FATAL_UNKNOWN_KIND;
       }
-    default:
-      return ERR_FATAL_UNKNOWN_SECTION;
     }
+
+    if(m.importsection.n_import != num) // n_import is the same as globals, check to make sure we derived it properly
+      return ERR_FATAL_INVALID_MODULE;
+    return ERR_SUCCESS;
   }
+  case WASM_SECTION_FUNCTION:
+    return Parse<varuint32>::template Array<&ParseVarUInt32>(s, m.function.funcdecl, m.function.n_funcdecl, env);
+  case WASM_SECTION_TABLE:
+    return Parse<TableDesc>::template Array<&ParseTableDesc>(s, m.table.tables, m.table.n_tables, env);
+  case WASM_SECTION_MEMORY:
+    return Parse<MemoryDesc>::template Array<&ParseMemoryDesc>(s, m.memory.memories, m.memory.n_memories, env);
+  case WASM_SECTION_GLOBAL:
+    return Parse<GlobalDecl, const Environment&>::template Array<&ParseGlobalDecl>(s, m.global.globals, m.global.n_globals, env, env);
+  case WASM_SECTION_EXPORT:
+    return Parse<Export, const Environment&>::template Array<&ParseExport>(s, m.exportsection.exports, m.exportsection.n_exports, env, env);
+  case WASM_SECTION_START:
+    m.start = s.ReadVarUInt32(err);
+    return err;
+  case WASM_SECTION_ELEMENT:
+    return Parse<TableInit, Module&, const Environment&>::template Array<&ParseTableInit>(s, m.element.elements, m.element.n_elements, env, m, env);
+  case WASM_SECTION_CODE:
+    return ParseCodeSection(s, m, env);
+  case WASM_SECTION_DATA:
+    return Parse<DataInit, const Environment&>::template Array<&ParseDataInit>(s, m.data.data, m.data.n_data, env, env);
+  case WASM_SECTION_CUSTOM:
+  {
+    if(payload < 1) // A custom section MUST have an identifier, which itself must take up at least 1 byte, so a payload of 0 bytes is impossible.
+      return ERR_PARSE_INVALID_FILE_LENGTH;
 
-  if(err < 0)
+    // Custom sections are rare, so we just grow the array by one instead of counting them in a separate pass
+    CustomSection* custom = tmalloc<CustomSection>(env, m.n_custom + 1);
+    if(!custom)
+      return assert(false), ERR_FATAL_OUT_OF_MEMORY;
+    if(m.n_custom > 0)
+      tmemcpy<CustomSection>(custom, m.n_custom + 1, m.custom, m.n_custom);
+    m.custom = custom;
+
+    CustomSection& section = m.custom[m.n_custom++];
+    section.payload = payload;
+    section.data = s.data + s.pos;
+    size_t end = s.pos + payload;
+    err = ParseIdentifier(s, section.name, env);
+    if(err == ERR_SUCCESS && !ValidateIdentifier(section.name))
+      return ERR_INVALID_UTF8_ENCODING; // An invalid UTF8 encoding for the name is an actual parse error for some reason
+    if(err == ERR_SUCCESS && !strcmp(section.name.str(), "name"))
+      ParseNameSection(s, end, m, env);
+    else
+      s.pos = end; // Skip over the custom payload, minus the name
     return err;
+  }
+  }
+
+  return ERR_FATAL_UNKNOWN_SECTION;
+}
 
+IR_ERROR innative::ParseModuleEnd(Module& m, ByteArray name, ValidationError*& errors, const Environment& env)
+{
   if(!m.name.size())
   {
     m.name.resize(name.size(), true, env);
@@ -798,8 +934,38 @@ IR_ERROR innative::ParseModule(Stream& s, const Environment& env, Module& m, Byt
   return ParseExportFixup(m, errors, env);
 }
 
+IR_ERROR innative::ParseModule(Stream& s, const Environment& env, Module& m, ByteArray name, ValidationError*& errors)
+{
+  m = { 0 };
+
+  IR_ERROR err = ParseModuleHeader(s, m);
+  while(err >= 0 && !s.End())
+  {
+    varuint7 opcode = s.ReadVarUInt7(err);
+    if(err < 0)
+      break;
+    varuint32 payload = s.ReadVarUInt32(err);
+    if(err < 0)
+      break;
+    if(payload > s.size - s.pos)
+      return ERR_PARSE_INVALID_FILE_LENGTH;
+    if((err = ParseSectionOrder(m, opcode)) < 0)
+      return err;
+    err = ParseSection(s, opcode, payload, m, env);
+  }
+
+  if(err < 0)
+    return err;
+
+  return ParseModuleEnd(m, name, errors, env);
+}
+
 IR_ERROR innative::ParseExportFixup(Module& m, ValidationError*& errors, const Environment& env)
 {
+  IR_ERROR err = InternModule(env, m); // After this, resolving imports and exports only compares pointers
+  if(err < 0)
+    return err;
+
   for(varuint32 i = 0; i < m.exportsection.n_exports; ++i)
   {
     int r = 0;
@@ -813,3 +979,186 @@ IR_ERROR innative::ParseExportFixup(Module& m, ValidationError*& errors, const E
 
   return ERR_SUCCESS;
 }
+
+namespace innative {
+  namespace internal {
+    // Length of the LEB128 value starting at p, or 0 if it hasn't fully arrived yet. Values that are already too long to be valid
+    // count as complete so the parser can report them.
+    IR_FORCEINLINE size_t LEB128Length(const uint8_t* p, size_t n)
+    {
+      for(size_t i = 0; i < n && i < 10; ++i)
+        if(!(p[i] & 0x80))
+          return i + 1;
+      return n >= 10 ? 10 : 0;
+    }
+  }
+}
+
+__WASM_MODULE_STREAM::__WASM_MODULE_STREAM(Environment& e, const char* n) : env(e), name(n), pos(0), state(STATE_HEADER), err(ERR_SUCCESS),
+  opcode(0), payload(0), remaining(0), next(0), outstanding(0)
+{
+  m = { 0 };
+}
+
+__WASM_MODULE_STREAM::~__WASM_MODULE_STREAM() { Join(); }
+
+void __WASM_MODULE_STREAM::Join()
+{
+  env.pool->Wait([this]() { return !outstanding.load(std::memory_order_acquire); });
+}
+
+void __WASM_MODULE_STREAM::ParseBody(varuint32 index, const uint8_t* data, size_t size)
+{
+  Stream s = { const_cast<uint8_t*>(data), size, 0 };
+  results[index] = ParseFunctionBody(s, m.code.funcbody[index], env, &m, index);
+  if(results[index] >= 0 && s.pos != size)
+    results[index] = ERR_PARSE_INVALID_FILE_LENGTH;
+}
+
+IR_ERROR __WASM_MODULE_STREAM::Push(const uint8_t* data, size_t size)
+{
+  if(err < 0)
+    return err;
+
+  buffer.insert(buffer.end(), data, data + size);
+  bool progress = true;
+  while(progress && err >= 0)
+    err = Step(progress);
+
+  buffer.erase(buffer.begin(), buffer.begin() + pos); // Only the unparsed tail is kept, so memory use is bounded by the largest pending section
+  pos = 0;
+  return err;
+}
+
+IR_ERROR __WASM_MODULE_STREAM::Step(bool& progress)
+{
+  progress = false;
+  size_t avail = buffer.size() - pos;
+  Stream s = { buffer.data() + pos, avail, 0 };
+  IR_ERROR e = ERR_SUCCESS;
+
+  switch(state)
+  {
+  case STATE_HEADER:
+    if(avail < 8)
+      return ERR_SUCCESS;
+    if((e = ParseModuleHeader(s, m)) < 0)
+      return e;
+    state = STATE_SECTION;
+    break;
+  case STATE_SECTION:
+  {
+    size_t len = LEB128Length(s.data, avail);
+    if(!len || !LEB128Length(s.data + len, avail - len))
+      return ERR_SUCCESS;
+    opcode = s.ReadVarUInt7(e);
+    if(e >= 0)
+      payload = s.ReadVarUInt32(e);
+    if(e < 0 || (e = ParseSectionOrder(m, opcode)) < 0)
+      return e;
+    state = (opcode == WASM_SECTION_CODE) ? STATE_CODE_COUNT : STATE_PAYLOAD;
+    remaining = payload;
+    break;
+  }
+  case STATE_PAYLOAD:
+    if(avail < payload)
+      return ERR_SUCCESS;
+    s.size = payload;
+    Join(); // The name section writes into function bodies, so any that are still being parsed have to finish first
+    if(opcode == WASM_SECTION_CUSTOM) // Custom sections keep a pointer to their payload, so they get their own copy
+    {
+      if(!(s.data = tmalloc<uint8_t>(env, payload)) && payload > 0)
+        return assert(false), ERR_FATAL_OUT_OF_MEMORY;
+      tmemcpy<uint8_t>(s.data, payload, buffer.data() + pos, payload);
+    }
+    if((e = ParseSection(s, opcode, payload, m, env)) < 0)
+      return e;
+    s.pos = payload;
+    state = STATE_SECTION;
+    break;
+  case STATE_CODE_COUNT:
+    if(!LEB128Length(s.data, avail))
+      return ERR_SUCCESS;
+    m.code.n_funcbody = s.ReadVarUInt32(e);
+    if(e < 0)
+      return e;
+    if(s.pos > remaining)
+      return ERR_PARSE_INVALID_FILE_LENGTH;
+    remaining -= s.pos;
+    if(m.code.n_funcbody > remaining) // Every body takes at least one byte, so this catches absurd counts before we allocate anything
+      return ERR_PARSE_INVALID_FILE_LENGTH;
+    m.code.funcbody = tmalloc<FunctionBody>(env, m.code.n_funcbody);
+    if(!m.code.funcbody && m.code.n_funcbody > 0)
+      return assert(false), ERR_FATAL_OUT_OF_MEMORY;
+    results.assign(m.code.n_funcbody, ERR_SUCCESS);
+    next = 0;
+    if(!m.code.n_funcbody && remaining > 0)
+      return ERR_PARSE_INVALID_FILE_LENGTH;
+    state = m.code.n_funcbody > 0 ? STATE_CODE_BODY : STATE_SECTION;
+    break;
+  case STATE_CODE_BODY:
+  {
+    if(!LEB128Length(s.data, avail))
+      return ERR_SUCCESS;
+    varuint32 size = s.ReadVarUInt32(e);
+    if(e < 0)
+      return e;
+    size_t total = s.pos + size; // ParseFunctionBody reads the size itself, so it gets the whole thing
+    if(total > remaining)
+      return ERR_PARSE_INVALID_FILE_LENGTH;
+    if(avail < total)
+      return ERR_SUCCESS;
+
+    varuint32 index = next++;
+    if(env.flags & ENV_LAZY_FUNCTIONS) // Lazy bodies point into their bytes, so those have to last as long as the module
+    {
+      uint8_t* bytes = tmalloc<uint8_t>(env, total);
+      if(!bytes)
+        return assert(false), ERR_FATAL_OUT_OF_MEMORY;
+      tmemcpy<uint8_t>(bytes, total, s.data, total);
+      ParseBody(index, bytes, total); // Nothing to decode, so there's no point sending it to another thread
+    }
+    else if(env.flags & ENV_MULTITHREADED)
+    {
+      std::shared_ptr<uint8_t> bytes(new uint8_t[total], std::default_delete<uint8_t[]>());
+      tmemcpy<uint8_t>(bytes.get(), total, s.data, total);
+      outstanding.fetch_add(1, std::memory_order_relaxed);
+      env.pool->Submit([this, index, bytes, total]() {
+        ParseBody(index, bytes.get(), total);
+        outstanding.fetch_sub(1, std::memory_order_release);
+      });
+    }
+    else
+      ParseBody(index, s.data, total);
+
+    s.pos = total;
+    remaining -= total;
+    if(next >= m.code.n_funcbody)
+    {
+      if(remaining > 0)
+        return ERR_PARSE_INVALID_FILE_LENGTH;
+      state = STATE_SECTION;
+    }
+    break;
+  }
+  }
+
+  pos += s.pos;
+  progress = true;
+  return ERR_SUCCESS;
+}
+
+IR_ERROR __WASM_MODULE_STREAM::Finish()
+{
+  Join();
+  if(err < 0)
+    return err;
+  if(state != STATE_SECTION || pos != buffer.size())
+    return ERR_PARSE_UNEXPECTED_EOF;
+
+  for(auto r : results) // Report the first body that failed, just like parsing the whole buffer would
+    if(r < 0)
+      return r;
+
+  return ParseModuleEnd(m, ByteArray((uint8_t*)name.c_str(), (varuint32)name.size()), env.errors, env);
+}
@@ -5,8 +5,13 @@
 #define __PARSE_H__IR__
 
 #include "stream.h"
+#include <vector>
+#include <string>
+#include <atomic>
 
 namespace innative {
+  class BodyValidator;
+
   IR_ERROR ParseByteArray(utility::Stream& s, ByteArray& section, bool terminator, const Environment& env);
   IR_ERROR ParseIdentifier(utility::Stream& s, ByteArray& section, const Environment& env);
   IR_ERROR ParseInitializer(utility::Stream& s, Instruction& ins, const Environment& env);
@@ -19,14 +24,64 @@ namespace innative {
   IR_ERROR ParseImport(utility::Stream& s, Import& i, const Environment& env);
   IR_ERROR ParseExport(utility::Stream& s, Export& e, const Environment& env);
   IR_ERROR ParseInstruction(utility::Stream& s, Instruction& ins, const Environment& env);
+  IR_ERROR ParseInstruction(utility::Stream& s, Instruction& ins, const Environment& env, __WASM_ALLOCATOR& alloc);
   IR_ERROR ParseTableInit(utility::Stream& s, TableInit& init, Module& m, const Environment& env);
-  IR_ERROR ParseFunctionBody(utility::Stream& s, FunctionBody& f, const Environment& env);
+  IR_ERROR ParseInstructions(utility::Stream& s, size_t end, FunctionBody& f, const Environment& env, __WASM_ALLOCATOR& alloc,
+                             BodyValidator* validator = nullptr);
+  // If m is given, the body is validated as it's decoded and its errors are kept until ValidateModule
+  IR_ERROR ParseFunctionBody(utility::Stream& s, FunctionBody& f, const Environment& env, Module* m = nullptr, varuint32 index = 0);
+  IR_ERROR ParseCodeSection(utility::Stream& s, Module& m, const Environment& env);
+  // Decodes a body parsed with ENV_LAZY_FUNCTIONS into f, allocating from alloc so the caller can release it afterwards
+  IR_ERROR DecodeFunctionBody(const FunctionBody& lazy, FunctionBody& f, __WASM_ALLOCATOR& alloc, const Environment& env);
   IR_ERROR ParseDataInit(utility::Stream& s, DataInit& data, const Environment& env);
   IR_ERROR ParseNameSectionLocal(utility::Stream& s, size_t num, DebugInfo*& target, const Environment& env);
   IR_ERROR ParseNameSection(utility::Stream& s, size_t end, Module& m, const Environment& env);
+  IR_ERROR ParseModuleHeader(utility::Stream& s, Module& m);
+  IR_ERROR ParseSectionOrder(Module& m, varuint7 opcode);
+  IR_ERROR ParseSection(utility::Stream& s, varuint7 opcode, varuint32 payload, Module& m, const Environment& env);
+  IR_ERROR ParseModuleEnd(Module& m, ByteArray name, ValidationError*& errors, const Environment& env);
   IR_ERROR ParseModule(utility::Stream& s, const Environment& env, Module& module, ByteArray name, ValidationError*& errors);
   IR_ERROR ParseExportFixup(Module& module, ValidationError*& errors, const Environment& env);
 }
 
+// Parses a binary module from chunks of bytes as they arrive. Each section is parsed as soon as all of its bytes are available,
+// and each function body is decoded and validated on the environment's thread pool as soon as its own bytes are.
+struct __WASM_MODULE_STREAM
+{
+  __WASM_MODULE_STREAM(Environment& env, const char* name);
+  ~__WASM_MODULE_STREAM(); // Waits for any function bodies that are still being parsed
+
+  IR_ERROR Push(const uint8_t* data, size_t size);
+  IR_ERROR Finish(); // Call once every byte has been pushed. m is only usable if this succeeds.
+
+  Module m;
+
+private:
+  enum STATE
+  {
+    STATE_HEADER,
+    STATE_SECTION,
+    STATE_PAYLOAD,
+    STATE_CODE_COUNT,
+    STATE_CODE_BODY,
+  };
+
+  IR_ERROR Step(bool& progress);
+  void ParseBody(varuint32 index, const uint8_t* data, size_t size);
+  void Join();
+
+  Environment& env;
+  std::string name;
+  std::vector<uint8_t> buffer; // Bytes that have arrived but haven't been parsed yet, starting at pos
+  size_t pos;
+  STATE state;
+  IR_ERROR err;
+  varuint7 opcode;
+  varuint32 payload;
+  size_t remaining; // Bytes left in the code section
+  varuint32 next; // Next function body in the code section
+  std::vector<IR_ERROR> results; // Result of each function body, so errors are reported in the same order as ParseModule
+  std::atomic<size_t> outstanding;
+};
 
 #endif
\ No newline at end of file
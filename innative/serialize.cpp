@@ -2,6 +2,8 @@
 // For conditions of distribution and use, see copyright notice in innative.h
 
 #include "serialize.h"
+#include "instruction.h"
+#include "parse.h"
 #include <stdarg.h>
 #include <ostream>
 
@@ -125,6 +127,11 @@ void innative::wat::TokenizeInstruction(const Environment& env, Queue<WatToken>&
   case OP_call_indirect:
     tokens.Push(WatToken{ TOKEN_INTEGER, 0, 0, 0, ins.immediates[0]._varuint32 });
     break;
+  case OP_memory_size:
+  case OP_memory_grow:
+    if(ins.immediates[0]._varuint32 != 0)
+      tokens.Push(WatToken{ TOKEN_INTEGER, 0, 0, 0, ins.immediates[0]._varuint32 });
+    break;
   case OP_i32_load:
   case OP_i64_load:
   case OP_f32_load:
@@ -148,6 +155,9 @@ void innative::wat::TokenizeInstruction(const Environment& env, Queue<WatToken>&
   case OP_i64_store8:
   case OP_i64_store16:
   case OP_i64_store32:
+    if(ins.immediates[2]._varuint32 != 0)
+      tokens.Push(WatToken{ TOKEN_INTEGER, 0, 0, 0, ins.immediates[2]._varuint32 });
+
     if(ins.immediates[0]._varuint32 != 0)
     {
       tokens.Push(WatToken{ TOKEN_ALIGN });
@@ -187,7 +197,7 @@ void innative::wat::PushExportToken(Queue<WatToken>& tokens, const Module& m, va
     }
 }
 
-void innative::wat::TokenizeModule(const Environment& env, Queue<WatToken>& tokens, const Module& m)
+IR_ERROR innative::wat::TokenizeModule(const Environment& env, Queue<WatToken>& tokens, const Module& m)
 {
   tokens.Push(WatToken{ TOKEN_OPEN });
   tokens.Push(WatToken{ TOKEN_MODULE });
@@ -372,6 +382,8 @@ void innative::wat::TokenizeModule(const Environment& env, Queue<WatToken>& toke
       tokens.Push(WatToken{ TOKEN_CLOSE });
     }
 
+  // Lazily parsed bodies are decoded into this scope, which is reset once each body has been turned into tokens
+  __WASM_ALLOCATOR scratch(env.alloc);
   for(uint64_t i = 0; i < m.function.n_funcdecl && i < m.code.n_funcbody; ++i)
   {
     tokens.Push(WatToken{ TOKEN_OPEN });
@@ -417,11 +429,17 @@ void innative::wat::TokenizeModule(const Environment& env, Queue<WatToken>& toke
       tokens.Push(WatToken{ TOKEN_CLOSE });
     }
 
-    for(uint64_t j = 0; j < m.code.funcbody[i].n_body; ++j)
-    {
-      TokenizeInstruction(env, tokens, m, m.code.funcbody[i].body[j], &m.code.funcbody[i], &fn);
-    }
+    FunctionBody body;
+    IR_ERROR err = DecodeFunctionBody(m.code.funcbody[i], body, scratch, env);
+    if(err < 0)
+      return err;
+
+    InstructionCursor cursor(body);
+    Instruction ins;
+    while(cursor.Next(ins))
+      TokenizeInstruction(env, tokens, m, ins, &body, &fn);
     tokens.Push(WatToken{ TOKEN_CLOSE });
+    scratch.Reset();
   }
 
   if(m.knownsections&(1 << WASM_SECTION_DATA))
@@ -441,6 +459,7 @@ void innative::wat::TokenizeModule(const Environment& env, Queue<WatToken>& toke
     }
 
   tokens.Push(WatToken{ TOKEN_CLOSE });
+  return ERR_SUCCESS;
 }
 
 void innative::wat::WriteTokens(Queue<WatToken> tokens, std::ostream& out)
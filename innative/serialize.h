@@ -15,7 +15,7 @@ namespace innative {
     void PushIdentifierToken(Queue<WatToken>& tokens, const ByteArray& id, WatTokens token = TOKEN_STRING);
     void TokenizeInstruction(const Environment& env, Queue<WatToken>& tokens, const Module& m, const Instruction& ins, const FunctionBody* body, const FunctionType* ftype);
     void PushExportToken(Queue<WatToken>& tokens, const Module& m, varuint7 kind, varuint32 index, bool outside);
-    void TokenizeModule(const Environment& env, Queue<WatToken>& tokens, const Module& m);
+    IR_ERROR TokenizeModule(const Environment& env, Queue<WatToken>& tokens, const Module& m); // Fails if a lazily parsed body can't be decoded
     void WriteTokens(Queue<WatToken> tokens, std::ostream& out);
   }
 }
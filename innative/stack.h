@@ -41,6 +41,7 @@ namespace innative {
     inline size_t Size() const { return _size - _limit; }
     inline size_t Limit() const { return _limit; }
     inline void SetLimit(size_t limit) { assert(limit <= _size); _limit = limit; }
+    inline void Clear() { _size = 0; _limit = 0; } // Keeps the capacity so the stack can be reused
 
     static const int MINSIZE = 8;
 
@@ -2,13 +2,71 @@
 // For conditions of distribution and use, see copyright notice in innative.h
 
 #include "stream.h"
+#include "util.h"
 
 using namespace innative;
 using namespace utility;
 
-uint64_t Stream::DecodeLEB128(IR_ERROR& err, unsigned int maxbits, bool sign)
+namespace innative {
+  namespace internal {
+    // Checks the unused bits of the final byte and sign extends the result, once shift bits have been read
+    IR_FORCEINLINE uint64_t FinishLEB128(IR_ERROR& err, uint64_t result, int byte, unsigned int shift, unsigned int maxbits, bool sign)
+    {
+      if(shift > maxbits)
+      {
+        int bits = (int)((~0u << (maxbits + 7 - shift)) & 0x7F); // Gets the illegal bits of this byte
+        int signbit = (1 << (maxbits + 6 - shift)) & byte;
+
+        if(sign && signbit) // If the sign bit is set, we need to check (~byte)&bits instead of byte&bits
+          byte = ~byte;
+
+        if(byte & bits)
+        {
+          err = ERR_FATAL_INVALID_ENCODING;
+          return 0;
+        }
+      }
+
+      if(sign && (byte & 0x40) && shift < 64) // Once the unused bits are checked, bit 6 always matches the sign bit
+        result |= (~0ULL << shift);
+
+      err = ERR_SUCCESS;
+      return result;
+    }
+  }
+}
+
+uint64_t Stream::DecodeLEB128Multi(IR_ERROR& err, unsigned int maxbits, bool sign)
 {
-  size_t shift = 0;
+  if(size - pos >= sizeof(uint64_t)) // If a whole word is left, find the last byte and gather the 7 bit groups without looping
+  {
+    uint64_t word;
+    memcpy(&word, data + pos, sizeof(uint64_t));
+#ifdef IR_ENDIAN_BIG
+    internal::FlipEndian(&word);
+#endif
+    uint64_t ends = ~word & 0x8080808080808080ULL;
+    if(ends) // Only 64-bit values can be longer than 8 bytes, and those take the slow path
+    {
+      unsigned int last = internal::CountTrailingZeros(ends) >> 3;
+      unsigned int shift = (last + 1) * 7;
+      if(shift - 7 >= maxbits)
+      {
+        err = ERR_FATAL_OVERLONG_ENCODING;
+        return 0;
+      }
+
+      int byte = (int)((word >> (last * 8)) & 0x7F);
+      word &= (last < 7) ? ((1ULL << ((last + 1) * 8)) - 1) : ~0ULL;
+      uint64_t result = (word & 0x7FULL) | ((word >> 1) & (0x7FULL << 7)) | ((word >> 2) & (0x7FULL << 14)) |
+                        ((word >> 3) & (0x7FULL << 21)) | ((word >> 4) & (0x7FULL << 28)) | ((word >> 5) & (0x7FULL << 35)) |
+                        ((word >> 6) & (0x7FULL << 42)) | ((word >> 7) & (0x7FULL << 49));
+      pos += last + 1;
+      return internal::FinishLEB128(err, result, byte, shift, maxbits, sign);
+    }
+  }
+
+  unsigned int shift = 0;
   int byte = 0;
   uint64_t result = 0;
   do
@@ -25,30 +83,9 @@ uint64_t Stream::DecodeLEB128(IR_ERROR& err, unsigned int maxbits, bool sign)
       return 0;
     }
 
-    result |= ((byte & 0x7F) << shift);
+    result |= (static_cast<uint64_t>(byte & 0x7F) << shift);
     shift += 7;
   } while((byte & 0x80) != 0);
 
-  int signbit = (1 << (maxbits + 6 - shift)) & byte;
-
-  if(shift > maxbits)
-  {
-    int bits = (~0 << (maxbits + 7 - shift)) & 0x7F; // Gets the illegal bits of this byte
-
-    if(sign && signbit) // If the sign bit is set, we need to check (~byte)&bits instead of byte&bits
-      byte = ~byte;
-
-    if(byte & bits)
-    {
-      err = ERR_FATAL_INVALID_ENCODING;
-      return 0;
-    }
-  }
-
-  //assert(!(((~0ULL) << maxbits) & result));
-  if(sign && signbit != 0)
-    result |= (~0ULL << shift);
-
-  err = ERR_SUCCESS;
-  return result;
-}
\ No newline at end of file
+  return internal::FinishLEB128(err, result, byte, shift, maxbits, sign);
+}
@@ -16,6 +16,7 @@ namespace innative {
       uint8_t* data;
       size_t size;
       size_t pos;
+      bool persistent; // If data lives as long as the environment, parsed byte arrays point into it instead of being copied
 
       // Attempts to read num bytes from the stream, returns actual number of bytes read
       inline size_t ReadBytes(uint8_t* target, size_t num) noexcept
@@ -68,7 +69,21 @@ namespace innative {
         return r;
       }
 
-      uint64_t DecodeLEB128(IR_ERROR& err, unsigned int maxbits, bool sign);
+      // Almost every LEB128 value in a module fits in one byte, so that case is decoded inline. maxbits and sign are constants at
+      // every call site, so each Read function compiles down to its own specialized decoder.
+      IR_FORCEINLINE uint64_t DecodeLEB128(IR_ERROR& err, unsigned int maxbits, bool sign)
+      {
+        if(maxbits >= 7 && pos < size && !(data[pos] & 0x80))
+        {
+          uint64_t result = data[pos++];
+          if(sign && (result & 0x40))
+            result |= (~0ULL << 7);
+          err = ERR_SUCCESS;
+          return result;
+        }
+        return DecodeLEB128Multi(err, maxbits, sign);
+      }
+      uint64_t DecodeLEB128Multi(IR_ERROR& err, unsigned int maxbits, bool sign);
       IR_FORCEINLINE varuint1 ReadVarUInt1(IR_ERROR& err) { return DecodeLEB128(err, 1, false) != 0; }
       IR_FORCEINLINE varuint7 ReadVarUInt7(IR_ERROR& err) { return static_cast<varuint7>(DecodeLEB128(err, 7, false)); }
       IR_FORCEINLINE varuint32 ReadVarUInt32(IR_ERROR& err) { return static_cast<varuint32>(DecodeLEB128(err, 32, false)); }
@@ -0,0 +1,116 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "threadpool.h"
+
+__WASM_THREADPOOL::__WASM_THREADPOOL(unsigned int maxthreads) : n_threads(maxthreads), next(0), pending(0), stop(false)
+{
+  if(!n_threads)
+    n_threads = std::thread::hardware_concurrency();
+  if(!n_threads)
+    n_threads = 1;
+  queues.reset(new TaskQueue[n_threads]);
+}
+
+__WASM_THREADPOOL::~__WASM_THREADPOOL()
+{
+  {
+    std::lock_guard<std::mutex> l(sleep);
+    stop = true;
+  }
+  wake.notify_all();
+
+  for(auto& t : threads)
+    t.join();
+}
+
+void __WASM_THREADPOOL::Push(std::function<void()>&& task)
+{
+  std::call_once(started, [this]() {
+    for(unsigned int i = 0; i < n_threads; ++i)
+      threads.emplace_back(&__WASM_THREADPOOL::Work, this, i);
+  });
+
+  {
+    std::lock_guard<std::mutex> l(sleep);
+    pending.fetch_add(1, std::memory_order_release); // Counted before it's queued, so a worker can never take it before it's counted
+  }
+
+  TaskQueue& q = queues[next.fetch_add(1, std::memory_order_relaxed) % n_threads];
+  {
+    std::lock_guard<std::mutex> l(q.lock);
+    q.tasks.push_back(std::move(task));
+  }
+  wake.notify_one();
+  Notify(); // A task blocked in Wait may be holding the only thread that could run this, so it has to run it itself
+}
+
+bool __WASM_THREADPOOL::Pop(size_t index, std::function<void()>& task)
+{
+  {
+    TaskQueue& q = queues[index];
+    std::lock_guard<std::mutex> l(q.lock);
+    if(!q.tasks.empty())
+    {
+      task = std::move(q.tasks.back()); // Newest first from our own queue, since its data is most likely still in cache
+      q.tasks.pop_back();
+      pending.fetch_sub(1, std::memory_order_acq_rel);
+      return true;
+    }
+  }
+
+  for(size_t i = 1; i < n_threads; ++i)
+  {
+    TaskQueue& q = queues[(index + i) % n_threads];
+    std::lock_guard<std::mutex> l(q.lock);
+    if(!q.tasks.empty())
+    {
+      task = std::move(q.tasks.front()); // Steal the oldest task from everyone else
+      q.tasks.pop_front();
+      pending.fetch_sub(1, std::memory_order_acq_rel);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool __WASM_THREADPOOL::RunOne()
+{
+  std::function<void()> task;
+  if(!Pop(next.load(std::memory_order_relaxed) % n_threads, task))
+    return false;
+
+  task();
+  Notify();
+  return true;
+}
+
+void __WASM_THREADPOOL::Notify()
+{
+  {
+    std::lock_guard<std::mutex> l(lock); // Waiters check their predicate under this lock, so taking it here prevents a lost wakeup
+  }
+  done.notify_all();
+}
+
+void __WASM_THREADPOOL::Work(size_t index)
+{
+  std::function<void()> task;
+
+  for(;;)
+  {
+    if(Pop(index, task))
+    {
+      task();
+      task = nullptr;
+      Notify();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> l(sleep);
+    wake.wait(l, [this]() { return stop || pending.load(std::memory_order_acquire) > 0; });
+    if(stop && !pending.load(std::memory_order_acquire))
+      return;
+  }
+}
@@ -0,0 +1,78 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#ifndef __THREADPOOL_H__IR__
+#define __THREADPOOL_H__IR__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+// Work-stealing thread pool owned by an environment. Each worker takes tasks from the back of its own queue and steals from the
+// front of the others when it runs out. Threads aren't started until the first task is submitted.
+struct __WASM_THREADPOOL
+{
+  explicit __WASM_THREADPOOL(unsigned int maxthreads);
+  ~__WASM_THREADPOOL(); // Finishes every queued task before joining the workers
+
+  template<class F>
+  std::future<typename std::result_of<F()>::type> Submit(F&& f)
+  {
+    typedef typename std::result_of<F()>::type R;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+    std::future<R> result = task->get_future();
+    Push([task]() { (*task)(); });
+    return result;
+  }
+
+  // Runs one queued task on the calling thread, returning false if nothing was queued
+  bool RunOne();
+
+  // Blocks until pred returns true, which is checked while holding lock. The calling thread helps by running queued tasks while it waits.
+  template<class P>
+  void Wait(P pred)
+  {
+    std::unique_lock<std::mutex> l(lock);
+    while(!pred())
+    {
+      l.unlock();
+      bool ran = RunOne();
+      l.lock();
+      if(!ran && !pred())
+        done.wait(l);
+    }
+  }
+
+  std::mutex lock; // Guards whatever state tasks publish their results into
+  std::condition_variable done; // Notified after every task finishes, and whenever a new one is queued
+
+private:
+  struct TaskQueue
+  {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  void Push(std::function<void()>&& task);
+  bool Pop(size_t index, std::function<void()>& task);
+  void Work(size_t index);
+  void Notify();
+
+  unsigned int n_threads;
+  std::unique_ptr<TaskQueue[]> queues;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> next;
+  std::atomic<size_t> pending;
+  std::once_flag started;
+  std::mutex sleep;
+  std::condition_variable wake;
+  bool stop;
+};
+
+#endif
@@ -6,9 +6,24 @@
 #include "compile.h"
 #include "tools.h"
 #include "wat.h"
+#include "threadpool.h"
 #include <atomic>
+#include <algorithm>
 #include <thread>
 #include <stdio.h>
+#include <signal.h>
+#include <setjmp.h>
+
+#ifdef IR_PLATFORM_POSIX
+#include <unistd.h>
+#include <sys/wait.h>
+#include <errno.h>
+#define LONGJMP(x,i) siglongjmp(x,i)
+#define SETJMP(x) sigsetjmp(x,1)
+#else
+#define LONGJMP(x,i) longjmp(x,i)
+#define SETJMP(x) setjmp(x)
+#endif
 
 using namespace innative;
 using namespace utility;
@@ -23,9 +38,14 @@ Environment* innative::CreateEnvironment(unsigned int modules, unsigned int maxt
     //env->cimports = kh_init_cimport();
     env->modules = trealloc<Module>(0, modules);
     env->alloc = new __WASM_ALLOCATOR();
+    env->pool = new __WASM_THREADPOOL(maxthreads);
+    env->symbols = CreateSymbols();
 
     if(!env->modules)
     {
+      DestroySymbols(env->symbols);
+      delete env->pool;
+      delete env->alloc;
       free(env);
       return nullptr;
     }
@@ -52,9 +72,15 @@ void innative::DestroyEnvironment(Environment* env)
   if(!env)
     return;
 
+  delete env->pool; // Finishes any loads or compiles that are still running
+
   for(varuint32 i = 0; i < env->n_modules; ++i)
     kh_destroy_exports(env->modules[i].exports);
 
+  for(__WASM_MAPPING* mapping = env->mappings; mapping; mapping = mapping->next)
+    UnmapFile(mapping->data, mapping->size);
+
+  DestroySymbols(env->symbols);
   delete env->alloc;
   kh_destroy_modulepair(env->whitelist);
   kh_destroy_modules(env->modulemap);
@@ -63,68 +89,148 @@ void innative::DestroyEnvironment(Environment* env)
   free(env);
 }
 
+void innative::GetAllocatorStats(Environment* env, IRAllocatorStats* stats)
+{
+  if(env && stats)
+    env->alloc->GetStats(*stats);
+}
+
 void innative::LoadModule(Environment* env, size_t index, const void* data, uint64_t size, const char* name, const char* path, int* err)
 {
-  Stream s = { (uint8_t*)data, size, 0 };
+  Stream s = { (uint8_t*)data, size, 0, path != nullptr }; // Files are mapped by the environment, so the module can point into them
+  Module m = { 0 }; // Parsed outside of the module array, so other threads can grow it while we work
 
   if((env->flags & ENV_ENABLE_WAT) && size > 0 && s.data[0] != 0)
-    *err = innative::wat::ParseWatModule(*env, env->modules[index], s.data, size, StringRef{ name, strlen(name) });
+    *err = innative::wat::ParseWatModule(*env, m, s.data, size, StringRef{ name, strlen(name) });
   else
-    *err = ParseModule(s, *env, env->modules[index], ByteArray((uint8_t*)name, (varuint32)strlen(name)), env->errors);
+    *err = ParseModule(s, *env, m, ByteArray((uint8_t*)name, (varuint32)strlen(name)), env->errors);
 
-  env->modules[index].path = path;
-  ((std::atomic<size_t>&)env->n_modules).fetch_add(1, std::memory_order_release);
+  m.path = path;
+  std::lock_guard<std::mutex> lock(env->pool->lock);
+  env->modules[index] = m;
+  ++env->n_modules;
 }
 
-void innative::AddModule(Environment* env, const void* data, uint64_t size, const char* name, int* err)
+IR_ERROR innative::ReserveModule(Environment* env, size_t& index)
+{
+  // Loads only write to the module array while holding this lock, so it's safe to move it here
+  std::lock_guard<std::mutex> lock(env->pool->lock);
+  index = env->size;
+  if(index >= env->capacity)
+  {
+    Module* modules = trealloc<Module>(env->modules, index * 2);
+    if(!modules)
+      return ERR_FATAL_OUT_OF_MEMORY;
+    env->modules = modules;
+    env->capacity = index * 2;
+  }
+  ++env->size;
+  return ERR_SUCCESS;
+}
+
+// Maps the file for as long as the environment exists, so nothing parsed from it ever needs to be copied out
+const void* innative::MapModuleFile(Environment* env, const char* path, uint64_t& size)
+{
+  __WASM_MAPPING* mapping = tmalloc<__WASM_MAPPING>(*env, 1);
+  if(!mapping || !(mapping->data = MapFile(path, mapping->size)))
+    return nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(env->pool->lock);
+    mapping->next = env->mappings;
+    env->mappings = mapping;
+  }
+
+  size = mapping->size;
+  return mapping->data;
+}
+
+void innative::AddModuleAsync(Environment* env, const void* data, uint64_t size, const char* name, IR_Completion callback, void* user)
 {
-  if(!env || !err)
+  if(!env || !name)
   {
-    *err = ERR_FATAL_NULL_POINTER;
+    if(callback)
+      (*callback)(user, ERR_FATAL_NULL_POINTER);
     return;
   }
 
   const char* path = nullptr;
-  std::unique_ptr<uint8_t[]> data_module;
   if(!size)
   {
-    long sz = 0;
     path = (const char*)data;
-    data_module = utility::LoadFile(path, sz);
-    if(data_module.get() == nullptr)
+    data = MapModuleFile(env, path, size);
+    if(data == nullptr)
     {
-      *err = ERR_FATAL_FILE_ERROR;
+      if(callback)
+        (*callback)(user, ERR_FATAL_FILE_ERROR);
       return;
     }
-    size = sz;
-    data = data_module.get();
   }
 
-  if((env->flags & ENV_MULTITHREADED) != 0 && env->maxthreads > 0)
+  size_t index;
+  IR_ERROR err = ReserveModule(env, index);
+  if(err < 0)
   {
-    while(((std::atomic<size_t>&)env->size).load(std::memory_order_relaxed) - ((std::atomic<size_t>&)env->n_modules).load(std::memory_order_relaxed) >= env->maxthreads)
-      std::this_thread::sleep_for(std::chrono::milliseconds(2)); // If we're using maxthreads, block until one finishes (we must block up here or we risk a deadlock)
+    if(callback)
+      (*callback)(user, err);
+    return;
   }
 
-  size_t index = ((std::atomic<size_t>&)env->size).fetch_add(1, std::memory_order_acq_rel);
-  if(index >= env->capacity)
-  {
-    while(((std::atomic<size_t>&)env->n_modules).load(std::memory_order_relaxed) != index)
-      std::this_thread::sleep_for(std::chrono::milliseconds(5)); // If we've exceeded our capacity, block until all other threads have finished
-
-    env->modules = trealloc<Module>(env->modules, index * 2);
-    if(!env->modules)
-    {
-      *err = ERR_FATAL_OUT_OF_MEMORY;
-      return;
-    }
-    ((std::atomic<size_t>&)env->capacity).store(index * 2, std::memory_order_release);
-  }
+  std::string module_name(name); // The caller's name doesn't have to outlive this call
+  auto load = [env, index, data, size, module_name, path, callback, user]() {
+    int result;
+    LoadModule(env, index, data, size, module_name.c_str(), path, &result);
+    if(callback)
+      (*callback)(user, (enum IR_ERROR)result);
+  };
 
   if(env->flags & ENV_MULTITHREADED)
-    std::thread(LoadModule, env, index, data, size, name, path, err).detach();
+    env->pool->Submit(load);
   else
-    LoadModule(env, index, data, size, name, path, err);
+    load();
+}
+
+void innative::AddModule(Environment* env, const void* data, uint64_t size, const char* name, int* err)
+{
+  if(!err)
+    return;
+
+  AddModuleAsync(env, data, size, name, [](void* user, enum IR_ERROR e) { *reinterpret_cast<int*>(user) = e; }, err);
+}
+
+struct __WASM_MODULE_STREAM* innative::BeginModuleStream(Environment* env, const char* name)
+{
+  if(!env || !name)
+    return nullptr;
+  return new __WASM_MODULE_STREAM(*env, name);
+}
+
+enum IR_ERROR innative::PushModuleStream(struct __WASM_MODULE_STREAM* stream, const void* data, uint64_t size)
+{
+  if(!stream || (!data && size > 0))
+    return ERR_FATAL_NULL_POINTER;
+  return stream->Push(reinterpret_cast<const uint8_t*>(data), (size_t)size);
+}
+
+enum IR_ERROR innative::FinishModuleStream(Environment* env, struct __WASM_MODULE_STREAM* stream)
+{
+  if(!env || !stream)
+    return ERR_FATAL_NULL_POINTER;
+
+  std::unique_ptr<__WASM_MODULE_STREAM> owned(stream);
+  IR_ERROR err = stream->Finish();
+
+  // The module only joins the environment once it's complete, so WaitForLoad never blocks on bytes that haven't arrived. Just like
+  // LoadModule, it's added even if parsing failed so the environment cleans it up.
+  size_t index;
+  IR_ERROR reserve = ReserveModule(env, index);
+  if(reserve < 0)
+    return reserve;
+
+  std::lock_guard<std::mutex> lock(env->pool->lock);
+  env->modules[index] = stream->m;
+  ++env->n_modules;
+  return err;
 }
 
 void innative::AddWhitelist(Environment* env, const char* module_name, const char* export_name)
@@ -142,8 +248,8 @@ void innative::AddWhitelist(Environment* env, const char* module_name, const cha
 
 void innative::WaitForLoad(Environment* env)
 {
-  while(((std::atomic<size_t>&)env->size).load(std::memory_order_relaxed) > ((std::atomic<size_t>&)env->n_modules).load(std::memory_order_relaxed))
-    std::this_thread::sleep_for(std::chrono::milliseconds(5)); // Spin until all modules loaded
+  if(env)
+    env->pool->Wait([env]() { return env->n_modules >= env->size; });
 }
 
 enum IR_ERROR innative::AddEmbedding(Environment* env, int tag, const void* data, uint64_t size)
@@ -179,7 +285,7 @@ enum IR_ERROR innative::AddEmbedding(Environment* env, int tag, const void* data
   return ERR_SUCCESS;
 }
 
-enum IR_ERROR innative::Compile(Environment* env, const char* file)
+enum IR_ERROR innative::Validate(Environment* env)
 {
   if(!env)
     return ERR_FATAL_NULL_POINTER;
@@ -187,6 +293,9 @@ enum IR_ERROR innative::Compile(Environment* env, const char* file)
   // Before validating, add all modules to the modulemap. We must do this outside of LoadModule for multithreading reasons.
   for(size_t i = 0; i < env->n_modules; ++i)
   {
+    IR_ERROR err = InternIdentifier(*env, env->modules[i].name); // modulemap compares pointers, and the name could have been replaced
+    if(err < 0)
+      return err;
     int r;
     khiter_t iter = kh_put_modules(env->modulemap, env->modules[i].name, &r);
     if(!r)
@@ -201,32 +310,593 @@ enum IR_ERROR innative::Compile(Environment* env, const char* file)
     return ERR_VALIDATION_ERROR;
   }
 
+  return ERR_SUCCESS;
+}
+
+enum IR_ERROR innative::Compile(Environment* env, const char* file)
+{
+  IR_ERROR err = Validate(env);
+  if(err < 0)
+    return err;
+
   return CompileEnvironment(env, file);
 }
-IR_Entrypoint innative::LoadFunction(void* cache, const char* module_name, const char* function)
+
+void innative::CompileAsync(Environment* env, const char* file, IR_Completion callback, void* user)
 {
-  return (IR_Entrypoint)LoadDLLFunction(cache, !function ? IR_INIT_FUNCTION : utility::CanonicalName(StringRef::From(module_name), StringRef::From(function)).c_str());
+  if(!env)
+  {
+    if(callback)
+      (*callback)(user, ERR_FATAL_NULL_POINTER);
+    return;
+  }
+
+  std::string out(!file ? "" : file);
+  bool null_file = !file;
+  auto compile = [env, out, null_file, callback, user]() {
+    WaitForLoad(env); // Helps finish any queued loads instead of just blocking a worker
+    enum IR_ERROR err = Compile(env, null_file ? nullptr : out.c_str());
+    if(callback)
+      (*callback)(user, err);
+  };
+
+  if(env->flags & ENV_MULTITHREADED)
+    env->pool->Submit(compile);
+  else
+    compile();
 }
 
+static const char* SNAPSHOT_MEMORY_PREFIX = "_innative_snapshot_memory#";
+static const char* SNAPSHOT_GLOBAL_PREFIX = "_innative_snapshot_global#";
+static const char* SNAPSHOT_TABLE_PREFIX = "_innative_snapshot_table#";
+static const char* SNAPSHOT_START_PREFIX = "_innative_snapshot_start#";
+
 struct IR_TABLE
 {
   IR_Entrypoint func;
   varuint32 type;
 };
 
+void* LoadExport(void* cache, const char* module_name, const char* export_name);
+
+// Export names are interned like every other export, so the validator and compiler can compare them by pointer
+IR_ERROR SnapshotName(Environment& env, const char* prefix, varuint32 index, Identifier& name)
+{
+  std::string buf = std::string(prefix) + std::to_string(index);
+  name = Identifier((uint8_t*)buf.data(), (varuint32)buf.size());
+  return InternIdentifier(env, name);
+}
+
+// Splits a snapshot of linear memory into data segments, skipping any zero runs of at least a page
+IR_ERROR SnapshotMemory(Environment& env, const uint8_t* mem, uint64_t size, varuint32 index, std::vector<DataInit>& out)
+{
+  uint64_t i = 0;
+  while(i < size)
+  {
+    while(i < size && !mem[i]) ++i;
+    if(i >= size)
+      break;
+
+    uint64_t start = i;
+    uint64_t end = i;
+    while(i < size && i - end < IR_PAGE_SIZE)
+    {
+      if(mem[i++] != 0)
+        end = i;
+    }
+
+    DataInit d = { index };
+    d.offset = Instruction{ OP_i32_const };
+    d.offset.immediates[0]._varsint32 = (varsint32)start;
+    d.data.resize((varuint32)(end - start), false, env);
+    if(!d.data.get())
+      return ERR_FATAL_OUT_OF_MEMORY;
+    tmemcpy(d.data.get(), d.data.size(), mem + start, end - start);
+    out.push_back(d);
+    i = end;
+  }
+
+  return ERR_SUCCESS;
+}
+
+IR_ERROR SnapshotModule(Environment& env, Module& m, void* cache)
+{
+  varuint32 memories = m.importsection.memories - m.importsection.tables;
+  varuint32 globals = m.importsection.globals - m.importsection.memories;
+
+  std::vector<DataInit> data;
+  for(varuint32 i = 0; i < m.memory.n_memories; ++i)
+  {
+    Identifier name;
+    IR_ERROR err = SnapshotName(env, SNAPSHOT_MEMORY_PREFIX, i, name);
+    if(err < 0)
+      return err;
+    IRGlobal* g = LoadGlobal(cache, m.name.str(), name.str());
+    if(!g || !g->memory)
+      return ERR_FATAL_INVALID_MODULE;
+
+    const uint8_t* mem = (const uint8_t*)g->memory;
+    uint64_t size = ((const uint64_t*)mem)[-1];
+    m.memory.memories[i].limits.minimum = (varuint32)(size >> 16); // memory.grow during init becomes part of the initial size
+
+    err = SnapshotMemory(env, mem, size, memories + i, data);
+    if(err < 0)
+      return err;
+  }
+
+  m.data.n_data = (varuint32)data.size();
+  m.data.data = tmalloc<DataInit>(env, data.size());
+  if(data.size() > 0)
+  {
+    if(!m.data.data)
+      return ERR_FATAL_OUT_OF_MEMORY;
+    tmemcpy(m.data.data, m.data.n_data, data.data(), data.size());
+    m.knownsections |= (1 << WASM_SECTION_DATA);
+  }
+
+  for(varuint32 i = 0; i < m.global.n_globals; ++i)
+  {
+    Identifier name;
+    IR_ERROR err = SnapshotName(env, SNAPSHOT_GLOBAL_PREFIX, i, name);
+    if(err < 0)
+      return err;
+    IRGlobal* g = LoadGlobal(cache, m.name.str(), name.str());
+    if(!g)
+      return ERR_FATAL_INVALID_MODULE;
+
+    GlobalDecl& decl = m.global.globals[i];
+    decl.init = Instruction{ 0 };
+    switch(decl.desc.type)
+    {
+    case TE_i32: decl.init.opcode = OP_i32_const; decl.init.immediates[0]._varsint32 = (varsint32)g->i32; break;
+    case TE_i64: decl.init.opcode = OP_i64_const; decl.init.immediates[0]._varsint64 = (varsint64)g->i64; break;
+    case TE_f32: decl.init.opcode = OP_f32_const; decl.init.immediates[0]._float32 = g->f32; break;
+    case TE_f64: decl.init.opcode = OP_f64_const; decl.init.immediates[0]._float64 = g->f64; break;
+    default: return assert(false), ERR_INVALID_TYPE;
+    }
+  }
+
+  m.knownsections &= ~(1 << WASM_SECTION_START); // The start function already ran
+  return ERR_SUCCESS;
+}
+
+// The pieces of a scratch library's initialization, which the snapshot runs by hand so it can check each step
+struct SnapshotInit
+{
+  IR_Entrypoint init; // Only applies the data and element segments, because the scratch modules have no start section
+  std::vector<IR_Entrypoint> starts; // One per module that has a start function, in module order
+  std::vector<IR_TABLE**> tables; // Every table any module defines
+};
+
+static jmp_buf snapshot_jump;
+
+static void SnapshotCrashHandler(int sig) { LONGJMP(snapshot_jump, 1); }
+
+// longjmp skips destructors, so we isolate this call from anything that owns memory
+static IR_ERROR IsolateSnapshotCall(IR_Entrypoint f)
+{
+  if(SETJMP(snapshot_jump) != 0)
+    return ERR_RUNTIME_TRAP;
+
+  (*f)();
+  return ERR_SUCCESS;
+}
+
+static std::string SnapshotTable(IR_TABLE** ref)
+{
+  if(!*ref)
+    return std::string();
+  return std::string((const char*)*ref, (size_t)((const uint64_t*)*ref)[-1]);
+}
+
+// The snapshot keeps the element segments instead of recording the tables, so a start function that changes a table (which
+// webassembly code can only do through a host import) is refused, because the snapshotted binary would lose that change.
+static IR_ERROR RunSnapshotInit(const SnapshotInit& run)
+{
+  auto ill = signal(SIGILL, SnapshotCrashHandler);
+  auto fpe = signal(SIGFPE, SnapshotCrashHandler);
+
+  IR_ERROR err = IsolateSnapshotCall(run.init);
+  std::vector<std::string> tables;
+  for(auto ref : run.tables)
+    tables.push_back(SnapshotTable(ref));
+
+  for(size_t i = 0; i < run.starts.size() && err >= 0; ++i)
+    err = IsolateSnapshotCall(run.starts[i]);
+
+  for(size_t i = 0; i < run.tables.size() && err >= 0; ++i)
+    if(SnapshotTable(run.tables[i]) != tables[i])
+      err = ERR_INVALID_START_FUNCTION;
+
+  signal(SIGILL, ill);
+  signal(SIGFPE, fpe);
+  return err;
+}
+
+#ifdef IR_PLATFORM_POSIX
+// A start function that never returns would hang the compile, so the first run happens in a child process with a deadline. The
+// child also contains any crash the signal handlers can't recover from.
+static IR_ERROR ForkSnapshotInit(const SnapshotInit& run, unsigned int seconds)
+{
+  pid_t pid = fork();
+  if(pid < 0)
+    return ERR_RUNTIME_INIT_ERROR;
+  if(!pid)
+  {
+    alarm(seconds);
+    IR_ERROR err = RunSnapshotInit(run);
+    _exit(err >= 0 ? 0 : err == ERR_INVALID_START_FUNCTION ? 2 : 1);
+  }
+
+  int status;
+  while(waitpid(pid, &status, 0) < 0)
+    if(errno != EINTR)
+      return ERR_RUNTIME_INIT_ERROR;
+
+  if(WIFSIGNALED(status))
+    return WTERMSIG(status) == SIGALRM ? ERR_RUNTIME_INIT_ERROR : ERR_RUNTIME_TRAP;
+  switch(WEXITSTATUS(status))
+  {
+  case 0: return ERR_SUCCESS;
+  case 2: return ERR_INVALID_START_FUNCTION;
+  default: return ERR_RUNTIME_TRAP;
+  }
+}
+#endif
+
+// Compiles the environment to a scratch library, runs its initialization in this process, and then folds the resulting memories and
+// globals back into the modules. Compiling afterwards emits a binary whose init restores that state and skips the start functions.
+// A trap during initialization returns ERR_RUNTIME_TRAP, and on POSIX a start function still running after the given number of
+// seconds returns ERR_RUNTIME_INIT_ERROR.
+enum IR_ERROR innative::SnapshotEnvironment(Environment* env, const char* scratch, unsigned int seconds)
+{
+  if(!env || !scratch)
+    return ERR_FATAL_NULL_POINTER;
+
+  // Data segments are replaced by the snapshot, so one that writes to an imported memory would be lost
+  for(size_t i = 0; i < env->n_modules; ++i)
+  {
+    Module& m = env->modules[i];
+    varuint32 imported = m.importsection.memories - m.importsection.tables;
+    for(varuint32 j = 0; j < m.data.n_data; ++j)
+      if(m.data.data[j].index < imported)
+        return ERR_INVALID_DATA_SEGMENT;
+  }
+
+  // The scratch compile works on a copy of the environment with its own modules and module map, so the real one is never modified
+  Environment copy = *env;
+  copy.flags = (env->flags | ENV_LIBRARY | ENV_NO_INIT) & ~ENV_EMIT_LLVM;
+  copy.modulemap = kh_init_modules();
+  copy.modules = tmalloc<Module>(*env, env->n_modules);
+  utility::DeferLambda<std::function<void()>> destroy([&]() { kh_destroy_modules(copy.modulemap); });
+  if(!copy.modules)
+    return ERR_FATAL_OUT_OF_MEMORY;
+  tmemcpy(copy.modules, env->n_modules, env->modules, env->n_modules);
+  copy.size = copy.capacity = env->n_modules;
+
+  // Export every memory, global and table each module defines, so we can find them in the scratch library. The start function is
+  // exported instead of run by init, so it can be called separately once the segments are applied.
+  for(size_t i = 0; i < copy.n_modules; ++i)
+  {
+    Module& m = copy.modules[i];
+    bool start = (m.knownsections & (1 << WASM_SECTION_START)) != 0;
+    varuint32 n = m.exportsection.n_exports + m.memory.n_memories + m.global.n_globals + m.table.n_tables + start;
+    Export* exports = tmalloc<Export>(*env, n);
+    if(!exports && n > 0)
+      return ERR_FATAL_OUT_OF_MEMORY;
+    if(m.exportsection.n_exports > 0)
+      tmemcpy(exports, n, m.exportsection.exports, m.exportsection.n_exports);
+
+    IR_ERROR err = ERR_SUCCESS;
+    for(varuint32 j = 0; j < m.memory.n_memories && err >= 0; ++j)
+    {
+      Export& e = exports[m.exportsection.n_exports++] = Export{ Identifier(), WASM_KIND_MEMORY, m.importsection.memories - m.importsection.tables + j };
+      err = SnapshotName(*env, SNAPSHOT_MEMORY_PREFIX, j, e.name);
+    }
+    for(varuint32 j = 0; j < m.global.n_globals && err >= 0; ++j)
+    {
+      Export& e = exports[m.exportsection.n_exports++] = Export{ Identifier(), WASM_KIND_GLOBAL, m.importsection.globals - m.importsection.memories + j };
+      err = SnapshotName(*env, SNAPSHOT_GLOBAL_PREFIX, j, e.name);
+    }
+    for(varuint32 j = 0; j < m.table.n_tables && err >= 0; ++j)
+    {
+      Export& e = exports[m.exportsection.n_exports++] = Export{ Identifier(), WASM_KIND_TABLE, m.importsection.tables - m.importsection.functions + j };
+      err = SnapshotName(*env, SNAPSHOT_TABLE_PREFIX, j, e.name);
+    }
+    if(start && err >= 0)
+    {
+      Export& e = exports[m.exportsection.n_exports++] = Export{ Identifier(), WASM_KIND_FUNCTION, m.start };
+      err = SnapshotName(*env, SNAPSHOT_START_PREFIX, 0, e.name);
+      m.knownsections &= ~(1 << WASM_SECTION_START);
+    }
+    if(err < 0)
+      return err;
+
+    m.exportsection.exports = exports;
+    m.knownsections |= (1 << WASM_SECTION_EXPORT);
+  }
+
+  IR_ERROR err = Compile(&copy, scratch);
+  env->errors = copy.errors;
+  if(err < 0)
+    return err;
+
+  void* cache = LoadAssembly(scratch);
+  if(!cache)
+    return ERR_FATAL_FILE_ERROR;
+
+  SnapshotInit run = { LoadFunction(cache, 0, IR_INIT_FUNCTION) };
+  IR_Entrypoint exit = LoadFunction(cache, 0, IR_EXIT_FUNCTION);
+  for(size_t i = 0; i < env->n_modules && err >= 0; ++i)
+  {
+    Module& m = env->modules[i];
+    Identifier name;
+    if(m.knownsections & (1 << WASM_SECTION_START))
+    {
+      err = SnapshotName(*env, SNAPSHOT_START_PREFIX, 0, name);
+      IR_Entrypoint f = (err < 0) ? nullptr : LoadFunction(cache, m.name.str(), name.str());
+      if(!f && err >= 0)
+        err = ERR_FATAL_INVALID_MODULE;
+      run.starts.push_back(f);
+    }
+    for(varuint32 j = 0; j < m.table.n_tables && err >= 0; ++j)
+    {
+      err = SnapshotName(*env, SNAPSHOT_TABLE_PREFIX, j, name);
+      IR_TABLE** ref = (err < 0) ? nullptr : (IR_TABLE**)LoadExport(cache, m.name.str(), name.str());
+      if(!ref && err >= 0)
+        err = ERR_FATAL_INVALID_MODULE;
+      run.tables.push_back(ref);
+    }
+  }
+
+  if(!run.init)
+    err = ERR_RUNTIME_INIT_ERROR;
+#ifdef IR_PLATFORM_POSIX
+  if(err >= 0)
+    err = ForkSnapshotInit(run, seconds);
+#endif
+  if(err >= 0)
+    err = RunSnapshotInit(run);
+
+  for(size_t i = 0; i < env->n_modules && err >= 0; ++i)
+    err = SnapshotModule(*env, env->modules[i], cache);
+
+  if(exit && run.init)
+    (*exit)();
+  FreeDLL(cache);
+  return err;
+}
+
+// The directory is a single exported symbol, so looking it up again each time is cheap and can never be stale
+const IRExportDirectory* innative::LoadExportDirectory(void* cache)
+{
+  return !cache ? nullptr : (const IRExportDirectory*)LoadDLLFunction(cache, IR_EXPORT_DIRECTORY);
+}
+
+const IRExportEntry* innative::FindExport(const IRExportDirectory* directory, const char* module_name, const char* export_name)
+{
+  if(!export_name)
+    return nullptr;
+  return FindExport(directory, module_name, !module_name ? 0 : strlen(module_name), export_name, strlen(export_name));
+}
+
+const IRExportEntry* innative::FindExport(const IRExportDirectory* directory, const char* module_name, size_t module_size, const char* export_name,
+                                          size_t export_size)
+{
+  if(!directory || !export_name)
+    return nullptr;
+
+  auto module_ref = StringRef{ module_name, module_size };
+  auto export_ref = StringRef{ export_name, export_size };
+  uint64_t hash = utility::ExportHash(module_ref, export_ref);
+  const IRExportEntry* begin = directory->entries;
+  const IRExportEntry* end = directory->entries + directory->count;
+
+  // Find the first entry with this hash, then check the names of every entry that shares it
+  for(auto e = std::lower_bound(begin, end, hash, [](const IRExportEntry& entry, uint64_t h) { return entry.hash < h; }); e != end && e->hash == hash; ++e)
+  {
+    if(StringRef{ e->module_name, e->module_size } == module_ref && StringRef{ e->export_name, e->export_size } == export_ref)
+      return e;
+  }
+
+  return nullptr;
+}
+
+// Uses the export directory when the library has one, and only falls back to the mangled symbol name for anything it doesn't list
+void* LoadExport(void* cache, const char* module_name, const char* export_name)
+{
+  if(auto entry = innative::FindExport(innative::LoadExportDirectory(cache), module_name, export_name))
+    return entry->address;
+  return LoadDLLFunction(cache, utility::CanonicalName(StringRef::From(module_name), StringRef::From(export_name)).c_str());
+}
+
+IR_Entrypoint innative::LoadFunction(void* cache, const char* module_name, const char* function)
+{
+  return (IR_Entrypoint)(!function ? LoadDLLFunction(cache, IR_INIT_FUNCTION) : LoadExport(cache, module_name, function));
+}
+
+// Like memories, the exported symbol is a pointer to the table, which stores its size in bytes just before the first entry
 IR_Entrypoint innative::LoadTable(void* cache, const char* module_name, const char* table, varuint32 index)
 {
-  IR_TABLE* ref = (IR_TABLE*)LoadDLLFunction(cache, utility::CanonicalName(StringRef::From(module_name), StringRef::From(table)).c_str());
-  return !ref ? nullptr : ref[index].func;
+  IR_TABLE** ref = (IR_TABLE**)LoadExport(cache, module_name, table);
+  if(!ref || !*ref || index >= ((uint64_t*)*ref)[-1] / sizeof(IR_TABLE))
+    return nullptr;
+  return (*ref)[index].func;
 }
 
 IRGlobal* innative::LoadGlobal(void* cache, const char* module_name, const char* export_name)
 {
-  return (IRGlobal*)LoadDLLFunction(cache, utility::CanonicalName(StringRef::From(module_name), StringRef::From(export_name)).c_str());
+  return (IRGlobal*)LoadExport(cache, module_name, export_name);
+}
+
+enum IR_ERROR innative::LoadTypedFunction(void* cache, const char* module_name, const char* function, IRFunction* out)
+{
+  if(!cache || !function || !out)
+    return ERR_FATAL_NULL_POINTER;
+
+  // The export directory has all three pointers in one entry, so only libraries without one need the dynamic linker
+  const void* signature;
+  if(auto entry = FindExport(LoadExportDirectory(cache), module_name, function))
+  {
+    out->function = (IR_Entrypoint)entry->address;
+    out->invoke = entry->invoke;
+    signature = entry->signature;
+  }
+  else
+  {
+    auto canonical = utility::CanonicalName(StringRef::From(module_name), StringRef::From(function));
+    size_t len = canonical.size();
+    out->function = (IR_Entrypoint)LoadDLLFunction(cache, canonical.c_str());
+    out->invoke = (IR_Invoke)LoadDLLFunction(cache, canonical.append(IR_INVOKE_SUFFIX).c_str());
+    signature = LoadDLLFunction(cache, canonical.replace(len, std::string::npos, IR_SIGNATURE_SUFFIX).c_str());
+  }
+
+  if(!out->function || !out->invoke || !signature)
+    return ERR_UNKNOWN_EXPORT;
+
+  auto counts = reinterpret_cast<const uint32_t*>(signature);
+  out->type.form = TE_func;
+  out->type.n_params = counts[0];
+  out->type.n_returns = counts[1];
+  out->type.params = (varsint7*)(counts + 2);
+  out->type.returns = out->type.params + out->type.n_params;
+  return ERR_SUCCESS;
 }
 
 void* innative::LoadAssembly(const char* file)
 {
   Path path(file != nullptr ? Path(file) : GetProgramPath(0) + IR_EXTENSION);
   return LoadDLL(path.c_str());
+}
+
+IRInstance* innative::CreateInstance(void* cache)
+{
+  auto swap = (void*(*)(void*))LoadDLLFunction(cache, IR_INSTANCE_SWAP_FUNCTION);
+  auto image = (const char*)LoadDLLFunction(cache, IR_INSTANCE_TEMPLATE);
+  auto size = (const uint64_t*)LoadDLLFunction(cache, IR_INSTANCE_SIZE);
+  auto memories = (const uint64_t*)LoadDLLFunction(cache, IR_INSTANCE_MEMORIES);
+  auto tables = (const uint64_t*)LoadDLLFunction(cache, IR_INSTANCE_TABLES);
+  auto init = (IR_Entrypoint)LoadDLLFunction(cache, IR_INIT_FUNCTION);
+  auto exit = (IR_Entrypoint)LoadDLLFunction(cache, IR_EXIT_FUNCTION);
+  if(!swap || !image || !size || !memories || !tables || !init || !exit)
+    return nullptr; // Not compiled with ENV_INSTANCES
+
+  // The state block lives directly after the instance, and starts out as a copy of the template
+  IRInstance* instance = reinterpret_cast<IRInstance*>(malloc(sizeof(IRInstance) + *size));
+  if(!instance)
+    return nullptr;
+  instance->swap = swap;
+  instance->exit = exit;
+  instance->state = instance + 1;
+  instance->size = *size;
+  instance->memories = memories;
+  instance->tables = tables;
+  instance->saved = nullptr;
+  memcpy(instance->state, image, *size);
+
+  void* previous = EnterInstance(instance);
+  (*init)();
+  LeaveInstance(instance, previous);
+  return instance;
+}
+
+void* innative::EnterInstance(IRInstance* instance) { return (*instance->swap)(instance->state); }
+
+void innative::LeaveInstance(IRInstance* instance, void* previous) { (*instance->swap)(previous); }
+
+struct IR_INSTANCE_SAVE
+{
+  struct Region
+  {
+    uint8_t* p;
+    uint64_t size;
+    int image; // Handle from SaveMemoryImage, or -1 if we fall back to the copy
+    std::unique_ptr<uint8_t[]> copy;
+  };
+
+  std::unique_ptr<uint8_t[]> state;
+  std::vector<Region> memories;
+  std::vector<Region> tables;
+
+  ~IR_INSTANCE_SAVE()
+  {
+    for(auto& m : memories)
+      if(m.image >= 0)
+        FreeMemoryImage(m.image);
+  }
+};
+
+enum IR_ERROR innative::SaveInstance(IRInstance* instance)
+{
+  if(!instance)
+    return ERR_FATAL_NULL_POINTER;
+
+  delete reinterpret_cast<IR_INSTANCE_SAVE*>(instance->saved);
+  auto save = new IR_INSTANCE_SAVE();
+  instance->saved = save;
+  save->state.reset(new uint8_t[instance->size]);
+  memcpy(save->state.get(), instance->state, instance->size);
+
+  // Memory and table pointers never move once created, so we can hold on to them
+  for(const uint64_t* i = instance->memories; *i != ~0ULL; ++i)
+  {
+    uint8_t* p = *reinterpret_cast<uint8_t**>(reinterpret_cast<uint8_t*>(instance->state) + *i);
+    uint64_t size = reinterpret_cast<uint64_t*>(p)[-1];
+    save->memories.push_back({ p, size, !size ? -1 : SaveMemoryImage(p, size) });
+    if(save->memories.back().image < 0)
+    {
+      save->memories.back().copy.reset(new uint8_t[size]);
+      memcpy(save->memories.back().copy.get(), p, size);
+    }
+  }
+
+  for(const uint64_t* i = instance->tables; *i != ~0ULL; ++i)
+  {
+    uint8_t* p = *reinterpret_cast<uint8_t**>(reinterpret_cast<uint8_t*>(instance->state) + *i);
+    uint64_t size = reinterpret_cast<uint64_t*>(p)[-1];
+    save->tables.push_back({ p, size, -1, std::unique_ptr<uint8_t[]>(new uint8_t[size]) });
+    memcpy(save->tables.back().copy.get(), p, size);
+  }
+
+  return ERR_SUCCESS;
+}
+
+enum IR_ERROR innative::ResetInstance(IRInstance* instance)
+{
+  if(!instance || !instance->saved)
+    return ERR_FATAL_NULL_POINTER;
+
+  auto save = reinterpret_cast<IR_INSTANCE_SAVE*>(instance->saved);
+  for(auto& m : save->memories)
+  {
+    uint64_t* info = reinterpret_cast<uint64_t*>(m.p);
+    if(info[-1] > m.size) // Give back any pages grown since the save
+    {
+      DecommitMemory(m.p + m.size, info[-1] - m.size);
+      info[-1] = m.size;
+    }
+
+    if(m.image >= 0)
+      ResetMemoryImage(m.image, m.p, m.size);
+    else
+      memcpy(m.p, m.copy.get(), m.size);
+  }
+
+  for(auto& t : save->tables)
+    memcpy(t.p, t.copy.get(), t.size);
+
+  memcpy(instance->state, save->state.get(), instance->size); // Restores all mutable globals
+  return ERR_SUCCESS;
+}
+
+void innative::DestroyInstance(IRInstance* instance)
+{
+  if(!instance)
+    return;
+
+  delete reinterpret_cast<IR_INSTANCE_SAVE*>(instance->saved);
+  void* previous = EnterInstance(instance);
+  (*instance->exit)();
+  LeaveInstance(instance, previous);
+  free(instance);
 }
\ No newline at end of file
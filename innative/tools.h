@@ -9,20 +9,41 @@
 #include <ostream>
 
 struct __WASM_ENVIRONMENT;
+struct __WASM_MODULE_STREAM;
 
 namespace innative {
   struct __WASM_ENVIRONMENT* CreateEnvironment(unsigned int modules, unsigned int maxthreads, const char* arg0);
   void DestroyEnvironment(struct __WASM_ENVIRONMENT* env);
+  void GetAllocatorStats(struct __WASM_ENVIRONMENT* env, IRAllocatorStats* stats);
   void LoadModule(struct __WASM_ENVIRONMENT* env, size_t index, const void* data, uint64_t size, const char* name, const char* path, int* err);
   void AddModule(struct __WASM_ENVIRONMENT* env, const void* data, uint64_t size, const char* name, int* err);
+  void AddModuleAsync(struct __WASM_ENVIRONMENT* env, const void* data, uint64_t size, const char* name, IR_Completion callback, void* user);
+  IR_ERROR ReserveModule(struct __WASM_ENVIRONMENT* env, size_t& index);
+  const void* MapModuleFile(struct __WASM_ENVIRONMENT* env, const char* path, uint64_t& size);
+  struct __WASM_MODULE_STREAM* BeginModuleStream(struct __WASM_ENVIRONMENT* env, const char* name);
+  enum IR_ERROR PushModuleStream(struct __WASM_MODULE_STREAM* stream, const void* data, uint64_t size);
+  enum IR_ERROR FinishModuleStream(struct __WASM_ENVIRONMENT* env, struct __WASM_MODULE_STREAM* stream);
   void AddWhitelist(struct __WASM_ENVIRONMENT* env, const char* module_name, const char* export_name);
   void WaitForLoad(struct __WASM_ENVIRONMENT* env);
   enum IR_ERROR AddEmbedding(struct __WASM_ENVIRONMENT* env, int tag, const void* data, uint64_t size);
+  enum IR_ERROR Validate(struct __WASM_ENVIRONMENT* env); // Adds every module to the module map and validates the environment
   enum IR_ERROR Compile(struct __WASM_ENVIRONMENT* env, const char* file);
+  void CompileAsync(struct __WASM_ENVIRONMENT* env, const char* file, IR_Completion callback, void* user);
+  enum IR_ERROR SnapshotEnvironment(struct __WASM_ENVIRONMENT* env, const char* scratch, unsigned int seconds = 60);
   IR_Entrypoint LoadFunction(void* cache, const char* module_name, const char* function);
   IR_Entrypoint LoadTable(void* cache, const char* module_name, const char* table, varuint32 index);
   IRGlobal* LoadGlobal(void* cache, const char* module_name, const char* export_name);
+  const IRExportDirectory* LoadExportDirectory(void* cache);
+  const IRExportEntry* FindExport(const IRExportDirectory* directory, const char* module_name, const char* export_name);
+  const IRExportEntry* FindExport(const IRExportDirectory* directory, const char* module_name, size_t module_size, const char* export_name, size_t export_size);
+  enum IR_ERROR LoadTypedFunction(void* cache, const char* module_name, const char* function, IRFunction* out);
   void* LoadAssembly(const char* file);
+  IRInstance* CreateInstance(void* cache);
+  void* EnterInstance(IRInstance* instance);
+  void LeaveInstance(IRInstance* instance, void* previous);
+  enum IR_ERROR SaveInstance(IRInstance* instance);
+  enum IR_ERROR ResetInstance(IRInstance* instance);
+  void DestroyInstance(IRInstance* instance);
   void DumpModule(std::ostream& stream, Module& mod);
 }
 
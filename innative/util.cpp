@@ -7,6 +7,7 @@
 #include <stdexcept>
 #include <stdarg.h>
 #include <algorithm>
+#include <mutex>
 
 #ifdef IR_PLATFORM_WIN32
 #include "../innative/win32.h"
@@ -18,52 +19,274 @@
 #include <dlfcn.h>
 #include <sys/mman.h>
 #include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #else
 #error unknown platform
 #endif
 
 using std::string;
 
-void* __WASM_ALLOCATOR::allocate(size_t n)
+namespace {
+  // Chunks of released allocators, kept by size class so a new environment can reuse them instead of going back to malloc
+  struct ChunkPool
+  {
+    static const int CLASSES = 9; // CHUNK_SIZE up to CHUNK_SIZE << 8 (16 MiB)
+    static const size_t MAX_RETAINED = (1 << 26);
+
+    std::mutex lock;
+    __WASM_ALLOCATOR::Chunk* free[CLASSES];
+    size_t retained;
+
+    static int Class(size_t size)
+    {
+      int c = 0;
+      while(c < CLASSES && (__WASM_ALLOCATOR::CHUNK_SIZE << c) < size) ++c;
+      return c;
+    }
+
+    ~ChunkPool()
+    {
+      for(int i = 0; i < CLASSES; ++i)
+        while(free[i])
+        {
+          auto next = free[i]->next;
+          ::free(free[i]);
+          free[i] = next;
+        }
+    }
+  };
+
+  ChunkPool& GetChunkPool()
+  {
+    static ChunkPool pool = {};
+    return pool;
+  }
+
+  std::atomic<uint64_t> allocator_ids(1);
+
+  struct ChunkCache
+  {
+    uint64_t id;
+    __WASM_ALLOCATOR::Chunk* chunk;
+  };
+}
+
+__WASM_ALLOCATOR::__WASM_ALLOCATOR(__WASM_ALLOCATOR* parent) : id(allocator_ids.fetch_add(1, std::memory_order_relaxed)),
+  root(!parent ? this : parent->root), list(nullptr), live(0), peak(0) {}
+
+void __WASM_ALLOCATOR::Track(int64_t bytes)
 {
-  size_t index = cur.fetch_add(n, std::memory_order_acq_rel);
-  size_t end = index + n;
-  size_t max;
+  uint64_t total = root->live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  uint64_t prev = root->peak.load(std::memory_order_relaxed);
+  while(bytes > 0 && total > prev && !root->peak.compare_exchange_weak(prev, total, std::memory_order_relaxed));
+}
 
-  while(end > (max = sz.load(std::memory_order_acquire)))
+__WASM_ALLOCATOR::Chunk* __WASM_ALLOCATOR::Reserve(size_t n, bool exact)
+{
+  Chunk* chunk = nullptr;
+  int c = ChunkPool::Class(n);
+  if(c < ChunkPool::CLASSES && (!exact || (CHUNK_SIZE << c) == n)) // Exact reservations only take a pooled chunk of their size
   {
-    if(index <= max && end > max) // Exactly one allocation can be in this state at a time, the others will spin while waiting for the reallocation
+    n = CHUNK_SIZE << c;
+    auto& pool = GetChunkPool();
+    std::lock_guard<std::mutex> lock(pool.lock);
+    if((chunk = pool.free[c]) != nullptr)
     {
-      while(commit.load(std::memory_order_acquire) != index); // Spin until all reads are done
+      pool.free[c] = chunk->next;
+      pool.retained -= n;
+    }
+  }
+
+  if(!chunk)
+  {
+    chunk = reinterpret_cast<Chunk*>(malloc(sizeof(Chunk) + n));
+    if(!chunk)
+      return nullptr;
+    chunk->size = n;
+  }
+
+  Track(chunk->size);
+  chunk->used.store(0, std::memory_order_relaxed);
+  chunk->requested.store(0, std::memory_order_relaxed);
+  chunk->next = list.load(std::memory_order_relaxed);
+  while(!list.compare_exchange_weak(chunk->next, chunk, std::memory_order_release, std::memory_order_relaxed));
+  return chunk;
+}
 
-      size_t len = std::max<size_t>(end, 4096) * 2;
-      void* prev = malloc(len); // = mem.load(std::memory_order_acquire);
-      list.push_back({ prev, len }); // Add real pointer and size to our destructor list
-      mem.exchange((char*)prev - index, std::memory_order_release); // backtrack to trick the current index into pointing to the right address
-      sz.exchange(len + index, std::memory_order_release); // Actual "end" is our previous allocation endpoint (not the memory endpoint) plus current size
+void* __WASM_ALLOCATOR::allocate(size_t n)
+{
+  static const int CACHED = 4; // Number of allocators each thread remembers a chunk for
+  static thread_local ChunkCache cache[CACHED] = {};
+  static thread_local int evict = 0;
+
+  ChunkCache* slot = nullptr;
+  for(int i = 0; i < CACHED; ++i)
+    if(cache[i].id == id)
+      slot = cache + i;
+
+  if(slot)
+  {
+    Chunk* chunk = slot->chunk;
+    size_t start = (chunk->used.load(std::memory_order_relaxed) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    if(start + n <= chunk->size)
+    {
+      chunk->used.store(start + n, std::memory_order_relaxed);
+      chunk->requested.store(chunk->requested.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+      return reinterpret_cast<char*>(chunk + 1) + start;
     }
   }
 
-  void* m = mem.load(std::memory_order_acquire);
-  commit.fetch_add(n, std::memory_order_release);
-  return (char*)m + index;
+  // Large allocations get a chunk of exactly their size, so they neither throw away the rest of the current chunk nor leave the
+  // rest of a size class unused
+  bool large = n > CHUNK_SIZE / 4;
+  Chunk* chunk = large ? Reserve(n, true) : Reserve(CHUNK_SIZE, false);
+  if(!chunk)
+    return nullptr;
+  chunk->used.store(n, std::memory_order_relaxed);
+  chunk->requested.store(n, std::memory_order_relaxed);
+  if(large)
+    return chunk + 1;
+
+  if(!slot)
+  {
+    slot = cache + evict;
+    evict = (evict + 1) % CACHED;
+  }
+  slot->id = id;
+  slot->chunk = chunk;
+  return chunk + 1;
 }
 
-__WASM_ALLOCATOR::~__WASM_ALLOCATOR()
+void __WASM_ALLOCATOR::GetStats(IRAllocatorStats& stats) const
+{
+  stats.requested = stats.reserved = stats.chunks = 0;
+  for(Chunk* chunk = list.load(std::memory_order_acquire); chunk != nullptr; chunk = chunk->next)
+  {
+    stats.requested += chunk->requested.load(std::memory_order_relaxed);
+    stats.reserved += chunk->size;
+    ++stats.chunks;
+  }
+
+  stats.live = root->live.load(std::memory_order_relaxed);
+  stats.peak = root->peak.load(std::memory_order_relaxed);
+}
+
+void __WASM_ALLOCATOR::Reset()
 {
-  mem.exchange(nullptr, std::memory_order_release);
-  sz.exchange(0, std::memory_order_release);
-  cur.exchange(0, std::memory_order_release);
+  auto& pool = GetChunkPool();
+  Chunk* chunk = list.exchange(nullptr, std::memory_order_acquire);
+  id = allocator_ids.fetch_add(1, std::memory_order_relaxed); // Invalidates every thread's cached chunk
 
-  while(!list.empty())
+  std::lock_guard<std::mutex> lock(pool.lock);
+  while(chunk)
   {
-    free(list.back().first);
-    list.pop_back();
+    Chunk* next = chunk->next;
+    Track(-(int64_t)chunk->size);
+    int c = ChunkPool::Class(chunk->size);
+    if(c < ChunkPool::CLASSES && (CHUNK_SIZE << c) == chunk->size && pool.retained + chunk->size <= ChunkPool::MAX_RETAINED)
+    {
+      chunk->next = pool.free[c];
+      pool.free[c] = chunk;
+      pool.retained += chunk->size;
+    }
+    else
+      free(chunk);
+    chunk = next;
   }
 }
 
+__WASM_ALLOCATOR::~__WASM_ALLOCATOR()
+{
+  Reset();
+}
+
+KHASH_INIT(symbols, Identifier, char, 0, innative::internal::__ac_hash_bytearray, kh_int_hash_equal);
+
+struct __WASM_SYMBOLS
+{
+  std::mutex lock; // Modules are interned while they load, which can happen on several threads at once
+  kh_symbols_t* set;
+  __WASM_ALLOCATOR alloc; // Names are copied here rather than the environment's arena, which callers can swap for a scratch scope
+};
+
 namespace innative {
+  namespace internal {
+    // Must be called while holding the symbol table lock
+    IR_ERROR InternLocked(const Environment& env, Identifier& id, bool add)
+    {
+      khiter_t iter = kh_get_symbols(env.symbols->set, id);
+      if(iter != kh_end(env.symbols->set))
+      {
+        id = kh_key(env.symbols->set, iter);
+        return ERR_SUCCESS;
+      }
+      if(!add)
+        return ERR_PARSE_INVALID_NAME;
+
+      // The table keeps its own copy, since the identifier we were given could be freed before the environment is
+      uint8_t* bytes = reinterpret_cast<uint8_t*>(env.symbols->alloc.allocate(id.size() + 1));
+      if(!bytes)
+        return assert(false), ERR_FATAL_OUT_OF_MEMORY;
+      if(id.size() > 0)
+        utility::tmemcpy(bytes, id.size(), id.get(), id.size());
+      bytes[id.size()] = 0;
+      Identifier copy(bytes, id.size());
+
+      int r;
+      kh_put_symbols(env.symbols->set, copy, &r);
+      if(r < 0)
+        return ERR_FATAL_BAD_HASH;
+      id = copy;
+      return ERR_SUCCESS;
+    }
+  }
+
   namespace utility {
+    __WASM_SYMBOLS* CreateSymbols()
+    {
+      __WASM_SYMBOLS* symbols = new __WASM_SYMBOLS();
+      symbols->set = kh_init_symbols();
+      return symbols;
+    }
+
+    void DestroySymbols(__WASM_SYMBOLS* symbols)
+    {
+      if(symbols)
+        kh_destroy_symbols(symbols->set);
+      delete symbols;
+    }
+
+    IR_ERROR InternIdentifier(const Environment& env, Identifier& id)
+    {
+      std::lock_guard<std::mutex> lock(env.symbols->lock);
+      return internal::InternLocked(env, id, true);
+    }
+
+    IR_ERROR InternModule(const Environment& env, Module& m)
+    {
+      std::lock_guard<std::mutex> lock(env.symbols->lock);
+      IR_ERROR err = internal::InternLocked(env, m.name, true);
+
+      for(varuint32 i = 0; i < m.importsection.n_import && err >= 0; ++i)
+      {
+        if((err = internal::InternLocked(env, m.importsection.imports[i].module_name, true)) >= 0)
+          err = internal::InternLocked(env, m.importsection.imports[i].export_name, true);
+      }
+
+      for(varuint32 i = 0; i < m.exportsection.n_exports && err >= 0; ++i)
+        err = internal::InternLocked(env, m.exportsection.exports[i].name, true);
+
+      return err;
+    }
+
+    bool FindIdentifier(const Environment& env, Identifier& id)
+    {
+      std::lock_guard<std::mutex> lock(env.symbols->lock);
+      return internal::InternLocked(env, id, false) >= 0;
+    }
+
     KHASH_INIT(opnames, StringRef, uint8_t, 1, internal::__ac_X31_hash_stringrefins, kh_int_hash_equal);
 
     kh_opnames_t* GenOpNames()
@@ -332,6 +555,37 @@ namespace innative {
     void* LoadDLLFunction(void* dll, const char* name) { return GetProcAddress((HMODULE)dll, name); }
     void FreeDLL(void* dll) { FreeLibrary((HMODULE)dll); }
 
+    // Windows has no private mapping of anonymous memory we can roll back, so callers must keep their own copy
+    int SaveMemoryImage(void* p, uint64_t size) { return -1; }
+    void ResetMemoryImage(int image, void* p, uint64_t size) {}
+    void FreeMemoryImage(int image) {}
+    void DecommitMemory(void* p, uint64_t size) { VirtualFree(p, size, MEM_DECOMMIT); }
+
+    void* MapFile(const char* file, uint64_t& size)
+    {
+      HANDLE f = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+      if(f == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+      void* view = nullptr;
+      LARGE_INTEGER sz;
+      if(GetFileSizeEx(f, &sz) && sz.QuadPart > 0)
+      {
+        HANDLE mapping = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(mapping)
+        {
+          view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+          CloseHandle(mapping); // The view keeps the mapping alive
+          size = sz.QuadPart;
+        }
+      }
+
+      CloseHandle(f);
+      return view;
+    }
+
+    void UnmapFile(void* p, uint64_t size) { UnmapViewOfFile(p); }
+
 #define MAKEWSTRING2(x) L#x
 #define MAKEWSTRING(x) MAKEWSTRING2(x)
 #define IR_VERSION_PATH MAKEWSTRING(INNATIVE_VERSION_MAJOR) L"\\" MAKEWSTRING(INNATIVE_VERSION_MINOR) L"\\" MAKEWSTRING(INNATIVE_VERSION_REVISION)
@@ -471,6 +725,66 @@ namespace innative {
     void* LoadDLLFunction(void* dll, const char* name) { return dlsym(dll, name); }
     void FreeDLL(void* dll) { dlclose(dll); }
 
+    // Copies [p, p + size) into a memory file and maps it back over itself copy-on-write, so MADV_DONTNEED restores the copy
+    int SaveMemoryImage(void* p, uint64_t size)
+    {
+      int fd = (int)syscall(SYS_memfd_create, "innative-image", 0);
+      if(fd < 0)
+        return -1;
+
+      uint64_t written = 0;
+      if(!ftruncate(fd, size))
+      {
+        while(written < size)
+        {
+          ssize_t n = pwrite(fd, (const char*)p + written, size - written, written);
+          if(n <= 0)
+            break;
+          written += n;
+        }
+      }
+
+      if(written < size || mmap(p, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+      {
+        close(fd);
+        return -1;
+      }
+
+      return fd;
+    }
+
+    void ResetMemoryImage(int image, void* p, uint64_t size) { madvise(p, size, MADV_DONTNEED); }
+    void FreeMemoryImage(int image) { close(image); }
+
+    void DecommitMemory(void* p, uint64_t size)
+    {
+      madvise(p, size, MADV_DONTNEED);
+      mprotect(p, size, PROT_NONE);
+    }
+
+    void* MapFile(const char* file, uint64_t& size)
+    {
+      int fd = open(file, O_RDONLY);
+      if(fd < 0)
+        return nullptr;
+
+      void* p = nullptr;
+      struct stat st;
+      if(!fstat(fd, &st) && st.st_size > 0)
+      {
+        p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED)
+          p = nullptr;
+        else
+          size = st.st_size;
+      }
+
+      close(fd); // The mapping stays valid after the descriptor is closed
+      return p;
+    }
+
+    void UnmapFile(void* p, uint64_t size) { munmap(p, size); }
+
 #define POSIX_LIB_BASE "/usr/lib/libinnative.so"
 #define POSIX_LIB_PATH POSIX_LIB_BASE "." MAKESTRING(INNATIVE_VERSION_MAJOR) "." MAKESTRING(INNATIVE_VERSION_MINOR) "." MAKESTRING(INNATIVE_VERSION_REVISION)
 
@@ -5,6 +5,7 @@
 #define __UTIL_H__IR__
 
 #include "innative/schema.h"
+#include "innative/export.h"
 #include "innative/path.h"
 #include "constants.h"
 #include <string>
@@ -16,18 +17,54 @@
 #include <atomic>
 #include <vector>
 
+#ifdef IR_COMPILER_MSC
+#include <intrin.h>
+#endif
+
+// Chunked bump allocator. Each thread bumps through its own chunk, so allocating never takes a lock or waits on another thread.
+// Chunks are sized in power of two classes and are recycled through a shared pool when their allocator is reset or destroyed.
+// An allocator created with a parent is a scope: its memory is released in bulk, and its usage counts towards the parent's peak.
 struct __WASM_ALLOCATOR
 {
-  __WASM_ALLOCATOR() : mem(0), sz(0), cur(0), commit(0) {}
+  explicit __WASM_ALLOCATOR(__WASM_ALLOCATOR* parent = nullptr);
   ~__WASM_ALLOCATOR();
 
-  std::atomic<void*> mem;
-  std::atomic_size_t sz;
-  std::atomic_size_t cur;
-  std::atomic_size_t commit;
-  std::vector<std::pair<void*, size_t>> list;
+  struct Chunk
+  {
+    Chunk* next;
+    size_t size; // Usable bytes after the header
+    std::atomic_size_t used; // Only written by the thread bumping through this chunk
+    std::atomic_size_t requested;
+  };
+
+  static const size_t CHUNK_SIZE = (1 << 16);
+  static const size_t ALIGNMENT = 16;
 
   void* allocate(size_t n);
+  void Reset(); // Releases everything allocated so far. Nothing else may allocate from this allocator while it resets.
+  void GetStats(IRAllocatorStats& stats) const;
+
+private:
+  Chunk* Reserve(size_t n, bool exact); // Unless exact, n is rounded up to a size class that can be pooled
+  void Track(int64_t bytes);
+
+  uint64_t id; // Unlike the address, this is never reused, so threads can tell when a cached chunk belongs to a dead allocator
+  __WASM_ALLOCATOR* root; // Top level allocator that all scopes report their usage to
+  std::atomic<Chunk*> list; // Every chunk this allocator owns, pushed without locking
+  std::atomic<uint64_t> live; // Bytes reserved by this allocator and every scope under it
+  std::atomic<uint64_t> peak;
+};
+
+// Environment-wide set of interned identifiers. Interning replaces an identifier with the environment's copy of it, so
+// every interned identifier with the same name has the same bytes pointer.
+struct __WASM_SYMBOLS;
+
+// A read-only mapping of an entire file, kept in a list by the environment that owns it
+struct __WASM_MAPPING
+{
+  __WASM_MAPPING* next;
+  void* data;
+  uint64_t size;
 };
 
 extern "C" int64_t GetRSPValue();
@@ -58,6 +95,50 @@ namespace innative {
   }
 
   namespace internal {
+    IR_FORCEINLINE unsigned int CountTrailingZeros(uint64_t x)
+    {
+#ifdef IR_COMPILER_MSC
+      unsigned long i;
+      _BitScanForward64(&i, x);
+      return i;
+#else
+      return __builtin_ctzll(x);
+#endif
+    }
+
+    IR_FORCEINLINE unsigned int CountLeadingZeros(uint64_t x)
+    {
+#ifdef IR_COMPILER_MSC
+      unsigned long i;
+      _BitScanReverse64(&i, x);
+      return 63 - i;
+#else
+      return __builtin_clzll(x);
+#endif
+    }
+
+    // Returns the high 64 bits of a * b and puts the low 64 bits in lo
+    IR_FORCEINLINE uint64_t Multiply128(uint64_t a, uint64_t b, uint64_t& lo)
+    {
+#ifdef __SIZEOF_INT128__
+      unsigned __int128 r = (unsigned __int128)a * b;
+      lo = (uint64_t)r;
+      return (uint64_t)(r >> 64);
+#elif defined(IR_COMPILER_MSC) && defined(IR_CPU_x86_64)
+      uint64_t hi;
+      lo = _umul128(a, b, &hi);
+      return hi;
+#else
+      uint64_t ll = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+      uint64_t lh = (a & 0xFFFFFFFF) * (b >> 32);
+      uint64_t hl = (a >> 32) * (b & 0xFFFFFFFF);
+      uint64_t hh = (a >> 32) * (b >> 32);
+      uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFF) + (hl & 0xFFFFFFFF);
+      lo = (mid << 32) | (ll & 0xFFFFFFFF);
+      return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+    }
+
     // For simplicity reasons, we assemble the error list backwards. This reverses it so it appears in the correct order.
     inline void ReverseErrorList(ValidationError*& errors) noexcept
     {
@@ -103,27 +184,60 @@ namespace innative {
       return h;
     }
 
-    inline khint_t __ac_X31_hash_bytearray(const ByteArray& id)
+    // MurmurHash64A, which mixes a whole word at a time. Names like func1, func2, func3 all land in the same few buckets with X31.
+    inline uint64_t HashBytes(const void* key, size_t len)
     {
-      const char* s = (const char*)id.get();
-      const char* end = s + id.size();
-      khint_t h = 0;
-      if(s < end)
+      const uint64_t m = 0xc6a4a7935bd1e995ULL;
+      const int r = 47;
+      const uint8_t* p = (const uint8_t*)key;
+      const uint8_t* end = p + (len & ~(size_t)7);
+      uint64_t h = len * m;
+
+      for(; p < end; p += 8)
       {
-        h = *s;
-        for(++s; s < end; ++s)
-          h = (h << 5) - h + (khint_t)*s;
+        uint64_t k;
+        memcpy(&k, p, sizeof(uint64_t));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
       }
+
+      switch(len & 7)
+      {
+      case 7: h ^= uint64_t(p[6]) << 48;
+      case 6: h ^= uint64_t(p[5]) << 40;
+      case 5: h ^= uint64_t(p[4]) << 32;
+      case 4: h ^= uint64_t(p[3]) << 24;
+      case 3: h ^= uint64_t(p[2]) << 16;
+      case 2: h ^= uint64_t(p[1]) << 8;
+      case 1: h ^= uint64_t(p[0]);
+        h *= m;
+      }
+
+      h ^= h >> r;
+      h *= m;
+      h ^= h >> r;
       return h;
     }
 
+    inline khint_t __ac_hash_bytearray(const ByteArray& id)
+    {
+      uint64_t h = HashBytes(id.get(), id.size());
+      return (khint_t)(h ^ (h >> 32));
+    }
+
+    // Interned identifiers share their bytes, so they are hashed and compared by pointer
+    inline khint_t __ac_hash_symbol(const ByteArray& id) { return kh_int64_hash_func((khint64_t)(uintptr_t)id.get()); }
+#define kh_symbol_hash_equal(a, b) ((a).get() == (b).get())
+
     // Hashes a pair of strings seperated by a null terminator
-    kh_inline khint_t __ac_X31_hash_string_pair(const char *s)
+    kh_inline khint_t __ac_hash_string_pair(const char* s)
     {
-      khint_t h = (khint_t)*s;
-      if(h) for(++s; *s; ++s) h = (h << 5) - h + (khint_t)*s;
-      for(++s; *s; ++s) h = (h << 5) - h + (khint_t)*s;
-      return h;
+      size_t first = strlen(s) + 1;
+      uint64_t h = HashBytes(s, first + strlen(s + first));
+      return (khint_t)(h ^ (h >> 32));
     }
   }
 
@@ -161,6 +275,27 @@ namespace innative {
       return reinterpret_cast<T*>(env.alloc->allocate(n * sizeof(T)));
     }
 
+    template<class T>
+    inline T* tmalloc(__WASM_ALLOCATOR& alloc, size_t n)
+    {
+      return reinterpret_cast<T*>(alloc.allocate(n * sizeof(T)));
+    }
+
+    // Sends every allocation made through the environment to a scratch allocator until the scope is left, then releases all of it
+    // when the scope is destroyed. Nothing else can be allocating from the environment while a scope is active.
+    class AllocationScope
+    {
+    public:
+      explicit AllocationScope(Environment& env) : _env(env), _parent(env.alloc), _alloc(env.alloc) { env.alloc = &_alloc; }
+      ~AllocationScope() { Leave(); }
+      inline void Leave() { _env.alloc = _parent; } // Allocates from the parent again, but keeps the scratch memory until destruction
+
+    private:
+      Environment& _env;
+      __WASM_ALLOCATOR* _parent;
+      __WASM_ALLOCATOR _alloc;
+    };
+
     IR_FORCEINLINE bool ModuleHasSection(const Module& m, varuint7 opcode) { return (m.knownsections&(1 << opcode)) != 0; }
 
     uint8_t GetInstruction(StringRef s);
@@ -181,6 +316,17 @@ namespace innative {
     void* LoadDLL(const char* path);
     void* LoadDLLFunction(void* dll, const char* name);
     void FreeDLL(void* dll);
+    int SaveMemoryImage(void* p, uint64_t size); // Returns -1 if the platform can't roll back memory, otherwise an image handle
+    void ResetMemoryImage(int image, void* p, uint64_t size); // Discards every write since SaveMemoryImage
+    void FreeMemoryImage(int image);
+    void DecommitMemory(void* p, uint64_t size); // Returns pages to the reserved state that memory.grow commits from
+    void* MapFile(const char* file, uint64_t& size); // Maps a file read-only, returning null if it can't be opened or is empty
+    __WASM_SYMBOLS* CreateSymbols();
+    void DestroySymbols(__WASM_SYMBOLS* symbols);
+    IR_ERROR InternIdentifier(const Environment& env, Identifier& id);
+    IR_ERROR InternModule(const Environment& env, Module& m); // Interns the name, imports and exports of a module under one lock
+    bool FindIdentifier(const Environment& env, Identifier& id); // Like InternIdentifier, but returns false if the name was never interned
+    void UnmapFile(void* p, uint64_t size);
     int Install(const char* arg0, bool full);
     int Uninstall();
     bool RestoreStackGuard(void* lpPage);
@@ -233,6 +379,18 @@ namespace innative {
       return canonical;
     }
 
+    // FNV-1a hash of a module and export name pair, used to sort and search the export directory
+    inline uint64_t ExportHash(StringRef module_name, StringRef export_name)
+    {
+      uint64_t hash = 14695981039346656037ULL;
+      for(size_t i = 0; i < module_name.len; ++i)
+        hash = (hash ^ (unsigned char)module_name.s[i]) * 1099511628211ULL;
+      hash = (hash ^ 0xFF) * 1099511628211ULL; // 0xFF never appears in UTF8, so it separates the two names
+      for(size_t i = 0; i < export_name.len; ++i)
+        hash = (hash ^ (unsigned char)export_name.s[i]) * 1099511628211ULL;
+      return hash;
+    }
+
     // Generates the correct mangled C function name
     inline std::string CanonImportName(const Import& imp)
     {
@@ -266,7 +424,8 @@ namespace innative {
       return s;
     }
 
-    inline std::unique_ptr<uint8_t[]> LoadFile(const char* file, long& sz)
+    template<class F>
+    inline uint8_t* ReadFile(const char* file, long& sz, F alloc)
     {
       FILE* f = nullptr;
       FOPEN(f, file, "rb");
@@ -275,11 +434,17 @@ namespace innative {
       fseek(f, 0, SEEK_END);
       sz = ftell(f);
       fseek(f, 0, SEEK_SET);
-      std::unique_ptr<uint8_t[]> data(new uint8_t[sz]);
-      sz = (long)fread(data.get(), 1, sz, f);
+      uint8_t* data = alloc(sz);
+      if(data)
+        sz = (long)fread(data, 1, sz, f);
       fclose(f);
       return data;
     }
+
+    inline std::unique_ptr<uint8_t[]> LoadFile(const char* file, long& sz)
+    {
+      return std::unique_ptr<uint8_t[]>(ReadFile(file, sz, [](long n) { return new uint8_t[n]; }));
+    }
   }
 }
 
@@ -3,29 +3,36 @@
 
 #include "validate.h"
 #include "util.h"
+#include "parse.h"
+#include "instruction.h"
 #include "stack.h"
 #include "compile.h"
+#include "threadpool.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <atomic>
 #include <limits>
+#include <vector>
+#include <algorithm>
 
-#define str_pair_hash_equal(a, b) (strcmp(a, b) == 0) && (strcmp(strchr(a, 0)+1, strchr(a, 0)+1) == 0)
+#define str_pair_hash_equal(a, b) (strcmp(a, b) == 0) && (strcmp(strchr(a, 0)+1, strchr(b, 0)+1) == 0)
 
-__KHASH_IMPL(modulepair, , kh_cstr_t, FunctionType, 1, innative::internal::__ac_X31_hash_string_pair, str_pair_hash_equal);
-__KHASH_IMPL(cimport, , Identifier, char, 0, innative::internal::__ac_X31_hash_bytearray, kh_int_hash_equal);
+__KHASH_IMPL(modulepair, , kh_cstr_t, FunctionType, 1, innative::internal::__ac_hash_string_pair, str_pair_hash_equal);
+__KHASH_IMPL(cimport, , Identifier, char, 0, innative::internal::__ac_hash_bytearray, kh_int_hash_equal);
 
 using namespace innative;
 using namespace utility;
 
 namespace innative {
   namespace internal {
-    struct ControlBlock
+    // Function bodies validated on the same thread reuse these, so the stacks only grow once per thread instead of once per body
+    struct BodyScratch
     {
-      size_t limit; // Previous limit of value stack
-      varsint7 sig; // Block signature
-      uint8_t type; // instruction that pushed this label
+      Stack<ControlBlock> control;
+      Stack<varsint7> values;
     };
+
+    static thread_local BodyScratch bodyscratch;
   }
 }
 
@@ -381,24 +388,33 @@ void ValidateBranchTable(varuint32 n_table, varuint32* table, varuint32 def, Sta
   }
 }
 
+void ValidateMemoryIndex(varuint32 memory, Environment& env, Module* m)
+{
+  if(!ModuleMemory(*m, memory))
+  {
+    if(!memory)
+      AppendError(env, env.errors, m, ERR_INVALID_MEMORY_INDEX, "No default linear memory in module.");
+    else
+      AppendError(env, env.errors, m, ERR_INVALID_MEMORY_INDEX, "Invalid memory index %u", memory);
+  }
+}
+
 template<typename T, WASM_TYPE_ENCODING PUSH>
-void ValidateLoad(varuint32 align, Stack<varsint7>& values, Environment& env, Module* m)
+void ValidateLoad(varuint32 align, varuint32 memory, Stack<varsint7>& values, Environment& env, Module* m)
 {
-  if(!ModuleMemory(*m, 0))
-    AppendError(env, env.errors, m, ERR_INVALID_MEMORY_INDEX, "No default linear memory in module.");
-  if((1ULL << align) > sizeof(T))
-    AppendError(env, env.errors, m, ERR_INVALID_MEMORY_ALIGNMENT, "Alignment of %u exceeds number of accessed bytes %i", (1 << align), sizeof(T));
+  ValidateMemoryIndex(memory, env, m);
+  if(align >= 64 || (1ULL << align) > sizeof(T)) // Shifting by 64 or more is undefined
+    AppendError(env, env.errors, m, ERR_INVALID_MEMORY_ALIGNMENT, "Alignment of 2^%u exceeds number of accessed bytes %i", align, sizeof(T));
   ValidatePopType(values, TE_i32, env, m);
   values.Push(PUSH);
 }
 
 template<typename T, WASM_TYPE_ENCODING POP>
-void ValidateStore(varuint32 align, Stack<varsint7>& values, Environment& env, Module* m)
+void ValidateStore(varuint32 align, varuint32 memory, Stack<varsint7>& values, Environment& env, Module* m)
 {
-  if(!ModuleMemory(*m, 0))
-    AppendError(env, env.errors, m, ERR_INVALID_MEMORY_INDEX, "No default linear memory in module.");
-  if((1ULL << align) > sizeof(T))
-    AppendError(env, env.errors, m, ERR_INVALID_MEMORY_ALIGNMENT, "Alignment of %u exceeds number of accessed bytes %i", (1 << align), sizeof(T));
+  ValidateMemoryIndex(memory, env, m);
+  if(align >= 64 || (1ULL << align) > sizeof(T)) // Shifting by 64 or more is undefined
+    AppendError(env, env.errors, m, ERR_INVALID_MEMORY_ALIGNMENT, "Alignment of 2^%u exceeds number of accessed bytes %i", align, sizeof(T));
   ValidatePopType(values, POP, env, m);
   ValidatePopType(values, TE_i32, env, m);
 }
@@ -573,41 +589,41 @@ void ValidateInstruction(const Instruction& ins, Stack<varsint7>& values, Stack<
   break;
 
   // Memory-related operators
-  case OP_i32_load: ValidateLoad<int32_t, TE_i32>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_i64_load: ValidateLoad<int64_t, TE_i64>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_f32_load: ValidateLoad<float, TE_f32>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_f64_load: ValidateLoad<double, TE_f64>(ins.immediates[0]._varuint32, values, env, m); break;
+  case OP_i32_load: ValidateLoad<int32_t, TE_i32>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_i64_load: ValidateLoad<int64_t, TE_i64>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_f32_load: ValidateLoad<float, TE_f32>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_f64_load: ValidateLoad<double, TE_f64>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
   case OP_i32_load8_s:
-  case OP_i32_load8_u: ValidateLoad<int8_t, TE_i32>(ins.immediates[0]._varuint32, values, env, m); break;
+  case OP_i32_load8_u: ValidateLoad<int8_t, TE_i32>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
   case OP_i32_load16_s:
-  case OP_i32_load16_u: ValidateLoad<int16_t, TE_i32>(ins.immediates[0]._varuint32, values, env, m); break;
+  case OP_i32_load16_u: ValidateLoad<int16_t, TE_i32>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
   case OP_i64_load8_s:
-  case OP_i64_load8_u: ValidateLoad<int8_t, TE_i64>(ins.immediates[0]._varuint32, values, env, m); break;
+  case OP_i64_load8_u: ValidateLoad<int8_t, TE_i64>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
   case OP_i64_load16_s:
-  case OP_i64_load16_u: ValidateLoad<int16_t, TE_i64>(ins.immediates[0]._varuint32, values, env, m); break;
+  case OP_i64_load16_u: ValidateLoad<int16_t, TE_i64>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
   case OP_i64_load32_s:
-  case OP_i64_load32_u: ValidateLoad<int32_t, TE_i64>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_i32_store: ValidateStore<int32_t, TE_i32>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_i64_store: ValidateStore<int64_t, TE_i64>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_f32_store: ValidateStore<float, TE_f32>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_f64_store: ValidateStore<double, TE_f64>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_i32_store8: ValidateStore<int8_t, TE_i32>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_i32_store16: ValidateStore<int16_t, TE_i32>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_i64_store8: ValidateStore<int8_t, TE_i64>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_i64_store16: ValidateStore<int16_t, TE_i64>(ins.immediates[0]._varuint32, values, env, m); break;
-  case OP_i64_store32: ValidateStore<int32_t, TE_i64>(ins.immediates[0]._varuint32, values, env, m); break;
+  case OP_i64_load32_u: ValidateLoad<int32_t, TE_i64>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_i32_store: ValidateStore<int32_t, TE_i32>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_i64_store: ValidateStore<int64_t, TE_i64>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_f32_store: ValidateStore<float, TE_f32>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_f64_store: ValidateStore<double, TE_f64>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_i32_store8: ValidateStore<int8_t, TE_i32>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_i32_store16: ValidateStore<int16_t, TE_i32>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_i64_store8: ValidateStore<int8_t, TE_i64>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_i64_store16: ValidateStore<int16_t, TE_i64>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
+  case OP_i64_store32: ValidateStore<int32_t, TE_i64>(ins.immediates[0]._varuint32, ins.immediates[2]._varuint32, values, env, m); break;
   case OP_memory_size:
-    if(!ModuleMemory(*m, 0))
-      AppendError(env, env.errors, m, ERR_INVALID_MEMORY_INDEX, "No default linear memory in module.");
-    if(ins.immediates[0]._varuint1 != 0)
+    if(!(env.features & ENV_FEATURE_MULTI_MEMORY) && ins.immediates[0]._varuint32 != 0)
       AppendError(env, env.errors, m, ERR_INVALID_RESERVED_VALUE, "reserved must be 0.");
+    else
+      ValidateMemoryIndex(ins.immediates[0]._varuint32, env, m);
     values.Push(TE_i32);
     break;
   case OP_memory_grow:
-    if(!ModuleMemory(*m, 0))
-      AppendError(env, env.errors, m, ERR_INVALID_MEMORY_INDEX, "No default linear memory in module.");
-    if(ins.immediates[0]._varuint1 != 0)
+    if(!(env.features & ENV_FEATURE_MULTI_MEMORY) && ins.immediates[0]._varuint32 != 0)
       AppendError(env, env.errors, m, ERR_INVALID_RESERVED_VALUE, "reserved must be 0.");
+    else
+      ValidateMemoryIndex(ins.immediates[0]._varuint32, env, m);
     ValidatePopType(values, TE_i32, env, m);
     values.Push(TE_i32);
     break;
@@ -906,84 +922,122 @@ void ValidateEndBlock(internal::ControlBlock block, Stack<varsint7>& values, Env
 
 void innative::ValidateFunctionBody(const FunctionType& sig, const FunctionBody& body, Environment& env, Module* m)
 {
-  Instruction* cur = body.body;
-  Stack<internal::ControlBlock> control; // control-flow stack that must be closed by end instructions
-  Stack<varsint7> values; // Current stack of value types
-  varsint7 ret = TE_void;
-  if(sig.n_returns > 1) // This is already an invalid function so don't pollute the output with more errors.
+  if(!body.body && body.source) // Lazily parsed bodies are decoded into scratch memory that's released as soon as they're validated
+  {
+    __WASM_ALLOCATOR scratch(env.alloc);
+    FunctionBody decoded;
+    IR_ERROR err = DecodeFunctionBody(body, decoded, scratch, env);
+    if(err < 0)
+      return AppendError(env, env.errors, m, err, "Failed to decode function body: %i", err);
+    return ValidateFunctionBody(sig, decoded, env, m);
+  }
+
+  BodyValidator validator(sig, body, env, m);
+  if(!validator.Begin())
     return;
 
-  if(sig.n_returns > 0)
-    ret = sig.returns[0];
+  InstructionCursor cursor(body);
+  Instruction cur;
+  while(cursor.Next(cur))
+    validator.Step(cur);
+  validator.End();
+}
+
+innative::BodyValidator::BodyValidator(const FunctionType& sig, const FunctionBody& body, Environment& env, Module* m) : _sig(sig), _body(body), _env(env), _m(m),
+  _control(internal::bodyscratch.control), _values(internal::bodyscratch.values), _n_local(0), _locals(0), _index(0), _last(OP_unreachable) {}
+
+bool innative::BodyValidator::Begin()
+{
+  _control.Clear();
+  _values.Clear();
+  varsint7 ret = TE_void;
+  if(_sig.n_returns > 1) // This is already an invalid function so don't pollute the output with more errors.
+    return false;
+
+  if(_sig.n_returns > 0)
+    ret = _sig.returns[0];
 
   // Calculate function locals
-  if(sig.n_params > (std::numeric_limits<uint32_t>::max() - body.n_locals))
+  if(_sig.n_params > (std::numeric_limits<uint32_t>::max() - _body.n_locals))
   {
-    AppendError(env, env.errors, m, ERR_FATAL_TOO_MANY_LOCALS, "n_local + n_params exceeds the max value of uint32!");
-    return;
+    AppendError(_env, _env.errors, _m, ERR_FATAL_TOO_MANY_LOCALS, "n_local + n_params exceeds the max value of uint32!");
+    return false;
   }
-  varuint32 n_local = sig.n_params + body.n_locals;
+  _n_local = _sig.n_params + _body.n_locals;
 
-  varsint7* locals = tmalloc<varsint7>(env, n_local);
-  if(locals)
-    tmemcpy<varsint7>(locals, n_local, sig.params, sig.n_params);
-  n_local = sig.n_params;
-  for(uint64_t i = 0; i < body.n_locals; ++i)
-    locals[n_local++] = body.locals[i];
+  _locals = tmalloc<varsint7>(_env, _n_local);
+  if(_locals)
+    tmemcpy<varsint7>(_locals, _n_local, _sig.params, _sig.n_params);
+  _n_local = _sig.n_params;
+  for(uint64_t i = 0; i < _body.n_locals; ++i)
+    _locals[_n_local++] = _body.locals[i];
 
-  control.Push({ values.Limit(), ret, OP_block }); // Push the function body block with the function signature
+  _control.Push({ _values.Limit(), ret, OP_block }); // Push the function body block with the function signature
+  return true;
+}
 
-  if(!body.n_body)
-    return AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Cannot have an empty function body!");
+void innative::BodyValidator::Step(const Instruction& ins)
+{
+  Stack<internal::ControlBlock>& control = _control; // control-flow stack that must be closed by end instructions
+  Stack<varsint7>& values = _values; // Current stack of value types
+  Environment& env = _env;
+  Module* m = _m;
+  varuint32 i = _index++;
+  _last = ins.opcode;
 
-  for(uint64_t i = 0; i < body.n_body; ++i)
-  {
-    ValidateInstruction(cur[i], values, control, n_local, locals, env, m);
+  ValidateInstruction(ins, values, control, _n_local, _locals, env, m);
 
-    switch(cur[i].opcode)
+  switch(ins.opcode)
+  {
+  case OP_block:
+  case OP_loop:
+  case OP_if:
+    control.Push({ values.Limit(), ins.immediates[0]._varsint7, ins.opcode });
+    values.SetLimit(values.Size() + values.Limit());
+    break;
+  case OP_end:
+    if(!control.Size())
+      AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Mismatched end instruction at index %u!", i);
+    else
     {
-    case OP_block:
-    case OP_loop:
-    case OP_if:
-      control.Push({ values.Limit(), cur[i].immediates[0]._varsint7, cur[i].opcode });
+      if(control.Peek().type == OP_if && control.Peek().sig != TE_void)
+        AppendError(env, env.errors, m, ERR_INVALID_BLOCK_SIGNATURE, "If statement without else cannot have a non-void block signature, had %hhi.", control.Peek().sig);
+      ValidateEndBlock(control.Pop(), values, env, m, true);
+    }
+    break;
+  case OP_else:
+    if(!control.Size())
+      AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Mismatched else instruction at index %u!", i);
+    else
+    {
+      internal::ControlBlock block = control.Pop();
+      if(block.type != OP_if)
+        AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Expected else instruction to terminate if block, but found %hhi instead.", block.type);
+      ValidateEndBlock(block, values, env, m, false);
+      control.Push({ values.Limit(), block.sig, OP_else }); // Push a new else block that must be terminated by an end instruction
       values.SetLimit(values.Size() + values.Limit());
-      break;
-    case OP_end:
-      if(!control.Size())
-        AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Mismatched end instruction at index %u!", i);
-      else
-      {
-        if(control.Peek().type == OP_if && control.Peek().sig != TE_void)
-          AppendError(env, env.errors, m, ERR_INVALID_BLOCK_SIGNATURE, "If statement without else cannot have a non-void block signature, had %hhi.", control.Peek().sig);
-        ValidateEndBlock(control.Pop(), values, env, m, true);
-      }
-      break;
-    case OP_else:
-      if(!control.Size())
-        AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Mismatched else instruction at index %u!", i);
-      else
-      {
-        internal::ControlBlock block = control.Pop();
-        if(block.type != OP_if)
-          AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Expected else instruction to terminate if block, but found %hhi instead.", block.type);
-        ValidateEndBlock(block, values, env, m, false);
-        control.Push({ values.Limit(), block.sig, OP_else }); // Push a new else block that must be terminated by an end instruction
-        values.SetLimit(values.Size() + values.Limit());
-      }
     }
   }
+}
 
-  for(uint64_t i = 0; i < sig.n_returns; ++i)
-    ValidatePopType(values, sig.returns[i], env, m);
+void innative::BodyValidator::End()
+{
+  Environment& env = _env;
+  Module* m = _m;
+  if(!_index)
+    return AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Cannot have an empty function body!");
 
-  if(control.Size() > 0)
-    AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Control stack not fully terminated, off by %zu", control.Size());
+  for(uint64_t i = 0; i < _sig.n_returns; ++i)
+    ValidatePopType(_values, _sig.returns[i], env, m);
 
-  if(values.Size() > 0 || values.Limit() > 0)
-    AppendError(env, env.errors, m, ERR_INVALID_VALUE_STACK, "Value stack not fully empty, off by %zu", values.Size() + values.Limit());
+  if(_control.Size() > 0)
+    AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Control stack not fully terminated, off by %zu", _control.Size());
 
-  if(cur[body.n_body - 1].opcode != OP_end)
-    AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Expected end instruction to terminate function body, got %hhu instead.", cur[body.n_body - 1].opcode);
+  if(_values.Size() > 0 || _values.Limit() > 0)
+    AppendError(env, env.errors, m, ERR_INVALID_VALUE_STACK, "Value stack not fully empty, off by %zu", _values.Size() + _values.Limit());
+
+  if(_last != OP_end)
+    AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Expected end instruction to terminate function body, got %hhu instead.", _last);
 }
 
 void innative::ValidateDataOffset(const DataInit& init, Environment& env, Module* m)
@@ -1048,7 +1102,7 @@ void innative::ValidateModule(Environment& env, Module& m)
 
   if(ModuleTable(m, 1) != nullptr)
     AppendError(env, env.errors, &m, ERR_MULTIPLE_TABLES, "Cannot have more than 1 table defined.");
-  if(ModuleMemory(m, 1) != nullptr)
+  if(!(env.features & ENV_FEATURE_MULTI_MEMORY) && ModuleMemory(m, 1) != nullptr)
     AppendError(env, env.errors, &m, ERR_MULTIPLE_MEMORIES, "Cannot have more than 1 memory defined.");
 
   if(m.knownsections&(1 << WASM_SECTION_TYPE))
@@ -1093,16 +1147,74 @@ void innative::ValidateModule(Environment& env, Module& m)
     ValidateSection<TableInit, &ValidateTableOffset>(m.element.elements, m.element.n_elements, env, &m);
 
   if(m.knownsections&(1 << WASM_SECTION_CODE))
+    ValidateFunctionBodies(env, m);
+
+  if(m.knownsections&(1 << WASM_SECTION_DATA))
+    ValidateSection<DataInit, &ValidateDataOffset>(m.data.data, m.data.n_data, env, &m);
+}
+
+// Puts a newest-first list of errors in front of another one, which gives the same list as appending each of them in order.
+// If m is given, the errors are also assigned to it, since errors found during parsing came before the module had an index.
+void innative::SpliceErrors(ValidationError*& errors, ValidationError* head, const Environment& env, Module* m)
+{
+  if(!head)
+    return;
+
+  ValidationError* tail = head;
+  for(;; tail = tail->next)
   {
-    for(varuint32 j = 0; j < m.code.n_funcbody; ++j)
+    if(m && m >= env.modules && (m - env.modules) < env.n_modules)
+      tail->m = m - env.modules;
+    if(!tail->next)
+      break;
+  }
+  tail->next = errors;
+  errors = head;
+}
+
+void innative::ValidateFunctionBodies(Environment& env, Module& m)
+{
+  static const varuint32 BATCH_SIZE = 64;
+  varuint32 n = std::min(m.code.n_funcbody, m.function.n_funcdecl);
+  auto validate = [&m](Environment& target, varuint32 begin, varuint32 end) {
+    for(varuint32 j = begin; j < end; ++j)
     {
-      if(m.function.funcdecl[j] < m.type.n_functions)
-        ValidateFunctionBody(m.type.functions[m.function.funcdecl[j]], m.code.funcbody[j], env, &m);
+      FunctionBody& body = m.code.funcbody[j];
+      if(body.validated) // Already validated while it was parsed, so we only have to report what was found
+      {
+        SpliceErrors(target.errors, body.errors, target, &m);
+        body.errors = 0;
+        body.validated = false; // The errors have been handed off, so validating again has to start from scratch
+      }
+      else if(m.function.funcdecl[j] < m.type.n_functions)
+        ValidateFunctionBody(m.type.functions[m.function.funcdecl[j]], body, target, &m);
     }
+  };
+
+  if(!(env.flags & ENV_MULTITHREADED) || !env.pool || n <= BATCH_SIZE)
+    return validate(env, 0, n);
+
+  // Each batch appends to its own error list, which are spliced together in batch order afterwards. Because every list is built
+  // newest-first, the result is exactly the list a serial run would have produced.
+  size_t batches = (n + BATCH_SIZE - 1) / BATCH_SIZE;
+  std::vector<ValidationError*> errors(batches, nullptr);
+  std::atomic<size_t> outstanding(batches);
+
+  for(size_t i = 0; i < batches; ++i)
+  {
+    env.pool->Submit([&, i]() {
+      Environment local = env; // A shallow copy that only differs in where errors go
+      local.errors = nullptr;
+      validate(local, (varuint32)(i * BATCH_SIZE), (varuint32)std::min<size_t>((i + 1) * BATCH_SIZE, n));
+      errors[i] = local.errors;
+      outstanding.fetch_sub(1, std::memory_order_release);
+    });
   }
 
-  if(m.knownsections&(1 << WASM_SECTION_DATA))
-    ValidateSection<DataInit, &ValidateDataOffset>(m.data.data, m.data.n_data, env, &m);
+  env.pool->Wait([&outstanding]() { return !outstanding.load(std::memory_order_acquire); });
+
+  for(auto head : errors)
+    SpliceErrors(env.errors, head, env, nullptr);
 }
 
 // Performs all post-load validation that couldn't be done during parsing
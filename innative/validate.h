@@ -5,8 +5,40 @@
 #define __VALIDATE_H__IR__
 
 #include "innative/schema.h"
+#include "stack.h"
 
 namespace innative {
+  namespace internal {
+    struct ControlBlock
+    {
+      size_t limit; // Previous limit of value stack
+      varsint7 sig; // Block signature
+      uint8_t type; // instruction that pushed this label
+    };
+  }
+
+  // Validates a function body one instruction at a time, so the binary parser can validate each instruction as soon as it's decoded
+  class BodyValidator
+  {
+  public:
+    BodyValidator(const FunctionType& sig, const FunctionBody& body, Environment& env, Module* m);
+    bool Begin(); // Returns false if nothing else about the body can be validated. Any error has already been reported.
+    void Step(const Instruction& ins);
+    void End();
+
+  private:
+    const FunctionType& _sig;
+    const FunctionBody& _body;
+    Environment& _env;
+    Module* _m;
+    Stack<internal::ControlBlock>& _control;
+    Stack<varsint7>& _values;
+    varuint32 _n_local;
+    varsint7* _locals;
+    varuint32 _index;
+    uint8_t _last;
+  };
+
   bool ValidateIdentifier(const ByteArray& bytes);
   void AppendError(const Environment& env, ValidationError*& errors, Module* m, int code, const char* fmt, ...);
   void ValidateFunctionSig(const FunctionType& sig, Environment& env, Module* m);
@@ -23,6 +55,8 @@ namespace innative {
   varsint32 EvalInitializerI32(const Instruction& ins, Environment& env, Module* m);
   void ValidateTableOffset(const TableInit& init, Environment& env, Module* m);
   void ValidateFunctionBody(const FunctionType& sig, const FunctionBody& body, Environment& env, Module* m);
+  void SpliceErrors(ValidationError*& errors, ValidationError* head, const Environment& env, Module* m);
+  void ValidateFunctionBodies(Environment& env, Module& m); // Spreads the bodies across the thread pool with ENV_MULTITHREADED
   void ValidateDataOffset(const DataInit& init, Environment& env, Module* m);
   void ValidateImportOrder(Module& m);
   void ValidateModule(Environment& env, Module& m);
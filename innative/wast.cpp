@@ -11,6 +11,7 @@
 #include <signal.h>
 #include <setjmp.h>
 #include <iostream>
+#include <functional>
 #include <atomic>
 
 #ifdef IR_PLATFORM_WIN32
@@ -245,39 +246,83 @@ namespace innative {
   }
 }
 
-void InvalidateCache(void*& cache, const Path& cachepath)
+// Each module is compiled only once, into a new library that is linked against the libraries loaded before it. Libraries stay loaded
+// until the script ends, so every action runs against the live code and state of all the modules defined so far.
+struct WastSession
 {
-  if(cache)
+  struct Library
   {
-    auto exit = LoadFunction(cache, 0, IR_EXIT_FUNCTION);
+    void* dll;
+    Path path;
+  };
+
+  std::vector<Library> libraries;
+  std::vector<size_t> owner; // Library that each loaded module was compiled into. Modules past the end still have to be compiled.
+  size_t validated; // Modules before this one have already been validated
+  Embedding* embeddings; // The environment's embeddings before any import libraries were added to them
+  int counter; // Even if we unload wast.dll, visual studio will keep the .pdb open forever, so we have to generate new DLLs for each new test section.
+  std::string targetpath; // We also have to be sure we don't overlap with any other .wast files, so we name the DLL based on the file path.
+
+  void* Find(const Environment& env, const Module* m) const
+  {
+    size_t i = m - env.modules;
+    return (i < owner.size()) ? libraries[owner[i]].dll : nullptr;
+  }
+
+  // Forgets modules that were removed from the environment. Their library stays loaded, because other modules can already point into it.
+  void Truncate(size_t n)
+  {
+    if(owner.size() > n)
+      owner.resize(n);
+    if(validated > n)
+      validated = n;
+  }
+};
+
+void ValidateWastModules(Environment& env, WastSession& session)
+{
+  for(; session.validated < env.n_modules; ++session.validated)
+    ValidateModule(env, env.modules[session.validated]);
+}
+
+// Libraries are unloaded newest first, so none is unloaded while a library linked against it is still loaded
+void UnloadWast(Environment& env, WastSession& session)
+{
+  while(!session.libraries.empty())
+  {
+    WastSession::Library& lib = session.libraries.back();
+    auto exit = LoadFunction(lib.dll, 0, IR_EXIT_FUNCTION);
 
     if(exit)
       (*exit)();
     else
       assert(false);
 
-    FreeDLL(cache);
-    std::remove(cachepath.c_str());
-    std::remove((cachepath.RemoveExtension().Get() + ".lib").c_str());
-    std::remove((cachepath.RemoveExtension().Get() + ".pdb").c_str());
+    FreeDLL(lib.dll);
+    std::remove(lib.path.c_str());
+    std::remove((lib.path.RemoveExtension().Get() + ".lib").c_str());
+    std::remove((lib.path.RemoveExtension().Get() + ".pdb").c_str());
+    session.libraries.pop_back();
   }
-  cache = nullptr;
+
+  session.owner.clear();
+  env.embeddings = session.embeddings;
 }
 
 // longjmp and exceptions don't always play well with destructors, so we isolate this call
-int IsolateInitCall(Environment& env, void*& cache, Path& cachepath)
+int IsolateInitCall(Environment& env, void*& dll, const Path& path)
 {
   if(SETJMP(jump_location) != 0)
     return ERR_RUNTIME_TRAP;
 
-  cache = LoadDLL(cachepath.c_str());
-  if(!cache)
+  dll = LoadDLL(path.c_str());
+  if(!dll)
     return ERR_RUNTIME_INIT_ERROR;
 
   if(env.wasthook != nullptr)
-    (*env.wasthook)(cache);
+    (*env.wasthook)(dll);
 
-  auto entry = LoadFunction(cache, 0, IR_INIT_FUNCTION);
+  auto entry = LoadFunction(dll, 0, IR_INIT_FUNCTION);
 
   if(!entry)
     return ERR_RUNTIME_INIT_ERROR;
@@ -286,30 +331,100 @@ int IsolateInitCall(Environment& env, void*& cache, Path& cachepath)
   return ERR_SUCCESS;
 }
 
-int CompileWast(Environment& env, const char* out, void*& cache, Path& cachepath)
+#ifdef IR_PLATFORM_WIN32
+// Data can only be imported from another DLL through dllimport, which we don't emit, so if a new module imports a table, memory or
+// global from a loaded library, everything has to be linked into one library again.
+bool ImportsLoadedData(const Environment& env, const WastSession& session)
 {
-  InvalidateCache(cache, cachepath);
+  for(size_t i = session.owner.size(); i < env.n_modules; ++i)
+  {
+    const Module& m = env.modules[i];
+    for(varuint32 j = m.importsection.functions; j < m.importsection.globals; ++j)
+    {
+      if(!ResolveExport(env, m.importsection.imports[j]).second)
+        continue;
+      auto pair = ResolveTrueExport(env, m.importsection.imports[j]);
+      if((size_t)(pair.first - env.modules) < session.owner.size())
+        return true;
+    }
+  }
+  return false;
+}
+#endif
 
+// Compiles every module that isn't loaded yet into a new library, then loads it and calls its init function
+int LoadWastModules(Environment& env, WastSession& session)
+{
   int err;
-  ValidateEnvironment(env);
+  ValidateWastModules(env, session);
   if(env.errors)
     return ERR_VALIDATION_ERROR;
-  if(err = CompileEnvironment(&env, out))
+
+#ifdef IR_PLATFORM_WIN32
+  if(ImportsLoadedData(env, session))
+    UnloadWast(env, session);
+#endif
+
+  std::string out = session.targetpath + std::to_string(session.counter++) + IR_LIBRARY_EXTENSION;
+  if(err = CompileEnvironment(&env, out.c_str(), (varuint32)session.owner.size(), true))
     return err;
 
-  cachepath = GetWorkingDir();
-  cachepath.Append(out);
+  Path path = GetWorkingDir();
+  path.Append(out.c_str());
+  void* dll = nullptr;
 
   signal(SIGILL, WastCrashHandler);
   signal(SIGFPE, WastCrashHandler);
 
-  err = IsolateInitCall(env, cache, cachepath);
+  err = IsolateInitCall(env, dll, path);
 
   signal(SIGILL, SIG_DFL);
   signal(SIGFPE, SIG_DFL);
+
+  if(!dll)
+  {
+    std::remove(path.c_str());
+    return err;
+  }
+
+  // Even if the init function trapped, the library stays loaded, because it may have already written its functions into another module's table
+  session.libraries.push_back(WastSession::Library{ dll, path });
+  session.owner.resize(env.n_modules, session.libraries.size() - 1);
+
+  // Later libraries link against this one directly, so they find its symbols without it having to be loaded globally
+#ifdef IR_PLATFORM_WIN32
+  std::string lib = path.RemoveExtension().Get() + ".lib"; // Through its import library
+#else
+  std::string lib = path.Get();
+#endif
+  Embedding* embed = tmalloc<Embedding>(env, 1);
+  char* file = tmalloc<char>(env, lib.size() + 1);
+  if(!embed || !file)
+    return ERR_FATAL_OUT_OF_MEMORY;
+  tmemcpy<char>(file, lib.size() + 1, lib.c_str(), lib.size() + 1);
+  embed->data = file;
+  embed->size = 0;
+  embed->tag = 0;
+  embed->next = env.embeddings;
+  env.embeddings = embed;
+
   return err;
 }
 
+// An export that passes on an import is only certain to be exported by the library of the module it came from
+std::pair<Module*, Export*> ResolveWastExport(const Environment& env, Module* m, Export* e)
+{
+  while(Import* imp = ResolveImport(*m, *e))
+  {
+    auto pair = ResolveExport(env, *imp);
+    if(!pair.second)
+      break;
+    m = pair.first;
+    e = pair.second;
+  }
+  return { m, e };
+}
+
 void SetTempName(Environment& env, Module& m)
 {
   static std::atomic_size_t modcount(1); // We can't use n_modules in case a module is malformed
@@ -319,7 +434,37 @@ void SetTempName(Environment& env, Module& m)
   tmemcpy((char*)m.name.get(), m.name.size(), buf.data(), buf.size());
 }
 
-int ParseWastModule(Environment& env, Queue<WatToken>& tokens, kh_indexname_t* mapping, Module& m, const char* path)
+// Modules that only exist to check an assertion are parsed into scratch memory. When the scope is left, any validation errors still
+// in the environment are copied back into its permanent arena, so nothing refers to the scratch memory once it's released.
+class AssertionScope
+{
+public:
+  explicit AssertionScope(Environment& env) : _env(env), _scope(env), _left(false) {}
+  ~AssertionScope() { Leave(); }
+  void Leave()
+  {
+    if(_left)
+      return;
+    _left = true;
+    _scope.Leave();
+
+    ValidationError* copy = nullptr;
+    for(ValidationError* e = _env.errors; e != nullptr; e = e->next)
+    {
+      AppendError(_env, copy, nullptr, e->code, "%s", e->error);
+      copy->m = e->m;
+    }
+    internal::ReverseErrorList(copy);
+    _env.errors = copy;
+  }
+
+private:
+  Environment& _env;
+  utility::AllocationScope _scope;
+  bool _left;
+};
+
+int ParseWastModule(Environment& env, WatLexer& tokens, kh_indexname_t* mapping, Module& m, const char* path)
 {
   EXPECTED(tokens, TOKEN_MODULE, ERR_WAT_EXPECTED_MODULE);
   int err;
@@ -377,7 +522,7 @@ int ParseWastModule(Environment& env, Queue<WatToken>& tokens, kh_indexname_t* m
   }
   else // If the module has no name, we must assign a temporary one
     SetTempName(env, m);
-  return ERR_SUCCESS;
+  return InternIdentifier(env, m.name); // The name may have been replaced after parsing interned it, and modulemap compares pointers
 }
 
 template<int I, typename... Args>
@@ -457,7 +602,7 @@ void GenWastFunctionCall(void* f, WastResult& result, Args... params)
 }
 
 // SEH exceptions and destructors don't mix, so we isolate all this signal and exception handling in this function.
-int IsolateFunctionCall(Environment& env, varuint32 n_params, void* f, WastResult& result, std::vector<Instruction>& params)
+int IsolateFunctionCall(Environment& env, varuint32 n_params, void* f, IR_Invoke invoke, const IRValue* args, WastResult& result, std::vector<Instruction>& params)
 {
   if(SETJMP(jump_location) != 0)
   {
@@ -468,7 +613,14 @@ int IsolateFunctionCall(Environment& env, varuint32 n_params, void* f, WastResul
   __try // this catches division by zero on windows
   {
 #endif
-    if(env.flags&ENV_HOMOGENIZE_FUNCTIONS)
+    if(invoke) // The invoke thunk handles any signature, so we only fall back to the generated calls when it's missing
+    {
+      IRValue r;
+      (*invoke)(args, &r, 1);
+      if(result.type != TE_void)
+        result.i64 = r.i64;
+    }
+    else if(env.flags&ENV_HOMOGENIZE_FUNCTIONS)
     {
       switch(n_params)
       {
@@ -543,12 +695,12 @@ int IsolateFunctionCall(Environment& env, varuint32 n_params, void* f, WastResul
   return ERR_SUCCESS;
 }
 
-int ParseWastAction(Environment& env, Queue<WatToken>& tokens, kh_indexname_t* mapping, Module*& last, void*& cache, Path& cachepath, int& counter, const std::string& path, WastResult& result)
+int ParseWastAction(Environment& env, WatLexer& tokens, kh_indexname_t* mapping, Module*& last, WastSession& session, WastResult& result)
 {
   int err;
   int cache_err = 0;
-  if(!cache) // If cache is null we need to recompile the current environment, but we can't bail on error messages yet or we'll corrupt the parse
-    cache_err = CompileWast(env, (path + std::to_string(counter++) + IR_LIBRARY_EXTENSION).c_str(), cache, cachepath);
+  if(session.owner.size() < env.n_modules) // Modules defined since the last action have to be loaded, but we can't bail on error messages yet or we'll corrupt the parse
+    cache_err = LoadWastModules(env, session);
   
   switch(tokens.Pop().id)
   {
@@ -570,7 +722,7 @@ int ParseWastAction(Environment& env, Queue<WatToken>& tokens, kh_indexname_t* m
     if(err = WatString(env, func, tokens.Pop()))
       return err;
 
-    khiter_t iter = kh_get_exports(m->exports, func);
+    khiter_t iter = !FindIdentifier(env, func) ? kh_end(m->exports) : kh_get_exports(m->exports, func);
     if(!kh_exist2(m->exports, iter))
       return ERR_INVALID_FUNCTION_INDEX;
     Export& e = m->exportsection.exports[kh_val(m->exports, iter)];
@@ -610,10 +762,27 @@ int ParseWastAction(Environment& env, Queue<WatToken>& tokens, kh_indexname_t* m
 
     if(cache_err != 0)
       return cache_err;
-    assert(cache);
-    void* f = reinterpret_cast<void*>(LoadDLLFunction(cache, utility::CanonicalName(StringRef::From(m->name), StringRef::From(func)).c_str()));
+    auto source = ResolveWastExport(env, m, &e);
+    void* dll = session.Find(env, source.first);
+    assert(dll);
+    auto canonical = utility::CanonicalName(StringRef::From(source.first->name), StringRef::From(source.second->name));
+    void* f = reinterpret_cast<void*>(LoadDLLFunction(dll, canonical.c_str()));
     if(!f)
       return ERR_INVALID_FUNCTION_INDEX;
+    IR_Invoke invoke = reinterpret_cast<IR_Invoke>(LoadDLLFunction(dll, (canonical + IR_INVOKE_SUFFIX).c_str()));
+
+    std::vector<IRValue> args(params.size());
+    for(size_t i = 0; i < params.size(); ++i)
+    {
+      switch(params[i].opcode)
+      {
+      case OP_i32_const: args[i].i32 = params[i].immediates[0]._varsint32; break;
+      case OP_i64_const: args[i].i64 = params[i].immediates[0]._varsint64; break;
+      case OP_f32_const: args[i].f32 = params[i].immediates[0]._float32; break;
+      case OP_f64_const: args[i].f64 = params[i].immediates[0]._float64; break;
+      default: return ERR_WAT_INVALID_TYPE;
+      }
+    }
 
     if(!ftype->n_returns)
       result.type = TE_void;
@@ -643,7 +812,7 @@ int ParseWastAction(Environment& env, Queue<WatToken>& tokens, kh_indexname_t* m
     sigaction(SIGSEGV, &sa, NULL);
 #endif
 
-    err = IsolateFunctionCall(env, ftype->n_params, f, result, params);
+    err = IsolateFunctionCall(env, ftype->n_params, f, invoke, args.data(), result, params);
 
     signal(SIGILL, SIG_DFL);
     signal(SIGFPE, SIG_DFL);
@@ -671,7 +840,7 @@ int ParseWastAction(Environment& env, Queue<WatToken>& tokens, kh_indexname_t* m
     if(err = WatString(env, global, tokens.Pop()))
       return err;
 
-    khiter_t iter = kh_get_exports(m->exports, global);
+    khiter_t iter = !FindIdentifier(env, global) ? kh_end(m->exports) : kh_get_exports(m->exports, global);
     if(!kh_exist2(m->exports, iter))
       return ERR_INVALID_GLOBAL_INDEX;
     Export& e = m->exportsection.exports[kh_val(m->exports, iter)];
@@ -681,8 +850,12 @@ int ParseWastAction(Environment& env, Queue<WatToken>& tokens, kh_indexname_t* m
 
     if(cache_err != 0)
       return cache_err;
-    assert(cache);
-    void* f = innative::LoadGlobal(cache, m->name.str(), global.str());
+    auto source = ResolveWastExport(env, m, &e);
+    void* dll = session.Find(env, source.first);
+    assert(dll);
+    // Wast names can contain null bytes, so look the export up by size instead of going through LoadGlobal
+    auto entry = FindExport(LoadExportDirectory(dll), source.first->name.str(), source.first->name.size(), source.second->name.str(), source.second->name.size());
+    void* f = entry ? entry->address : innative::LoadGlobal(dll, source.first->name.str(), source.second->name.str());
     if(!f)
       return ERR_INVALID_GLOBAL_INDEX;
 
@@ -745,15 +918,12 @@ inline const char* MapAssertionString(const char* s)
 // This parses an entire extended WAT testing script into an environment
 int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, const char* path, bool always_compile)
 {
-  Queue<WatToken> tokens;
   const char* start = (const char*)data;
-  TokenizeWAT(tokens, start, (const char*)data + sz);
+  WatLexer tokens(start, start + sz);
   ValidationError* errors = nullptr;
-  int counter = 0; // Even if we unload wast.dll, visual studio will keep the .pdb open forever, so we have to generate new DLLs for each new test section.
-  std::string targetpath = Path(path).File().RemoveExtension().Get(); // We also have to be sure we don't overlap with any other .wast files, so we name the DLL based on the file path.
   env.flags |= ENV_NO_INIT; // We can't allow the DLL to call _DllInit because we can't catch exceptions from it, so we manually call it instead.
 
-  int err = CheckWatTokens(env, env.errors, tokens, start);
+  int err = CheckWatTokens(env, env.errors, start, start + sz);
   if(err)
     return err;
 
@@ -762,8 +932,11 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
 
   kh_indexname_t* mapping = kh_init_indexname(); // This is a special mapping for all modules using the module name itself, not just registered ones.
   Module* last = nullptr; // For anything not providing a module name, this was the most recently defined module.
-  void* cache = nullptr;
-  Path cachepath;
+  WastSession session = { {}, {}, 0, env.embeddings, 0, Path(path).File().RemoveExtension().Get() };
+  utility::DeferLambda<std::function<void()>> unload([&]() { UnloadWast(env, session); });
+
+  if(!(env.flags&ENV_CHECK_MEMORY_ACCESS))
+    AppendIntrinsics(env);
 
   while(tokens.Size() > 0 && tokens[0].id != TOKEN_CLOSE)
   {
@@ -772,14 +945,12 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
     {
     case TOKEN_MODULE:
     {
-      InvalidateCache(cache, cachepath);
-
       env.modules = trealloc<Module>(env.modules, ++env.n_modules);
       last = &env.modules[env.n_modules - 1];
 
       if(err = ParseWastModule(env, tokens, mapping, *last, path))
         return err;
-      ValidateModule(env, *last);
+      ValidateWastModules(env, session);
       if(env.errors)
         return ERR_VALIDATION_ERROR;
 
@@ -787,12 +958,13 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
     }
     case TOKEN_REGISTER:
     {
-      InvalidateCache(cache, cachepath);
       tokens.Pop();
 
       ByteArray name;
       if(err = WatString(env, name, tokens.Pop()))
         return err;
+      if(err = InternIdentifier(env, name))
+        return err;
       int r;
       khiter_t iter = kh_put_modules(env.modulemap, name, &r);
       if(!r)
@@ -807,7 +979,8 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
         return ERR_PARSE_INVALID_NAME;
 
       kh_val(env.modulemap, iter) = i;
-      env.modules[i].name = name;
+      if(i >= session.owner.size()) // A loaded module keeps the name its library exported it under, and is found by the new one through the module map
+        env.modules[i].name = name;
       break;
     }
     case TOKEN_INVOKE:
@@ -815,7 +988,7 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
     {
       WatToken t = tokens.Peek();
       WastResult result;
-      if(err = ParseWastAction(env, tokens, mapping, last, cache, cachepath, counter, targetpath, result))
+      if(err = ParseWastAction(env, tokens, mapping, last, session, result))
       {
         if(err != ERR_RUNTIME_TRAP && err != ERR_RUNTIME_INIT_ERROR)
           return err;
@@ -829,14 +1002,18 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
       WatToken t = tokens.Pop();
       if(tokens.Size() > 1 && tokens[0].id == TOKEN_OPEN && tokens[1].id == TOKEN_MODULE) // Check if we're actually trapping on a module load
       {
+        // Load everything defined before this module first, so it's the only module in its library
+        int loaded = (session.owner.size() < env.n_modules) ? LoadWastModules(env, session) : ERR_SUCCESS;
+
         EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
         env.modules = trealloc<Module>(env.modules, ++env.n_modules); // We temporarily add this module to the environment, but don't set the "last" module to it
         if(err = ParseWastModule(env, tokens, mapping, env.modules[env.n_modules - 1], path))
           return err;
         EXPECTED(tokens, TOKEN_CLOSE, ERR_WAT_EXPECTED_CLOSE);
 
-        err = CompileWast(env, (targetpath + std::to_string(counter++) + IR_LIBRARY_EXTENSION).c_str(), cache, cachepath);
+        err = (loaded != ERR_SUCCESS) ? loaded : LoadWastModules(env, session);
         --env.n_modules; // Remove the module from the environment to avoid poisoning other compilations
+        session.Truncate(env.n_modules);
         if(err != ERR_RUNTIME_TRAP)
           AppendError(env, errors, 0, ERR_RUNTIME_ASSERT_FAILURE, "[%zu] Expected trap, but call succeeded", WatLineNumber(start, t.pos));
         EXPECTED(tokens, TOKEN_STRING, ERR_WAT_EXPECTED_STRING);
@@ -845,7 +1022,7 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
       {
         EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
         WastResult result;
-        err = ParseWastAction(env, tokens, mapping, last, cache, cachepath, counter, targetpath, result);
+        err = ParseWastAction(env, tokens, mapping, last, session, result);
         if(err != ERR_RUNTIME_TRAP)
           AppendError(env, errors, last, ERR_RUNTIME_ASSERT_FAILURE, "[%zu] Expected trap, but call succeeded", WatLineNumber(start, t.pos));
         EXPECTED(tokens, TOKEN_CLOSE, ERR_WAT_EXPECTED_CLOSE);
@@ -860,7 +1037,7 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
       WatToken t = tokens.Pop();
       EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
       WastResult result = { TE_NONE };
-      if(err = ParseWastAction(env, tokens, mapping, last, cache, cachepath, counter, targetpath, result))
+      if(err = ParseWastAction(env, tokens, mapping, last, session, result))
       {
         if(err != ERR_RUNTIME_TRAP && err != ERR_RUNTIME_INIT_ERROR)
           return err;
@@ -944,6 +1121,7 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
     {
       WatToken t = tokens.Pop();
       EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
+      AssertionScope scope(env);
       Module m;
       int code = ParseWastModule(env, tokens, mapping, m, path);
       EXPECTED(tokens, TOKEN_CLOSE, ERR_WAT_EXPECTED_CLOSE);
@@ -953,10 +1131,11 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
         return err;
 
       string assertcode = GetAssertionString(code);
+      env.errors = 0;
+      scope.Leave();
 
       if(STRICMP(assertcode.c_str(), MapAssertionString(error.str())))
         AppendError(env, errors, 0, ERR_RUNTIME_ASSERT_FAILURE, "[%zu] Expected '%s' error, but got '%s' instead", WatLineNumber(start, t.pos), error.str(), assertcode.c_str());
-      env.errors = 0;
       break;
     }
     case TOKEN_ASSERT_INVALID:
@@ -964,6 +1143,7 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
     {
       WatToken t = tokens.Pop();
       EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
+      AssertionScope scope(env);
       Module m;
       int code = ParseWastModule(env, tokens, mapping, m, path);
       EXPECTED(tokens, TOKEN_CLOSE, ERR_WAT_EXPECTED_CLOSE);
@@ -972,6 +1152,7 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
 
       if(code < 0)
       {
+        scope.Leave();
         AppendError(env, errors, 0, ERR_RUNTIME_ASSERT_FAILURE, "[%zu] Expected module parsing success, but got '%s' instead", WatLineNumber(start, t.pos), assertcode.c_str());
         return code; // A parsing failure means we cannot recover
       }
@@ -992,11 +1173,13 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
           break;
         env.errors = env.errors->next;
       }
+      bool found = env.errors != nullptr;
+
+      env.errors = 0;
+      scope.Leave();
 
-      if(!env.errors)
+      if(!found)
         AppendError(env, errors, 0, ERR_RUNTIME_ASSERT_FAILURE, "[%zu] Expected '%s' error, but got '%s' instead", WatLineNumber(start, t.pos), error.str(), assertcode.c_str());
-      else
-        env.errors = 0;
       break;
     }
     case TOKEN_SCRIPT:
@@ -1030,14 +1213,12 @@ int innative::wat::ParseWast(Environment& env, const uint8_t* data, size_t sz, c
     EXPECTED(tokens, TOKEN_CLOSE, ERR_WAT_EXPECTED_CLOSE);
   }
 
-  if(always_compile && !cache) // If cache is null we must ensure we've at least tried to compile the test even if there's nothing to run.
+  if(always_compile && session.owner.size() < env.n_modules) // We must ensure we've at least tried to compile every module even if nothing ran after it.
   {
-    if(err = CompileWast(env, (targetpath + std::to_string(counter++) + IR_LIBRARY_EXTENSION).c_str(), cache, cachepath))
+    if(err = LoadWastModules(env, session))
       return err;
-    assert(cache);
   }
 
-  InvalidateCache(cache, cachepath);
   env.errors = errors;
   if(env.errors)
     internal::ReverseErrorList(env.errors);
@@ -4,8 +4,12 @@
 #include "wat.h"
 #include "util.h"
 #include "parse.h"
+#include "instruction.h"
 #include "validate.h"
+#include "threadpool.h"
 #include <limits>
+#include <atomic>
+#include <algorithm>
 
 using std::string;
 using std::numeric_limits;
@@ -17,15 +21,15 @@ namespace innative {
   namespace wat {
     __KHASH_IMPL(indexname, , StringRef, varuint32, 1, internal::__ac_X31_hash_stringrefins, kh_int_hash_equal);
 
-    template<typename T, int(*FN)(const WatToken&, std::string&, T&)>
+    template<typename T, int(*FN)(const WatToken&, T&)>
     T ResolveInlineToken(WatState& state, const WatToken& token)
     {
       T t;
-      int err = (*FN)(token, state.numbuf, t);
+      int err = (*FN)(token, t);
       return !err ? t : (T)~0;
     }
 
-    WatState::WatState(Environment& e, Module& mod) : m(mod), env(e)
+    WatState::WatState(Environment& e, Module& mod) : m(mod), env(e), owner(true)
     {
       typehash = kh_init_indexname();
       funchash = kh_init_indexname();
@@ -33,8 +37,13 @@ namespace innative {
       memoryhash = kh_init_indexname();
       globalhash = kh_init_indexname();
     }
+    WatState::WatState(Environment& e, WatState& names) : m(names.m), env(e), typehash(names.typehash), funchash(names.funchash),
+      tablehash(names.tablehash), memoryhash(names.memoryhash), globalhash(names.globalhash), owner(false)
+    {}
     WatState::~WatState()
     {
+      if(!owner)
+        return;
       kh_destroy_indexname(typehash);
       kh_destroy_indexname(funchash);
       kh_destroy_indexname(tablehash);
@@ -217,7 +226,7 @@ namespace innative {
       return AppendArray<varsint7>(ty, a, n);
     }
 
-    int WatFunctionTypeInner(const Environment& env, Queue<WatToken>& tokens, FunctionType& sig, DebugInfo** info, bool anonymous)
+    int WatFunctionTypeInner(const Environment& env, WatLexer& tokens, FunctionType& sig, DebugInfo** info, bool anonymous)
     {
       sig.form = TE_func;
       int err;
@@ -282,7 +291,7 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    int WatFunctionType(WatState& state, Queue<WatToken>& tokens, varuint32* index)
+    int WatFunctionType(WatState& state, WatLexer& tokens, varuint32* index)
     {
       EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
       EXPECTED(tokens, TOKEN_FUNC, ERR_WAT_EXPECTED_FUNC);
@@ -380,7 +389,7 @@ namespace innative {
       return AppendArray<FunctionType>(ftype, state.m.type.functions, state.m.type.n_functions);
     }
 
-    int WatTypeUse(WatState& state, Queue<WatToken>& tokens, varuint32& sig, DebugInfo** info, bool anonymous)
+    int WatTypeUse(WatState& state, WatLexer& tokens, varuint32& sig, DebugInfo** info, bool anonymous)
     {
       sig = (varuint32)~0;
       if(tokens.Size() > 1 && tokens[0].id == TOKEN_OPEN && tokens[1].id == TOKEN_TYPE)
@@ -473,22 +482,22 @@ namespace innative {
       return (varuint32)~0;
     }
 
-    int WatConstantOperator(WatState& state, Queue<WatToken>& tokens, Instruction& op)
+    int WatConstantOperator(WatState& state, WatLexer& tokens, Instruction& op)
     {
       int err = ERR_SUCCESS;
       switch(op.opcode)
       {
       case OP_i32_const:
-        err = ResolveTokeni32(tokens.Pop(), state.numbuf, op.immediates[0]._varsint32);
+        err = ResolveTokeni32(tokens.Pop(), op.immediates[0]._varsint32);
         break;
       case OP_i64_const:
-        err = ResolveTokeni64(tokens.Pop(), state.numbuf, op.immediates[0]._varsint64);
+        err = ResolveTokeni64(tokens.Pop(), op.immediates[0]._varsint64);
         break;
       case OP_f32_const:
-        err = ResolveTokenf32(tokens.Pop(), state.numbuf, op.immediates[0]._float32);
+        err = ResolveTokenf32(tokens.Pop(), op.immediates[0]._float32);
         break;
       case OP_f64_const:
-        err = ResolveTokenf64(tokens.Pop(), state.numbuf, op.immediates[0]._float64);
+        err = ResolveTokenf64(tokens.Pop(), op.immediates[0]._float64);
         break;
       case OP_global_get: // For constant initializers, this has to be an import, and thus must always already exist by the time we reach it.
         op.immediates[0]._varuint32 = WatGetFromHash(state, state.globalhash, tokens.Pop());
@@ -501,7 +510,24 @@ namespace innative {
 
       return err;
     }
-    int WatOperator(WatState& state, Queue<WatToken>& tokens, Instruction& op, FunctionBody& f, FunctionType& sig, DeferWatAction& defer)
+
+    // Parses the optional memory index that the multi-memory proposal allows after memory instructions
+    int WatMemoryIndex(WatState& state, WatLexer& tokens, Instruction& op, int slot, DeferWatAction& defer)
+    {
+      op.immediates[slot]._varuint32 = 0;
+      if(tokens.Peek().id != TOKEN_NUMBER && tokens.Peek().id != TOKEN_NAME)
+        return ERR_SUCCESS;
+      if(!(state.env.features & ENV_FEATURE_MULTI_MEMORY)) // Malformed input, not an internal error
+        return ERR_WAT_INVALID_TOKEN;
+
+      if(tokens.Peek().id == TOKEN_NAME) // Memories can be declared after the function that uses them, so we defer named references
+        defer = DeferWatAction{ !slot ? (int)op.opcode : -TOKEN_MEMORY, tokens.Pop(), 0, 0 };
+      else if((op.immediates[slot]._varuint32 = WatGetFromHash(state, state.memoryhash, tokens.Pop())) == (varuint32)~0)
+        return assert(false), ERR_WAT_INVALID_VAR;
+      return ERR_SUCCESS;
+    }
+
+    int WatOperator(WatState& state, WatLexer& tokens, Instruction& op, FunctionBody& f, FunctionType& sig, DeferWatAction& defer)
     {
       if(tokens.Peek().id != TOKEN_OPERATOR)
         return ERR_WAT_EXPECTED_OPERATOR;
@@ -565,6 +591,11 @@ namespace innative {
         if(err = WatTypeUse(state, tokens, op.immediates[0]._varuint32, 0, true))
           return err;
         break;
+      case OP_memory_size:
+      case OP_memory_grow:
+        if(err = WatMemoryIndex(state, tokens, op, 0, defer))
+          return err;
+        break;
       case OP_i32_load:
       case OP_i64_load:
       case OP_f32_load:
@@ -588,17 +619,19 @@ namespace innative {
       case OP_i64_store8:
       case OP_i64_store16:
       case OP_i64_store32:
+        if(err = WatMemoryIndex(state, tokens, op, 2, defer))
+          return err;
         if(tokens.Peek().id == TOKEN_OFFSET)
         {
           tokens.Pop();
-          if(err = ResolveTokenu32(tokens.Pop(), state.numbuf, op.immediates[1]._varuint32))
+          if(err = ResolveTokenu32(tokens.Pop(), op.immediates[1]._varuint32))
           //if(err = ResolveTokenu64(tokens.Pop(), op.immediates[1]._varuptr)) // We can't do this until webassembly actually supports 64-bit
             return err;
         }
         if(tokens.Peek().id == TOKEN_ALIGN)
         {
           tokens.Pop();
-          if(err = ResolveTokenu32(tokens.Pop(), state.numbuf, op.immediates[0]._varuint32))
+          if(err = ResolveTokenu32(tokens.Pop(), op.immediates[0]._varuint32))
             return assert(false), err;
           if(op.immediates[0]._varuint32 == 0 || !IsPowerOfTwo(op.immediates[0]._varuint32)) // Ensure this alignment is exactly a power of two
             return ERR_WAT_INVALID_ALIGNMENT;
@@ -611,7 +644,7 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    void WatLabel(WatState& state, Queue<WatToken>& tokens)
+    void WatLabel(WatState& state, WatLexer& tokens)
     {
       if(tokens.Peek().id == TOKEN_NAME)
       {
@@ -622,7 +655,7 @@ namespace innative {
         state.stack.Push(StringRef{ 0, 0 });
     }
 
-    bool CheckLabel(WatState& state, Queue<WatToken>& tokens)
+    bool CheckLabel(WatState& state, WatLexer& tokens)
     {
       if(tokens.Peek().id == TOKEN_NAME)
       {
@@ -633,7 +666,7 @@ namespace innative {
       return true;
     }
 
-    int WatBlockType(Queue<WatToken>& tokens, varsint7& out)
+    int WatBlockType(WatLexer& tokens, varsint7& out)
     {
       out = TE_void;
       if(tokens.Size() > 1 && tokens[0].id == TOKEN_OPEN && tokens[1].id == TOKEN_RESULT)
@@ -658,9 +691,9 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    int WatInstruction(WatState& state, Queue<WatToken>& tokens, FunctionBody& f, FunctionType& sig, varuint32 index);
+    int WatInstruction(WatState& state, WatLexer& tokens, FunctionBody& f, FunctionType& sig, varuint32 index);
 
-    int WatExpression(WatState& state, Queue<WatToken>& tokens, FunctionBody& f, FunctionType& sig, varuint32 index)
+    int WatExpression(WatState& state, WatLexer& tokens, FunctionBody& f, FunctionType& sig, varuint32 index)
     {
       EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
 
@@ -681,7 +714,7 @@ namespace innative {
           op.immediates[0]._varsint7 = blocktype;
           op.line = t.line;
           op.column = t.column;
-          if(err = AppendArray<Instruction>(op, f.body, f.n_body))
+          if(err = AppendInstruction(f, op))
             return err;
         }
 
@@ -692,7 +725,7 @@ namespace innative {
         Instruction op = { OP_end };
         op.line = tokens.Peek().line;
         op.column = tokens.Peek().column;
-        if(err = AppendArray<Instruction>(op, f.body, f.n_body))
+        if(err = AppendInstruction(f, op))
           return err;
         state.stack.Pop();
         break;
@@ -713,7 +746,7 @@ namespace innative {
           op.immediates[0]._varsint7 = blocktype;
           op.line = t.line;
           op.column = t.column;
-          if(err = AppendArray<Instruction>(op, f.body, f.n_body)) // We append the if instruction _after_ the optional condition expression
+          if(err = AppendInstruction(f, op)) // We append the if instruction _after_ the optional condition expression
             return err;
         }
       }
@@ -737,7 +770,7 @@ namespace innative {
 
           op.line = t.line;
           op.column = t.column;
-          if(err = AppendArray<Instruction>(op, f.body, f.n_body))
+          if(err = AppendInstruction(f, op))
             return err;
 
           while(tokens.Peek().id != TOKEN_CLOSE)
@@ -751,7 +784,7 @@ namespace innative {
           Instruction op = { OP_end };
           op.line = tokens.Peek().line;
           op.column = tokens.Peek().column;
-          if(err = AppendArray<Instruction>(op, f.body, f.n_body))
+          if(err = AppendInstruction(f, op))
             return err;
         }
 
@@ -769,9 +802,9 @@ namespace innative {
           if(err = WatExpression(state, tokens, f, sig, index))
             return err;
 
-        if(defer.id) // Only perform the defer after we evaluate the folded instructions, so f.n_body is correct
-          state.defer.Push(DeferWatAction{ defer.id, defer.t, index, f.n_body });
-        if(err = AppendArray<Instruction>(op, f.body, f.n_body)) // Now we append the operator
+        if(defer.id) // Only perform the defer after we evaluate the folded instructions, so f.n_code is correct
+          state.defer.Push(DeferWatAction{ defer.id, defer.t, index, f.n_code });
+        if(err = AppendInstruction(f, op)) // Now we append the operator
           return err;
         break;
       }
@@ -781,7 +814,7 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    int WatInstruction(WatState& state, Queue<WatToken>& tokens, FunctionBody& f, FunctionType& sig, varuint32 index)
+    int WatInstruction(WatState& state, WatLexer& tokens, FunctionBody& f, FunctionType& sig, varuint32 index)
     {
       int err;
       varsint7 blocktype;
@@ -802,7 +835,7 @@ namespace innative {
           op.immediates[0]._varsint7 = blocktype;
           op.line = t.line;
           op.column = t.column;
-          if(err = AppendArray<Instruction>(op, f.body, f.n_body))
+          if(err = AppendInstruction(f, op))
             return err;
         }
 
@@ -819,7 +852,7 @@ namespace innative {
           Instruction op = { OP_end };
           op.line = tokens.Peek().line;
           op.column = tokens.Peek().column;
-          if(err = AppendArray<Instruction>(op, f.body, f.n_body))
+          if(err = AppendInstruction(f, op))
             return err;
         }
 
@@ -838,7 +871,7 @@ namespace innative {
           op.immediates[0]._varsint7 = blocktype;
           op.line = t.line;
           op.column = t.column;
-          if(err = AppendArray<Instruction>(op, f.body, f.n_body)) // We append the if instruction _after_ the optional condition expression
+          if(err = AppendInstruction(f, op)) // We append the if instruction _after_ the optional condition expression
             return err;
         }
 
@@ -855,7 +888,7 @@ namespace innative {
           Instruction op = { OP_else };
           op.line = t.line;
           op.column = t.column;
-          if(err = AppendArray<Instruction>(op, f.body, f.n_body))
+          if(err = AppendInstruction(f, op))
             return err;
 
           while(tokens.Peek().id != TOKEN_END)
@@ -873,7 +906,7 @@ namespace innative {
           Instruction op = { OP_end };
           op.line = tokens.Peek().line;
           op.column = tokens.Peek().column;
-          if(err = AppendArray<Instruction>(op, f.body, f.n_body))
+          if(err = AppendInstruction(f, op))
             return err;
         }
 
@@ -887,15 +920,15 @@ namespace innative {
           return err;
 
         if(defer.id)
-          state.defer.Push(DeferWatAction{ defer.id, defer.t, index, f.n_body });
-        return AppendArray<Instruction>(op, f.body, f.n_body);
+          state.defer.Push(DeferWatAction{ defer.id, defer.t, index, f.n_code });
+        return AppendInstruction(f, op);
       }
       }
 
       return ERR_SUCCESS;
     }
 
-    int WatInlineImportExport(const Environment& env, Module& m, Queue<WatToken>& tokens, varuint32* index, varuint7 kind, Import** out)
+    int WatInlineImportExport(const Environment& env, Module& m, WatLexer& tokens, varuint32* index, varuint7 kind, Import** out)
     {
       int err;
       while(tokens.Size() > 1 && tokens[0].id == TOKEN_OPEN && tokens[1].id == TOKEN_EXPORT)
@@ -949,7 +982,7 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    int WatLocalAppend(FunctionBody& body, Queue<WatToken>& tokens)
+    int WatLocalAppend(FunctionBody& body, WatLexer& tokens)
     {
       varsint7 local = WatValType(tokens.Pop().id);
       if(!local)
@@ -957,7 +990,51 @@ namespace innative {
       return AppendArray<varsint7>(local, body.locals, body.n_locals);
     }
 
-    int WatFunction(WatState& state, Queue<WatToken>& tokens, varuint32* index, StringRef name)
+    int WatFunctionBody(WatState& state, WatLexer& tokens, FunctionBody& body, FunctionType& desc, varuint32 index)
+    {
+      int err;
+      assert(state.stack.Size() == 0);
+      while(tokens.Peek().id != TOKEN_CLOSE)
+      {
+        if(err = WatInstruction(state, tokens, body, desc, index))
+          return err;
+      }
+      assert(state.stack.Size() == 0);
+      Instruction op = { OP_end };
+      op.line = tokens.Peek().line;
+      op.column = tokens.Peek().column;
+      return AppendInstruction(body, op);
+    }
+
+    // Skips the instructions of a function body, except for the signatures of call_indirect. Those can add types, so they are
+    // merged here to number the types in the same order as parsing every body in place would.
+    int SkipWatFunctionBody(WatState& state, WatLexer& tokens)
+    {
+      int count = 1;
+      while(tokens.Size())
+      {
+        if(tokens[0].id == TOKEN_OPEN)
+          ++count;
+        else if(tokens[0].id == TOKEN_CLOSE)
+        {
+          if(!--count)
+            break;
+        }
+        else if(tokens[0].id == TOKEN_OPERATOR && tokens[0].i == OP_call_indirect)
+        {
+          tokens.Pop();
+          varuint32 sig;
+          int err = WatTypeUse(state, tokens, sig, 0, true);
+          if(err)
+            return err;
+          continue;
+        }
+        tokens.Pop();
+      }
+      return ERR_SUCCESS;
+    }
+
+    int WatFunction(WatState& state, WatLexer& tokens, varuint32* index, StringRef name)
     {
       int err;
       FunctionBody body = { 0 };
@@ -976,7 +1053,7 @@ namespace innative {
       if(err = WatTypeUse(state, tokens, sig, &body.param_names, false))
         return err;
 
-      FunctionType& desc = state.m.type.functions[sig];
+      FunctionType desc = state.m.type.functions[sig]; // A copy, because call_indirect can add types and move the array
       if(name.len > 0)
         if(err = WatString(state.env, body.debug.name, name))
           return err;
@@ -1017,18 +1094,13 @@ namespace innative {
         EXPECTED(tokens, TOKEN_CLOSE, ERR_WAT_EXPECTED_CLOSE);
       }
 
-      // Read in all instructions
-      assert(state.stack.Size() == 0);
-      while(tokens.Peek().id != TOKEN_CLOSE)
+      if((state.env.flags & ENV_MULTITHREADED) && state.env.pool) // Leave the instructions for WatFunctionBodies
       {
-        if(err = WatInstruction(state, tokens, body, desc, *index))
+        state.pending.push_back(WatPendingBody{ tokens.Mark(), state.m.code.n_funcbody, *index });
+        if(err = SkipWatFunctionBody(state, tokens))
           return err;
       }
-      assert(state.stack.Size() == 0);
-      Instruction op = { OP_end };
-      op.line = tokens.Peek().line;
-      op.column = tokens.Peek().column;
-      if(err = AppendArray(op, body.body, body.n_body))
+      else if(err = WatFunctionBody(state, tokens, body, desc, *index))
         return err;
 
       state.m.knownsections |= (1 << WASM_SECTION_FUNCTION);
@@ -1039,14 +1111,14 @@ namespace innative {
       return AppendArray(body, state.m.code.funcbody, state.m.code.n_funcbody);
     }
 
-    int WatResizableLimits(WatState& state, ResizableLimits& limits, Queue<WatToken>& tokens)
+    int WatResizableLimits(WatState& state, ResizableLimits& limits, WatLexer& tokens)
     {
-      int err = ResolveTokenu32(tokens.Pop(), state.numbuf, limits.minimum);
+      int err = ResolveTokenu32(tokens.Pop(), limits.minimum);
       if(err)
         return err;
       if(tokens.Peek().id == TOKEN_NUMBER)
       {
-        if(err = ResolveTokenu32(tokens.Pop(), state.numbuf, limits.maximum))
+        if(err = ResolveTokenu32(tokens.Pop(), limits.maximum))
           return err;
         limits.flags = 1;
       }
@@ -1054,7 +1126,7 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    int WatTableDesc(WatState& state, TableDesc& t, Queue<WatToken>& tokens)
+    int WatTableDesc(WatState& state, TableDesc& t, WatLexer& tokens)
     {
       int err;
       if(err = WatResizableLimits(state, t.resizable, tokens))
@@ -1066,7 +1138,7 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    int WatTable(WatState& state, Queue<WatToken>& tokens, varuint32* index)
+    int WatTable(WatState& state, WatLexer& tokens, varuint32* index)
     {
       int err;
       *index = state.m.table.n_tables + state.m.importsection.tables - state.m.importsection.functions;
@@ -1097,7 +1169,7 @@ namespace innative {
       return AppendArray(table, state.m.table.tables, state.m.table.n_tables);
     }
 
-    int WatInitializerInstruction(WatState& state, Queue<WatToken>& tokens, Instruction& op, bool expr)
+    int WatInitializerInstruction(WatState& state, WatLexer& tokens, Instruction& op, bool expr)
     {
       int err;
       FunctionBody blank = { 0 };
@@ -1120,13 +1192,13 @@ namespace innative {
       if(blank.n_body != 1)
         AppendError(state.env, state.env.errors, 0, ERR_INVALID_INITIALIZER, "Only one instruction is allowed as an initializer");
 
-      if(blank.n_body > 0)
-        op = blank.body[0];
+      InstructionCursor cursor(blank);
+      cursor.Next(op);
 
       return ERR_SUCCESS;
     }
 
-    int WatInitializer(WatState& state, Queue<WatToken>& tokens, Instruction& op)
+    int WatInitializer(WatState& state, WatLexer& tokens, Instruction& op)
     {
       int err = WatInitializerInstruction(state, tokens, op, false);
       if(err < 0)
@@ -1138,7 +1210,7 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    int WatGlobalDesc(GlobalDesc& g, Queue<WatToken>& tokens)
+    int WatGlobalDesc(GlobalDesc& g, WatLexer& tokens)
     {
       if(tokens.Peek().id == TOKEN_OPEN)
       {
@@ -1160,7 +1232,7 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    int WatGlobal(WatState& state, Queue<WatToken>& tokens, varuint32* index)
+    int WatGlobal(WatState& state, WatLexer& tokens, varuint32* index)
     {
       int err;
       *index = state.m.global.n_globals + state.m.importsection.globals - state.m.importsection.memories;
@@ -1182,12 +1254,12 @@ namespace innative {
       return AppendArray(g, state.m.global.globals, state.m.global.n_globals);
     }
 
-    int WatMemoryDesc(WatState& state, MemoryDesc& m, Queue<WatToken>& tokens)
+    int WatMemoryDesc(WatState& state, MemoryDesc& m, WatLexer& tokens)
     {
       return WatResizableLimits(state, m.limits, tokens);
     }
 
-    int WatMemory(WatState& state, Queue<WatToken>& tokens, varuint32* index)
+    int WatMemory(WatState& state, WatLexer& tokens, varuint32* index)
     {
       int err;
       *index = state.m.memory.n_memories + state.m.importsection.memories - state.m.importsection.tables;
@@ -1246,7 +1318,7 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    int WatImport(WatState& state, Queue<WatToken>& tokens)
+    int WatImport(WatState& state, WatLexer& tokens)
     {
       Import i = { };
       int err;
@@ -1300,8 +1372,8 @@ namespace innative {
       return AddWatName(hash, name, index);
     }
 
-    template<int(*F)(WatState&, Queue<WatToken>&, varuint32*)>
-    int WatIndexProcess(WatState& state, Queue<WatToken>& tokens, kh_indexname_t* hash)
+    template<int(*F)(WatState&, WatLexer&, varuint32*)>
+    int WatIndexProcess(WatState& state, WatLexer& tokens, kh_indexname_t* hash)
     {
       WatToken t = GetWatNameToken(tokens);
 
@@ -1314,7 +1386,7 @@ namespace innative {
       return AddWatName(hash, t, index);
     }
 
-    int WatExport(WatState& state, Queue<WatToken>& tokens)
+    int WatExport(WatState& state, WatLexer& tokens)
     {
       Export e = {};
       int err;
@@ -1349,7 +1421,7 @@ namespace innative {
       return AppendArray(e, state.m.exportsection.exports, state.m.exportsection.n_exports);
     }
 
-    int WatElemData(WatState& state, Queue<WatToken>& tokens, varuint32& index, Instruction& op, kh_indexname_t* hash)
+    int WatElemData(WatState& state, WatLexer& tokens, varuint32& index, Instruction& op, kh_indexname_t* hash)
     {
       if(tokens[0].id == TOKEN_NUMBER || tokens[0].id == TOKEN_NAME)
         index = WatGetFromHash(state, hash, tokens.Pop());
@@ -1377,7 +1449,7 @@ namespace innative {
       return ERR_SUCCESS;
     }
 
-    int WatElem(WatState& state, TableInit& e, Queue<WatToken>& tokens)
+    int WatElem(WatState& state, TableInit& e, WatLexer& tokens)
     {
       while(tokens[0].id != TOKEN_CLOSE)
       {
@@ -1392,7 +1464,7 @@ namespace innative {
       return AppendArray(e, state.m.element.elements, state.m.element.n_elements);
     }
 
-    int WatData(WatState& state, Queue<WatToken>& tokens)
+    int WatData(WatState& state, WatLexer& tokens)
     {
       DataInit d = { 0 };
       int err;
@@ -1412,7 +1484,7 @@ namespace innative {
     }
 
     // Skips over an entire section of tokens by counting paranthesis, assuming they are well-formed
-    void SkipSection(Queue<WatToken>& tokens, int count)
+    void SkipSection(WatLexer& tokens, int count)
     {
       while(tokens.Size())
       {
@@ -1427,41 +1499,145 @@ namespace innative {
       }
     }
 
-    int WatModule(Environment& env, Module& m, Queue<WatToken>& tokens, StringRef name, WatToken& internalname)
+    int WatFunctionBodies(WatState& state, const char* end)
     {
-      int err;
-      m = { 0 };
-      if(name.s && (err = WatName(env, m.name, WatToken{ TOKEN_NAME, (const char*)name.s, 0, 0, (int64_t)name.len })))
-        return err;
+      static const size_t BATCH_SIZE = 64;
+      if(state.pending.empty())
+        return ERR_SUCCESS;
 
-      if((tokens.Peek().id == TOKEN_NAME) && (err = WatName(env, m.name, internalname = tokens.Pop())))
-        return err;
+      Module& m = state.m;
+      std::vector<int> results(state.pending.size(), ERR_SUCCESS);
+      size_t batches = (state.pending.size() + BATCH_SIZE - 1) / BATCH_SIZE;
+      std::vector<std::vector<DeferWatAction>> defers(batches);
+      std::atomic<size_t> outstanding(batches);
+
+      // Each batch has its own labels and deferred actions, and starts lexing at its first body. The main pass already
+      // reported unknown types in call_indirect, so errors that the batches append are dropped.
+      auto parse = [&](size_t b) {
+        Environment local = state.env;
+        local.errors = nullptr;
+        WatState batch(local, state);
+        size_t last = std::min((b + 1) * BATCH_SIZE, state.pending.size());
+        for(size_t i = b * BATCH_SIZE; i < last; ++i)
+        {
+          const WatPendingBody& p = state.pending[i];
+          WatLexer tokens(p.start, end);
+          FunctionType& desc = m.type.functions[m.function.funcdecl[p.code]];
+          if(results[i] = WatFunctionBody(batch, tokens, m.code.funcbody[p.code], desc, p.index))
+            break;
+        }
+        for(; batch.defer.Size() > 0; batch.defer.Pop())
+          defers[b].push_back(batch.defer[0]);
+        outstanding.fetch_sub(1, std::memory_order_release);
+      };
 
-      WatState state(env, m);
+      if(batches <= 1)
+        parse(0);
+      else
+      {
+        for(size_t b = 0; b < batches; ++b)
+          state.env.pool->Submit([&parse, b]() { parse(b); });
+        state.env.pool->Wait([&outstanding]() { return !outstanding.load(std::memory_order_acquire); });
+      }
 
-      WatToken t;
-      size_t restore = tokens.GetPosition();
-      while(tokens.Size() > 0 && tokens.Peek().id != TOKEN_CLOSE)
+      for(auto r : results) // Report the first body that failed, just like a serial parse
+        if(r)
+          return r;
+      for(auto& list : defers)
+        for(auto& d : list)
+          state.defer.Push(d);
+      state.pending.clear();
+      return ERR_SUCCESS;
+    }
+
+    // Where one field of a module starts, so a pass can seek straight to the fields it handles
+    struct WatField
+    {
+      WatTokenID id; // The token after the opening parenthesis
+      size_t index;
+      WatCursor mark;
+    };
+
+    struct WatFields
+    {
+      std::vector<WatField> fields;
+      WatField end; // The module's closing parenthesis, the end of the input, or the first token that can't start a field
+      int err; // What reaching the end means for a serial parse, once every field before it parsed
+    };
+
+    // Finds every field of the module by matching parentheses, which is the only time most of its tokens are lexed. If start is
+    // set, the rest of the input is lexed as well, and every invalid token in it is reported like CheckWatTokens would.
+    int ScanWatFields(Environment& env, WatLexer& tokens, WatFields& out, const char* start)
+    {
+      int err = ERR_SUCCESS;
+      int depth = 0;
+      bool done = false;
+      out.err = ERR_SUCCESS;
+      while(tokens.Size() > 0 && (!done || start))
       {
-        EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
-        t = tokens.Pop();
-        switch(t.id) // This initial pass is for types and function types only
+        size_t index = tokens.GetPosition();
+        WatCursor mark = tokens.Mark();
+        WatToken t = tokens.Pop();
+        switch(t.id)
         {
-        case TOKEN_TYPE:
-          if(err = WatIndexProcess<WatFunctionType>(state, tokens, state.typehash))
-            return err;
+        case TOKEN_NONE:
+          if(start)
+            AppendError(env, env.errors, nullptr, ERR_WAT_INVALID_TOKEN, "[%zu] Invalid token: %s", WatLineNumber(start, t.pos), string(t.pos, t.len).c_str());
+          err = ERR_WAT_INVALID_TOKEN;
           break;
-        default:
-          SkipSection(tokens);
+        case TOKEN_RANGE_ERROR:
+          if(start)
+            AppendError(env, env.errors, nullptr, ERR_WAT_OUT_OF_RANGE, "[%zu] Constant out of range: %s", WatLineNumber(start, t.pos), string(t.pos, t.len).c_str());
+          err = ERR_WAT_INVALID_TOKEN;
           break;
         }
-        EXPECTED(tokens, TOKEN_CLOSE, ERR_WAT_EXPECTED_CLOSE);
+
+        if(done)
+          continue;
+        if(depth == 1 && out.fields.back().index + 1 == index)
+          out.fields.back().id = t.id;
+        if(t.id == TOKEN_OPEN)
+        {
+          if(!depth++)
+            out.fields.push_back(WatField{ TOKEN_NONE, index, mark });
+        }
+        else if(t.id == TOKEN_CLOSE && depth > 0)
+          --depth;
+        else if(!depth)
+        {
+          out.end = WatField{ t.id, index, mark };
+          out.err = (t.id == TOKEN_CLOSE) ? ERR_SUCCESS : ERR_WAT_EXPECTED_OPEN;
+          done = true;
+        }
       }
 
-      // This is the main pass for functions/imports/etc. and also identifies illegal tokens
-      tokens.SetPosition(restore);
-      while(tokens.Size() > 0 && tokens.Peek().id != TOKEN_CLOSE)
+      if(!done)
       {
+        out.end = WatField{ TOKEN_NONE, tokens.GetPosition(), tokens.Mark() };
+        out.err = depth > 0 ? ERR_WAT_EXPECTED_CLOSE : ERR_SUCCESS;
+      }
+      return start ? err : ERR_SUCCESS; // Without start, the caller already checked every token
+    }
+
+    // This is the main pass for functions/imports/etc. and also identifies illegal fields
+    int WatModuleFields(WatState& state, WatLexer& tokens, const WatFields& fields)
+    {
+      int err;
+      WatToken t;
+      Module& m = state.m;
+      for(auto& field : fields.fields)
+      {
+        switch(field.id)
+        {
+        case TOKEN_EXPORT:
+        case TOKEN_TYPE:
+        case TOKEN_ELEM:
+        case TOKEN_DATA:
+        case TOKEN_START:
+          continue;
+        }
+
+        tokens.SetPosition(field.index, field.mark);
         EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
         t = tokens.Pop();
         switch(t.id)
@@ -1488,9 +1664,9 @@ namespace innative {
           if(fname.id == TOKEN_NAME)
           {
             if(index < m.importsection.functions)
-              WatName(env, m.importsection.imports[index].func_desc.debug.name, fname);
+              WatName(state.env, m.importsection.imports[index].func_desc.debug.name, fname);
             else if(index - m.importsection.functions < m.code.n_funcbody)
-              WatName(env, m.code.funcbody[index - m.importsection.functions].debug.name, fname);
+              WatName(state.env, m.code.funcbody[index - m.importsection.functions].debug.name, fname);
           }
 
           if(iter != kh_end(state.funchash))
@@ -1513,26 +1689,71 @@ namespace innative {
           if(err = WatIndexProcess<WatGlobal>(state, tokens, state.globalhash))
             return err;
           break;
-        case TOKEN_EXPORT:
-        case TOKEN_TYPE:
-        case TOKEN_ELEM:
-        case TOKEN_DATA:
-        case TOKEN_START:
-          SkipSection(tokens);
-          break;
         default:
           return assert(false), ERR_WAT_INVALID_TOKEN;
         }
         EXPECTED(tokens, TOKEN_CLOSE, ERR_WAT_EXPECTED_CLOSE);
       }
 
+      return ERR_SUCCESS;
+    }
+
+    int WatModule(Environment& env, Module& m, WatLexer& tokens, StringRef name, WatToken& internalname, const char* start)
+    {
+      int err;
+      m = { 0 };
+      if(name.s && (err = WatName(env, m.name, WatToken{ TOKEN_NAME, (const char*)name.s, 0, 0, (int64_t)name.len })))
+        return err;
+
+      if((tokens.Peek().id == TOKEN_NAME) && (err = WatName(env, m.name, internalname = tokens.Pop())))
+        return err;
+
+      WatFields fields;
+      if(err = ScanWatFields(env, tokens, fields, start))
+        return err;
+
+      WatState state(env, m);
+
+      // This initial pass is for types and function types only
+      for(auto& field : fields.fields)
+      {
+        if(field.id != TOKEN_TYPE)
+          continue;
+        tokens.SetPosition(field.index, field.mark);
+        EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
+        EXPECTED(tokens, TOKEN_TYPE, ERR_WAT_INVALID_TOKEN);
+        if(err = WatIndexProcess<WatFunctionType>(state, tokens, state.typehash))
+          return err;
+        EXPECTED(tokens, TOKEN_CLOSE, ERR_WAT_EXPECTED_CLOSE);
+      }
+      if(fields.err)
+        return assert(false), fields.err;
+
+      // A serial parse reports a body that fails before anything wrong in a later field. Every pending body comes before the point
+      // where the main pass stopped, so they're parsed even if it failed, and their errors take precedence.
+      err = WatModuleFields(state, tokens, fields);
+      if(int bodies = WatFunctionBodies(state, tokens.End()))
+        return bodies;
+      if(err)
+        return err;
+
       // This pass resolves exports, elem, data, and the start function, to minimize deferred actions
-      tokens.SetPosition(restore);
-      while(tokens.Size() > 0 && tokens.Peek().id != TOKEN_CLOSE)
+      for(auto& field : fields.fields)
       {
+        switch(field.id)
+        {
+        case TOKEN_EXPORT:
+        case TOKEN_ELEM:
+        case TOKEN_DATA:
+        case TOKEN_START:
+          break;
+        default:
+          continue;
+        }
+
+        tokens.SetPosition(field.index, field.mark);
         EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
-        t = tokens.Pop();
-        switch(t.id)
+        switch(tokens.Pop().id)
         {
         case TOKEN_EXPORT:
           if(err = WatExport(state, tokens))
@@ -1559,21 +1780,16 @@ namespace innative {
           if(m.start == (varuint32)~0)
             return assert(false), ERR_WAT_INVALID_VAR;
           break;
-        default:
-          SkipSection(tokens);
-          break;
         }
         EXPECTED(tokens, TOKEN_CLOSE, ERR_WAT_EXPECTED_CLOSE);
       }
+      tokens.SetPosition(fields.end.index, fields.end.mark);
 
-      auto procRef = [](WatState& s, Module& mod, varuint32 e) {
+      auto procRef = [](WatState& s, Module& mod, varuint32 e, int slot) {
         if(s.defer[0].func < mod.importsection.functions || s.defer[0].func >= mod.code.n_funcbody + mod.importsection.functions)
           return ERR_INVALID_FUNCTION_INDEX;
         auto& f = mod.code.funcbody[s.defer[0].func - mod.importsection.functions];
-        if(s.defer[0].index >= f.n_body)
-          return ERR_INVALID_FUNCTION_BODY;
-        f.body[s.defer[0].index].immediates[0]._varuint32 = e;
-        return ERR_SUCCESS;
+        return PatchImmediate(f, (varuint32)s.defer[0].index, slot, e);
       };
 
       // Process all deferred actions
@@ -1601,10 +1817,17 @@ namespace innative {
         break;
         case OP_global_get:
         case OP_global_set:
-          err = procRef(state, m, WatGetFromHash(state, state.globalhash, state.defer[0].t));
+          err = procRef(state, m, WatGetFromHash(state, state.globalhash, state.defer[0].t), 0);
           break;
         case OP_call:
-          err = procRef(state, m, WatGetFromHash(state, state.funchash, state.defer[0].t));
+          err = procRef(state, m, WatGetFromHash(state, state.funchash, state.defer[0].t), 0);
+          break;
+        case OP_memory_size:
+        case OP_memory_grow:
+          err = procRef(state, m, WatGetFromHash(state, state.memoryhash, state.defer[0].t), 0);
+          break;
+        case -TOKEN_MEMORY: // Memory index of a load or store, which is stored after the align and offset
+          err = procRef(state, m, WatGetFromHash(state, state.memoryhash, state.defer[0].t), 2);
           break;
         default:
           return assert(false), ERR_WAT_INVALID_TOKEN;
@@ -1619,24 +1842,26 @@ namespace innative {
       return ParseExportFixup(m, env.errors, env);
     }
 
-    int WatEnvironment(Environment& env, Queue<WatToken>& tokens)
+    int WatEnvironment(Environment& env, WatLexer& tokens)
     {
       return 0;
     }
 
     // Checks for parse errors in the tokenization process
-    int CheckWatTokens(const Environment& env, ValidationError*& errors, Queue<WatToken>& tokens, const char* start)
+    int CheckWatTokens(const Environment& env, ValidationError*& errors, const char* start, const char* end)
     {
       int err = ERR_SUCCESS;
-      for(size_t i = 0; i < tokens.Size(); ++i)
+      WatCursor cur = { start, start, 0 };
+      WatToken t;
+      while(NextWatToken(cur, end, t)) // Nothing is kept, so checking a huge file doesn't need room for all of its tokens
       {
-        switch(tokens[i].id)
+        switch(t.id)
         {
         case TOKEN_NONE:
-          AppendError(env, errors, nullptr, ERR_WAT_INVALID_TOKEN, "[%zu] Invalid token: %s", WatLineNumber(start, tokens[i].pos), string(tokens[i].pos, tokens[i].len).c_str());
+          AppendError(env, errors, nullptr, ERR_WAT_INVALID_TOKEN, "[%zu] Invalid token: %s", WatLineNumber(start, t.pos), string(t.pos, t.len).c_str());
           break;
         case TOKEN_RANGE_ERROR:
-          AppendError(env, errors, nullptr, ERR_WAT_OUT_OF_RANGE, "[%zu] Constant out of range: %s", WatLineNumber(start, tokens[i].pos), string(tokens[i].pos, tokens[i].len).c_str());
+          AppendError(env, errors, nullptr, ERR_WAT_OUT_OF_RANGE, "[%zu] Constant out of range: %s", WatLineNumber(start, t.pos), string(t.pos, t.len).c_str());
           break;
         default:
           continue;
@@ -1649,24 +1874,23 @@ namespace innative {
 
     int ParseWatModule(Environment& env, Module& m, uint8_t* data, size_t sz, StringRef name)
     {
-      Queue<WatToken> tokens;
-      TokenizeWAT(tokens, (char*)data, (char*)data + sz);
+      WatLexer tokens((char*)data, (char*)data + sz);
       WatToken nametoken;
 
       if(!tokens.Size())
         return ERR_FATAL_INVALID_MODULE;
 
-      int err = CheckWatTokens(env, env.errors, tokens, (char*)data);
-      if(err < 0)
-        return err;
+      // WatModule checks every token it hasn't seen yet while finding the fields, so this doesn't need a separate pass
+      int err;
+      const char* start = (const char*)data;
 
       // If we don't detect "(module", just assume it's an inline module
       if(tokens[0].id != TOKEN_OPEN || tokens[1].id != TOKEN_MODULE)
-        return WatModule(env, m, tokens, name, nametoken);
+        return WatModule(env, m, tokens, name, nametoken, start);
 
       EXPECTED(tokens, TOKEN_OPEN, ERR_WAT_EXPECTED_OPEN);
       EXPECTED(tokens, TOKEN_MODULE, ERR_WAT_EXPECTED_MODULE);
-      if(!(err = WatModule(env, m, tokens, name, nametoken)))
+      if(!(err = WatModule(env, m, tokens, name, nametoken, start)))
         EXPECTED(tokens, TOKEN_CLOSE, ERR_WAT_EXPECTED_CLOSE);
       return err;
     }
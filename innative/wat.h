@@ -6,6 +6,7 @@
 
 #include "lexer.h"
 #include "stack.h"
+#include <vector>
 
 namespace innative {
   namespace wat {
@@ -19,9 +20,18 @@ namespace innative {
 
     KHASH_DECLARE(indexname, utility::StringRef, varuint32);
 
+    // A function body the main pass skipped so it can be parsed on the thread pool once every index is known
+    struct WatPendingBody
+    {
+      WatCursor start; // First token after the locals
+      varuint32 code; // Index into the code section
+      varuint32 index; // Function index, which deferred actions refer to
+    };
+
     struct WatState
     {
       WatState(Environment& e, Module& mod);
+      WatState(Environment& e, WatState& names); // Shares the name hashes of another state, which has to outlive this one
       ~WatState();
       varuint32 GetJump(WatState& state, WatToken var);
 
@@ -34,17 +44,20 @@ namespace innative {
       kh_indexname_t* tablehash;
       kh_indexname_t* memoryhash;
       kh_indexname_t* globalhash;
-      std::string numbuf;
+      std::vector<WatPendingBody> pending;
+      bool owner;
     };
 
 #define EXPECTED(t, e, err) if((t).Size() == 0 || (t).Pop().id != (e)) return assert(false), (err)
 
     int ParseWatModule(Environment& env, Module& m, uint8_t* data, size_t sz, utility::StringRef name);
     int WatString(const Environment& env, ByteArray& str, utility::StringRef ref);
-    void SkipSection(Queue<WatToken>& tokens, int count = 1);
-    int WatInitializer(WatState& state, Queue<WatToken>& tokens, Instruction& op);
+    void SkipSection(WatLexer& tokens, int count = 1);
+    int WatInitializer(WatState& state, WatLexer& tokens, Instruction& op);
     int WatName(const Environment& env, ByteArray& name, const WatToken& t);
-    int WatModule(Environment& env, Module& m, Queue<WatToken>& tokens, utility::StringRef name, WatToken& internalname);
+    // If start is set, invalid tokens from here to the end of the input are reported, with line numbers counted from start
+    int WatModule(Environment& env, Module& m, WatLexer& tokens, utility::StringRef name, WatToken& internalname, const char* start = nullptr);
+    int WatFunctionBodies(WatState& state, const char* end);
     size_t WatLineNumber(const char* start, const char* pos);
 
     IR_FORCEINLINE int WatString(const Environment& env, ByteArray& str, const WatToken& t)
@@ -54,7 +67,7 @@ namespace innative {
       return WatString(env, str, utility::StringRef{ t.pos, t.len });
     }
 
-    IR_FORCEINLINE WatToken GetWatNameToken(Queue<WatToken>& tokens)
+    IR_FORCEINLINE WatToken GetWatNameToken(WatLexer& tokens)
     {
       return (tokens.Peek().id == TOKEN_NAME) ? tokens.Pop() : WatToken{ TOKEN_NONE };
     }